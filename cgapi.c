@@ -1,13 +1,23 @@
 
+
 #include <archive.h>
 #include <archive_entry.h>
+#include <ctype.h>
 #include <curl/curl.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "cgapi.h"
-#include "cgrip.h"
+#include "cgformat.h"
+#include "cghash.h"
+#include "cglib.h"
+#include "cgloop.h"
+#include "cgout.h"
+#include "cgpng.h"
+#include "cgpix.h"
+#include "cgpro.h"
 
 #include "lodepng.h"
 
@@ -33,19 +43,75 @@ static const char *cgapi_matmap[] = {
 };
 
 static const char *cgapi_output[] = {
-    "_ambientocclusion.png",
-    ".png", /* no suffix for albedo */
-    "_displacement.png",
-    "_emission.png",
-    "_metalness.png",
-    "_normal_dx.png",
-    "_normal_gl.png",
-    "_opacity.png",
-    "_roughness.png",
+    "_ambientocclusion",
+    "", /* no suffix for albedo */
+    "_displacement",
+    "_emission",
+    "_metalness",
+    "_normal_dx",
+    "_normal_gl",
+    "_opacity",
+    "_roughness",
 };
 
 static const char *cgapi_download_ids_url = "https://ambientcg.com/api/v2/downloads_csv?type=Material&id=";
 
+/* connections, dns and tls sessions every transfer reuses, NULL before cgapi_init */
+static CURLSH *cgapi_share = NULL;
+static pthread_mutex_t cgapi_share_locks[CURL_LOCK_DATA_LAST];
+/* where every transfer runs, NULL falls back to one blocking transfer per caller */
+static struct cgloop *cgapi_loop = NULL;
+/* decoded maps kept across runs, NULL to always decode */
+static struct cgpix *cgapi_pixels = NULL;
+
+static void cgapi_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *ud)
+{
+    pthread_mutex_lock(&cgapi_share_locks[data]);
+}
+
+static void cgapi_share_unlock(CURL *curl, curl_lock_data data, void *ud)
+{
+    pthread_mutex_unlock(&cgapi_share_locks[data]);
+}
+
+/* after curl_global_init, without it every transfer connects from scratch */
+void cgapi_init(void)
+{
+    int i;
+    if (cgapi_share)
+        return;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&cgapi_share_locks[i], NULL);
+    cgapi_loop = cgloop_new();
+    cgapi_share = curl_share_init();
+    if (!cgapi_share)
+        return;
+    curl_share_setopt(cgapi_share, CURLSHOPT_LOCKFUNC, cgapi_share_lock);
+    curl_share_setopt(cgapi_share, CURLSHOPT_UNLOCKFUNC, cgapi_share_unlock);
+    curl_share_setopt(cgapi_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(cgapi_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(cgapi_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+/* not owned, the caller frees it after the last decode */
+void cgapi_set_pixels(struct cgpix *pix)
+{
+    cgapi_pixels = pix;
+}
+
+void cgapi_cleanup(void)
+{
+    int i;
+    cgloop_free(cgapi_loop);
+    cgapi_loop = NULL;
+    if (!cgapi_share)
+        return;
+    curl_share_cleanup(cgapi_share);
+    cgapi_share = NULL;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_destroy(&cgapi_share_locks[i]);
+}
+
 static int endcmp(const char *str, const char *end) {
     int offset = strlen(str) - strlen(end);
     if (offset < 0) return 1;
@@ -59,7 +125,7 @@ struct cgapi_mem {
 
 int cgapi_material_has_map(struct cgapi_material *mat, enum cgapi_matmap map)
 {
-    return mat->maps[map].data != NULL;
+    return mat->maps[map].data != NULL || mat->maps[map].stored;
 }
 
 static int cgapi_read_mem(char *data, size_t membsz, size_t nmemb, void *ud)
@@ -67,8 +133,9 @@ static int cgapi_read_mem(char *data, size_t membsz, size_t nmemb, void *ud)
     size_t size = membsz * nmemb;
     struct cgapi_mem *mem = (struct cgapi_mem *) ud;
 
-    char *ptr = realloc(mem->res, mem->sz + size + 1);
-    doom(ptr);
+    char *ptr = cgmem_realloc(mem->res, mem->sz + size + 1);
+    if (!ptr)
+        return 0; /* fails the transfer */
 
     mem->res = ptr;
     memcpy(&(mem->res[mem->sz]), data, size);
@@ -77,88 +144,254 @@ static int cgapi_read_mem(char *data, size_t membsz, size_t nmemb, void *ud)
     return size;
 }
 
-static struct cgapi_mem cgapi_curl_chunk(const char *url)
+/* a transfer into memory and how it went */
+struct cgapi_transfer {
+    struct cgapi_mem mem;
+    char error[CURL_ERROR_SIZE];
+    CURLcode res;
+    char etag[256], modified[64]; /* validators of the final response, "" if not sent */
+};
+
+/* copies the value of header name out of line, if that is what line is */
+static void cgapi_header_value(const char *line, size_t size, const char *name, char *out, size_t outsz)
+{
+    size_t len = strlen(name), i;
+    if (size <= len || line[len] != ':')
+        return;
+    for (i = 0; i < len; i++)
+        if (tolower((unsigned char) line[i]) != tolower((unsigned char) name[i]))
+            return;
+    line += len + 1;
+    size -= len + 1;
+    while (size > 0 && (*line == ' ' || *line == '\t')) {
+        line++;
+        size--;
+    }
+    while (size > 0 && isspace((unsigned char) line[size - 1]))
+        size--;
+    if (size == 0 || size >= outsz)
+        return;
+    memcpy(out, line, size);
+    out[size] = 0;
+}
+
+static size_t cgapi_read_header(char *data, size_t membsz, size_t nmemb, void *ud)
+{
+    struct cgapi_transfer *t = (struct cgapi_transfer *) ud;
+    size_t size = membsz * nmemb;
+    if (size >= 5 && !memcmp(data, "HTTP/", 5)) {
+        /* a new response, say after a redirect */
+        *t->etag = 0;
+        *t->modified = 0;
+    }
+    cgapi_header_value(data, size, "ETag", t->etag, sizeof t->etag);
+    cgapi_header_value(data, size, "Last-Modified", t->modified, sizeof t->modified);
+    return size;
+}
+
+static CURL *cgapi_curl_new(struct cgapi_transfer *t, const char *url)
 {
-    struct cgapi_mem out = { 0 };
     CURL *curl = curl_easy_init();
-    CURLcode res;
-    char buf[CURL_ERROR_SIZE];
 
-    if (!curl) return out;
+    memset(t, 0, sizeof(struct cgapi_transfer));
+    if (!curl)
+        return NULL;
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, cgapi_read_mem);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &out);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &t->mem);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, cgapi_read_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, t);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+    if (cgapi_share)
+        curl_easy_setopt(curl, CURLOPT_SHARE, cgapi_share);
     /* curl_easy_setopt(curl, CURLOPT_VERBOSE, (long) arguments.verbose); */
-    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, buf);
-    res = curl_easy_perform(curl);
-    out.sz++; /* null char */
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, t->error);
+    return curl;
+}
 
-    if (res != CURLE_OK)
-        fatal("curl error: %s\n", buf);
+/* what came of t, NULL on failure */
+static struct cgapi_mem cgapi_transfer_result(struct cglib_context *ctx, struct cgapi_transfer *t)
+{
+    struct cgapi_mem out = t->mem;
+    out.sz++; /* null char */
+    if (t->res != CURLE_OK) {
+        cglib_fail(ctx, cglib_error_network, "curl error: %s\n", *t->error ? t->error : curl_easy_strerror(t->res));
+        cgmem_free(out.res);
+        out.res = NULL;
+        out.sz = 0;
+    }
     return out;
 }
 
-static int cgapi_rip_textures(struct cgapi_material *mat, struct cgapi_mem zip_mem)
+struct cgapi_wait {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    CURLcode res;
+    int done;
+};
+
+static void cgapi_wake(CURL *curl, CURLcode res, void *ud)
+{
+    struct cgapi_wait *w = (struct cgapi_wait *) ud;
+    pthread_mutex_lock(&w->lock);
+    w->res = res;
+    w->done = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* runs curl to the end, on the loop when there is one so connections are pooled */
+static CURLcode cgapi_perform(CURL *curl)
+{
+    struct cgapi_wait w;
+    CURLcode res;
+
+    if (!cgapi_loop)
+        return curl_easy_perform(curl);
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.done = 0;
+    if (cgloop_add(cgapi_loop, curl, cgapi_wake, &w)) {
+        pthread_mutex_lock(&w.lock);
+        while (!w.done)
+            pthread_cond_wait(&w.cond, &w.lock);
+        pthread_mutex_unlock(&w.lock);
+        res = w.res;
+    } else {
+        res = curl_easy_perform(curl);
+    }
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+    return res;
+}
+
+static struct cgapi_mem cgapi_curl_chunk(struct cglib_context *ctx, const char *url)
+{
+    struct cgapi_transfer t;
+    CURL *curl = cgapi_curl_new(&t, url);
+
+    if (!curl) {
+        cglib_fail(ctx, cglib_error_network, "curl init failed\n");
+        return t.mem;
+    }
+    t.res = cgapi_perform(curl);
+    curl_easy_cleanup(curl);
+    return cgapi_transfer_result(ctx, &t);
+}
+
+/* pulls the wanted entries out of the zip, still encoded */
+static int cgapi_extract_textures(struct cglib_context *ctx, struct cgapi_material *mat, const char *zip, size_t zip_size)
 {
+    const struct cglib_job *job = ctx->job;
     struct archive *a;
     struct archive_entry *entry;
-    int err;
+    int err, ok, derive_normal;
     int enabled_matmaps[CGAPI_MAPNUM];
+    struct cgapi_map *dx = &mat->maps[cgapi_matmap_normaldx];
+    struct cgapi_map *gl = &mat->maps[cgapi_matmap_normalgl];
 
     a = archive_read_new();
     archive_read_support_filter_all(a);
     archive_read_support_format_zip(a); /* ambientCG only serves .zip */
-    err = archive_read_open_memory(a, zip_mem.res, zip_mem.sz - 1);
+    err = archive_read_open_memory(a, zip, zip_size);
     if (err != ARCHIVE_OK) {
-        verbose("failed to read zip for %s: %s\n", mat->id, archive_error_string(a));
+        cglib_fail(ctx, cglib_error_archive, "failed to read zip for %s: %s\n", mat->id, archive_error_string(a));
         archive_read_free(a);
         return 0;
     }
 
-    enabled_matmaps[cgapi_matmap_ambientocclusion] = arguments.save_ambientocclusion;
-    enabled_matmaps[cgapi_matmap_color] = arguments.save_color;
-    enabled_matmaps[cgapi_matmap_displacement] = arguments.save_displacement;
-    enabled_matmaps[cgapi_matmap_emission] = arguments.save_emission;
-    enabled_matmaps[cgapi_matmap_metalness] = arguments.save_metalness;
-    enabled_matmaps[cgapi_matmap_normaldx] = arguments.save_normal == cgrip_normal_type_both 
-                                            || arguments.save_normal == cgrip_normal_type_dx;
-    enabled_matmaps[cgapi_matmap_normalgl] = arguments.save_normal == cgrip_normal_type_both 
-                                            || arguments.save_normal == cgrip_normal_type_gl;
-    enabled_matmaps[cgapi_matmap_opacity] = arguments.save_opacity;
-    enabled_matmaps[cgapi_matmap_roughness] = arguments.save_roughness;
+    enabled_matmaps[cgapi_matmap_ambientocclusion] = job->save_ambientocclusion;
+    enabled_matmaps[cgapi_matmap_color] = job->save_color;
+    enabled_matmaps[cgapi_matmap_displacement] = job->save_displacement;
+    enabled_matmaps[cgapi_matmap_emission] = job->save_emission;
+    enabled_matmaps[cgapi_matmap_metalness] = job->save_metalness;
+    enabled_matmaps[cgapi_matmap_normaldx] = job->save_normal == cgrip_normal_type_both 
+                                            || job->save_normal == cgrip_normal_type_dx;
+    enabled_matmaps[cgapi_matmap_normalgl] = job->save_normal == cgrip_normal_type_both 
+                                            || job->save_normal == cgrip_normal_type_gl;
+    enabled_matmaps[cgapi_matmap_opacity] = job->save_opacity;
+    enabled_matmaps[cgapi_matmap_roughness] = job->save_roughness;
+    /* only decode whichever normal map comes first, the other is derived */
+    derive_normal = enabled_matmaps[cgapi_matmap_normaldx] && enabled_matmaps[cgapi_matmap_normalgl];
+    mat->derived_normal = -1;
 
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+    while ((err = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
         int i;
-        verbose("%s: %s\n", mat->id, archive_entry_pathname(entry));
+        cglib_log(ctx, cglib_log_verbose, "%s: %s\n", mat->id, archive_entry_pathname(entry));
 
         for (i = 0; i < CGAPI_MAPNUM; i++) {
             if (!enabled_matmaps[i]) continue;
             if (!endcmp(archive_entry_pathname(entry), cgapi_matmap[i])) {
                 struct cgapi_map *map = &mat->maps[i];
                 size_t size = archive_entry_size(entry);
-                void *data = malloc(size);
-                doom(data);
+                void *data;
+                if (derive_normal && ((i == cgapi_matmap_normaldx && gl->encoded)
+                            || (i == cgapi_matmap_normalgl && dx->encoded))) {
+                    cglib_log(ctx, cglib_log_verbose, "skipping %s %s, deriving it instead\n", mat->id, cgapi_matmap[i]);
+                    mat->derived_normal = i;
+                    break;
+                }
+                data = cgmem_alloc(size);
+                if (!data) {
+                    cglib_fail(ctx, cglib_error_memory, "out of memory for %s %s\n", mat->id, cgapi_matmap[i]);
+                    break;
+                }
 
                 err = archive_read_data(a, data, size);
                 if (err == ARCHIVE_FATAL) {
-                    verbose("failed to read data from zip file: %s\n", archive_error_string(a));
-                    free(data);
+                    cglib_fail(ctx, cglib_error_archive, "failed to read data from zip file: %s\n", archive_error_string(a));
+                    cgmem_free(data);
                     break;
                 }
-                verbose("found %s %s\n", mat->id, cgapi_matmap[i]);
-                err = lodepng_decode32(&map->data, &map->width, &map->height, data, size);
-                free(data);
-                if (map->data == NULL)
-                    warn("failed to load image %s: %s\n", archive_entry_pathname(entry), lodepng_error_text(err));
+                cglib_log(ctx, cglib_log_verbose, "found %s %s\n", mat->id, cgapi_matmap[i]);
+                cgmem_free(map->encoded);
+                map->encoded = data;
+                map->encoded_size = size;
                 break;
             }
         }
     }
+    ok = err == ARCHIVE_EOF;
+    if (!ok)
+        cglib_fail(ctx, cglib_error_archive, "failed to read zip for %s: %s\n", mat->id, archive_error_string(a));
 
     err = archive_read_free(a);
     if (err != ARCHIVE_OK)
-        verbose("probable memory leak: %s\n", archive_error_string(a));
+        cglib_log(ctx, cglib_log_verbose, "probable memory leak: %s\n", archive_error_string(a));
+    return ok;
+}
+
+int cgapi_map_decode(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap)
+{
+    struct cgapi_map *map = &mat->maps[matmap];
+    unsigned long key = 0;
+    unsigned err = 0;
+
+    if (!map->encoded)
+        return map->data != NULL;
+    /* keyed by the png itself, whatever zip or material it came in */
+    if (cgapi_pixels) {
+        key = cghash_bytes(CGHASH_INIT, map->encoded, map->encoded_size);
+        if (cgpix_load(cgapi_pixels, key, &map->data, &map->width, &map->height))
+            cglib_log(ctx, cglib_log_verbose, "%s %s was decoded before\n", mat->id, cgapi_matmap[matmap]);
+    }
+    if (!map->data) {
+        err = lodepng_decode32(&map->data, &map->width, &map->height, map->encoded, map->encoded_size);
+        if (map->data && cgapi_pixels)
+            cgpix_save(cgapi_pixels, key, map->data, map->width, map->height);
+    }
+    cgmem_free(map->encoded);
+    map->encoded = NULL;
+    map->encoded_size = 0;
+    if (map->data == NULL)
+        return cglib_fail(ctx, cglib_error_image, "failed to load image %s%s: %s\n", mat->id, cgapi_matmap[matmap], lodepng_error_text(err));
+
+    if ((matmap == cgapi_matmap_normaldx && mat->derived_normal == cgapi_matmap_normalgl)
+            || (matmap == cgapi_matmap_normalgl && mat->derived_normal == cgapi_matmap_normaldx)) {
+        cglib_log(ctx, cglib_log_verbose, "deriving %s %s\n", mat->id, cgapi_matmap[mat->derived_normal]);
+        if (!cgpro_flip_green(&mat->maps[mat->derived_normal], map))
+            cglib_fail(ctx, cglib_error_memory, "failed to derive normal map for %s\n", mat->id);
+    }
     return 1;
 }
 
@@ -173,72 +406,264 @@ static const char *get_extension(const char *path)
 }
 
 
-static void cgapi_process_material(struct cgapi_materials *out, const char *id, const char *quality, const char *url)
+static int cgapi_add_material(struct cgapi_materials *out, const char *id, const char *quality, const char *size, const char *url)
 {
     const char *expected_quality = cgapi_quality[out->quality];
-    struct cgapi_mem zip_mem = { 0 };
     struct cgapi_material *mat;
-    int i;
 
-    if (strcmp(quality, expected_quality) != 0) return;
-    out->materials = realloc(out->materials, ++out->material_count * sizeof(struct cgapi_material));
-    mat = &out->materials[out->material_count - 1];
-    doom(out->materials);
+    if (strcmp(quality, expected_quality) != 0) return 1;
+    mat = realloc(out->materials, (out->material_count + 1) * sizeof(struct cgapi_material));
+    if (!mat)
+        return 0;
+    out->materials = mat;
+    mat = &out->materials[out->material_count++];
+    memset(mat, 0, sizeof(struct cgapi_material));
+    mat->derived_normal = -1;
+    mat->download_size = strtoul(size, NULL, 10);
+    cgmem_hold_init(&mat->mem, out->material_count - 1);
 
     mat->id = malloc(strlen(id) + 1);
+    mat->url = malloc(strlen(url) + 1);
     mat->quality = out->quality;
-    doom(mat->id);
-
+    if (!mat->id || !mat->url)
+        return 0;
     memcpy(mat->id, id, strlen(id) + 1);
-    for (i = 0; i < CGAPI_MAPNUM; i++) {
-        mat->maps[i].data = NULL;
+    memcpy(mat->url, url, strlen(url) + 1);
+    return 1;
+}
+
+/* asks for the zip only if it changed since mat->source, the list goes with curl */
+static struct curl_slist *cgapi_revalidate(CURL *curl, struct cgapi_material *mat)
+{
+    struct curl_slist *headers;
+    if (!mat->source)
+        return NULL;
+    headers = curl_slist_append(NULL, mat->source);
+    if (headers)
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    return headers;
+}
+
+/* takes the zip into mat, or lets go of what mat held for it */
+static int cgapi_material_downloaded(struct cglib_context *ctx, struct cgapi_material *mat, CURL *curl, struct cgapi_transfer *t)
+{
+    struct cgapi_mem zip_mem;
+    long code = 0;
+    char *source = NULL;
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    if (t->res == CURLE_OK && code == 304) {
+        cglib_log(ctx, cglib_log_info, "%s is unchanged\n", mat->id);
+        cgmem_free(t->mem.res);
+        cgmem_release(&mat->mem);
+        mat->unchanged = 1;
+        return 0;
+    }
+    zip_mem = cgapi_transfer_result(ctx, t);
+    cglib_log(ctx, cglib_log_verbose, "downloaded %s -> %lu B\n", mat->id, zip_mem.sz);
+    if (!zip_mem.res) {
+        cgmem_release(&mat->mem);
+        return 0;
     }
+    cgmem_adjust(&mat->mem, zip_mem.sz);
+    mat->zip = zip_mem.res;
+    mat->zip_size = zip_mem.sz - 1;
 
-    printf("downloading %s.zip\n", id);
-    verbose("downloading material %s (%s)\n", id, url);
-    zip_mem = cgapi_curl_chunk(url);
-    verbose("downloaded %s -> %lu B\n", id, zip_mem.sz);
+    /* what to ask with next time, the etag being the stronger of the two */
+    if (*t->etag && (source = malloc(strlen(t->etag) + sizeof "If-None-Match: ")))
+        sprintf(source, "If-None-Match: %s", t->etag);
+    else if (*t->modified && (source = malloc(strlen(t->modified) + sizeof "If-Modified-Since: ")))
+        sprintf(source, "If-Modified-Since: %s", t->modified);
+    free(mat->source);
+    mat->source = source;
+    return 1;
+}
 
-    if (arguments.save_zip) {
-        char buf[256];
-        int sz = 0;
+static void cgapi_download_begin(struct cglib_context *ctx, struct cgapi_material *mat)
+{
+    cgmem_acquire(&mat->mem, mat->download_size);
+    cglib_log(ctx, cglib_log_info, mat->source ? "checking %s.zip\n" : "downloading %s.zip\n", mat->id);
+    cglib_log(ctx, cglib_log_verbose, "downloading material %s (%s)\n", mat->id, mat->url);
+}
 
-        verbose("saving zip (%s.zip)...\n", id);
+/* with mat->source set, a zip that did not change is not downloaded and mat is unchanged */
+int cgapi_material_download(struct cglib_context *ctx, struct cgapi_material *mat)
+{
+    struct cgapi_transfer t;
+    struct curl_slist *headers;
+    CURL *curl;
+    int ok;
 
-        *buf = 0;
-        if (arguments.output_zip) {
-            sz += strncat_s(buf + sz, arguments.output_zip, sizeof buf - sz);
-            sz += strncat_s(buf + sz, "/", sizeof buf - sz);
-        } else if (arguments.output) {
-            sz += strncat_s(buf + sz, arguments.output, sizeof buf - sz);
-            sz += strncat_s(buf + sz, "/", sizeof buf - sz);
-        }
-        sz += strncat_s(buf + sz, mat->id, sizeof buf - sz);
-        sz += strncat_s(buf + sz, ".zip", sizeof buf - sz);
-        if (get_extension(buf) && !strcmp(get_extension(buf), "zip")) {
-            FILE *out = fopen(buf, "wb");
-            fwrite(zip_mem.res, sizeof(char), zip_mem.sz - 1, out);
-            fclose(out);
-            verbose("saved zip (%s.zip)\n", id);
+    cgapi_download_begin(ctx, mat);
+    curl = cgapi_curl_new(&t, mat->url);
+    if (!curl) {
+        cgmem_release(&mat->mem);
+        return cglib_fail(ctx, cglib_error_network, "curl init failed\n");
+    }
+    headers = cgapi_revalidate(curl, mat);
+    t.res = cgapi_perform(curl);
+    ok = cgapi_material_downloaded(ctx, mat, curl, &t);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+    if (ok)
+        cgapi_material_save_zip(ctx, mat);
+    return ok;
+}
+
+struct cgapi_download {
+    struct cgapi_transfer t;
+    struct curl_slist *headers;
+    struct cglib_context *ctx;
+    struct cgapi_material *mat;
+    cgapi_download_fn done;
+    void *ud;
+};
+
+static void cgapi_download_end(CURL *curl, CURLcode res, void *ud)
+{
+    struct cgapi_download *d = (struct cgapi_download *) ud;
+    int ok;
+    d->t.res = res;
+    ok = cgapi_material_downloaded(d->ctx, d->mat, curl, &d->t);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(d->headers);
+    d->done(d->mat, ok, d->ud);
+    free(d);
+}
+
+/*
+ * like cgapi_material_download, without waiting for it. done gets mat
+ * back, usually on the event loop thread, so it should only hand it on.
+ * the zip is not saved, see cgapi_material_save_zip. returns 0 without
+ * calling done when the download could not be started.
+ */
+int cgapi_material_download_start(struct cglib_context *ctx, struct cgapi_material *mat, cgapi_download_fn done, void *ud)
+{
+    struct cgapi_download *d = malloc(sizeof(struct cgapi_download));
+    CURL *curl;
+
+    if (!d)
+        return cglib_fail(ctx, cglib_error_memory, "out of memory downloading %s\n", mat->id);
+    cgapi_download_begin(ctx, mat);
+    curl = cgapi_curl_new(&d->t, mat->url);
+    if (!curl) {
+        cgmem_release(&mat->mem);
+        free(d);
+        return cglib_fail(ctx, cglib_error_network, "curl init failed\n");
+    }
+    d->headers = cgapi_revalidate(curl, mat);
+    d->ctx = ctx;
+    d->mat = mat;
+    d->done = done;
+    d->ud = ud;
+    if (!cgapi_loop || !cgloop_add(cgapi_loop, curl, cgapi_download_end, d))
+        cgapi_download_end(curl, curl_easy_perform(curl), d);
+    return 1;
+}
+
+/* writes the downloaded zip out when the job asks for it */
+void cgapi_material_save_zip(struct cglib_context *ctx, struct cgapi_material *mat)
+{
+    const struct cglib_job *job = ctx->job;
+    char buf[256];
+    int sz = 0;
+
+    if (!job->save_zip || !mat->zip)
+        return;
+    cglib_log(ctx, cglib_log_verbose, "saving zip (%s.zip)...\n", mat->id);
+
+    *buf = 0;
+    if (job->output_zip) {
+        sz += strncat_s(buf + sz, job->output_zip, sizeof buf - sz);
+        sz += strncat_s(buf + sz, "/", sizeof buf - sz);
+    } else if (job->output) {
+        sz += strncat_s(buf + sz, job->output, sizeof buf - sz);
+        sz += strncat_s(buf + sz, "/", sizeof buf - sz);
+    }
+    sz += strncat_s(buf + sz, mat->id, sizeof buf - sz);
+    sz += strncat_s(buf + sz, ".zip", sizeof buf - sz);
+    if (get_extension(buf) && !strcmp(get_extension(buf), "zip")) {
+        if (cgout_save(buf, mat->zip, mat->zip_size)) {
+            cglib_log(ctx, cglib_log_verbose, "saved zip (%s.zip)\n", mat->id);
+            cglib_output(ctx, mat->id, buf);
         } else {
-            warn("path too long, failed to save zip to %s\n", buf);
+            cglib_fail(ctx, cglib_error_io, "failed to save zip to %s\n", buf);
         }
+    } else {
+        cglib_fail(ctx, cglib_error_io, "path too long, failed to save zip to %s\n", buf);
+    }
+}
+
+/* what decoding map will take at its peak, read off the png header */
+static size_t cgapi_map_footprint(struct cgapi_map *map)
+{
+    LodePNGState state;
+    unsigned width, height;
+    size_t raw, out;
+
+    lodepng_state_init(&state);
+    if (lodepng_inspect(&width, &height, &state, map->encoded, map->encoded_size)) {
+        lodepng_state_cleanup(&state);
+        return 0;
     }
+    /* inflated scanlines and the rgba result live side by side */
+    raw = (size_t) height * (1 + ((size_t) width * lodepng_get_bpp(&state.info_png.color) + 7) / 8);
+    out = (size_t) width * height * 4;
+    lodepng_state_cleanup(&state);
+    return raw + out;
+}
+
+/*
+ * holds off until the decoded material fits the memory budget, so nothing
+ * past this point has to wait for memory.
+ */
+int cgapi_material_extract(struct cglib_context *ctx, struct cgapi_material *mat)
+{
+    size_t encoded = 0, decoded = 0;
+    int ok, i;
+    if (!mat->zip)
+        return 0;
+    ok = cgapi_extract_textures(ctx, mat, mat->zip, mat->zip_size);
+    cgmem_free(mat->zip);
+    mat->zip = NULL;
+    mat->zip_size = 0;
 
-    if (!cgapi_rip_textures(mat, zip_mem)) {
-        out->material_count--;
-        free(mat->id);
+    for (i = 0; i < CGAPI_MAPNUM; i++) {
+        struct cgapi_map *map = &mat->maps[i];
+        size_t footprint;
+        if (!map->encoded)
+            continue;
+        footprint = cgapi_map_footprint(map);
+        encoded += map->encoded_size;
+        decoded += footprint;
+        /* the derived normal comes out the same size as its source */
+        if (mat->derived_normal >= 0 && (i == cgapi_matmap_normaldx || i == cgapi_matmap_normalgl))
+            decoded += footprint;
+    }
+    cgmem_adjust(&mat->mem, encoded);
+    if (decoded) {
+        cglib_log(ctx, cglib_log_verbose, "%s needs %lu B decoded\n", mat->id, (unsigned long) decoded);
+        cgmem_acquire(&mat->mem, encoded + decoded);
     }
-    free(zip_mem.res);
-    return;
+    return ok;
+}
+
+int cgapi_material_rip(struct cglib_context *ctx, struct cgapi_material *mat)
+{
+    int i;
+    if (!cgapi_material_extract(ctx, mat))
+        return 0;
+    for (i = 0; i < CGAPI_MAPNUM; i++)
+        cgapi_map_decode(ctx, mat, i);
+    return 1;
 }
 
-static struct cgapi_materials cgapi_process_downloads_csv(enum cgapi_quality quality, char *csv)
+static struct cgapi_materials cgapi_process_downloads_csv(struct cglib_context *ctx, enum cgapi_quality quality, char *csv)
 {
     struct cgapi_materials out = { 0 };
     int line = 0, col = 0;
     char *p;
-    char *asset_id = 0, *download_attribute = 0, *raw_link = 0;
+    char *asset_id = 0, *download_attribute = 0, *size = 0, *raw_link = 0;
     out.quality = quality;
 
     for (p = csv; *p; p++) {
@@ -246,6 +671,8 @@ static struct cgapi_materials cgapi_process_downloads_csv(enum cgapi_quality qua
             asset_id = p;
         if (col == 1 && !download_attribute)
             download_attribute = p;
+        if (col == 3 && !size)
+            size = p;
         if (col == 5 && !raw_link)
             raw_link = p;
 
@@ -259,18 +686,30 @@ static struct cgapi_materials cgapi_process_downloads_csv(enum cgapi_quality qua
             p++;
         case '\n':
             *p = 0;
-            if (!asset_id || !download_attribute || !raw_link)
-                fatal("unexpected downloads.csv eol, try re-running\n");
+            if (!asset_id || !download_attribute || !size || !raw_link) {
+                cglib_fail(ctx, cglib_error_listing, "unexpected downloads.csv eol, try re-running\n");
+                cgapi_materials_free(&out);
+                return out;
+            }
             /* check columns are actually what we are processing */
             if (line == 0 && (strcmp(asset_id, "assetId") != 0
                         || strcmp(download_attribute, "downloadAttribute") != 0
-                        || strcmp(raw_link, "rawLink") != 0))
-                fatal("unexpected downloads.csv format, have you updated cgrip?\n");
-            cgapi_process_material(&out, asset_id, download_attribute, raw_link);
+                        || strcmp(size, "size") != 0
+                        || strcmp(raw_link, "rawLink") != 0)) {
+                cglib_fail(ctx, cglib_error_listing, "unexpected downloads.csv format, have you updated cgrip?\n");
+                cgapi_materials_free(&out);
+                return out;
+            }
+            if (!cgapi_add_material(&out, asset_id, download_attribute, size, raw_link)) {
+                cglib_fail(ctx, cglib_error_memory, "out of memory listing materials\n");
+                cgapi_materials_free(&out);
+                return out;
+            }
             line++;
             col = 0;
             asset_id = NULL;
             download_attribute = NULL;
+            size = NULL;
             raw_link = NULL;
             break;
         default:
@@ -278,95 +717,281 @@ static struct cgapi_materials cgapi_process_downloads_csv(enum cgapi_quality qua
         }
     }
     
-    verbose("found %d materials\n", out.material_count);
+    cglib_log(ctx, cglib_log_verbose, "found %d materials\n", out.material_count);
     return out;
 }
 
-static void cgapi_map_save(struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out)
+/* where a map of mat goes under out, 0 when it cannot */
+static int cgapi_map_path(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out, char *buf, int size)
 {
-    struct cgapi_map *map = &mat->maps[matmap];
-    char buf[256];
     int sz = 0;
 
-    if (map->data == NULL) return;
     *buf = 0;
     if (out) {
-        sz += strncat_s(buf + sz, out, sizeof buf - sz);
-        sz += strncat_s(buf + sz, "/", sizeof buf - sz);
+        sz += strncat_s(buf + sz, out, size - sz);
+        sz += strncat_s(buf + sz, "/", size - sz);
     }
-    cgapi_material_get_filename(mat, matmap, buf + sz, sizeof buf - sz);
-    verbose("found extension: %s\n", get_extension(buf));
-    printf("extracting %s%s\n", mat->id, cgapi_output[matmap]);
-    if (arguments.apply_opacity && matmap == cgapi_matmap_color) {
-        struct cgapi_map *opacity_map = &mat->maps[cgapi_matmap_opacity];
-        if (opacity_map->data) {
-            int i, j;
-            for (i = 0; i < map->width; i++) {
-                for (j = 0; j < map->height; j++) {
-                    unsigned char *opacity_color = &opacity_map->data[(j * opacity_map->width + i) * 4];
-                    unsigned char *color = &map->data[(j * map->width + i) * 4];
-                    color[3] = opacity_color[0];
-                }
-            }
-        }
+    cgapi_material_get_filename(mat, matmap, ctx->job->format, buf + sz, size - sz);
+    cglib_log(ctx, cglib_log_verbose, "found extension: %s\n", get_extension(buf));
+    cglib_log(ctx, cglib_log_info, "extracting %s%s.%s\n", mat->id, cgapi_output[matmap], cgformat_get(ctx->job->format)->extension);
+    if (!get_extension(buf) || strcmp(get_extension(buf), cgformat_get(ctx->job->format)->extension))
+        return cglib_fail(ctx, cglib_error_io, "path too long, failed to save material map for %s to %s\n", mat->id, buf);
+    return 1;
+}
+
+/*
+ * encodes a map into output, to be written with cgapi_material_write_maps.
+ * returns 0 when there is nothing to write.
+ */
+int cgapi_material_encode_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out, struct cgapi_output *output)
+{
+    struct cgapi_map *map = &mat->maps[matmap];
+
+    struct cgformat_options options;
+
+    output->data = NULL;
+    output->size = 0;
+    if (map->data == NULL) return 0;
+    if (!cgapi_map_path(ctx, mat, matmap, out, output->path, sizeof output->path))
+        return 0;
+    cgapi_format_options(ctx->job, matmap, &options);
+    output->data = cgformat_encode_memory(ctx->job->format, map->data, map->width, map->height, &options, &output->size);
+    if (!output->data)
+        return cglib_fail(ctx, cglib_error_memory, "out of memory encoding %s\n", output->path);
+    return 1;
+}
+
+/*
+ * encodes a map straight into its file as it is encoded, for maps too
+ * big to hold a whole file of alongside. renamed in like the rest.
+ */
+int cgapi_material_stream_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out)
+{
+    struct cgapi_map *map = &mat->maps[matmap];
+    struct cgformat_options options;
+    char path[256], tmp[320];
+    int fd;
+
+    if (map->data == NULL) return 0;
+    if (!cgapi_map_path(ctx, mat, matmap, out, path, sizeof path))
+        return 0;
+    if ((fd = cgout_open(path, tmp, sizeof tmp)) < 0)
+        return cglib_fail(ctx, cglib_error_io, "failed to write %s\n", path);
+    cgapi_format_options(ctx->job, matmap, &options);
+    if (!cgout_commit(fd, tmp, path, cgformat_encode_fd(ctx->job->format, fd, map->data, map->width, map->height, &options)))
+        return cglib_fail(ctx, cglib_error_io, "failed to write %s\n", path);
+    cglib_output(ctx, mat->id, path);
+    return 1;
+}
+
+static int cgapi_stream_in(void *ud, const unsigned char *rgba, unsigned int y)
+{
+    return cgpro_stream_row((struct cgpro_stream *) ud, rgba, y);
+}
+
+/* the encoder rows of a cgapi_map_stream go to */
+struct cgapi_stream_encoder {
+    const struct cgformat_info *format;
+    void *enc;
+};
+
+static int cgapi_stream_out(void *ud, const unsigned char *rgba, unsigned int y)
+{
+    struct cgapi_stream_encoder *out = (struct cgapi_stream_encoder *) ud;
+    (void) y;
+    return out->format->encoder_row(out->enc, rgba);
+}
+
+/*
+ * decodes, runs pipeline on and encodes a map into its file a row at a
+ * time, for maps of at least CGAPI_STREAM_PIXELS that are not cached
+ * decoded. an 8K map then never takes more than a few rows. formats
+ * without a row encoder, and mip chains, need the whole map. returns 1 once
+ * it is saved, otherwise the map is left as it was, still to be decoded.
+ */
+int cgapi_map_stream(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out, struct cgpro_pipeline *pipeline)
+{
+    struct cgapi_map *map = &mat->maps[matmap];
+    struct cgpro_palette palette = pipeline->palette;
+    struct cgpro_stream stream;
+    struct cgapi_stream_encoder enc;
+    struct cgformat_options options;
+    struct cgpng_info info;
+    char path[256], tmp[320];
+    int fd, channels, ok;
+
+    enc.format = cgformat_get(ctx->job->format);
+    if (!enc.format->encoder_new || (ctx->job->mipmaps && enc.format->mipmaps))
+        return 0;
+    if (!map->encoded || cgapi_pixels || !cgpng_read_info(map->encoded, map->encoded_size, &info)
+            || info.interlaced || (size_t) info.width * info.height < CGAPI_STREAM_PIXELS)
+        return 0;
+    if (!cgpro_stream_init(&stream, pipeline, info.width, info.height, cgapi_stream_out, &enc))
+        return 0;
+    /* quantized, an opaque map is all palette colors and is stored as them */
+    channels = info.channels;
+    if (palette.data && (channels == 2 || channels == 4))
+        channels = 4;
+    else if (palette.data)
+        channels = 3;
+    if (!palette.data || channels == 4 || palette.num > 256)
+        palette.data = NULL;
+    if (!cgapi_map_path(ctx, mat, matmap, out, path, sizeof path)) {
+        cgpro_stream_free(&stream);
+        return 0;
     }
-    if (get_extension(buf) && !strcmp(get_extension(buf), "png")) { /* TODO: other formats? */
-        unsigned error = lodepng_encode32_file(buf, map->data, map->width, map->height);
-        if (error)
-            warn("png write error: %s\n", lodepng_error_text(error));
-    } else {
-        warn("path too long, failed to save material map for %s to %s\n", mat->id, buf);
+    if ((fd = cgout_open(path, tmp, sizeof tmp)) < 0) {
+        cgpro_stream_free(&stream);
+        return 0;
+    }
+    /* an encoder can also decline what it needs the whole map for */
+    cgapi_format_options(ctx->job, matmap, &options);
+    enc.enc = enc.format->encoder_new(stream.width, stream.height, channels, &options,
+            palette.data, palette.num, cgformat_write_fd, &fd);
+    if (!enc.enc) {
+        cgout_commit(fd, tmp, path, 0);
+        cgpro_stream_free(&stream);
+        return 0;
+    }
+    cglib_log(ctx, cglib_log_verbose, "streaming %s %s\n", mat->id, cgapi_matmap[matmap]);
+    ok = cgpng_decode_rows(map->encoded, map->encoded_size, cgapi_stream_in, &stream)
+        && enc.format->encoder_finish(enc.enc);
+    enc.format->encoder_free(enc.enc);
+    if (!cgout_commit(fd, tmp, path, ok) || !ok) {
+        cglib_log(ctx, cglib_log_verbose, "failed to stream %s %s, decoding it whole\n", mat->id, cgapi_matmap[matmap]);
+        cgpro_stream_free(&stream);
+        return 0;
     }
+    map->width = stream.width;
+    map->height = stream.height;
+    cgpro_stream_free(&stream);
+    cgmem_free(map->encoded);
+    map->encoded = NULL;
+    map->encoded_size = 0;
+    map->stored = 1;
+    cglib_output(ctx, mat->id, path);
+    return 1;
+}
+
+/*
+ * writes encoded maps of mat all at once and frees them. each is written
+ * aside and renamed over, so nobody sees half a file and a hard link into
+ * a store is replaced rather than written through.
+ */
+void cgapi_material_write_maps(struct cglib_context *ctx, struct cgapi_material *mat, struct cgapi_output *outputs, unsigned int count)
+{
+    struct cgout_file files[CGAPI_MAPNUM];
+    unsigned int i, n = 0;
+
+    for (i = 0; i < count && n < CGAPI_MAPNUM; i++) {
+        if (!outputs[i].data)
+            continue;
+        files[n].path = outputs[i].path;
+        files[n].data = outputs[i].data;
+        files[n].size = outputs[i].size;
+        n++;
+    }
+    cgout_write(files, n);
+    for (i = 0; i < n; i++) {
+        if (files[i].ok)
+            cglib_output(ctx, mat->id, files[i].path);
+        else
+            cglib_fail(ctx, cglib_error_io, "failed to write %s\n", files[i].path);
+        cgmem_free((void *) files[i].data);
+    }
+    for (i = 0; i < count; i++)
+        outputs[i].data = NULL;
 }
 
-void cgapi_material_get_filename(struct cgapi_material *mat, enum cgapi_matmap map, char *buf, int bufsz)
+static void cgapi_map_save(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out)
+{
+    struct cgapi_output output;
+    struct cgapi_map *map = &mat->maps[matmap];
+    if ((size_t) map->width * map->height >= CGAPI_STREAM_PIXELS)
+        cgapi_material_stream_map(ctx, mat, matmap, out);
+    else if (cgapi_material_encode_map(ctx, mat, matmap, out, &output))
+        cgapi_material_write_maps(ctx, mat, &output, 1);
+}
+
+void cgapi_material_get_filename(struct cgapi_material *mat, enum cgapi_matmap map, enum cgformat format, char *buf, int bufsz)
 {
     int sz = 0;
     sz += strncat_s(buf + sz, mat->id, bufsz - sz);
     sz += strncat_s(buf + sz, cgapi_output[map], bufsz - sz);
+    sz += strncat_s(buf + sz, ".", bufsz - sz);
+    sz += strncat_s(buf + sz, cgformat_get(format)->extension, bufsz - sz);
 }
 
-void cgapi_material_save(struct cgapi_material *mat, const char *out)
-{
-    if (arguments.save_ambientocclusion)
-        cgapi_map_save(mat, cgapi_matmap_ambientocclusion, out);
-    if (arguments.save_color)
-        cgapi_map_save(mat, cgapi_matmap_color, out);
-    if (arguments.save_displacement)
-        cgapi_map_save(mat, cgapi_matmap_displacement, out);
-    if (arguments.save_emission)
-        cgapi_map_save(mat, cgapi_matmap_emission, out);
-    if (arguments.save_metalness)
-        cgapi_map_save(mat, cgapi_matmap_metalness, out);
-    if (arguments.save_opacity && !arguments.apply_opacity)
-        cgapi_map_save(mat, cgapi_matmap_opacity, out);
-    if (arguments.save_roughness)
-        cgapi_map_save(mat, cgapi_matmap_roughness, out);
-
-    switch (arguments.save_normal) {
-    case cgrip_normal_type_dx:
-        cgapi_map_save(mat, cgapi_matmap_normaldx, out);
-        break;
-    case cgrip_normal_type_both:
-        cgapi_map_save(mat, cgapi_matmap_normaldx, out);
-    case cgrip_normal_type_gl:
-        cgapi_map_save(mat, cgapi_matmap_normalgl, out);
-        break;
+/* what a format is told a map holds */
+enum cgformat_kind cgapi_matmap_kind(enum cgapi_matmap matmap)
+{
+    switch (matmap) {
+    case cgapi_matmap_color:
+    case cgapi_matmap_emission:
+        return cgformat_kind_color;
+    case cgapi_matmap_normaldx:
+    case cgapi_matmap_normalgl:
+        return cgformat_kind_normal;
     default:
-        break;
+        return cgformat_kind_gray;
+    }
+}
+
+/* how job wants a map saved */
+void cgapi_format_options(const struct cglib_job *job, enum cgapi_matmap matmap, struct cgformat_options *options)
+{
+    options->kind = cgapi_matmap_kind(matmap);
+    options->mipmaps = job->mipmaps;
+    options->zstd = job->zstd;
+}
+
+int cgapi_map_is_saved(const struct cglib_job *job, enum cgapi_matmap matmap)
+{
+    switch (matmap) {
+    case cgapi_matmap_ambientocclusion:
+        return job->save_ambientocclusion;
+    case cgapi_matmap_color:
+        return job->save_color;
+    case cgapi_matmap_displacement:
+        return job->save_displacement;
+    case cgapi_matmap_emission:
+        return job->save_emission;
+    case cgapi_matmap_metalness:
+        return job->save_metalness;
+    case cgapi_matmap_normaldx:
+        return job->save_normal == cgrip_normal_type_dx || job->save_normal == cgrip_normal_type_both;
+    case cgapi_matmap_normalgl:
+        return job->save_normal == cgrip_normal_type_gl || job->save_normal == cgrip_normal_type_both;
+    case cgapi_matmap_opacity:
+        return job->save_opacity && !job->apply_opacity;
+    case cgapi_matmap_roughness:
+        return job->save_roughness;
     }
-        
+    return 0;
+}
+
+void cgapi_material_save_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out)
+{
+    if (cgapi_map_is_saved(ctx->job, matmap))
+        cgapi_map_save(ctx, mat, matmap, out);
 }
 
-void cgapi_materials_save(struct cgapi_materials *mats, const char *out)
+void cgapi_material_save(struct cglib_context *ctx, struct cgapi_material *mat, const char *out)
+{
+    int i;
+    for (i = 0; i < CGAPI_MAPNUM; i++)
+        cgapi_material_save_map(ctx, mat, i, out);
+}
+
+void cgapi_materials_save(struct cglib_context *ctx, struct cgapi_materials *mats, const char *out)
 {
     int i = 0;
     for (i = 0; i < mats->material_count; i++) {
-        cgapi_material_save(&mats->materials[i], out);
+        cgapi_material_save(ctx, &mats->materials[i], out);
     }
 }
 
-struct cgapi_materials cgapi_download_ids(enum cgapi_quality quality, const char **ids, int id_count)
+struct cgapi_materials cgapi_list_ids(struct cglib_context *ctx, enum cgapi_quality quality, const char **ids, int id_count)
 {
     struct cgapi_materials out;
     struct cgapi_mem mem;
@@ -381,27 +1006,70 @@ struct cgapi_materials cgapi_download_ids(enum cgapi_quality quality, const char
         sz += strncat_s(url + sz, ids[i], sizeof url - sz);
     }
 
-    verbose("downloading %s\n", url);
-    mem = cgapi_curl_chunk(url);
-    verbose("downloaded successfully -> %lu B\n", mem.sz);
-    out = cgapi_process_downloads_csv(quality, mem.res);
-    free(mem.res);
+    cglib_log(ctx, cglib_log_verbose, "downloading %s\n", url);
+    mem = cgapi_curl_chunk(ctx, url);
+    if (!mem.res) {
+        memset(&out, 0, sizeof out);
+        out.quality = quality;
+        return out;
+    }
+    cglib_log(ctx, cglib_log_verbose, "downloaded successfully -> %lu B\n", mem.sz);
+    out = cgapi_process_downloads_csv(ctx, quality, mem.res);
+    cgmem_free(mem.res);
 
     if (out.material_count == 0)
-        warn("found no materials matching given ids.\n");
+        cglib_log(ctx, cglib_log_warn, "found no materials matching given ids.\n");
+    return out;
+}
+
+struct cgapi_materials cgapi_download_ids(struct cglib_context *ctx, enum cgapi_quality quality, const char **ids, int id_count)
+{
+    struct cgapi_materials out = cgapi_list_ids(ctx, quality, ids, id_count);
+    int i, kept = 0;
+
+    for (i = 0; i < out.material_count; i++) {
+        struct cgapi_material *mat = &out.materials[i];
+        if (cgapi_material_download(ctx, mat) && cgapi_material_rip(ctx, mat)) {
+            /* everything is kept around, there is nothing to wait for */
+            cgmem_release(&mat->mem);
+            out.materials[kept++] = *mat;
+        } else {
+            cgapi_material_release(mat);
+            free(mat->id);
+            free(mat->url);
+            free(mat->source);
+        }
+    }
+    out.material_count = kept;
     return out;
 }
 
+/* drops everything downloaded or decoded for mat, keeping what identifies it */
+void cgapi_material_release(struct cgapi_material *mat)
+{
+    int j;
+    for (j = 0; j < CGAPI_MAPNUM; j++) {
+        cgmem_free(mat->maps[j].data);
+        cgmem_free(mat->maps[j].encoded);
+        mat->maps[j].data = NULL;
+        mat->maps[j].encoded = NULL;
+    }
+    cgmem_free(mat->zip);
+    mat->zip = NULL;
+    mat->zip_size = 0;
+    cgmem_release(&mat->mem);
+}
+
 void cgapi_materials_free(struct cgapi_materials *mats)
 {
-    int i, j;
+    int i;
     for (i = 0; i < mats->material_count; i++) {
+        cgapi_material_release(&mats->materials[i]);
         free(mats->materials[i].id);
-        for (j = 0; j < CGAPI_MAPNUM; j++) {
-            if (mats->materials[i].maps[j].data != NULL)
-                free(mats->materials[i].maps[j].data);
-        }
+        free(mats->materials[i].url);
+        free(mats->materials[i].source);
     }
     free(mats->materials);
+    mats->materials = NULL;
+    mats->material_count = 0;
 }
-
@@ -2,7 +2,19 @@
 #ifndef CGAPI_H_
 #define CGAPI_H_
 
+#include <stddef.h>
+
+#include "cgformat.h"
+#include "cgmem.h"
+
+struct cglib_context;
+struct cglib_job;
+struct cgpix;
+struct cgpro_pipeline;
+
 #define CGAPI_MAPNUM 9
+/* maps of at least this many pixels are encoded straight into their file, decoded too when they can be */
+#define CGAPI_STREAM_PIXELS (2048 * 2048)
 
 enum cgapi_quality {
     cgapi_quality_1k_png,
@@ -27,12 +39,31 @@ struct cgapi_map {
     unsigned char *data;
     struct cgpro_palette *palette;
     unsigned int width, height;
+    unsigned char *encoded; /* extracted but not yet decoded */
+    size_t encoded_size;
+    int stored; /* saved from a store or streamed without being decoded, so there is no data */
 };
 
 struct cgapi_material {
     char *id;
+    char *url;
     enum cgapi_quality quality;
     struct cgapi_map maps[CGAPI_MAPNUM];
+    char *zip; /* downloaded but not yet ripped */
+    size_t zip_size;
+    int derived_normal; /* normal map made from the other one, or -1 */
+    size_t download_size; /* as listed, for admission before downloading */
+    struct cgmem_hold mem;
+    char *source; /* request header revalidating the zip, NULL when there is none */
+    unsigned long zip_hash; /* of the zip's bytes, for a store */
+    int unchanged; /* revalidated by source, nothing was downloaded */
+};
+
+/* a map's png on its way out, see cgapi_material_encode_map */
+struct cgapi_output {
+    char path[256];
+    unsigned char *data; /* encoded as the job's format */
+    size_t size;
 };
 
 struct cgapi_materials {
@@ -41,11 +72,33 @@ struct cgapi_materials {
     int material_count;
 };
 
+/* gets mat back once its download is over, ok says whether it has its zip */
+typedef void (*cgapi_download_fn)(struct cgapi_material *mat, int ok, void *ud);
+
+void cgapi_init(void);
+void cgapi_cleanup(void);
+void cgapi_set_pixels(struct cgpix *pix);
 int cgapi_material_has_map(struct cgapi_material *mat, enum cgapi_matmap map);
-void cgapi_material_get_filename(struct cgapi_material *mat, enum cgapi_matmap map, char *buf, int bufsz);
-void cgapi_material_save(struct cgapi_material *mat, const char *out);
-void cgapi_materials_save(struct cgapi_materials *mats, const char *out);
-struct cgapi_materials cgapi_download_ids(enum cgapi_quality quality, const char **ids, int id_count);
+void cgapi_material_get_filename(struct cgapi_material *mat, enum cgapi_matmap map, enum cgformat format, char *buf, int bufsz);
+enum cgformat_kind cgapi_matmap_kind(enum cgapi_matmap matmap);
+void cgapi_format_options(const struct cglib_job *job, enum cgapi_matmap matmap, struct cgformat_options *options);
+int cgapi_map_is_saved(const struct cglib_job *job, enum cgapi_matmap matmap);
+void cgapi_material_save_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out);
+int cgapi_material_encode_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out, struct cgapi_output *output);
+void cgapi_material_write_maps(struct cglib_context *ctx, struct cgapi_material *mat, struct cgapi_output *outputs, unsigned int count);
+int cgapi_map_stream(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out, struct cgpro_pipeline *pipeline);
+int cgapi_material_stream_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out);
+void cgapi_material_save(struct cglib_context *ctx, struct cgapi_material *mat, const char *out);
+void cgapi_materials_save(struct cglib_context *ctx, struct cgapi_materials *mats, const char *out);
+struct cgapi_materials cgapi_list_ids(struct cglib_context *ctx, enum cgapi_quality quality, const char **ids, int id_count);
+int cgapi_material_download(struct cglib_context *ctx, struct cgapi_material *mat);
+int cgapi_material_download_start(struct cglib_context *ctx, struct cgapi_material *mat, cgapi_download_fn done, void *ud);
+void cgapi_material_save_zip(struct cglib_context *ctx, struct cgapi_material *mat);
+int cgapi_material_extract(struct cglib_context *ctx, struct cgapi_material *mat);
+int cgapi_map_decode(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap);
+int cgapi_material_rip(struct cglib_context *ctx, struct cgapi_material *mat);
+struct cgapi_materials cgapi_download_ids(struct cglib_context *ctx, enum cgapi_quality quality, const char **ids, int id_count);
+void cgapi_material_release(struct cgapi_material *mat);
 void cgapi_materials_free(struct cgapi_materials *mats);
 
 #endif /* CGAPI_H_ */
@@ -0,0 +1,481 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "cgbcn.h"
+#include "cgpool.h"
+
+/* bc7 interpolation weights of 4 bit indices, out of 64 */
+static const int cgbcn_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+/* bc1 index of each step from its first color to its second */
+static const unsigned int cgbcn_bc1_order[4] = { 0, 2, 3, 1 };
+
+static struct cgpool *cgbcn_pool = NULL;
+
+/* a bc7 mode 6 endpoint: 7 bits a channel, a low bit shared, and the two made whole */
+struct cgbcn_endpoint {
+    int q[4], p, e[4];
+};
+
+/* without a pool everything runs on the calling thread */
+void cgbcn_set_pool(struct cgpool *pool)
+{
+    cgbcn_pool = pool;
+}
+
+/* color by whether it has alpha or bc7 is wanted, gray in one channel, normals in two */
+enum cgbcn_format cgbcn_pick(enum cgformat_kind kind, int alpha, int bc7)
+{
+    if (kind == cgformat_kind_gray)
+        return cgbcn_bc4;
+    if (kind == cgformat_kind_normal)
+        return cgbcn_bc5;
+    if (bc7)
+        return cgbcn_bc7;
+    return alpha ? cgbcn_bc3 : cgbcn_bc1;
+}
+
+unsigned int cgbcn_block_size(enum cgbcn_format format)
+{
+    return format == cgbcn_bc1 || format == cgbcn_bc4 ? 8 : 16;
+}
+
+/* bytes a width by height image takes, partial blocks included */
+size_t cgbcn_size(enum cgbcn_format format, unsigned int width, unsigned int height)
+{
+    return (size_t) ((width + 3) / 4) * ((height + 3) / 4) * cgbcn_block_size(format);
+}
+
+/* appends the low bits of value to a zeroed block, lowest first */
+static void cgbcn_bits(unsigned char *out, unsigned int *pos, unsigned int value, unsigned int bits)
+{
+    unsigned int i;
+    for (i = 0; i < bits; i++, (*pos)++)
+        out[*pos >> 3] |= ((value >> i) & 1) << (*pos & 7);
+}
+
+static int cgbcn_round(float v, int top)
+{
+    if (v <= 0)
+        return 0;
+    if (v >= top)
+        return top;
+    return (int) (v + 0.5f);
+}
+
+/*
+ * the line n channels of a block's 16 pixels lie closest to, by power
+ * iteration on their covariance, and the stretch of it they cover pulled
+ * in a little, since the steps between c0 and c1 do the rest.
+ */
+static void cgbcn_line(const unsigned char *px, int n, int steps, float *c0, float *c1)
+{
+    float cov[4][4] = { { 0 } }, mean[4], axis[4], v[4], d[4], lo = 0, hi = 0, len = 0, m, t;
+    int i, j, k, it, widest = 0;
+
+    for (j = 0; j < n; j++) {
+        for (i = 0, mean[j] = 0; i < 16; i++)
+            mean[j] += px[i * 4 + j];
+        mean[j] /= 16;
+    }
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < n; j++)
+            d[j] = px[i * 4 + j] - mean[j];
+        for (j = 0; j < n; j++)
+            for (k = j; k < n; k++)
+                cov[j][k] += d[j] * d[k];
+    }
+    for (j = 0; j < n; j++) {
+        for (k = 0; k < j; k++)
+            cov[j][k] = cov[k][j];
+        if (cov[j][j] > cov[widest][widest])
+            widest = j;
+    }
+    for (j = 0; j < n; j++)
+        axis[j] = cov[widest][j];
+    for (it = 0; it < 8; it++) {
+        for (j = 0, m = 0; j < n; j++) {
+            for (k = 0, v[j] = 0; k < n; k++)
+                v[j] += cov[j][k] * axis[k];
+            if (v[j] > m || -v[j] > m)
+                m = v[j] > 0 ? v[j] : -v[j];
+        }
+        if (m == 0)
+            break;
+        for (j = 0; j < n; j++)
+            axis[j] = v[j] / m;
+    }
+    for (j = 0; j < n; j++)
+        len += axis[j] * axis[j];
+    if (len > 0) {
+        for (i = 0; i < 16; i++) {
+            for (j = 0, t = 0; j < n; j++)
+                t += (px[i * 4 + j] - mean[j]) * axis[j];
+            if (i == 0 || t < lo)
+                lo = t;
+            if (i == 0 || t > hi)
+                hi = t;
+        }
+        t = (hi - lo) / (4 * steps);
+        lo = (lo + t) / len;
+        hi = (hi - t) / len;
+    }
+    for (j = 0; j < n; j++) {
+        c0[j] = len > 0 ? mean[j] + axis[j] * lo : mean[j];
+        c1[j] = len > 0 ? mean[j] + axis[j] * hi : mean[j];
+    }
+}
+
+/*
+ * the step from e0 to e1, 0 to steps - 1, nearest each pixel along the
+ * line between them. n of 3 leaves alpha out.
+ */
+static void cgbcn_fit(const unsigned char *px, const int *e0, const int *e1, int n, int steps, unsigned char *idx)
+{
+    int d[4] = { 0, 0, 0, 0 }, base = 0, len = 0, i = 0, j;
+    float scale, t;
+
+    for (j = 0; j < n; j++) {
+        d[j] = e1[j] - e0[j];
+        base += e0[j] * d[j];
+        len += d[j] * d[j];
+    }
+    if (!len) {
+        memset(idx, 0, 16);
+        return;
+    }
+    scale = (steps - 1) / (float) len;
+#ifdef __SSE2__
+    {
+        /* 4 pixels at a time: dot products by pairs of 16 bit products */
+        __m128i zero = _mm_setzero_si128();
+        __m128i axis = _mm_set_epi16(d[3], d[2], d[1], d[0], d[3], d[2], d[1], d[0]);
+        __m128 from = _mm_set1_ps((float) base), by = _mm_set1_ps(scale);
+        __m128 half = _mm_set1_ps(0.5f), top = _mm_set1_ps((float) (steps - 1)), none = _mm_setzero_ps();
+        for (; i < 16; i += 4) {
+            __m128i p = _mm_loadu_si128((const __m128i *) (px + i * 4));
+            __m128 a = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(p, zero), axis));
+            __m128 b = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(p, zero), axis));
+            __m128i dot = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+                    _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+            __m128 s = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(dot), from), by), half);
+            __m128i q = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(s, none), top));
+            int packed;
+            q = _mm_packs_epi32(q, q);
+            packed = _mm_cvtsi128_si32(_mm_packus_epi16(q, q));
+            memcpy(idx + i, &packed, 4);
+        }
+    }
+#endif
+    for (; i < 16; i++) {
+        const unsigned char *p = px + i * 4;
+        t = (p[0] * d[0] + p[1] * d[1] + p[2] * d[2] + p[3] * d[3] - base) * scale + 0.5f;
+        if (t < 0)
+            t = 0;
+        if (t > steps - 1)
+            t = steps - 1;
+        idx[i] = (unsigned char) t;
+    }
+}
+
+/* channel value of step t from a to b, as decoders make it */
+static int cgbcn_lerp(int a, int b, int t, int steps)
+{
+    if (steps == 16)
+        return ((64 - cgbcn_weights[t]) * a + cgbcn_weights[t] * b + 32) >> 6;
+    return ((3 - t) * a + t * b) / 3;
+}
+
+static long cgbcn_error(const unsigned char *px, const int *e0, const int *e1, int n, int steps, const unsigned char *idx)
+{
+    long err = 0;
+    int i, j, d;
+    for (i = 0; i < 16; i++)
+        for (j = 0; j < n; j++) {
+            d = cgbcn_lerp(e0[j], e1[j], idx[i], steps) - px[i * 4 + j];
+            err += d * d;
+        }
+    return err;
+}
+
+/* least squares endpoints for the steps px was given, 0 when all took one */
+static int cgbcn_refit(const unsigned char *px, int n, int steps, const unsigned char *idx, float *c0, float *c1)
+{
+    float aa = 0, ab = 0, bb = 0, ap[4] = { 0, 0, 0, 0 }, bp[4] = { 0, 0, 0, 0 }, w, v, det;
+    int i, j;
+
+    for (i = 0; i < 16; i++) {
+        w = steps == 16 ? cgbcn_weights[idx[i]] / 64.0f : idx[i] / 3.0f;
+        v = 1 - w;
+        aa += v * v;
+        ab += v * w;
+        bb += w * w;
+        for (j = 0; j < n; j++) {
+            ap[j] += v * px[i * 4 + j];
+            bp[j] += w * px[i * 4 + j];
+        }
+    }
+    det = aa * bb - ab * ab;
+    if (det < 0.0001f)
+        return 0;
+    for (j = 0; j < n; j++) {
+        c0[j] = (bb * ap[j] - ab * bp[j]) / det;
+        c1[j] = (aa * bp[j] - ab * ap[j]) / det;
+    }
+    return 1;
+}
+
+/* the 565 color nearest c, and in e as decoders widen it */
+static unsigned int cgbcn_565(const float *c, int *e)
+{
+    int r = cgbcn_round(c[0] * 31 / 255, 31), g = cgbcn_round(c[1] * 63 / 255, 63), b = cgbcn_round(c[2] * 31 / 255, 31);
+    e[0] = r << 3 | r >> 2;
+    e[1] = g << 2 | g >> 4;
+    e[2] = b << 3 | b >> 2;
+    e[3] = 0;
+    return r << 11 | g << 5 | b;
+}
+
+/* a bc1 color block of px, alpha left out, always in its four color mode */
+static void cgbcn_color(const unsigned char *px, unsigned char *out)
+{
+    float c0[3], c1[3];
+    int e0[4], e1[4], f0[4], f1[4], i;
+    unsigned int q0, q1, r0, r1, t;
+    unsigned char idx[16], refit[16];
+
+    cgbcn_line(px, 3, 4, c0, c1);
+    q0 = cgbcn_565(c0, e0);
+    q1 = cgbcn_565(c1, e1);
+    cgbcn_fit(px, e0, e1, 3, 4, idx);
+    if (cgbcn_refit(px, 3, 4, idx, c0, c1)) {
+        r0 = cgbcn_565(c0, f0);
+        r1 = cgbcn_565(c1, f1);
+        cgbcn_fit(px, f0, f1, 3, 4, refit);
+        if (cgbcn_error(px, f0, f1, 3, 4, refit) < cgbcn_error(px, e0, e1, 3, 4, idx)) {
+            q0 = r0;
+            q1 = r1;
+            memcpy(idx, refit, 16);
+        }
+    }
+    /* the first color greater keeps bc1 from its mode with transparency */
+    if (q0 < q1) {
+        t = q0;
+        q0 = q1;
+        q1 = t;
+        for (i = 0; i < 16; i++)
+            idx[i] = 3 - idx[i];
+    } else if (q0 == q1) {
+        memset(idx, 0, 16);
+    }
+    out[0] = q0 & 0xFF;
+    out[1] = q0 >> 8;
+    out[2] = q1 & 0xFF;
+    out[3] = q1 >> 8;
+    memset(out + 4, 0, 4);
+    for (i = 0; i < 16; i++)
+        out[4 + i / 4] |= cgbcn_bc1_order[idx[i]] << (i % 4 * 2);
+}
+
+/* a bc4 block of channel c of px, in its mode of eight values */
+static void cgbcn_single(const unsigned char *px, int c, unsigned char *out)
+{
+    int lo = 255, hi = 0, values[8], i, k, best, d, bestd;
+    unsigned int pos = 16;
+
+    for (i = 0; i < 16; i++) {
+        if (px[i * 4 + c] < lo)
+            lo = px[i * 4 + c];
+        if (px[i * 4 + c] > hi)
+            hi = px[i * 4 + c];
+    }
+    memset(out, 0, 8);
+    out[0] = hi;
+    out[1] = lo;
+    /* equal ends are the mode of six values, where index 0 is still the first */
+    if (hi == lo)
+        return;
+    values[0] = hi;
+    values[1] = lo;
+    for (k = 2; k < 8; k++)
+        values[k] = ((8 - k) * hi + (k - 1) * lo + 3) / 7;
+    for (i = 0; i < 16; i++) {
+        for (k = 0, best = 0, bestd = 256; k < 8; k++) {
+            d = values[k] - px[i * 4 + c];
+            if (d < 0)
+                d = -d;
+            if (d < bestd) {
+                bestd = d;
+                best = k;
+            }
+        }
+        cgbcn_bits(out, &pos, best, 3);
+    }
+}
+
+/* the mode 6 endpoint nearest c, trying both low bits */
+static void cgbcn_endpoint(const float *c, struct cgbcn_endpoint *end)
+{
+    float err, best = 0, d;
+    int bit, j, q[4];
+
+    for (bit = 0; bit < 2; bit++) {
+        for (j = 0, err = 0; j < 4; j++) {
+            q[j] = cgbcn_round((c[j] - bit) / 2, 127);
+            d = (q[j] << 1 | bit) - c[j];
+            err += d * d;
+        }
+        if (bit == 0 || err < best) {
+            best = err;
+            end->p = bit;
+            for (j = 0; j < 4; j++) {
+                end->q[j] = q[j];
+                end->e[j] = q[j] << 1 | bit;
+            }
+        }
+    }
+}
+
+/*
+ * a bc7 block of px in mode 6 alone: one pair of rgba endpoints and 16
+ * steps between them, which suits most of a texture's blocks well enough.
+ */
+static void cgbcn_mode6(const unsigned char *px, unsigned char *out)
+{
+    struct cgbcn_endpoint a, b, ra, rb, t;
+    float c0[4], c1[4];
+    unsigned char idx[16], refit[16];
+    unsigned int pos = 0;
+    int i, j;
+
+    cgbcn_line(px, 4, 16, c0, c1);
+    cgbcn_endpoint(c0, &a);
+    cgbcn_endpoint(c1, &b);
+    cgbcn_fit(px, a.e, b.e, 4, 16, idx);
+    if (cgbcn_refit(px, 4, 16, idx, c0, c1)) {
+        cgbcn_endpoint(c0, &ra);
+        cgbcn_endpoint(c1, &rb);
+        cgbcn_fit(px, ra.e, rb.e, 4, 16, refit);
+        if (cgbcn_error(px, ra.e, rb.e, 4, 16, refit) < cgbcn_error(px, a.e, b.e, 4, 16, idx)) {
+            a = ra;
+            b = rb;
+            memcpy(idx, refit, 16);
+        }
+    }
+    /* the first pixel's index is stored without its top bit, which must be 0 */
+    if (idx[0] >= 8) {
+        t = a;
+        a = b;
+        b = t;
+        for (i = 0; i < 16; i++)
+            idx[i] = 15 - idx[i];
+    }
+    memset(out, 0, 16);
+    cgbcn_bits(out, &pos, 1 << 6, 7);
+    for (j = 0; j < 4; j++) {
+        cgbcn_bits(out, &pos, a.q[j], 7);
+        cgbcn_bits(out, &pos, b.q[j], 7);
+    }
+    cgbcn_bits(out, &pos, a.p, 1);
+    cgbcn_bits(out, &pos, b.p, 1);
+    cgbcn_bits(out, &pos, idx[0], 3);
+    for (i = 1; i < 16; i++)
+        cgbcn_bits(out, &pos, idx[i], 4);
+}
+
+/* compresses one block, 16 rgba pixels in rows of 4, into out */
+void cgbcn_block(enum cgbcn_format format, const unsigned char *rgba, unsigned char *out)
+{
+    switch (format) {
+    case cgbcn_bc1:
+        cgbcn_color(rgba, out);
+        break;
+    case cgbcn_bc3:
+        cgbcn_single(rgba, 3, out);
+        cgbcn_color(rgba, out + 8);
+        break;
+    case cgbcn_bc4:
+        cgbcn_single(rgba, 0, out);
+        break;
+    case cgbcn_bc5:
+        cgbcn_single(rgba, 0, out);
+        cgbcn_single(rgba, 1, out + 8);
+        break;
+    case cgbcn_bc7:
+        cgbcn_mode6(rgba, out);
+        break;
+    }
+}
+
+/* an image on its way through, a block row to whoever claims it next */
+struct cgbcn_rows {
+    enum cgbcn_format format;
+    const unsigned char *rgba;
+    unsigned int width, height;
+    unsigned char *out;
+    unsigned int next_row;
+};
+
+static void cgbcn_row(struct cgbcn_rows *rows, unsigned int by)
+{
+    unsigned int blocks = (rows->width + 3) / 4, size = cgbcn_block_size(rows->format);
+    unsigned int bx, i, j, x, y;
+    unsigned char px[64], *out = rows->out + (size_t) by * blocks * size;
+    const unsigned char *src;
+
+    for (bx = 0; bx < blocks; bx++, out += size) {
+        /* blocks over the edge repeat its last pixels */
+        for (j = 0; j < 4; j++) {
+            y = by * 4 + j < rows->height ? by * 4 + j : rows->height - 1;
+            src = rows->rgba + (size_t) y * rows->width * 4;
+            if (bx * 4 + 4 <= rows->width) {
+                memcpy(px + j * 16, src + bx * 16, 16);
+                continue;
+            }
+            for (i = 0; i < 4; i++) {
+                x = bx * 4 + i < rows->width ? bx * 4 + i : rows->width - 1;
+                memcpy(px + j * 16 + i * 4, src + x * 4, 4);
+            }
+        }
+        cgbcn_block(rows->format, px, out);
+    }
+}
+
+static void cgbcn_rows_worker(void *ud)
+{
+    struct cgbcn_rows *rows = (struct cgbcn_rows *) ud;
+    unsigned int by, n = (rows->height + 3) / 4;
+    while ((by = __atomic_fetch_add(&rows->next_row, 1, __ATOMIC_RELAXED)) < n)
+        cgbcn_row(rows, by);
+}
+
+/*
+ * compresses width by height rgba pixels into out, cgbcn_size bytes of
+ * blocks left to right, top to bottom. block rows are spread over the
+ * pool, with the calling thread taking part.
+ */
+void cgbcn_compress(enum cgbcn_format format, const unsigned char *rgba, unsigned int width, unsigned int height, unsigned char *out)
+{
+    struct cgbcn_rows rows;
+    struct cgpool_group group = { 0 };
+    unsigned int i, n = cgbcn_pool ? cgpool_threads(cgbcn_pool) + 1 : 1;
+
+    if (!width || !height)
+        return;
+    if (n > (height + 3) / 4)
+        n = (height + 3) / 4;
+    rows.format = format;
+    rows.rgba = rgba;
+    rows.width = width;
+    rows.height = height;
+    rows.out = out;
+    rows.next_row = 0;
+    for (i = 1; i < n; i++)
+        if (!cgpool_submit(cgbcn_pool, &group, cgbcn_rows_worker, &rows))
+            break;
+    cgbcn_rows_worker(&rows);
+    if (cgbcn_pool)
+        cgpool_wait(cgbcn_pool, &group);
+}
@@ -0,0 +1,26 @@
+#ifndef CGBCN_H_
+#define CGBCN_H_
+
+#include <stddef.h>
+
+#include "cgformat.h"
+
+struct cgpool;
+
+/* block compressed gpu formats, each block 4x4 pixels */
+enum cgbcn_format {
+    cgbcn_bc1, /* rgb, 8 bytes a block */
+    cgbcn_bc3, /* rgba, 16 bytes a block */
+    cgbcn_bc4, /* red, 8 bytes a block */
+    cgbcn_bc5, /* red and green, 16 bytes a block */
+    cgbcn_bc7 /* rgba, 16 bytes a block */
+};
+
+void cgbcn_set_pool(struct cgpool *pool);
+enum cgbcn_format cgbcn_pick(enum cgformat_kind kind, int alpha, int bc7);
+unsigned int cgbcn_block_size(enum cgbcn_format format);
+size_t cgbcn_size(enum cgbcn_format format, unsigned int width, unsigned int height);
+void cgbcn_block(enum cgbcn_format format, const unsigned char *rgba, unsigned char *out);
+void cgbcn_compress(enum cgbcn_format format, const unsigned char *rgba, unsigned int width, unsigned int height, unsigned char *out);
+
+#endif /* CGBCN_H_ */
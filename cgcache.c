@@ -0,0 +1,336 @@
+#define _GNU_SOURCE /* snprintf */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgcache.h"
+#include "cgmem.h"
+
+#define CGCACHE_BUCKETS_MIN 256
+
+enum cgcache_state {
+    cgcache_state_filling, /* whoever missed first is making it, others wait */
+    cgcache_state_ready,
+    cgcache_state_failed /* out of the table, gone with its last holder */
+};
+
+/*
+ * byte-bounded lru of values by key. a miss is filled once no matter how
+ * many ask for it at the same time, and values held by someone are never
+ * evicted. with a dir, values also go to and come back from disk.
+ */
+struct cgcache {
+    size_t max_bytes, bytes;
+    char *dir;
+    struct cgcache_item **buckets;
+    unsigned int nbuckets, count;
+    struct cgcache_item *oldest, *newest;
+    unsigned long hits, misses, coalesced;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+};
+
+/* fnv-1a */
+static unsigned long cgcache_hash(const char *key)
+{
+    unsigned long h = 2166136261UL;
+    for (; *key; key++) {
+        h ^= (unsigned char) *key;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+struct cgcache *cgcache_new(size_t max_bytes, const char *dir)
+{
+    struct cgcache *cache = calloc(1, sizeof(struct cgcache));
+    if (!cache)
+        return NULL;
+    cache->max_bytes = max_bytes;
+    cache->nbuckets = CGCACHE_BUCKETS_MIN;
+    cache->buckets = calloc(cache->nbuckets, sizeof(struct cgcache_item *));
+    if (dir) {
+        cache->dir = malloc(strlen(dir) + 1);
+        if (cache->dir)
+            strcpy(cache->dir, dir);
+    }
+    if (!cache->buckets || (dir && !cache->dir)) {
+        free(cache->buckets);
+        free(cache->dir);
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->filled, NULL);
+    return cache;
+}
+
+static void cgcache_item_free(struct cgcache_item *item)
+{
+    cgmem_free(item->data);
+    free(item->key);
+    free(item);
+}
+
+/* the rest are with cache->lock held */
+static struct cgcache_item *cgcache_find(struct cgcache *cache, const char *key, unsigned long hash)
+{
+    struct cgcache_item *item;
+    for (item = cache->buckets[hash % cache->nbuckets]; item; item = item->next)
+        if (item->hash == hash && !strcmp(item->key, key))
+            return item;
+    return NULL;
+}
+
+static void cgcache_grow(struct cgcache *cache)
+{
+    unsigned int n = cache->nbuckets * 2, i;
+    struct cgcache_item **buckets = calloc(n, sizeof(struct cgcache_item *));
+    if (!buckets)
+        return; /* longer chains, still correct */
+    for (i = 0; i < cache->nbuckets; i++) {
+        while (cache->buckets[i]) {
+            struct cgcache_item *item = cache->buckets[i];
+            cache->buckets[i] = item->next;
+            item->next = buckets[item->hash % n];
+            buckets[item->hash % n] = item;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = n;
+}
+
+static void cgcache_insert(struct cgcache *cache, struct cgcache_item *item)
+{
+    struct cgcache_item **bucket;
+    if (cache->count >= cache->nbuckets * 2)
+        cgcache_grow(cache);
+    bucket = &cache->buckets[item->hash % cache->nbuckets];
+    item->next = *bucket;
+    *bucket = item;
+    cache->count++;
+}
+
+static void cgcache_remove(struct cgcache *cache, struct cgcache_item *item)
+{
+    struct cgcache_item **p = &cache->buckets[item->hash % cache->nbuckets];
+    while (*p && *p != item)
+        p = &(*p)->next;
+    if (*p) {
+        *p = item->next;
+        cache->count--;
+    }
+}
+
+static void cgcache_lru_unlink(struct cgcache *cache, struct cgcache_item *item)
+{
+    if (item->older)
+        item->older->newer = item->newer;
+    else
+        cache->oldest = item->newer;
+    if (item->newer)
+        item->newer->older = item->older;
+    else
+        cache->newest = item->older;
+    item->older = item->newer = NULL;
+}
+
+static void cgcache_lru_push(struct cgcache *cache, struct cgcache_item *item)
+{
+    item->newer = NULL;
+    item->older = cache->newest;
+    if (cache->newest)
+        cache->newest->newer = item;
+    else
+        cache->oldest = item;
+    cache->newest = item;
+}
+
+static void cgcache_evict(struct cgcache *cache)
+{
+    while (cache->bytes > cache->max_bytes && cache->oldest) {
+        struct cgcache_item *item = cache->oldest;
+        cgcache_lru_unlink(cache, item);
+        cgcache_remove(cache, item);
+        cache->bytes -= item->size;
+        cgcache_item_free(item);
+    }
+}
+
+/* the on-disk copy of key, a line with the key then the value */
+static void cgcache_path(struct cgcache *cache, struct cgcache_item *item, char *buf, size_t size, int tmp)
+{
+    if (tmp)
+        snprintf(buf, size, "%s/.%016lx.%lu", cache->dir, item->hash, (unsigned long) getpid());
+    else
+        snprintf(buf, size, "%s/%016lx", cache->dir, item->hash);
+}
+
+static int cgcache_disk_read(struct cgcache *cache, struct cgcache_item *item)
+{
+    char path[4096];
+    size_t keylen = strlen(item->key);
+    char *line = malloc(keylen + 2);
+    long size;
+    FILE *fp;
+    int ok = 0;
+
+    cgcache_path(cache, item, path, sizeof path, 0);
+    if (!line || !(fp = fopen(path, "rb"))) {
+        free(line);
+        return 0;
+    }
+    /* a different key with the same hash is just a miss */
+    if (fread(line, 1, keylen + 1, fp) == keylen + 1 && !memcmp(line, item->key, keylen) && line[keylen] == '\n'
+            && fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0
+            && fseek(fp, keylen + 1, SEEK_SET) == 0) {
+        item->size = size - (keylen + 1);
+        item->data = cgmem_alloc(item->size ? item->size : 1);
+        ok = item->data && fread(item->data, 1, item->size, fp) == item->size;
+        if (!ok) {
+            cgmem_free(item->data);
+            item->data = NULL;
+            item->size = 0;
+        }
+    }
+    fclose(fp);
+    free(line);
+    return ok;
+}
+
+/* written aside and renamed in, so a reader never sees half of it */
+static void cgcache_disk_write(struct cgcache *cache, struct cgcache_item *item)
+{
+    char tmp[4096], path[4096];
+    FILE *fp;
+    int ok;
+
+    cgcache_path(cache, item, tmp, sizeof tmp, 1);
+    cgcache_path(cache, item, path, sizeof path, 0);
+    if (!(fp = fopen(tmp, "wb")))
+        return;
+    ok = fputs(item->key, fp) >= 0 && fputc('\n', fp) != EOF
+        && fwrite(item->data, 1, item->size, fp) == item->size;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0)
+        remove(tmp);
+}
+
+/*
+ * the item for key, filled by fill(ud) on a miss. NULL when filling
+ * failed, with fill's error in error. hit says whether it was in memory.
+ */
+struct cgcache_item *cgcache_get(struct cgcache *cache, const char *key, cgcache_fill_fn fill, void *ud, int *error, int *hit)
+{
+    unsigned long hash = cgcache_hash(key);
+    struct cgcache_item *item;
+    int err = 0, from_disk;
+
+    *hit = 0;
+    pthread_mutex_lock(&cache->lock);
+    item = cgcache_find(cache, key, hash);
+    if (item) {
+        if (item->refs++ == 0 && item->state == cgcache_state_ready)
+            cgcache_lru_unlink(cache, item);
+        if (item->state == cgcache_state_ready) {
+            cache->hits++;
+            *hit = 1;
+        } else {
+            cache->coalesced++;
+            while (item->state == cgcache_state_filling)
+                pthread_cond_wait(&cache->filled, &cache->lock);
+        }
+        if (item->state == cgcache_state_failed) {
+            *error = item->error;
+            if (--item->refs == 0)
+                cgcache_item_free(item);
+            item = NULL;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return item;
+    }
+    item = calloc(1, sizeof(struct cgcache_item));
+    if (item)
+        item->key = malloc(strlen(key) + 1);
+    if (!item || !item->key) {
+        pthread_mutex_unlock(&cache->lock);
+        free(item);
+        *error = -1;
+        return NULL;
+    }
+    strcpy(item->key, key);
+    item->hash = hash;
+    item->refs = 1;
+    item->state = cgcache_state_filling;
+    cgcache_insert(cache, item);
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    from_disk = cache->dir && cgcache_disk_read(cache, item);
+    if (!from_disk) {
+        err = fill(ud, &item->data, &item->size);
+        if (!err && cache->dir)
+            cgcache_disk_write(cache, item);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (err) {
+        item->state = cgcache_state_failed;
+        item->error = err;
+        cgcache_remove(cache, item);
+        *error = err;
+        if (--item->refs == 0)
+            cgcache_item_free(item);
+        item = NULL;
+    } else {
+        item->state = cgcache_state_ready;
+        cache->bytes += item->size;
+    }
+    pthread_cond_broadcast(&cache->filled);
+    pthread_mutex_unlock(&cache->lock);
+    return item;
+}
+
+void cgcache_put(struct cgcache *cache, struct cgcache_item *item)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (--item->refs == 0) {
+        cgcache_lru_push(cache, item);
+        cgcache_evict(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cgcache_stats(struct cgcache *cache, unsigned long *hits, unsigned long *misses, unsigned long *coalesced, size_t *bytes)
+{
+    pthread_mutex_lock(&cache->lock);
+    *hits = cache->hits;
+    *misses = cache->misses;
+    *coalesced = cache->coalesced;
+    *bytes = cache->bytes;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* nothing may still be held */
+void cgcache_free(struct cgcache *cache)
+{
+    unsigned int i;
+    if (!cache)
+        return;
+    for (i = 0; i < cache->nbuckets; i++) {
+        while (cache->buckets[i]) {
+            struct cgcache_item *item = cache->buckets[i];
+            cache->buckets[i] = item->next;
+            cgcache_item_free(item);
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->filled);
+    free(cache->buckets);
+    free(cache->dir);
+    free(cache);
+}
@@ -0,0 +1,32 @@
+#ifndef CGCACHE_H_
+#define CGCACHE_H_
+
+#include <stddef.h>
+
+/*
+ * a cached value, held by whoever got it until cgcache_put. only data and
+ * size are for reading, the rest belongs to the cache.
+ */
+struct cgcache_item {
+    void *data; /* from cgmem_alloc */
+    size_t size;
+    char *key;
+    unsigned long hash;
+    unsigned int refs;
+    int state, error;
+    struct cgcache_item *next; /* in its bucket */
+    struct cgcache_item *older, *newer; /* unheld and ready ones, for eviction */
+};
+
+/* makes a value that was not cached, returns 0 or an error code of its own */
+typedef int (*cgcache_fill_fn)(void *ud, void **data, size_t *size);
+
+struct cgcache;
+
+struct cgcache *cgcache_new(size_t max_bytes, const char *dir);
+struct cgcache_item *cgcache_get(struct cgcache *cache, const char *key, cgcache_fill_fn fill, void *ud, int *error, int *hit);
+void cgcache_put(struct cgcache *cache, struct cgcache_item *item);
+void cgcache_stats(struct cgcache *cache, unsigned long *hits, unsigned long *misses, unsigned long *coalesced, size_t *bytes);
+void cgcache_free(struct cgcache *cache);
+
+#endif /* CGCACHE_H_ */
@@ -0,0 +1,349 @@
+#define _GNU_SOURCE /* sigaction, MSG_NOSIGNAL */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cgdaemon.h"
+
+/* longest request line a client may send */
+#define CGDAEMON_LINE_MAX (64 * 1024)
+#define CGDAEMON_ARGS_MAX 1024
+/* connections kept at once, past that accept waits for one to close */
+#define CGDAEMON_CLIENTS_MAX 64
+/* seconds between looks at cgdaemon_stop while waiting, the signal may land on any thread */
+#define CGDAEMON_TICK 1
+
+/*
+ * one connection. requests are read a line at a time and run in order,
+ * while anything the request does can send back to it from any thread.
+ */
+struct cgdaemon_client {
+    int fd;
+    unsigned int slot; /* in cgdaemon_fds */
+    pthread_mutex_t lock; /* whole lines go out together */
+    int gone; /* stopped listening, the rest is dropped */
+    cgdaemon_fn fn;
+    void *ud;
+};
+
+static volatile sig_atomic_t cgdaemon_stop = 0;
+
+static pthread_mutex_t cgdaemon_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cgdaemon_closed = PTHREAD_COND_INITIALIZER;
+static unsigned int cgdaemon_clients = 0; /* connected, under cgdaemon_lock */
+static int cgdaemon_fds[CGDAEMON_CLIENTS_MAX]; /* theirs by slot, -1 for free ones, under cgdaemon_lock */
+
+static void cgdaemon_on_signal(int sig)
+{
+    cgdaemon_stop = 1;
+}
+
+/* $XDG_RUNTIME_DIR/cgrip.sock, or one per user in /tmp */
+const char *cgdaemon_default_path(char *buf, size_t size)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir && *dir)
+        snprintf(buf, size, "%s/cgrip.sock", dir);
+    else
+        snprintf(buf, size, "/tmp/cgrip-%lu.sock", (unsigned long) getuid());
+    return buf;
+}
+
+static int cgdaemon_write(struct cgdaemon_client *client, const char *data, size_t size)
+{
+    while (size > 0 && !client->gone) {
+        ssize_t n = send(client->fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            client->gone = 1;
+            return 0;
+        }
+        data += n;
+        size -= n;
+    }
+    return !client->gone;
+}
+
+/* every line of the message goes out as "kind line" */
+void cgdaemon_vsend(struct cgdaemon_client *client, const char *kind, const char *fmt, va_list args)
+{
+    char msg[1024];
+    char *line, *end;
+
+    vsnprintf(msg, sizeof msg, fmt, args);
+    pthread_mutex_lock(&client->lock);
+    for (line = msg; *line || line == msg; line = end + 1) {
+        end = strchr(line, '\n');
+        if (!end)
+            end = line + strlen(line);
+        cgdaemon_write(client, kind, strlen(kind));
+        if (end > line) {
+            cgdaemon_write(client, " ", 1);
+            cgdaemon_write(client, line, end - line);
+        }
+        cgdaemon_write(client, "\n", 1);
+        if (!*end)
+            break;
+    }
+    pthread_mutex_unlock(&client->lock);
+}
+
+void cgdaemon_send(struct cgdaemon_client *client, const char *kind, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    cgdaemon_vsend(client, kind, fmt, args);
+    va_end(args);
+}
+
+/* splits on blanks in place, "double quotes" and \ escapes keep them */
+static int cgdaemon_split(char *line, char **argv, int max)
+{
+    char *in = line, *out;
+    int argc = 0;
+
+    while (1) {
+        while (*in == ' ' || *in == '\t' || *in == '\r')
+            in++;
+        if (!*in)
+            return argc;
+        if (argc == max)
+            return -1;
+        argv[argc++] = out = in;
+        while (*in && *in != ' ' && *in != '\t' && *in != '\r') {
+            if (*in == '"') {
+                for (in++; *in && *in != '"'; in++) {
+                    if (*in == '\\' && in[1])
+                        in++;
+                    *out++ = *in;
+                }
+                if (!*in)
+                    return -1;
+                in++;
+                continue;
+            }
+            if (*in == '\\' && in[1])
+                in++;
+            *out++ = *in++;
+        }
+        if (*in)
+            in++;
+        *out = 0;
+    }
+}
+
+static void cgdaemon_request(struct cgdaemon_client *client, char *line)
+{
+    char *argv[CGDAEMON_ARGS_MAX + 1];
+    const char *why;
+    int argc = cgdaemon_split(line, argv, CGDAEMON_ARGS_MAX);
+
+    if (argc == 0)
+        return;
+    if (argc < 0) {
+        cgdaemon_send(client, "fail", "malformed request");
+        return;
+    }
+    argv[argc] = NULL;
+    why = client->fn(client, argc, argv, client->ud);
+    if (why)
+        cgdaemon_send(client, "fail", "%s", why);
+    else
+        cgdaemon_send(client, "ok", "");
+}
+
+static int cgdaemon_gone(struct cgdaemon_client *client)
+{
+    int gone;
+    pthread_mutex_lock(&client->lock);
+    gone = client->gone;
+    pthread_mutex_unlock(&client->lock);
+    return gone;
+}
+
+static void *cgdaemon_client_main(void *ud)
+{
+    struct cgdaemon_client *client = (struct cgdaemon_client *) ud;
+    char *buf = malloc(CGDAEMON_LINE_MAX);
+    size_t used = 0;
+
+    while (buf && !cgdaemon_gone(client)) {
+        char *line, *end;
+        ssize_t n = recv(client->fd, buf + used, CGDAEMON_LINE_MAX - 1 - used, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        used += n;
+        buf[used] = 0;
+        for (line = buf; !cgdaemon_stop && (end = strchr(line, '\n')); line = end + 1) {
+            *end = 0;
+            cgdaemon_request(client, line);
+        }
+        used -= line - buf;
+        memmove(buf, line, used);
+        if (used == CGDAEMON_LINE_MAX - 1) {
+            cgdaemon_send(client, "fail", "request too long");
+            break;
+        }
+    }
+    free(buf);
+    /* closed under the lock, so a stop never shuts down an fd reused since */
+    pthread_mutex_lock(&cgdaemon_lock);
+    close(client->fd);
+    cgdaemon_fds[client->slot] = -1;
+    cgdaemon_clients--;
+    pthread_cond_signal(&cgdaemon_closed);
+    pthread_mutex_unlock(&cgdaemon_lock);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+    return NULL;
+}
+
+/* waits on cgdaemon_closed for at most CGDAEMON_TICK, with cgdaemon_lock held */
+static void cgdaemon_wait(void)
+{
+    struct timeval now;
+    struct timespec until;
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + CGDAEMON_TICK;
+    until.tv_nsec = now.tv_usec * 1000L;
+    pthread_cond_timedwait(&cgdaemon_closed, &cgdaemon_lock, &until);
+}
+
+/* an existing socket nobody answers on is left over from a dead daemon */
+static int cgdaemon_claim(const struct sockaddr_un *addr)
+{
+    struct stat s;
+    int fd;
+
+    if (lstat(addr->sun_path, &s) != 0)
+        return 1;
+    if (!S_ISSOCK(s.st_mode)) {
+        fprintf(stderr, "%s exists and is not a socket\n", addr->sun_path);
+        return 0;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (const struct sockaddr *) addr, sizeof *addr) == 0) {
+        close(fd);
+        fprintf(stderr, "a daemon is already listening on %s\n", addr->sun_path);
+        return 0;
+    }
+    if (fd >= 0)
+        close(fd);
+    return unlink(addr->sun_path) == 0;
+}
+
+/*
+ * listens on path until SIGINT or SIGTERM, each connection on a thread of
+ * its own so a slow client only holds up its own requests, up to
+ * CGDAEMON_CLIENTS_MAX of them. on the way out connections are shut down
+ * and jobs still running finished, so nothing they use goes before they
+ * do. returns 0 when it could not listen at all.
+ */
+int cgdaemon_run(const char *path, cgdaemon_fn fn, void *ud)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct pollfd listener;
+    pthread_attr_t attr;
+    unsigned int i;
+    mode_t mask;
+    int fd;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "socket path %s is too long\n", path);
+        return 0;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (!cgdaemon_claim(&addr))
+        return 0;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return 0;
+    /* only whoever started the daemon gets to talk to it */
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof addr) != 0 || listen(fd, 16) != 0) {
+        umask(mask);
+        fprintf(stderr, "cannot listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    umask(mask);
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = cgdaemon_on_signal;
+    sigemptyset(&sa.sa_mask);
+    /* no SA_RESTART, poll has to give up to notice */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < CGDAEMON_CLIENTS_MAX; i++)
+        cgdaemon_fds[i] = -1;
+
+    while (!cgdaemon_stop) {
+        struct cgdaemon_client *client;
+        pthread_t thread;
+        int cfd;
+
+        pthread_mutex_lock(&cgdaemon_lock);
+        while (cgdaemon_clients >= CGDAEMON_CLIENTS_MAX && !cgdaemon_stop)
+            cgdaemon_wait();
+        pthread_mutex_unlock(&cgdaemon_lock);
+        listener.fd = fd;
+        listener.events = POLLIN;
+        if (cgdaemon_stop || poll(&listener, 1, CGDAEMON_TICK * 1000) <= 0)
+            continue;
+        if ((cfd = accept(fd, NULL, NULL)) < 0)
+            continue;
+        client = calloc(1, sizeof(struct cgdaemon_client));
+        if (!client) {
+            close(cfd);
+            continue;
+        }
+        client->fd = cfd;
+        client->fn = fn;
+        client->ud = ud;
+        pthread_mutex_init(&client->lock, NULL);
+        pthread_mutex_lock(&cgdaemon_lock);
+        for (client->slot = 0; cgdaemon_fds[client->slot] >= 0; client->slot++)
+            ;
+        cgdaemon_fds[client->slot] = cfd;
+        cgdaemon_clients++;
+        if (pthread_create(&thread, &attr, cgdaemon_client_main, client)) {
+            cgdaemon_fds[client->slot] = -1;
+            cgdaemon_clients--;
+            pthread_mutex_destroy(&client->lock);
+            free(client);
+            close(cfd);
+        }
+        pthread_mutex_unlock(&cgdaemon_lock);
+    }
+    pthread_attr_destroy(&attr);
+    close(fd);
+    unlink(path);
+
+    pthread_mutex_lock(&cgdaemon_lock);
+    for (i = 0; i < CGDAEMON_CLIENTS_MAX; i++)
+        if (cgdaemon_fds[i] >= 0)
+            shutdown(cgdaemon_fds[i], SHUT_RDWR);
+    while (cgdaemon_clients)
+        pthread_cond_wait(&cgdaemon_closed, &cgdaemon_lock);
+    pthread_mutex_unlock(&cgdaemon_lock);
+    return 1;
+}
@@ -0,0 +1,20 @@
+#ifndef CGDAEMON_H_
+#define CGDAEMON_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+
+struct cgdaemon_client;
+
+/*
+ * runs one request, already split into arguments. returns NULL when it
+ * went fine, otherwise why it did not.
+ */
+typedef const char *(*cgdaemon_fn)(struct cgdaemon_client *client, int argc, char **argv, void *ud);
+
+const char *cgdaemon_default_path(char *buf, size_t size);
+int cgdaemon_run(const char *path, cgdaemon_fn fn, void *ud);
+void cgdaemon_send(struct cgdaemon_client *client, const char *kind, const char *fmt, ...);
+void cgdaemon_vsend(struct cgdaemon_client *client, const char *kind, const char *fmt, va_list args);
+
+#endif /* CGDAEMON_H_ */
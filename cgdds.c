@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgbcn.h"
+#include "cgdds.h"
+#include "cgmem.h"
+#include "cgpro.h"
+
+/* pixel rows compressed at once, enough block rows to go around a pool */
+#define CGDDS_BAND 128
+/* magic and header, and the extended header bc7 needs after them */
+#define CGDDS_HEADER 128
+#define CGDDS_DX10 20
+
+#define CGDDS_CAPS 0x1
+#define CGDDS_HEIGHT 0x2
+#define CGDDS_WIDTH 0x4
+#define CGDDS_PIXELFORMAT 0x1000
+#define CGDDS_MIPMAPCOUNT 0x20000
+#define CGDDS_LINEARSIZE 0x80000
+#define CGDDS_FOURCC 0x4
+#define CGDDS_COMPLEX 0x8
+#define CGDDS_TEXTURE 0x1000
+#define CGDDS_MIPMAP 0x400000
+#define CGDDS_DIMENSION_2D 3
+
+/* by enum cgbcn_format, srgb color and bc7 go by their dxgi format after a DX10 fourcc */
+static const char *cgdds_fourcc[] = { "DXT1", "DXT5", "ATI1", "ATI2", "DX10" };
+static const unsigned int cgdds_dxgi[][2] = { { 71, 72 }, { 77, 78 }, { 80, 80 }, { 83, 83 }, { 98, 99 } };
+
+/*
+ * one dds on its way out. rows are gathered into a band and compressed
+ * together, so a streamed map keeps the pool as busy as a whole one.
+ */
+struct cgdds_encoder {
+    cgformat_sink sink;
+    void *ud;
+    enum cgbcn_format format;
+    int srgb; /* color, which the blocks hold gamma encoded */
+    unsigned int width, height, levels;
+    unsigned int y; /* rows taken */
+    unsigned int rows; /* of those, still in band */
+    unsigned char *band; /* CGDDS_BAND rows, only when taking them one at a time */
+    unsigned char *blocks; /* a band compressed */
+};
+
+static void cgdds_put32(unsigned char *p, unsigned long v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static int cgdds_header(struct cgdds_encoder *enc)
+{
+    unsigned char h[CGDDS_HEADER + CGDDS_DX10];
+    size_t size = CGDDS_HEADER;
+
+    memset(h, 0, sizeof h);
+    memcpy(h, "DDS ", 4);
+    cgdds_put32(h + 4, 124);
+    cgdds_put32(h + 8, CGDDS_CAPS | CGDDS_HEIGHT | CGDDS_WIDTH | CGDDS_PIXELFORMAT | CGDDS_LINEARSIZE
+            | (enc->levels > 1 ? CGDDS_MIPMAPCOUNT : 0));
+    cgdds_put32(h + 12, enc->height);
+    cgdds_put32(h + 16, enc->width);
+    cgdds_put32(h + 20, cgbcn_size(enc->format, enc->width, enc->height));
+    cgdds_put32(h + 28, enc->levels);
+    cgdds_put32(h + 76, 32);
+    cgdds_put32(h + 80, CGDDS_FOURCC);
+    memcpy(h + 84, enc->srgb ? "DX10" : cgdds_fourcc[enc->format], 4);
+    cgdds_put32(h + 108, CGDDS_TEXTURE | (enc->levels > 1 ? CGDDS_COMPLEX | CGDDS_MIPMAP : 0));
+    if (enc->srgb || enc->format == cgbcn_bc7) {
+        cgdds_put32(h + 128, cgdds_dxgi[enc->format][enc->srgb]);
+        cgdds_put32(h + 132, CGDDS_DIMENSION_2D);
+        cgdds_put32(h + 140, 1); /* array size */
+        size += CGDDS_DX10;
+    }
+    return enc->sink(enc->ud, h, size);
+}
+
+static struct cgdds_encoder *cgdds_start(unsigned int width, unsigned int height, unsigned int levels,
+        enum cgbcn_format format, int srgb, int rows, cgformat_sink sink, void *ud)
+{
+    struct cgdds_encoder *enc;
+    if (!width || !height || !(enc = calloc(1, sizeof(struct cgdds_encoder))))
+        return NULL;
+    enc->sink = sink;
+    enc->ud = ud;
+    enc->format = format;
+    enc->srgb = srgb;
+    enc->width = width;
+    enc->height = height;
+    enc->levels = levels;
+    enc->blocks = malloc(cgbcn_size(format, width, CGDDS_BAND));
+    if (rows)
+        enc->band = malloc((size_t) width * CGDDS_BAND * 4);
+    if (!enc->blocks || (rows && !enc->band) || !cgdds_header(enc)) {
+        cgdds_encoder_free(enc);
+        return NULL;
+    }
+    return enc;
+}
+
+/* compresses and hands on rows of a level width wide, a whole band unless they are the last */
+static int cgdds_put_band(struct cgdds_encoder *enc, const unsigned char *rgba, unsigned int width, unsigned int rows)
+{
+    cgbcn_compress(enc->format, rgba, width, rows, enc->blocks);
+    return enc->sink(enc->ud, enc->blocks, cgbcn_size(enc->format, width, rows));
+}
+
+static int cgdds_put_level(struct cgdds_encoder *enc, const unsigned char *rgba, unsigned int width, unsigned int height)
+{
+    unsigned int y;
+    int ok = 1;
+    for (y = 0; ok && y < height; y += CGDDS_BAND)
+        ok = cgdds_put_band(enc, rgba + (size_t) y * width * 4, width, height - y < CGDDS_BAND ? height - y : CGDDS_BAND);
+    return ok;
+}
+
+/*
+ * bc4 for gray kinds, bc5 for normals, and for color bc7 if asked,
+ * otherwise bc3 when anything is not opaque and bc1 when all of it is.
+ * color is marked srgb. with mipmaps, each level is made from the one before as it goes out.
+ */
+int cgdds_encode(const unsigned char *rgba, unsigned int width, unsigned int height, const struct cgformat_options *options,
+        int bc7, cgformat_sink sink, void *ud)
+{
+    struct cgdds_encoder *enc;
+    size_t i, n = (size_t) width * height;
+    const unsigned char *level = rgba;
+    unsigned char *next;
+    unsigned int l, levels = options->mipmaps ? cgpro_mip_levels(width, height) : 1;
+    int alpha = 0, ok;
+
+    for (i = 0; options->kind == cgformat_kind_color && !bc7 && i < n; i++)
+        if (rgba[i * 4 + 3] != 255) {
+            alpha = 1;
+            break;
+        }
+    if (!(enc = cgdds_start(width, height, levels, cgbcn_pick(options->kind, alpha, bc7),
+                    options->kind == cgformat_kind_color, 0, sink, ud)))
+        return 0;
+    ok = cgdds_put_level(enc, rgba, width, height);
+    for (l = 1; ok && l < levels; l++) {
+        ok = (next = cgpro_mipmap(level, width, height, options->kind)) != NULL;
+        if (level != rgba)
+            cgmem_free((unsigned char *) level);
+        level = next;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        ok = ok && cgdds_put_level(enc, level, width, height);
+    }
+    if (level != rgba)
+        cgmem_free((unsigned char *) level);
+    cgdds_encoder_free(enc);
+    return ok;
+}
+
+/*
+ * an encoder taking rows one at a time. mip chains need the whole map, and
+ * so does color with alpha, to tell bc1 from bc3 the way cgdds_encode
+ * does, so it is NULL for those.
+ */
+struct cgdds_encoder *cgdds_encoder_new(unsigned int width, unsigned int height, int channels,
+        const struct cgformat_options *options, int bc7, cgformat_sink sink, void *ud)
+{
+    int color = options->kind == cgformat_kind_color;
+    if (options->mipmaps || (color && !bc7 && (channels == 2 || channels == 4)))
+        return NULL;
+    return cgdds_start(width, height, 1, cgbcn_pick(options->kind, 0, bc7), color, 1, sink, ud);
+}
+
+int cgdds_encoder_row(struct cgdds_encoder *enc, const unsigned char *rgba)
+{
+    int ok = 1;
+    if (enc->y == enc->height)
+        return 0;
+    memcpy(enc->band + (size_t) enc->rows * enc->width * 4, rgba, (size_t) enc->width * 4);
+    enc->y++;
+    if (++enc->rows == CGDDS_BAND || enc->y == enc->height) {
+        ok = cgdds_put_band(enc, enc->band, enc->width, enc->rows);
+        enc->rows = 0;
+    }
+    return ok;
+}
+
+/* every block is out once the last row is in, so this only checks it was */
+int cgdds_encoder_finish(struct cgdds_encoder *enc)
+{
+    return enc->y == enc->height;
+}
+
+void cgdds_encoder_free(struct cgdds_encoder *enc)
+{
+    if (!enc)
+        return;
+    free(enc->band);
+    free(enc->blocks);
+    free(enc);
+}
@@ -0,0 +1,16 @@
+#ifndef CGDDS_H_
+#define CGDDS_H_
+
+#include "cgformat.h"
+
+struct cgdds_encoder;
+
+int cgdds_encode(const unsigned char *rgba, unsigned int width, unsigned int height, const struct cgformat_options *options,
+        int bc7, cgformat_sink sink, void *ud);
+struct cgdds_encoder *cgdds_encoder_new(unsigned int width, unsigned int height, int channels,
+        const struct cgformat_options *options, int bc7, cgformat_sink sink, void *ud);
+int cgdds_encoder_row(struct cgdds_encoder *enc, const unsigned char *rgba);
+int cgdds_encoder_finish(struct cgdds_encoder *enc);
+void cgdds_encoder_free(struct cgdds_encoder *enc);
+
+#endif /* CGDDS_H_ */
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE /* strcasecmp, write */
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "cgformat.h"
+#include "cgdds.h"
+#include "cgktx.h"
+#include "cgmem.h"
+#include "cgpack.h"
+#include "cgpng.h"
+#include "cgqoi.h"
+
+static int cgformat_png_encode(const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options, cgformat_sink sink, void *ud)
+{
+    (void) options;
+    return cgpng_encode(rgba, width, height, sink, ud);
+}
+
+static void *cgformat_png_new(unsigned int width, unsigned int height, int channels, const struct cgformat_options *options,
+        const unsigned char *palette, unsigned int colors, cgformat_sink sink, void *ud)
+{
+    (void) options;
+    return cgpng_encoder_new(width, height, channels, palette, colors, sink, ud);
+}
+
+static int cgformat_png_row(void *enc, const unsigned char *rgba)
+{
+    return cgpng_encoder_row((struct cgpng_encoder *) enc, rgba);
+}
+
+static int cgformat_png_finish(void *enc)
+{
+    return cgpng_encoder_finish((struct cgpng_encoder *) enc);
+}
+
+static void cgformat_png_free(void *enc)
+{
+    cgpng_encoder_free((struct cgpng_encoder *) enc);
+}
+
+static int cgformat_qoi_encode(const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options, cgformat_sink sink, void *ud)
+{
+    (void) options;
+    return cgqoi_encode(rgba, width, height, sink, ud);
+}
+
+static void *cgformat_qoi_new(unsigned int width, unsigned int height, int channels, const struct cgformat_options *options,
+        const unsigned char *palette, unsigned int colors, cgformat_sink sink, void *ud)
+{
+    (void) options;
+    (void) palette;
+    (void) colors;
+    return cgqoi_encoder_new(width, height, channels, sink, ud);
+}
+
+static int cgformat_qoi_row(void *enc, const unsigned char *rgba)
+{
+    return cgqoi_encoder_row((struct cgqoi_encoder *) enc, rgba);
+}
+
+static int cgformat_qoi_finish(void *enc)
+{
+    return cgqoi_encoder_finish((struct cgqoi_encoder *) enc);
+}
+
+static void cgformat_qoi_free(void *enc)
+{
+    cgqoi_encoder_free((struct cgqoi_encoder *) enc);
+}
+
+static int cgformat_dds_encode(const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options, cgformat_sink sink, void *ud)
+{
+    return cgdds_encode(rgba, width, height, options, 0, sink, ud);
+}
+
+static int cgformat_bc7_encode(const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options, cgformat_sink sink, void *ud)
+{
+    return cgdds_encode(rgba, width, height, options, 1, sink, ud);
+}
+
+static void *cgformat_dds_new(unsigned int width, unsigned int height, int channels, const struct cgformat_options *options,
+        const unsigned char *palette, unsigned int colors, cgformat_sink sink, void *ud)
+{
+    (void) palette;
+    (void) colors;
+    return cgdds_encoder_new(width, height, channels, options, 0, sink, ud);
+}
+
+static void *cgformat_bc7_new(unsigned int width, unsigned int height, int channels, const struct cgformat_options *options,
+        const unsigned char *palette, unsigned int colors, cgformat_sink sink, void *ud)
+{
+    (void) palette;
+    (void) colors;
+    return cgdds_encoder_new(width, height, channels, options, 1, sink, ud);
+}
+
+static int cgformat_dds_row(void *enc, const unsigned char *rgba)
+{
+    return cgdds_encoder_row((struct cgdds_encoder *) enc, rgba);
+}
+
+static int cgformat_dds_finish(void *enc)
+{
+    return cgdds_encoder_finish((struct cgdds_encoder *) enc);
+}
+
+static void cgformat_dds_free(void *enc)
+{
+    cgdds_encoder_free((struct cgdds_encoder *) enc);
+}
+
+static int cgformat_ktx2_encode(const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options, cgformat_sink sink, void *ud)
+{
+    return cgktx_encode(rgba, width, height, options, 0, sink, ud);
+}
+
+static int cgformat_ktx2_bc7_encode(const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options, cgformat_sink sink, void *ud)
+{
+    return cgktx_encode(rgba, width, height, options, 1, sink, ud);
+}
+
+/* by enum cgformat */
+static const struct cgformat_info cgformats[cgformat_count] = {
+    { "PNG", "png", "image/png", cgpack_format_png, 0, cgformat_png_encode,
+        cgformat_png_new, cgformat_png_row, cgformat_png_finish, cgformat_png_free },
+    { "QOI", "qoi", "image/qoi", cgpack_format_qoi, 0, cgformat_qoi_encode,
+        cgformat_qoi_new, cgformat_qoi_row, cgformat_qoi_finish, cgformat_qoi_free },
+    { "DDS", "dds", "image/vnd.ms-dds", cgpack_format_dds, 1, cgformat_dds_encode,
+        cgformat_dds_new, cgformat_dds_row, cgformat_dds_finish, cgformat_dds_free },
+    { "DDS-BC7", "dds", "image/vnd.ms-dds", cgpack_format_dds, 1, cgformat_bc7_encode,
+        cgformat_bc7_new, cgformat_dds_row, cgformat_dds_finish, cgformat_dds_free },
+    { "KTX2", "ktx2", "image/ktx2", cgpack_format_ktx2, 1, cgformat_ktx2_encode, NULL, NULL, NULL, NULL },
+    { "KTX2-BC7", "ktx2", "image/ktx2", cgpack_format_ktx2, 1, cgformat_ktx2_bc7_encode, NULL, NULL, NULL, NULL }
+};
+
+const struct cgformat_info *cgformat_get(enum cgformat format)
+{
+    if ((unsigned int) format >= cgformat_count)
+        format = cgformat_png;
+    return &cgformats[format];
+}
+
+/* the format called name, in any case, -1 for none */
+int cgformat_parse(const char *name)
+{
+    int i;
+    for (i = 0; i < cgformat_count; i++)
+        if (!strcasecmp(cgformats[i].name, name))
+            return i;
+    return -1;
+}
+
+int cgformat_write_fd(void *ud, const void *data, size_t size)
+{
+    int fd = *(int *) ud;
+    const char *p = (const char *) data;
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+/* returns 0 on failure, with errno as write left it */
+int cgformat_encode_fd(enum cgformat format, int fd, const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options)
+{
+    return cgformat_get(format)->encode(rgba, width, height, options, cgformat_write_fd, &fd);
+}
+
+struct cgformat_memory {
+    unsigned char *data;
+    size_t size, cap;
+};
+
+static int cgformat_write_memory(void *ud, const void *data, size_t size)
+{
+    struct cgformat_memory *m = (struct cgformat_memory *) ud;
+    if (m->size + size > m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 131072;
+        unsigned char *p;
+        while (cap < m->size + size)
+            cap *= 2;
+        if (!(p = cgmem_realloc(m->data, cap)))
+            return 0;
+        m->data = p;
+        m->cap = cap;
+    }
+    memcpy(m->data + m->size, data, size);
+    m->size += size;
+    return 1;
+}
+
+/* the whole file in a cgmem buffer, NULL on failure */
+unsigned char *cgformat_encode_memory(enum cgformat format, const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options, size_t *size)
+{
+    struct cgformat_memory m = { NULL, 0, 0 };
+    if (!cgformat_get(format)->encode(rgba, width, height, options, cgformat_write_memory, &m)) {
+        cgmem_free(m.data);
+        return NULL;
+    }
+    *size = m.size;
+    return m.data;
+}
@@ -0,0 +1,64 @@
+#ifndef CGFORMAT_H_
+#define CGFORMAT_H_
+
+#include <stddef.h>
+
+/* takes a file piece by piece as it is made, returns 0 to stop */
+typedef int (*cgformat_sink)(void *ud, const void *data, size_t size);
+
+/* what maps are saved as, png unless asked otherwise */
+enum cgformat {
+    cgformat_png,
+    cgformat_qoi,
+    cgformat_dds,
+    cgformat_dds_bc7,
+    cgformat_ktx2,
+    cgformat_ktx2_bc7,
+    cgformat_count
+};
+
+/* what a map holds, for formats that store each kind its own way */
+enum cgformat_kind {
+    cgformat_kind_color,
+    cgformat_kind_gray,
+    cgformat_kind_normal
+};
+
+/* how a map is to be encoded, beyond its pixels */
+struct cgformat_options {
+    enum cgformat_kind kind;
+    int mipmaps; /* a full chain, in formats that hold one */
+    int zstd; /* supercompression level, 0 for none, in formats that take it */
+};
+
+/*
+ * one format maps can be saved in. encode takes a whole map, the encoder
+ * calls a map a row at a time, with channels and an optional palette as
+ * cgpng_encoder_new has them; formats without palettes ignore it, and
+ * formats ignore options they have no use for. formats with no encoder
+ * are only ever made whole, as are mip chains.
+ */
+struct cgformat_info {
+    const char *name; /* as --format takes it */
+    const char *extension; /* of saved maps, without the dot */
+    const char *mime;
+    unsigned int pack; /* enum cgpack_format */
+    int mipmaps; /* can hold a mip chain */
+    int (*encode)(const unsigned char *rgba, unsigned int width, unsigned int height,
+            const struct cgformat_options *options, cgformat_sink sink, void *ud);
+    void *(*encoder_new)(unsigned int width, unsigned int height, int channels, const struct cgformat_options *options,
+            const unsigned char *palette, unsigned int colors, cgformat_sink sink, void *ud);
+    int (*encoder_row)(void *enc, const unsigned char *rgba);
+    int (*encoder_finish)(void *enc);
+    void (*encoder_free)(void *enc);
+};
+
+const struct cgformat_info *cgformat_get(enum cgformat format);
+int cgformat_parse(const char *name);
+int cgformat_write_fd(void *ud, const void *data, size_t size); /* sink for an int *fd */
+int cgformat_encode_fd(enum cgformat format, int fd, const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options);
+unsigned char *cgformat_encode_memory(enum cgformat format, const unsigned char *rgba, unsigned int width, unsigned int height,
+        const struct cgformat_options *options, size_t *size);
+
+#endif /* CGFORMAT_H_ */
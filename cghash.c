@@ -0,0 +1,54 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cghash.h"
+
+/* fails to compile where unsigned long cannot hold the hash */
+typedef char cghash_needs_lp64[sizeof(unsigned long) >= 8 ? 1 : -1];
+
+unsigned long cghash_bytes(unsigned long hash, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *end = p + size;
+    for (; p < end; p++) {
+        hash ^= *p;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/* with its terminator, so "ab" "c" and "a" "bc" differ */
+unsigned long cghash_str(unsigned long hash, const char *str)
+{
+    return cghash_bytes(hash, str ? str : "", str ? strlen(str) + 1 : 1);
+}
+
+/* the same on any byte order */
+unsigned long cghash_uint(unsigned long hash, unsigned long value)
+{
+    unsigned char bytes[8];
+    int i;
+    for (i = 0; i < 8; i++) {
+        bytes[i] = value & 0xff;
+        value >>= 8;
+    }
+    return cghash_bytes(hash, bytes, sizeof bytes);
+}
+
+int cghash_file(const char *path, unsigned long *hash)
+{
+    unsigned char buf[65536];
+    size_t n;
+    FILE *fp = fopen(path, "rb");
+    int ok;
+
+    if (!fp)
+        return 0;
+    *hash = CGHASH_INIT;
+    while ((n = fread(buf, 1, sizeof buf, fp)) > 0)
+        *hash = cghash_bytes(*hash, buf, n);
+    ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
@@ -0,0 +1,17 @@
+#ifndef CGHASH_H_
+#define CGHASH_H_
+
+#include <stddef.h>
+
+/*
+ * 64-bit fnv-1a, chained by passing the last hash back in. it lives in an
+ * unsigned long, so this needs one of 64 bits (LP64).
+ */
+#define CGHASH_INIT 14695981039346656037UL
+
+unsigned long cghash_bytes(unsigned long hash, const void *data, size_t size);
+unsigned long cghash_str(unsigned long hash, const char *str);
+unsigned long cghash_uint(unsigned long hash, unsigned long value);
+int cghash_file(const char *path, unsigned long *hash);
+
+#endif /* CGHASH_H_ */
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef CGRIP_ZSTD
+/* zstd.h has long longs of its own, which -ansi would complain of */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wlong-long"
+#include <zstd.h>
+#pragma GCC diagnostic pop
+#endif
+
+#include "cgbcn.h"
+#include "cgktx.h"
+#include "cgmem.h"
+#include "cgpro.h"
+
+/* identifier and header, index, and one level index entry */
+#define CGKTX_HEADER 80
+#define CGKTX_LEVEL 24
+#define CGKTX_MAX_LEVELS 32
+#define CGKTX_SUPERCOMPRESSION_ZSTD 2
+
+/* data format descriptor: one basic block, samples of 16 bytes each */
+#define CGKTX_DFD_BLOCK 24
+#define CGKTX_DFD_SAMPLE 16
+#define CGKTX_DF_PRIMARIES_BT709 1
+#define CGKTX_DF_TRANSFER_LINEAR 1
+#define CGKTX_DF_TRANSFER_SRGB 2
+#define CGKTX_DF_SAMPLE_LINEAR 0x10
+
+static const char cgktx_writer[] = "KTXwriter\0cgrip";
+
+static const unsigned char cgktx_identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+/* by enum cgbcn_format: vulkan format unorm and srgb, dfd color model, samples and their channels */
+static const struct cgktx_format {
+    unsigned int unorm, srgb;
+    unsigned int model;
+    unsigned int samples;
+    unsigned int channels[2];
+} cgktx_formats[] = {
+    { 131, 132, 128, 1, { 0, 0 } }, /* bc1 rgb */
+    { 137, 138, 130, 2, { 15, 0 } }, /* bc3, alpha then color */
+    { 139, 139, 131, 1, { 0, 0 } }, /* bc4 */
+    { 141, 141, 132, 2, { 0, 1 } }, /* bc5, red then green */
+    { 145, 146, 134, 1, { 0, 0 } } /* bc7 */
+};
+
+/* one level of the chain as it goes out, and its size before supercompression */
+struct cgktx_level {
+    unsigned char *data;
+    size_t size, raw;
+};
+
+static void cgktx_put32(unsigned char *p, unsigned long v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static void cgktx_put64(unsigned char *p, size_t v)
+{
+    cgktx_put32(p, v & 0xFFFFFFFFul);
+    cgktx_put32(p + 4, (unsigned long) ((v >> 16) >> 16));
+}
+
+/* bytes of the descriptor written to p, or just counted when p is NULL */
+static size_t cgktx_dfd(unsigned char *p, enum cgbcn_format format, int srgb, int zstd)
+{
+    const struct cgktx_format *f = &cgktx_formats[format];
+    size_t block = CGKTX_DFD_BLOCK + f->samples * CGKTX_DFD_SAMPLE;
+    unsigned int i, bits = format == cgbcn_bc7 ? 128 : 64;
+
+    if (!p)
+        return 4 + block;
+    memset(p, 0, 4 + block);
+    cgktx_put32(p, 4 + block);
+    cgktx_put32(p + 8, 2 | (unsigned long) block << 16); /* version 2 */
+    p[12] = f->model;
+    p[13] = CGKTX_DF_PRIMARIES_BT709;
+    p[14] = srgb ? CGKTX_DF_TRANSFER_SRGB : CGKTX_DF_TRANSFER_LINEAR;
+    p[16] = 3; /* blocks are 4x4, stored less one */
+    p[17] = 3;
+    /* supercompressed planes have no fixed size */
+    p[20] = zstd ? 0 : cgbcn_block_size(format);
+    for (i = 0; i < f->samples; i++) {
+        unsigned char *s = p + 4 + CGKTX_DFD_BLOCK + i * CGKTX_DFD_SAMPLE;
+        s[0] = (i * bits) & 0xFF;
+        s[1] = (i * bits) >> 8;
+        s[2] = bits - 1;
+        s[3] = f->channels[i] | (srgb && f->channels[i] == 15 ? CGKTX_DF_SAMPLE_LINEAR : 0);
+        cgktx_put32(s + 12, 0xFFFFFFFFul);
+    }
+    return 4 + block;
+}
+
+/* compresses a level, supercompressing it at level zstd unless that is 0 */
+static int cgktx_level(struct cgktx_level *level, enum cgbcn_format format, const unsigned char *rgba,
+        unsigned int width, unsigned int height, int zstd)
+{
+    level->raw = level->size = cgbcn_size(format, width, height);
+    if (!(level->data = malloc(level->raw)))
+        return 0;
+    cgbcn_compress(format, rgba, width, height, level->data);
+#ifdef CGRIP_ZSTD
+    if (zstd) {
+        size_t bound = ZSTD_compressBound(level->raw), n;
+        unsigned char *packed = malloc(bound);
+        if (!packed)
+            return 0;
+        n = ZSTD_compress(packed, bound, level->data, level->raw, zstd);
+        if (ZSTD_isError(n)) {
+            free(packed);
+            return 0;
+        }
+        free(level->data);
+        level->data = packed;
+        level->size = n;
+    }
+#else
+    (void) zstd;
+#endif
+    return 1;
+}
+
+/*
+ * a ktx2 of the same blocks cgdds_encode picks, srgb for color. its levels
+ * go smallest first so loaders can start on the low ones, which means the
+ * whole chain is made before any of it goes out. zstd is only honoured
+ * when built with CGRIP_ZSTD.
+ */
+int cgktx_encode(const unsigned char *rgba, unsigned int width, unsigned int height, const struct cgformat_options *options,
+        int bc7, cgformat_sink sink, void *ud)
+{
+    struct cgktx_level levels[CGKTX_MAX_LEVELS];
+    enum cgbcn_format format;
+    const unsigned char *level = rgba;
+    unsigned char *next, *header = NULL;
+    unsigned int l, n, w = width, h = height;
+    size_t i, pixels = (size_t) width * height, dfd, kvd, size, offset;
+    int alpha = 0, srgb = options->kind == cgformat_kind_color, zstd = 0, ok = 1;
+
+#ifdef CGRIP_ZSTD
+    zstd = options->zstd;
+#endif
+    if (!width || !height)
+        return 0;
+    for (i = 0; options->kind == cgformat_kind_color && !bc7 && i < pixels; i++)
+        if (rgba[i * 4 + 3] != 255) {
+            alpha = 1;
+            break;
+        }
+    format = cgbcn_pick(options->kind, alpha, bc7);
+    n = options->mipmaps ? cgpro_mip_levels(width, height) : 1;
+    memset(levels, 0, sizeof levels);
+    for (l = 0; ok && l < n; l++) {
+        if (l) {
+            ok = (next = cgpro_mipmap(level, w, h, options->kind)) != NULL;
+            if (level != rgba)
+                cgmem_free((unsigned char *) level);
+            level = next;
+            w = w > 1 ? w / 2 : 1;
+            h = h > 1 ? h / 2 : 1;
+        }
+        ok = ok && cgktx_level(&levels[l], format, level, w, h, zstd);
+    }
+    if (level != rgba)
+        cgmem_free((unsigned char *) level);
+
+    dfd = cgktx_dfd(NULL, format, srgb, zstd);
+    kvd = sizeof cgktx_writer;
+    /* levels of whole blocks start on a block, supercompressed ones anywhere */
+    size = CGKTX_HEADER + n * CGKTX_LEVEL + dfd + (4 + kvd + 3) / 4 * 4;
+    if (!zstd)
+        size = (size + cgbcn_block_size(format) - 1) / cgbcn_block_size(format) * cgbcn_block_size(format);
+    if (ok && !(header = calloc(1, size)))
+        ok = 0;
+    if (ok) {
+        memcpy(header, cgktx_identifier, sizeof cgktx_identifier);
+        cgktx_put32(header + 12, srgb ? cgktx_formats[format].srgb : cgktx_formats[format].unorm);
+        cgktx_put32(header + 16, 1); /* type size, 1 for blocks */
+        cgktx_put32(header + 20, width);
+        cgktx_put32(header + 24, height);
+        cgktx_put32(header + 36, 1); /* faces */
+        cgktx_put32(header + 40, n);
+        cgktx_put32(header + 44, zstd ? CGKTX_SUPERCOMPRESSION_ZSTD : 0);
+        offset = CGKTX_HEADER + n * CGKTX_LEVEL;
+        cgktx_put32(header + 48, offset);
+        cgktx_put32(header + 52, dfd);
+        cgktx_dfd(header + offset, format, srgb, zstd);
+        offset += dfd;
+        cgktx_put32(header + 56, offset);
+        cgktx_put32(header + 60, 4 + kvd);
+        cgktx_put32(header + offset, kvd);
+        memcpy(header + offset + 4, cgktx_writer, kvd);
+        for (offset = size, l = n; l-- > 0; offset += levels[l].size) {
+            cgktx_put64(header + CGKTX_HEADER + l * CGKTX_LEVEL, offset);
+            cgktx_put64(header + CGKTX_HEADER + l * CGKTX_LEVEL + 8, levels[l].size);
+            cgktx_put64(header + CGKTX_HEADER + l * CGKTX_LEVEL + 16, levels[l].raw);
+        }
+        ok = sink(ud, header, size);
+        for (l = n; ok && l-- > 0;)
+            ok = sink(ud, levels[l].data, levels[l].size);
+    }
+    free(header);
+    for (l = 0; l < n; l++)
+        free(levels[l].data);
+    return ok;
+}
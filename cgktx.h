@@ -0,0 +1,9 @@
+#ifndef CGKTX_H_
+#define CGKTX_H_
+
+#include "cgformat.h"
+
+int cgktx_encode(const unsigned char *rgba, unsigned int width, unsigned int height, const struct cgformat_options *options,
+        int bc7, cgformat_sink sink, void *ud);
+
+#endif /* CGKTX_H_ */
@@ -0,0 +1,248 @@
+
+#include <curl/curl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cglib.h"
+#include "cgmem.h"
+
+static const char *cglib_errors[] = {
+    "no error",
+    "out of memory",
+    "network error",
+    "unexpected material listing",
+    "unreadable zip",
+    "unreadable image",
+    "i/o error",
+    "invalid argument",
+};
+
+int strncat_s(char *dest, const char *src, int sz)
+{
+    if (sz - 1 <= 0) return 0;
+    strncat(dest, src, sz - 1);
+    return strlen(src);
+}
+
+/* process-wide setup, before any context is used */
+void cglib_init(void)
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    cgapi_init();
+    cgpro_init();
+}
+
+void cglib_cleanup(void)
+{
+    cgapi_cleanup();
+    curl_global_cleanup();
+    cgmem_trim();
+}
+
+void cglib_job_init(struct cglib_job *job)
+{
+    memset(job, 0, sizeof(struct cglib_job));
+    job->dither = cgpro_dither_bayer8x8;
+}
+
+void cglib_context_init(struct cglib_context *ctx, const struct cglib_job *job)
+{
+    ctx->job = job;
+    ctx->log = NULL;
+    ctx->output = NULL;
+    ctx->log_ud = NULL;
+    ctx->error = cglib_error_none;
+}
+
+void cglib_log(struct cglib_context *ctx, enum cglib_log_level level, const char *fmt, ...)
+{
+    va_list args;
+    if (!ctx->log)
+        return;
+    va_start(args, fmt);
+    ctx->log(ctx->log_ud, level, fmt, args);
+    va_end(args);
+}
+
+/* records error on ctx and logs why, always returns 0 */
+int cglib_fail(struct cglib_context *ctx, enum cglib_error error, const char *fmt, ...)
+{
+    va_list args;
+    __atomic_store_n(&ctx->error, error, __ATOMIC_RELAXED);
+    if (!ctx->log)
+        return 0;
+    va_start(args, fmt);
+    ctx->log(ctx->log_ud, cglib_log_error, fmt, args);
+    va_end(args);
+    return 0;
+}
+
+void cglib_output(struct cglib_context *ctx, const char *id, const char *path)
+{
+    if (ctx->output)
+        ctx->output(ctx->log_ud, id, path);
+}
+
+const char *cglib_error_string(enum cglib_error error)
+{
+    if ((unsigned int) error >= sizeof cglib_errors / sizeof *cglib_errors)
+        return "unknown error";
+    return cglib_errors[error];
+}
+
+/* the per-map operators the job asks of matmap */
+static void cglib_map_pipeline(const struct cglib_job *job, struct cgapi_material *mat, enum cgapi_matmap matmap, struct cgpro_pipeline *pipeline)
+{
+    struct cgapi_map *opacity = &mat->maps[cgapi_matmap_opacity];
+
+    memset(pipeline, 0, sizeof(struct cgpro_pipeline));
+    if (job->downscale_width && job->downscale_height) {
+        pipeline->width = job->downscale_width;
+        pipeline->height = job->downscale_height;
+        if (matmap != cgapi_matmap_color && job->macro_scale > 0) {
+            pipeline->width *= job->macro_scale;
+            pipeline->height *= job->macro_scale;
+        }
+    }
+    if (matmap == cgapi_matmap_color) {
+        /* applied opacity is sampled straight from the source while combining */
+        if (job->apply_opacity && opacity->data) {
+            pipeline->combine = opacity;
+            pipeline->combine_channel = 3;
+            pipeline->combine_source_channel = 0;
+        }
+        if (job->palette.data) {
+            pipeline->palette = job->palette;
+            pipeline->dither = job->dither;
+        }
+    }
+}
+
+/* runs every per-map operator of the job in one pass over the map */
+int cglib_process_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap)
+{
+    struct cgapi_map *map = &mat->maps[matmap];
+    struct cgpro_pipeline pipeline;
+
+    if (!map->data)
+        return 1;
+    cglib_map_pipeline(ctx->job, mat, matmap, &pipeline);
+    if (pipeline.combine)
+        cglib_log(ctx, cglib_log_verbose, "applying opacity to %s\n", mat->id);
+    if (pipeline.palette.data)
+        cglib_log(ctx, cglib_log_verbose, "quantizing %s\n", mat->id);
+    if (!pipeline.width && !pipeline.combine && !pipeline.palette.data)
+        return 1;
+    if (!cgpro_pipeline_run(&pipeline, map))
+        return cglib_fail(ctx, cglib_error_memory, "failed to process matmap %d for %s\n", matmap, mat->id);
+    return 1;
+}
+
+/*
+ * processes and saves a big map into out straight from its png, a row at
+ * a time, when nothing the job does to it needs the whole map. returns 1
+ * once it is saved, otherwise it is left for cgapi_map_decode.
+ */
+int cglib_stream_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out)
+{
+    const struct cglib_job *job = ctx->job;
+    struct cgapi_map *opacity = &mat->maps[cgapi_matmap_opacity];
+    struct cgpro_pipeline pipeline;
+
+    if (!cgapi_map_is_saved(job, matmap))
+        return 0;
+    /* the derived normal is made from its source decoded */
+    if (mat->derived_normal >= 0 && (matmap == cgapi_matmap_normaldx || matmap == cgapi_matmap_normalgl))
+        return 0;
+    /* opacity to apply, or a palette built for this map, take it whole */
+    if (matmap == cgapi_matmap_color && ((job->apply_opacity && (opacity->data || opacity->encoded))
+                || (!job->palette.data && job->palette_colors)))
+        return 0;
+    cglib_map_pipeline(job, mat, matmap, &pipeline);
+    return cgapi_map_stream(ctx, mat, matmap, out, &pipeline);
+}
+
+/* against the job's palette, or one built for this map alone */
+int cglib_quantize_map(struct cglib_context *ctx, struct cgapi_map *map)
+{
+    const struct cglib_job *job = ctx->job;
+    struct cgpro_palette palette = job->palette;
+    int ok;
+
+    if (!map->data)
+        return cglib_fail(ctx, cglib_error_argument, "nothing to quantize\n");
+    if (!palette.data && job->palette_colors) {
+        struct cgpro_histogram hist = cgpro_histogram_new();
+        if (!hist.count)
+            return cglib_fail(ctx, cglib_error_memory, "out of memory\n");
+        cgpro_histogram_add(&hist, map);
+        palette = cgpro_palette_generate(&hist, job->palette_colors);
+        cgpro_histogram_free(hist);
+    }
+    if (!palette.data)
+        return cglib_fail(ctx, cglib_error_argument, "no palette to quantize with\n");
+    ok = cgpro_quantize_to(map, palette, job->dither);
+    if (palette.data != job->palette.data)
+        cgpro_palette_free(palette);
+    if (!ok)
+        return cglib_fail(ctx, cglib_error_memory, "failed to quantize\n");
+    return 1;
+}
+
+/*
+ * rips and processes a material straight from a zip in memory, leaving
+ * every map the job wants decoded in mat. nothing is saved.
+ */
+int cglib_process_zip(struct cglib_context *ctx, struct cgapi_material *mat, const char *id, const void *zip, size_t zip_size)
+{
+    const struct cglib_job *job = ctx->job;
+    struct cgapi_map *opacity = &mat->maps[cgapi_matmap_opacity];
+    int j, ok = 1;
+
+    memset(mat, 0, sizeof(struct cgapi_material));
+    mat->derived_normal = -1;
+    cgmem_hold_init(&mat->mem, 0);
+    mat->id = malloc(strlen(id) + 1);
+    mat->zip = cgmem_alloc(zip_size);
+    if (!mat->id || !mat->zip) {
+        cglib_material_free(mat);
+        return cglib_fail(ctx, cglib_error_memory, "out of memory\n");
+    }
+    strcpy(mat->id, id);
+    memcpy(mat->zip, zip, zip_size);
+    mat->zip_size = zip_size;
+
+    if (!cgapi_material_extract(ctx, mat)) {
+        cglib_material_free(mat);
+        return 0;
+    }
+    /* all decoded first, a derived normal only shows up with its source */
+    for (j = 0; j < CGAPI_MAPNUM; j++)
+        cgapi_map_decode(ctx, mat, j);
+    for (j = 0; ok && j < CGAPI_MAPNUM; j++) {
+        if (j == cgapi_matmap_opacity && job->apply_opacity)
+            continue;
+        ok = cglib_process_map(ctx, mat, j);
+    }
+    if (ok && job->apply_opacity) {
+        /* folded into the color map */
+        cgmem_free(opacity->data);
+        opacity->data = NULL;
+    }
+    if (ok && mat->maps[cgapi_matmap_color].data && !job->palette.data && job->palette_colors)
+        ok = cglib_quantize_map(ctx, &mat->maps[cgapi_matmap_color]);
+    cgmem_release(&mat->mem);
+    if (!ok)
+        cglib_material_free(mat);
+    return ok;
+}
+
+/* for materials that are not part of a cgapi_materials list */
+void cglib_material_free(struct cgapi_material *mat)
+{
+    cgapi_material_release(mat);
+    free(mat->id);
+    free(mat->url);
+    mat->id = NULL;
+    mat->url = NULL;
+}
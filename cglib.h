@@ -0,0 +1,95 @@
+
+#ifndef CGLIB_H_
+#define CGLIB_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "cgapi.h"
+#include "cgpro.h"
+
+enum cgrip_normal_type {
+    cgrip_normal_type_none,
+    cgrip_normal_type_gl,
+    cgrip_normal_type_dx,
+    cgrip_normal_type_both
+};
+
+enum cglib_error {
+    cglib_error_none,
+    cglib_error_memory,
+    cglib_error_network,
+    cglib_error_listing, /* downloads.csv missing or in an unknown format */
+    cglib_error_archive,
+    cglib_error_image,
+    cglib_error_io,
+    cglib_error_argument
+};
+
+enum cglib_log_level {
+    cglib_log_verbose,
+    cglib_log_info,
+    cglib_log_warn,
+    cglib_log_error
+};
+
+typedef void (*cglib_log_fn)(void *ud, enum cglib_log_level level, const char *fmt, va_list args);
+/* told of every file written for material id */
+typedef void (*cglib_output_fn)(void *ud, const char *id, const char *path);
+
+/* what to pull out of each material and what to do to it */
+struct cglib_job {
+    const char *output; /* dir maps are saved to, NULL for the cwd */
+    const char *output_zip; /* dir zips are saved to, NULL for output */
+    enum cgrip_normal_type save_normal;
+    unsigned int downscale_width, downscale_height; /* 0 keeps the size */
+    unsigned int macro_scale; /* multiplies the downscale of non-albedo maps */
+    struct cgpro_palette palette; /* quantize color against this when set */
+    unsigned int palette_colors; /* otherwise build a palette this big, 0 for none */
+    enum cgpro_dither dither;
+    enum cgformat format; /* maps are saved as */
+    unsigned int zstd; /* level ktx2 maps are supercompressed at, 0 for none */
+    char godot4_root[4096]; /* project dir, found from the output when empty */
+    unsigned save_zip : 1;
+    unsigned save_ambientocclusion : 1;
+    unsigned save_color : 1;
+    unsigned save_displacement : 1;
+    unsigned save_emission : 1;
+    unsigned save_metalness : 1;
+    unsigned save_opacity : 1;
+    unsigned save_roughness : 1;
+    unsigned apply_opacity : 1;
+    unsigned filter_nearest : 1;
+    unsigned mipmaps : 1; /* with a mip chain, where the format holds one */
+};
+
+/*
+ * everything one caller of the library needs. the job is only read, so
+ * contexts can share one; each keeps the last error it ran into.
+ */
+struct cglib_context {
+    const struct cglib_job *job;
+    cglib_log_fn log;
+    cglib_output_fn output; /* NULL for none, also gets log_ud */
+    void *log_ud;
+    enum cglib_error error;
+};
+
+void cglib_init(void);
+void cglib_cleanup(void);
+void cglib_job_init(struct cglib_job *job);
+void cglib_context_init(struct cglib_context *ctx, const struct cglib_job *job);
+void cglib_log(struct cglib_context *ctx, enum cglib_log_level level, const char *fmt, ...);
+int cglib_fail(struct cglib_context *ctx, enum cglib_error error, const char *fmt, ...);
+void cglib_output(struct cglib_context *ctx, const char *id, const char *path);
+const char *cglib_error_string(enum cglib_error error);
+
+int cglib_process_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap);
+int cglib_stream_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *out);
+int cglib_quantize_map(struct cglib_context *ctx, struct cgapi_map *map);
+int cglib_process_zip(struct cglib_context *ctx, struct cgapi_material *mat, const char *id, const void *zip, size_t zip_size);
+void cglib_material_free(struct cgapi_material *mat);
+
+int strncat_s(char *dest, const char *src, int sz);
+
+#endif /* CGLIB_H_ */
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE /* timerfd and eventfd under -ansi */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "cgloop.h"
+
+#define CGLOOP_EVENTS 64
+
+struct cgloop_transfer {
+    CURL *easy;
+    cgloop_done_fn done;
+    void *ud;
+    struct cgloop_transfer *prev, *next;
+};
+
+/*
+ * one thread multiplexing every transfer over epoll. curl says which
+ * sockets it wants watched and when it next needs a timeout, the timerfd
+ * stands in for the latter and the eventfd wakes the loop for new work.
+ */
+struct cgloop {
+    CURLM *multi;
+    int epfd, timerfd, wakefd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct cgloop_transfer *pending, *pending_last; /* added, not yet seen by the loop */
+    int stopping;
+    struct cgloop_transfer *active; /* only touched by the loop thread */
+};
+
+static int cgloop_socket(CURL *easy, curl_socket_t s, int what, void *ud, void *socketp)
+{
+    struct cgloop *loop = (struct cgloop *) ud;
+    struct epoll_event ev;
+
+    if (what == CURL_POLL_REMOVE) {
+        /* a socket curl already closed has left the set on its own */
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(loop->multi, s, NULL);
+        return 0;
+    }
+    memset(&ev, 0, sizeof ev);
+    ev.data.fd = s;
+    if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+        ev.events |= EPOLLIN;
+    if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+        ev.events |= EPOLLOUT;
+    if (socketp) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev);
+    } else {
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev);
+        curl_multi_assign(loop->multi, s, loop); /* anything but NULL marks it added */
+    }
+    return 0;
+}
+
+static int cgloop_timer(CURLM *multi, long timeout_ms, void *ud)
+{
+    struct cgloop *loop = (struct cgloop *) ud;
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof its);
+    if (timeout_ms > 0) {
+        its.it_value.tv_sec = timeout_ms / 1000;
+        its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    } else if (timeout_ms == 0) {
+        its.it_value.tv_nsec = 1; /* right away, all zero would disarm it */
+    }
+    timerfd_settime(loop->timerfd, 0, &its, NULL);
+    return 0;
+}
+
+static void cgloop_unlink(struct cgloop *loop, struct cgloop_transfer *t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        loop->active = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+}
+
+static void cgloop_end(struct cgloop_transfer *t, CURLcode result)
+{
+    t->done(t->easy, result, t->ud);
+    free(t);
+}
+
+/* hands what was added since last time to curl, returns whether to stop */
+static int cgloop_take(struct cgloop *loop)
+{
+    struct cgloop_transfer *t, *next;
+    int stopping;
+
+    pthread_mutex_lock(&loop->lock);
+    t = loop->pending;
+    loop->pending = loop->pending_last = NULL;
+    stopping = loop->stopping;
+    pthread_mutex_unlock(&loop->lock);
+
+    for (; t; t = next) {
+        next = t->next;
+        curl_easy_setopt(t->easy, CURLOPT_PRIVATE, t);
+        if (stopping || curl_multi_add_handle(loop->multi, t->easy) != CURLM_OK) {
+            cgloop_end(t, stopping ? CURLE_ABORTED_BY_CALLBACK : CURLE_FAILED_INIT);
+            continue;
+        }
+        t->prev = NULL;
+        t->next = loop->active;
+        if (loop->active)
+            loop->active->prev = t;
+        loop->active = t;
+    }
+    return stopping;
+}
+
+static void cgloop_done(struct cgloop *loop)
+{
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(loop->multi, &left)) != NULL) {
+        struct cgloop_transfer *t;
+        CURLcode result = msg->data.result;
+        CURL *easy = msg->easy_handle;
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **) &t);
+        curl_multi_remove_handle(loop->multi, easy);
+        cgloop_unlink(loop, t);
+        cgloop_end(t, result);
+    }
+}
+
+static void *cgloop_run(void *ud)
+{
+    struct cgloop *loop = (struct cgloop *) ud;
+    struct epoll_event events[CGLOOP_EVENTS];
+    int running, stop = 0;
+
+    while (!stop) {
+        int i, n = epoll_wait(loop->epfd, events, CGLOOP_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == loop->timerfd) {
+                unsigned char expirations[8];
+                if (read(loop->timerfd, expirations, sizeof expirations) < 0 && errno != EAGAIN)
+                    stop = 1;
+                curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+            } else if (fd == loop->wakefd) {
+                eventfd_t count;
+                eventfd_read(loop->wakefd, &count);
+                stop = cgloop_take(loop);
+            } else {
+                int mask = 0;
+                if (events[i].events & EPOLLIN)
+                    mask |= CURL_CSELECT_IN;
+                if (events[i].events & EPOLLOUT)
+                    mask |= CURL_CSELECT_OUT;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    mask |= CURL_CSELECT_ERR;
+                curl_multi_socket_action(loop->multi, fd, mask, &running);
+            }
+        }
+        cgloop_done(loop);
+    }
+
+    /* whoever is still waiting on a transfer hears it will not finish */
+    pthread_mutex_lock(&loop->lock);
+    loop->stopping = 1;
+    pthread_mutex_unlock(&loop->lock);
+    cgloop_take(loop);
+    while (loop->active) {
+        struct cgloop_transfer *t = loop->active;
+        curl_multi_remove_handle(loop->multi, t->easy);
+        cgloop_unlink(loop, t);
+        cgloop_end(t, CURLE_ABORTED_BY_CALLBACK);
+    }
+    return NULL;
+}
+
+/* after curl_global_init, NULL when the loop could not be set up */
+struct cgloop *cgloop_new(void)
+{
+    struct cgloop *loop = calloc(1, sizeof(struct cgloop));
+    struct epoll_event ev;
+
+    if (!loop)
+        return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop->multi = curl_multi_init();
+    if (loop->epfd < 0 || loop->timerfd < 0 || loop->wakefd < 0 || !loop->multi)
+        goto fail;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = loop->timerfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) < 0)
+        goto fail;
+    ev.data.fd = loop->wakefd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) < 0)
+        goto fail;
+
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, cgloop_socket);
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, cgloop_timer);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop);
+
+    pthread_mutex_init(&loop->lock, NULL);
+    if (pthread_create(&loop->thread, NULL, cgloop_run, loop)) {
+        pthread_mutex_destroy(&loop->lock);
+        goto fail;
+    }
+    return loop;
+
+fail:
+    if (loop->multi)
+        curl_multi_cleanup(loop->multi);
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    if (loop->timerfd >= 0)
+        close(loop->timerfd);
+    if (loop->wakefd >= 0)
+        close(loop->wakefd);
+    free(loop);
+    return NULL;
+}
+
+/*
+ * starts easy from any thread, done gets it back from the loop thread.
+ * the loop keeps its own pointer in CURLOPT_PRIVATE. returns 0 when the
+ * loop is stopping, done is not called then.
+ */
+int cgloop_add(struct cgloop *loop, CURL *easy, cgloop_done_fn done, void *ud)
+{
+    struct cgloop_transfer *t = malloc(sizeof(struct cgloop_transfer));
+
+    if (!t)
+        return 0;
+    t->easy = easy;
+    t->done = done;
+    t->ud = ud;
+    t->prev = t->next = NULL;
+    pthread_mutex_lock(&loop->lock);
+    if (loop->stopping) {
+        pthread_mutex_unlock(&loop->lock);
+        free(t);
+        return 0;
+    }
+    if (loop->pending_last)
+        loop->pending_last->next = t;
+    else
+        loop->pending = t;
+    loop->pending_last = t;
+    pthread_mutex_unlock(&loop->lock);
+    eventfd_write(loop->wakefd, 1);
+    return 1;
+}
+
+/* transfers still going are ended with CURLE_ABORTED_BY_CALLBACK */
+void cgloop_free(struct cgloop *loop)
+{
+    if (!loop)
+        return;
+    pthread_mutex_lock(&loop->lock);
+    loop->stopping = 1;
+    pthread_mutex_unlock(&loop->lock);
+    eventfd_write(loop->wakefd, 1);
+    pthread_join(loop->thread, NULL);
+
+    pthread_mutex_destroy(&loop->lock);
+    curl_multi_cleanup(loop->multi);
+    close(loop->epfd);
+    close(loop->timerfd);
+    close(loop->wakefd);
+    free(loop);
+}
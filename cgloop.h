@@ -0,0 +1,15 @@
+#ifndef CGLOOP_H_
+#define CGLOOP_H_
+
+#include <curl/curl.h>
+
+/* called on the loop thread once curl is done with easy, which is the caller's again */
+typedef void (*cgloop_done_fn)(CURL *easy, CURLcode result, void *ud);
+
+struct cgloop;
+
+struct cgloop *cgloop_new(void);
+int cgloop_add(struct cgloop *loop, CURL *easy, cgloop_done_fn done, void *ud);
+void cgloop_free(struct cgloop *loop);
+
+#endif /* CGLOOP_H_ */
@@ -0,0 +1,402 @@
+#define _GNU_SOURCE /* snprintf and getline */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cghash.h"
+#include "cgmanifest.h"
+
+#define CGMANIFEST_NAME ".cgrip-manifest"
+#define CGMANIFEST_HEADER "cgrip-manifest 1"
+#define CGMANIFEST_BUCKETS_MIN 64
+
+struct cgmanifest_output {
+    char *path; /* relative to the manifest's dir when it is inside it */
+    unsigned long size, mtime, hash;
+    struct cgmanifest_output *next;
+};
+
+enum cgmanifest_state {
+    cgmanifest_state_kept, /* as loaded, nothing was redone */
+    cgmanifest_state_making, /* being redone, forgotten unless it finishes */
+    cgmanifest_state_made
+};
+
+struct cgmanifest_entry {
+    char *id;
+    unsigned long params; /* everything the outputs were made with */
+    unsigned long size; /* of the zip, as listed */
+    char *source; /* request header revalidating the zip, "" for none */
+    struct cgmanifest_output *outputs;
+    enum cgmanifest_state state;
+    struct cgmanifest_entry *next; /* in its bucket */
+};
+
+/*
+ * what each material in a dir was last made from and into, so a run
+ * can tell which of its materials there is nothing to do for. lines of
+ *   material ID PARAMS SIZE SOURCE
+ *   output HASH SIZE MTIME PATH
+ * separated by tabs, outputs belonging to the material above them.
+ */
+struct cgmanifest {
+    char *dir;
+    struct cgmanifest_entry **buckets;
+    unsigned int nbuckets, count;
+    pthread_mutex_t lock;
+};
+
+static char *cgmanifest_strdup(const char *str)
+{
+    char *copy = malloc(strlen(str) + 1);
+    if (copy)
+        strcpy(copy, str);
+    return copy;
+}
+
+static void cgmanifest_outputs_free(struct cgmanifest_output *o)
+{
+    while (o) {
+        struct cgmanifest_output *next = o->next;
+        free(o->path);
+        free(o);
+        o = next;
+    }
+}
+
+static struct cgmanifest_entry *cgmanifest_find(struct cgmanifest *m, const char *id)
+{
+    struct cgmanifest_entry *e;
+    for (e = m->buckets[cghash_str(CGHASH_INIT, id) % m->nbuckets]; e; e = e->next)
+        if (!strcmp(e->id, id))
+            return e;
+    return NULL;
+}
+
+static void cgmanifest_grow(struct cgmanifest *m)
+{
+    unsigned int n = m->nbuckets * 2, i;
+    struct cgmanifest_entry **buckets = calloc(n, sizeof(struct cgmanifest_entry *));
+    if (!buckets)
+        return;
+    for (i = 0; i < m->nbuckets; i++) {
+        while (m->buckets[i]) {
+            struct cgmanifest_entry *e = m->buckets[i];
+            unsigned long b = cghash_str(CGHASH_INIT, e->id) % n;
+            m->buckets[i] = e->next;
+            e->next = buckets[b];
+            buckets[b] = e;
+        }
+    }
+    free(m->buckets);
+    m->buckets = buckets;
+    m->nbuckets = n;
+}
+
+/* the entry for id, made empty if there was none */
+static struct cgmanifest_entry *cgmanifest_get(struct cgmanifest *m, const char *id)
+{
+    struct cgmanifest_entry *e = cgmanifest_find(m, id);
+    unsigned long b;
+    if (e)
+        return e;
+    e = calloc(1, sizeof(struct cgmanifest_entry));
+    if (!e)
+        return NULL;
+    e->id = cgmanifest_strdup(id);
+    e->source = cgmanifest_strdup("");
+    if (!e->id || !e->source) {
+        free(e->id);
+        free(e->source);
+        free(e);
+        return NULL;
+    }
+    if (m->count >= m->nbuckets * 2)
+        cgmanifest_grow(m);
+    b = cghash_str(CGHASH_INIT, id) % m->nbuckets;
+    e->next = m->buckets[b];
+    m->buckets[b] = e;
+    m->count++;
+    return e;
+}
+
+static void cgmanifest_add_output(struct cgmanifest_entry *e, struct cgmanifest_output *o)
+{
+    struct cgmanifest_output **p = &e->outputs;
+    while (*p)
+        p = &(*p)->next;
+    o->next = NULL;
+    *p = o;
+}
+
+/* path as it is kept, short of the dir when inside it */
+static const char *cgmanifest_relative(struct cgmanifest *m, const char *path)
+{
+    size_t len = strlen(m->dir);
+    if (!strncmp(path, m->dir, len) && path[len] == '/')
+        return path + len + 1;
+    return path;
+}
+
+static void cgmanifest_resolve(struct cgmanifest *m, const char *path, char *buf, size_t size)
+{
+    if (*path == '/')
+        snprintf(buf, size, "%s", path);
+    else
+        snprintf(buf, size, "%s/%s", m->dir, path);
+}
+
+/* splits off the next tab separated field of *line */
+static char *cgmanifest_field(char **line)
+{
+    char *field = *line, *end;
+    if (!field)
+        return NULL;
+    end = strpbrk(field, "\t\n");
+    if (end && *end == '\t') {
+        *end = 0;
+        *line = end + 1;
+    } else {
+        if (end)
+            *end = 0;
+        *line = NULL;
+    }
+    return field;
+}
+
+static void cgmanifest_load(struct cgmanifest *m, FILE *fp)
+{
+    struct cgmanifest_entry *e = NULL;
+    char *line = NULL, *p, *kind;
+    size_t cap = 0;
+
+    if (getline(&line, &cap, fp) < 0 || strncmp(line, CGMANIFEST_HEADER "\n", sizeof CGMANIFEST_HEADER)) {
+        free(line);
+        return; /* unknown, everything gets made again */
+    }
+    while (getline(&line, &cap, fp) >= 0) {
+        p = line;
+        kind = cgmanifest_field(&p);
+        if (!strcmp(kind, "material")) {
+            char *id = cgmanifest_field(&p), *params = cgmanifest_field(&p);
+            char *size = cgmanifest_field(&p), *source = cgmanifest_field(&p);
+            char *copy;
+            e = NULL;
+            if (!id || !params || !size || !source || !(copy = cgmanifest_strdup(source)))
+                continue;
+            if (!(e = cgmanifest_get(m, id))) {
+                free(copy);
+                continue;
+            }
+            e->params = strtoul(params, NULL, 16);
+            e->size = strtoul(size, NULL, 10);
+            free(e->source);
+            e->source = copy;
+        } else if (!strcmp(kind, "output") && e) {
+            char *hash = cgmanifest_field(&p), *size = cgmanifest_field(&p);
+            char *mtime = cgmanifest_field(&p), *path = cgmanifest_field(&p);
+            struct cgmanifest_output *o;
+            if (!hash || !size || !mtime || !path || !(o = malloc(sizeof(struct cgmanifest_output))))
+                continue;
+            if (!(o->path = cgmanifest_strdup(path))) {
+                free(o);
+                continue;
+            }
+            o->hash = strtoul(hash, NULL, 16);
+            o->size = strtoul(size, NULL, 10);
+            o->mtime = strtoul(mtime, NULL, 10);
+            cgmanifest_add_output(e, o);
+        }
+    }
+    free(line);
+}
+
+/* the manifest of dir, empty when it has none yet */
+struct cgmanifest *cgmanifest_open(const char *dir)
+{
+    struct cgmanifest *m = calloc(1, sizeof(struct cgmanifest));
+    char path[4096];
+    FILE *fp;
+
+    if (!m)
+        return NULL;
+    m->dir = cgmanifest_strdup(dir);
+    m->nbuckets = CGMANIFEST_BUCKETS_MIN;
+    m->buckets = calloc(m->nbuckets, sizeof(struct cgmanifest_entry *));
+    if (!m->dir || !m->buckets) {
+        free(m->dir);
+        free(m->buckets);
+        free(m);
+        return NULL;
+    }
+    pthread_mutex_init(&m->lock, NULL);
+    snprintf(path, sizeof path, "%s/" CGMANIFEST_NAME, dir);
+    if ((fp = fopen(path, "r")) != NULL) {
+        cgmanifest_load(m, fp);
+        fclose(fp);
+    }
+    return m;
+}
+
+/* whether path still is what was written, hashing it only when it looks touched */
+static int cgmanifest_intact(struct cgmanifest *m, struct cgmanifest_output *o)
+{
+    char path[4096];
+    struct stat st;
+    unsigned long hash;
+
+    cgmanifest_resolve(m, o->path, path, sizeof path);
+    if (stat(path, &st) != 0 || (unsigned long) st.st_size != o->size)
+        return 0;
+    if ((unsigned long) st.st_mtime == o->mtime)
+        return 1;
+    if (!cghash_file(path, &hash) || hash != o->hash)
+        return 0;
+    o->mtime = st.st_mtime;
+    return 1;
+}
+
+/*
+ * when id was last made with params, from a zip listed at listed_size
+ * that can be revalidated, and all it made is still there untouched:
+ * the header to revalidate with. NULL when it has to be made again.
+ */
+char *cgmanifest_check(struct cgmanifest *m, const char *id, unsigned long params, size_t listed_size)
+{
+    struct cgmanifest_entry *e;
+    struct cgmanifest_output *o;
+    char *source = NULL;
+
+    pthread_mutex_lock(&m->lock);
+    e = cgmanifest_find(m, id);
+    if (e && e->state == cgmanifest_state_kept && e->params == params && e->size == listed_size && *e->source) {
+        for (o = e->outputs; o; o = o->next)
+            if (!cgmanifest_intact(m, o))
+                break;
+        if (!o)
+            source = cgmanifest_strdup(e->source);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return source;
+}
+
+/* id is being made again, what it made before no longer counts */
+void cgmanifest_begin(struct cgmanifest *m, const char *id, unsigned long params, size_t listed_size)
+{
+    struct cgmanifest_entry *e;
+    pthread_mutex_lock(&m->lock);
+    if ((e = cgmanifest_get(m, id)) != NULL) {
+        cgmanifest_outputs_free(e->outputs);
+        e->outputs = NULL;
+        e->params = params;
+        e->size = listed_size;
+        e->state = cgmanifest_state_making;
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+/* path was written for id, hashed as it is now */
+void cgmanifest_output(struct cgmanifest *m, const char *id, const char *path)
+{
+    struct cgmanifest_output *o = malloc(sizeof(struct cgmanifest_output));
+    struct cgmanifest_entry *e;
+    struct stat st;
+
+    if (!o)
+        return;
+    if (stat(path, &st) != 0 || !cghash_file(path, &o->hash)
+            || !(o->path = cgmanifest_strdup(cgmanifest_relative(m, path)))) {
+        free(o);
+        return;
+    }
+    o->size = st.st_size;
+    o->mtime = st.st_mtime;
+    pthread_mutex_lock(&m->lock);
+    e = cgmanifest_find(m, id);
+    if (e && e->state == cgmanifest_state_making) {
+        cgmanifest_add_output(e, o);
+        o = NULL;
+    }
+    pthread_mutex_unlock(&m->lock);
+    if (o) {
+        free(o->path);
+        free(o);
+    }
+}
+
+/* id was made from the zip source revalidates, NULL when it cannot be */
+void cgmanifest_finish(struct cgmanifest *m, const char *id, const char *source)
+{
+    struct cgmanifest_entry *e;
+    char *copy = cgmanifest_strdup(source ? source : "");
+    pthread_mutex_lock(&m->lock);
+    e = cgmanifest_find(m, id);
+    if (e && e->state == cgmanifest_state_making && copy) {
+        free(e->source);
+        e->source = copy;
+        copy = NULL;
+        e->state = cgmanifest_state_made;
+    }
+    pthread_mutex_unlock(&m->lock);
+    free(copy);
+}
+
+/* written aside and renamed over the old one, unfinished materials left out */
+int cgmanifest_save(struct cgmanifest *m)
+{
+    char tmp[4096], path[4096];
+    unsigned int i;
+    FILE *fp;
+    int ok = 1;
+
+    snprintf(tmp, sizeof tmp, "%s/." CGMANIFEST_NAME ".%lu", m->dir, (unsigned long) getpid());
+    snprintf(path, sizeof path, "%s/" CGMANIFEST_NAME, m->dir);
+    if (!(fp = fopen(tmp, "w")))
+        return 0;
+    pthread_mutex_lock(&m->lock);
+    fputs(CGMANIFEST_HEADER "\n", fp);
+    for (i = 0; i < m->nbuckets; i++) {
+        struct cgmanifest_entry *e;
+        for (e = m->buckets[i]; e; e = e->next) {
+            struct cgmanifest_output *o;
+            if (e->state == cgmanifest_state_making)
+                continue;
+            fprintf(fp, "material\t%s\t%lx\t%lu\t%s\n", e->id, e->params, e->size, e->source);
+            for (o = e->outputs; o; o = o->next)
+                fprintf(fp, "output\t%lx\t%lu\t%lu\t%s\n", o->hash, o->size, o->mtime, o->path);
+        }
+    }
+    pthread_mutex_unlock(&m->lock);
+    ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        remove(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+void cgmanifest_free(struct cgmanifest *m)
+{
+    unsigned int i;
+    if (!m)
+        return;
+    for (i = 0; i < m->nbuckets; i++) {
+        while (m->buckets[i]) {
+            struct cgmanifest_entry *e = m->buckets[i];
+            m->buckets[i] = e->next;
+            cgmanifest_outputs_free(e->outputs);
+            free(e->id);
+            free(e->source);
+            free(e);
+        }
+    }
+    pthread_mutex_destroy(&m->lock);
+    free(m->buckets);
+    free(m->dir);
+    free(m);
+}
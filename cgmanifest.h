@@ -0,0 +1,16 @@
+#ifndef CGMANIFEST_H_
+#define CGMANIFEST_H_
+
+#include <stddef.h>
+
+struct cgmanifest;
+
+struct cgmanifest *cgmanifest_open(const char *dir);
+char *cgmanifest_check(struct cgmanifest *m, const char *id, unsigned long params, size_t listed_size);
+void cgmanifest_begin(struct cgmanifest *m, const char *id, unsigned long params, size_t listed_size);
+void cgmanifest_output(struct cgmanifest *m, const char *id, const char *path);
+void cgmanifest_finish(struct cgmanifest *m, const char *id, const char *source);
+int cgmanifest_save(struct cgmanifest *m);
+void cgmanifest_free(struct cgmanifest *m);
+
+#endif /* CGMANIFEST_H_ */
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE /* MAP_ANONYMOUS, MADV_HUGEPAGE */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cgmem.h"
+
+/* smaller buffers are left to malloc */
+#define CGMEM_POOL_MIN (64 * 1024)
+/* size classes per doubling, so at most a quarter is wasted */
+#define CGMEM_CLASS_STEPS 4
+#define CGMEM_CLASSES (CGMEM_CLASS_STEPS * 8 * sizeof(size_t))
+/* idle buffers kept around for reuse when there is no budget */
+#define CGMEM_CACHE_DEFAULT ((size_t) 1024 * 1024 * 1024)
+#define CGMEM_HUGE_PAGE ((size_t) 2 * 1024 * 1024)
+/* class of blocks mapped from a file, which are never reused */
+#define CGMEM_FILE CGMEM_CLASSES
+
+/* sits in front of every buffer handed out */
+struct cgmem_block {
+    size_t size; /* usable bytes */
+    size_t mapped; /* bytes mapped for it, 0 when it came from malloc */
+    unsigned int cls;
+    struct cgmem_block *next; /* while idle */
+};
+
+static pthread_mutex_t cgmem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cgmem_freed = PTHREAD_COND_INITIALIZER;
+static size_t cgmem_limit = 0; /* 0 for no budget */
+static size_t cgmem_used = 0;
+static size_t cgmem_max_used = 0;
+static struct cgmem_hold *cgmem_holds = NULL; /* everyone holding anything */
+
+static pthread_mutex_t cgmem_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgmem_block *cgmem_idle[CGMEM_CLASSES];
+static size_t cgmem_cached = 0;
+static size_t cgmem_cache_max = CGMEM_CACHE_DEFAULT;
+static int cgmem_huge_pages = 0;
+static unsigned long cgmem_reused = 0, cgmem_mapped = 0;
+
+void cgmem_set_budget(size_t bytes)
+{
+    pthread_mutex_lock(&cgmem_lock);
+    cgmem_limit = bytes;
+    pthread_cond_broadcast(&cgmem_freed);
+    pthread_mutex_unlock(&cgmem_lock);
+    /* idle buffers are not held by anyone, keep them a small part of it */
+    pthread_mutex_lock(&cgmem_pool_lock);
+    cgmem_cache_max = bytes ? bytes / 4 : CGMEM_CACHE_DEFAULT;
+    pthread_mutex_unlock(&cgmem_pool_lock);
+    if (bytes)
+        cgmem_trim();
+}
+
+size_t cgmem_budget(void)
+{
+    return cgmem_limit;
+}
+
+size_t cgmem_peak(void)
+{
+    size_t peak;
+    pthread_mutex_lock(&cgmem_lock);
+    peak = cgmem_max_used;
+    pthread_mutex_unlock(&cgmem_lock);
+    return peak;
+}
+
+void cgmem_hold_init(struct cgmem_hold *hold, unsigned long order)
+{
+    hold->bytes = 0;
+    hold->order = order;
+    hold->prev = hold->next = NULL;
+}
+
+/* with cgmem_lock held */
+static void cgmem_set(struct cgmem_hold *hold, size_t bytes)
+{
+    if (!hold->bytes && bytes) {
+        hold->prev = NULL;
+        hold->next = cgmem_holds;
+        if (cgmem_holds)
+            cgmem_holds->prev = hold;
+        cgmem_holds = hold;
+    } else if (hold->bytes && !bytes) {
+        if (hold->prev)
+            hold->prev->next = hold->next;
+        else
+            cgmem_holds = hold->next;
+        if (hold->next)
+            hold->next->prev = hold->prev;
+        hold->prev = hold->next = NULL;
+    }
+    cgmem_used = cgmem_used - hold->bytes + bytes;
+    if (cgmem_used > cgmem_max_used)
+        cgmem_max_used = cgmem_used;
+    if (bytes < hold->bytes)
+        pthread_cond_broadcast(&cgmem_freed);
+    hold->bytes = bytes;
+}
+
+/* whether anyone older than hold still has memory it will give back */
+static int cgmem_older_holds(struct cgmem_hold *hold)
+{
+    struct cgmem_hold *h;
+    for (h = cgmem_holds; h; h = h->next)
+        if (h != hold && h->order < hold->order)
+            return 1;
+    return 0;
+}
+
+/*
+ * grows hold to bytes once that fits the budget. waiting only ever happens
+ * on older holders, which move on without waiting on younger ones, so the
+ * oldest is let through even when it alone is over budget.
+ */
+void cgmem_acquire(struct cgmem_hold *hold, size_t bytes)
+{
+    pthread_mutex_lock(&cgmem_lock);
+    while (cgmem_limit && bytes > hold->bytes
+            && cgmem_used - hold->bytes + bytes > cgmem_limit
+            && cgmem_older_holds(hold))
+        pthread_cond_wait(&cgmem_freed, &cgmem_lock);
+    cgmem_set(hold, bytes);
+    pthread_mutex_unlock(&cgmem_lock);
+}
+
+/* accounts for memory that is already allocated, never waits */
+void cgmem_adjust(struct cgmem_hold *hold, size_t bytes)
+{
+    pthread_mutex_lock(&cgmem_lock);
+    cgmem_set(hold, bytes);
+    pthread_mutex_unlock(&cgmem_lock);
+}
+
+void cgmem_release(struct cgmem_hold *hold)
+{
+    cgmem_adjust(hold, 0);
+}
+
+void cgmem_set_huge_pages(int enable)
+{
+    cgmem_huge_pages = enable;
+}
+
+static size_t cgmem_class_size(unsigned int cls)
+{
+    return (size_t) (CGMEM_CLASS_STEPS + cls % CGMEM_CLASS_STEPS) << (cls / CGMEM_CLASS_STEPS - 2);
+}
+
+static unsigned int cgmem_class(size_t size)
+{
+    unsigned int cls = 0;
+    while ((size >> (cls / CGMEM_CLASS_STEPS + 1)) > 0)
+        cls += CGMEM_CLASS_STEPS;
+    while (cgmem_class_size(cls) < size)
+        cls++;
+    return cls;
+}
+
+static struct cgmem_block *cgmem_map(unsigned int cls)
+{
+    struct cgmem_block *block;
+    size_t mapped = cgmem_class_size(cls);
+    void *p;
+
+    if (cgmem_huge_pages && mapped >= CGMEM_HUGE_PAGE)
+        mapped = (mapped + CGMEM_HUGE_PAGE - 1) / CGMEM_HUGE_PAGE * CGMEM_HUGE_PAGE;
+    p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (cgmem_huge_pages && mapped >= CGMEM_HUGE_PAGE)
+        madvise(p, mapped, MADV_HUGEPAGE);
+#endif
+    block = (struct cgmem_block *) p;
+    block->size = mapped - CGMEM_HEADER;
+    block->mapped = mapped;
+    block->cls = cls;
+    return block;
+}
+
+/*
+ * large buffers come from per size class lists of idle ones before a fresh
+ * mapping, so their pages are already faulted in and nobody zeroes them.
+ */
+void *cgmem_alloc(size_t size)
+{
+    struct cgmem_block *block;
+    unsigned int cls;
+
+    if (size + CGMEM_HEADER < CGMEM_POOL_MIN) {
+        block = malloc(size + CGMEM_HEADER);
+        if (!block)
+            return NULL;
+        block->size = size;
+        block->mapped = 0;
+        return (char *) block + CGMEM_HEADER;
+    }
+    cls = cgmem_class(size + CGMEM_HEADER);
+    pthread_mutex_lock(&cgmem_pool_lock);
+    block = cgmem_idle[cls];
+    if (block) {
+        cgmem_idle[cls] = block->next;
+        cgmem_cached -= block->mapped;
+        cgmem_reused++;
+    } else {
+        cgmem_mapped++;
+    }
+    pthread_mutex_unlock(&cgmem_pool_lock);
+    if (!block)
+        block = cgmem_map(cls);
+    if (!block)
+        return NULL;
+    return (char *) block + CGMEM_HEADER;
+}
+
+/*
+ * size bytes of fd as a buffer, from CGMEM_HEADER on. the mapping is
+ * private, so the first CGMEM_HEADER bytes become the block header and
+ * writes never reach the file. pages are shared with the page cache until
+ * written to.
+ */
+void *cgmem_map_file(int fd, size_t size)
+{
+    struct cgmem_block *block;
+    void *p;
+
+    if (size < CGMEM_HEADER)
+        return NULL;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    madvise(p, size, MADV_WILLNEED);
+    block = (struct cgmem_block *) p;
+    block->size = size - CGMEM_HEADER;
+    block->mapped = size;
+    block->cls = CGMEM_FILE;
+    return (char *) block + CGMEM_HEADER;
+}
+
+void *cgmem_realloc(void *ptr, size_t size)
+{
+    struct cgmem_block *block;
+    void *out;
+
+    if (!ptr)
+        return cgmem_alloc(size);
+    block = (struct cgmem_block *) ((char *) ptr - CGMEM_HEADER);
+    /* classes leave room to grow into */
+    if (size <= block->size)
+        return ptr;
+    out = cgmem_alloc(size);
+    if (!out)
+        return NULL;
+    memcpy(out, ptr, block->size < size ? block->size : size);
+    cgmem_free(ptr);
+    return out;
+}
+
+void cgmem_free(void *ptr)
+{
+    struct cgmem_block *block;
+
+    if (!ptr)
+        return;
+    block = (struct cgmem_block *) ((char *) ptr - CGMEM_HEADER);
+    if (!block->mapped) {
+        free(block);
+        return;
+    }
+    if (block->cls == CGMEM_FILE) {
+        munmap(block, block->mapped);
+        return;
+    }
+    pthread_mutex_lock(&cgmem_pool_lock);
+    if (cgmem_cached + block->mapped <= cgmem_cache_max) {
+        block->next = cgmem_idle[block->cls];
+        cgmem_idle[block->cls] = block;
+        cgmem_cached += block->mapped;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&cgmem_pool_lock);
+    if (block)
+        munmap(block, block->mapped);
+}
+
+/* gives every idle buffer back to the system */
+void cgmem_trim(void)
+{
+    struct cgmem_block *idle[CGMEM_CLASSES], *block;
+    unsigned int i;
+
+    pthread_mutex_lock(&cgmem_pool_lock);
+    memcpy(idle, cgmem_idle, sizeof idle);
+    memset(cgmem_idle, 0, sizeof cgmem_idle);
+    cgmem_cached = 0;
+    pthread_mutex_unlock(&cgmem_pool_lock);
+    for (i = 0; i < CGMEM_CLASSES; i++) {
+        while ((block = idle[i]) != NULL) {
+            idle[i] = block->next;
+            munmap(block, block->mapped);
+        }
+    }
+}
+
+void cgmem_buffer_stats(unsigned long *reused, unsigned long *mapped)
+{
+    pthread_mutex_lock(&cgmem_pool_lock);
+    *reused = cgmem_reused;
+    *mapped = cgmem_mapped;
+    pthread_mutex_unlock(&cgmem_pool_lock);
+}
+
+/* lodepng is built with LODEPNG_NO_COMPILE_ALLOCATORS and allocates here */
+void *lodepng_malloc(size_t size)
+{
+    return cgmem_alloc(size);
+}
+
+void *lodepng_realloc(void *ptr, size_t new_size)
+{
+    return cgmem_realloc(ptr, new_size);
+}
+
+void lodepng_free(void *ptr)
+{
+    cgmem_free(ptr);
+}
@@ -0,0 +1,32 @@
+#ifndef CGMEM_H_
+#define CGMEM_H_
+
+#include <stddef.h>
+
+/* bytes one owner holds against the memory budget */
+struct cgmem_hold {
+    size_t bytes;
+    unsigned long order; /* older owners go first */
+    struct cgmem_hold *prev, *next;
+};
+
+void cgmem_set_budget(size_t bytes);
+size_t cgmem_budget(void);
+size_t cgmem_peak(void);
+void cgmem_hold_init(struct cgmem_hold *hold, unsigned long order);
+void cgmem_acquire(struct cgmem_hold *hold, size_t bytes);
+void cgmem_adjust(struct cgmem_hold *hold, size_t bytes);
+void cgmem_release(struct cgmem_hold *hold);
+
+/* buffers start this far into their block, so whatever follows stays aligned for vector loads */
+#define CGMEM_HEADER 64
+
+void cgmem_set_huge_pages(int enable);
+void *cgmem_alloc(size_t size);
+void *cgmem_map_file(int fd, size_t size);
+void *cgmem_realloc(void *ptr, size_t size);
+void cgmem_free(void *ptr);
+void cgmem_trim(void);
+void cgmem_buffer_stats(unsigned long *reused, unsigned long *mapped);
+
+#endif /* CGMEM_H_ */
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE /* syscall, pwrite, O_CLOEXEC */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cgout.h"
+
+/* files one submission takes, each an open, write, close and rename */
+#define CGOUT_BATCH 16
+#define CGOUT_STEPS 4
+/* longest write a single entry is trusted with */
+#define CGOUT_MAX_WRITE 0x7FFFF000UL
+#define CGOUT_PATH 4096
+
+/*
+ * a ring per writing thread, set up on first use. every file is a linked
+ * chain on a direct descriptor, so a whole batch of files costs one
+ * io_uring_enter instead of a handful of blocking calls each.
+ */
+struct cgout_ring {
+    int fd;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static pthread_once_t cgout_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cgout_key;
+/* set once the kernel turns rings down, after which everyone writes plainly */
+static int cgout_plain = 0;
+static unsigned long cgout_tmp_count = 0;
+
+static void cgout_ring_free(void *ud)
+{
+    struct cgout_ring *ring = (struct cgout_ring *) ud;
+    if (!ring)
+        return;
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_len);
+    if (ring->sq_map)
+        munmap(ring->sq_map, ring->sq_len);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+}
+
+static void cgout_init(void)
+{
+    pthread_key_create(&cgout_key, cgout_ring_free);
+}
+
+static void *cgout_map(int fd, size_t len, off_t offset)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* whether the kernel knows every opcode a chain uses */
+static int cgout_ring_probe(struct cgout_ring *ring)
+{
+    static const unsigned char ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_RENAMEAT };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    unsigned int i;
+    int ok;
+
+    if (!probe)
+        return 0;
+    ok = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+    for (i = 0; ok && i < sizeof ops; i++)
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+static struct cgout_ring *cgout_ring_new(void)
+{
+    struct cgout_ring *ring = calloc(1, sizeof(struct cgout_ring));
+    struct io_uring_params p;
+    int files[CGOUT_BATCH];
+    unsigned int i;
+
+    if (!ring)
+        return NULL;
+    memset(&p, 0, sizeof p);
+    ring->fd = syscall(__NR_io_uring_setup, CGOUT_BATCH * CGOUT_STEPS, &p);
+    if (ring->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP))
+        goto fail;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_len > ring->sq_len)
+        ring->sq_len = ring->cq_len;
+    ring->sq_map = ring->cq_map = cgout_map(ring->fd, ring->sq_len, IORING_OFF_SQ_RING);
+    ring->cq_len = ring->sq_len;
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = cgout_map(ring->fd, ring->sqes_len, IORING_OFF_SQES);
+    if (!ring->sq_map || !ring->sqes)
+        goto fail;
+    ring->sq_head = (unsigned *) ((char *) ring->sq_map + p.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_map + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_map + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_map + p.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_map + p.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_map + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_map + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_map + p.cq_off.cqes);
+
+    /* every slot starts empty, each chain's open fills one */
+    for (i = 0; i < CGOUT_BATCH; i++)
+        files[i] = -1;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, CGOUT_BATCH) < 0
+            || !cgout_ring_probe(ring))
+        goto fail;
+    return ring;
+
+fail:
+    cgout_ring_free(ring);
+    return NULL;
+}
+
+/* the calling thread's ring, NULL when files are written plainly */
+static struct cgout_ring *cgout_ring(void)
+{
+    struct cgout_ring *ring;
+
+    if (__atomic_load_n(&cgout_plain, __ATOMIC_RELAXED))
+        return NULL;
+    pthread_once(&cgout_once, cgout_init);
+    ring = pthread_getspecific(cgout_key);
+    if (ring)
+        return ring;
+    ring = cgout_ring_new();
+    if (!ring)
+        __atomic_store_n(&cgout_plain, 1, __ATOMIC_RELAXED);
+    else
+        pthread_setspecific(cgout_key, ring);
+    return ring;
+}
+
+static struct io_uring_sqe *cgout_sqe(struct cgout_ring *ring, unsigned *tail, unsigned long user_data)
+{
+    unsigned idx = *tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = user_data;
+    ring->sq_array[idx] = idx;
+    (*tail)++;
+    return sqe;
+}
+
+/* one submission for count <= CGOUT_BATCH files, ok for each whose whole chain went through */
+static void cgout_ring_write(struct cgout_ring *ring, struct cgout_file *files, char *tmps, unsigned int count)
+{
+    int results[CGOUT_BATCH][CGOUT_STEPS];
+    unsigned tail = *ring->sq_tail, head;
+    unsigned int i, expected = count * CGOUT_STEPS, seen = 0;
+
+    for (i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe;
+        char *tmp = tmps + i * CGOUT_PATH;
+        results[i][0] = results[i][1] = results[i][2] = results[i][3] = -ECANCELED;
+
+        sqe = cgout_sqe(ring, &tail, i * CGOUT_STEPS + 0);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long) tmp;
+        sqe->len = 0644;
+        /* direct descriptors never reach a child, and refuse O_CLOEXEC */
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        sqe->file_index = i + 1;
+
+        sqe = cgout_sqe(ring, &tail, i * CGOUT_STEPS + 1);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+        sqe->fd = i;
+        sqe->addr = (unsigned long) files[i].data;
+        sqe->len = files[i].size;
+        sqe->off = 0;
+
+        sqe = cgout_sqe(ring, &tail, i * CGOUT_STEPS + 2);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->file_index = i + 1;
+
+        sqe = cgout_sqe(ring, &tail, i * CGOUT_STEPS + 3);
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long) tmp;
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (unsigned long) files[i].path;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (seen < expected) {
+        unsigned pending = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        unsigned cq_tail;
+        /*
+         * any other error may never clear, even with part of the batch in.
+         * what did not come back is written plainly, and the ring retired.
+         */
+        if (syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            break;
+        head = *ring->cq_head;
+        cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++, seen++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            unsigned long step = (unsigned long) cqe->user_data;
+            if (step < expected)
+                results[step / CGOUT_STEPS][step % CGOUT_STEPS] = cqe->res;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    /* a write is only whole when it covered everything */
+    for (i = 0; i < count; i++)
+        files[i].ok = results[i][0] >= 0 && results[i][1] == (int) files[i].size
+            && results[i][2] >= 0 && results[i][3] >= 0;
+    if (seen < expected || results[0][0] == -EINVAL || results[0][0] == -EBADF)
+        __atomic_store_n(&cgout_plain, 1, __ATOMIC_RELAXED);
+}
+
+static int cgout_write_plain(const char *tmp, const struct cgout_file *file)
+{
+    const char *p = (const char *) file->data;
+    size_t done = 0;
+    int fd, ok = 1;
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return 0;
+    while (done < file->size) {
+        ssize_t n = pwrite(fd, p + done, file->size - done, done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ok = 0;
+            break;
+        }
+        done += n;
+    }
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(tmp, file->path) == 0)
+        return 1;
+    unlink(tmp);
+    return 0;
+}
+
+/*
+ * writes every file under a name of its own next to it and renames it in,
+ * nothing is synced. goes through io_uring in batches where the kernel
+ * allows it, and through plain pwrite otherwise or for whatever the ring
+ * could not do.
+ */
+void cgout_write(struct cgout_file *files, unsigned int count)
+{
+    char *tmps = malloc(CGOUT_BATCH * CGOUT_PATH);
+    unsigned int i, j, n;
+
+    for (i = 0; i < count; i += n) {
+        struct cgout_ring *ring = tmps ? cgout_ring() : NULL;
+        n = count - i < CGOUT_BATCH ? count - i : CGOUT_BATCH;
+        for (j = 0; j < n; j++) {
+            char *tmp = tmps ? tmps + j * CGOUT_PATH : NULL;
+            files[i + j].ok = 0;
+            if (tmp)
+                snprintf(tmp, CGOUT_PATH, "%s.%lu.%lu.tmp", files[i + j].path, (unsigned long) getpid(),
+                        __atomic_add_fetch(&cgout_tmp_count, 1, __ATOMIC_RELAXED));
+            if (files[i + j].size > CGOUT_MAX_WRITE)
+                ring = NULL;
+        }
+        if (ring)
+            cgout_ring_write(ring, files + i, tmps, n);
+        for (j = 0; tmps && j < n; j++) {
+            char *tmp = tmps + j * CGOUT_PATH;
+            if (files[i + j].ok)
+                continue;
+            /* a chain cut short may have left its file behind */
+            if (ring)
+                unlink(tmp);
+            files[i + j].ok = cgout_write_plain(tmp, &files[i + j]);
+        }
+    }
+    free(tmps);
+}
+
+int cgout_save(const char *path, const void *data, size_t size)
+{
+    struct cgout_file file;
+    file.path = path;
+    file.data = data;
+    file.size = size;
+    cgout_write(&file, 1);
+    return file.ok;
+}
+
+/*
+ * for what is written as it is made rather than from memory: the fd of a
+ * file named into tmp next to path, -1 on failure. cgout_commit puts it
+ * in place.
+ */
+int cgout_open(const char *path, char *tmp, size_t size)
+{
+    snprintf(tmp, size, "%s.%lu.%lu.tmp", path, (unsigned long) getpid(),
+            __atomic_add_fetch(&cgout_tmp_count, 1, __ATOMIC_RELAXED));
+    return open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/* closes fd and renames tmp over path if ok so far, returns whether it was */
+int cgout_commit(int fd, const char *tmp, const char *path, int ok)
+{
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(tmp, path) == 0)
+        return 1;
+    unlink(tmp);
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef CGOUT_H_
+#define CGOUT_H_
+
+#include <stddef.h>
+
+/* one output, renamed over path once all of data is written */
+struct cgout_file {
+    const char *path;
+    const void *data;
+    size_t size;
+    int ok; /* set by cgout_write */
+};
+
+void cgout_write(struct cgout_file *files, unsigned int count);
+int cgout_save(const char *path, const void *data, size_t size);
+int cgout_open(const char *path, char *tmp, size_t size);
+int cgout_commit(int fd, const char *tmp, const char *path, int ok);
+
+#endif /* CGOUT_H_ */
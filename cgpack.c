@@ -0,0 +1,406 @@
+#define _GNU_SOURCE /* snprintf, pwrite, O_CLOEXEC */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cgpack.h"
+
+#define CGPACK_MAGIC "cgrippak"
+#define CGPACK_VERSION 1
+#define CGPACK_HEADER 64
+#define CGPACK_ENTRY 96
+#define CGPACK_ID 64
+/* payloads and the index start on a page of their own */
+#define CGPACK_ALIGN 4096
+
+/*
+ * every map of a run in one file, all little endian:
+ *
+ *   0  "cgrippak"
+ *   8  version, entry count (32 bit each)
+ *  16  offset of the index (64 bit)
+ *  24  size of an entry, alignment (32 bit each)
+ *  32  zeroes up to the first payload at CGPACK_ALIGN
+ *
+ * followed by the payloads, each aligned, and the index: one entry per
+ * map, sorted by material and map, so it can be searched in place.
+ *
+ *   0  material id, zero padded to CGPACK_ID
+ *  64  map, format, width, height (32 bit each)
+ *  80  offset, size (64 bit each)
+ */
+struct cgpack {
+    unsigned char *map;
+    size_t size;
+    const unsigned char *index;
+    unsigned int count;
+};
+
+/* an entry while the pack is written, before its index is */
+struct cgpack_item {
+    char id[CGPACK_ID];
+    unsigned long map, format, width, height;
+    size_t offset, size;
+    unsigned long seq; /* order added in, the last of a map wins */
+};
+
+struct cgpack_writer {
+    char *path, *tmp;
+    int fd;
+    const struct cgpack *old; /* what materials not written again are kept from */
+    pthread_mutex_t lock;
+    struct cgpack_item *items;
+    unsigned int count, cap;
+    size_t end; /* where the next payload goes */
+    int failed;
+};
+
+static unsigned long cgpack_tmp_count = 0;
+
+static void cgpack_put32(unsigned char *p, unsigned long v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static void cgpack_put64(unsigned char *p, size_t v)
+{
+    cgpack_put32(p, v & 0xFFFFFFFFUL);
+    cgpack_put32(p + 4, v >> 16 >> 16);
+}
+
+static unsigned long cgpack_get32(const unsigned char *p)
+{
+    return p[0] | (unsigned long) p[1] << 8 | (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+static size_t cgpack_get64(const unsigned char *p)
+{
+    return cgpack_get32(p) | (size_t) cgpack_get32(p + 4) << 16 << 16;
+}
+
+static size_t cgpack_align(size_t n)
+{
+    return (n + CGPACK_ALIGN - 1) & ~(size_t) (CGPACK_ALIGN - 1);
+}
+
+/* the whole of a pack mapped in, NULL when it is missing or no pack */
+struct cgpack *cgpack_open(const char *path)
+{
+    struct cgpack *pack;
+    struct stat st;
+    size_t offset;
+    void *p;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < CGPACK_HEADER) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (!(pack = malloc(sizeof(struct cgpack)))) {
+        munmap(p, st.st_size);
+        return NULL;
+    }
+    pack->map = p;
+    pack->size = st.st_size;
+    pack->count = cgpack_get32(pack->map + 12);
+    offset = cgpack_get64(pack->map + 16);
+    if (memcmp(pack->map, CGPACK_MAGIC, 8) || cgpack_get32(pack->map + 8) != CGPACK_VERSION
+            || cgpack_get32(pack->map + 24) != CGPACK_ENTRY || offset < CGPACK_HEADER
+            || offset > pack->size || pack->count > (pack->size - offset) / CGPACK_ENTRY) {
+        cgpack_free(pack);
+        return NULL;
+    }
+    pack->index = pack->map + offset;
+    return pack;
+}
+
+unsigned int cgpack_count(const struct cgpack *pack)
+{
+    return pack->count;
+}
+
+/* entry i in index order, 0 when it points outside the pack */
+int cgpack_entry(const struct cgpack *pack, unsigned int i, struct cgpack_entry *entry)
+{
+    const unsigned char *p = pack->index + (size_t) i * CGPACK_ENTRY;
+    size_t offset, size;
+
+    if (i >= pack->count || p[CGPACK_ID - 1])
+        return 0;
+    offset = cgpack_get64(p + 80);
+    size = cgpack_get64(p + 88);
+    if (offset > pack->size || size > pack->size - offset)
+        return 0;
+    entry->id = (const char *) p;
+    entry->map = cgpack_get32(p + 64);
+    entry->format = cgpack_get32(p + 68);
+    entry->width = cgpack_get32(p + 72);
+    entry->height = cgpack_get32(p + 76);
+    entry->data = pack->map + offset;
+    entry->size = size;
+    return 1;
+}
+
+static int cgpack_compare(const char *id, unsigned long map, const unsigned char *p)
+{
+    int c = strncmp(id, (const char *) p, CGPACK_ID);
+    if (c)
+        return c;
+    return map < cgpack_get32(p + 64) ? -1 : map > cgpack_get32(p + 64);
+}
+
+/* the first entry at or past id's map */
+static unsigned int cgpack_lower(const struct cgpack *pack, const char *id, unsigned long map)
+{
+    unsigned int lo = 0, hi = pack->count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (cgpack_compare(id, map, pack->index + (size_t) mid * CGPACK_ENTRY) > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int cgpack_find(const struct cgpack *pack, const char *id, unsigned int map, struct cgpack_entry *entry)
+{
+    unsigned int i = cgpack_lower(pack, id, map);
+    if (i >= pack->count || cgpack_compare(id, map, pack->index + (size_t) i * CGPACK_ENTRY))
+        return 0;
+    return cgpack_entry(pack, i, entry);
+}
+
+/* whether any map of material id is in the pack */
+int cgpack_has(const struct cgpack *pack, const char *id)
+{
+    unsigned int i = cgpack_lower(pack, id, 0);
+    return i < pack->count && !strncmp(id, (const char *) pack->index + (size_t) i * CGPACK_ENTRY, CGPACK_ID);
+}
+
+void cgpack_free(struct cgpack *pack)
+{
+    if (!pack)
+        return;
+    munmap(pack->map, pack->size);
+    free(pack);
+}
+
+static int cgpack_pwrite(int fd, const void *data, size_t size, size_t offset)
+{
+    const char *p = (const char *) data;
+    while (size) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 1;
+}
+
+/*
+ * a pack written aside and renamed over path by cgpack_save. whatever of
+ * old belongs to materials that are not added again is kept, so a pack
+ * collects maps across runs the way an output dir does.
+ */
+struct cgpack_writer *cgpack_create(const char *path, const struct cgpack *old)
+{
+    struct cgpack_writer *w = calloc(1, sizeof(struct cgpack_writer));
+    size_t len = strlen(path);
+
+    if (!w)
+        return NULL;
+    pthread_mutex_init(&w->lock, NULL);
+    w->fd = -1;
+    w->path = malloc(len + 1);
+    w->tmp = malloc(len + 48);
+    if (!w->path || !w->tmp) {
+        cgpack_writer_free(w);
+        return NULL;
+    }
+    strcpy(w->path, path);
+    snprintf(w->tmp, len + 48, "%s.%lu.%lu.tmp", path, (unsigned long) getpid(),
+            __atomic_add_fetch(&cgpack_tmp_count, 1, __ATOMIC_RELAXED));
+    if ((w->fd = open(w->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        cgpack_writer_free(w);
+        return NULL;
+    }
+    w->old = old;
+    w->end = CGPACK_ALIGN;
+    return w;
+}
+
+/* appends a map, safe to call from any thread */
+int cgpack_add(struct cgpack_writer *w, const char *id, unsigned int map, unsigned int format,
+        unsigned int width, unsigned int height, const void *data, size_t size)
+{
+    struct cgpack_item *item;
+    size_t offset;
+
+    if (strlen(id) >= CGPACK_ID)
+        return 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->cap) {
+        unsigned int cap = w->cap ? w->cap * 2 : 64;
+        struct cgpack_item *items = realloc(w->items, cap * sizeof(struct cgpack_item));
+        if (!items) {
+            pthread_mutex_unlock(&w->lock);
+            return 0;
+        }
+        w->items = items;
+        w->cap = cap;
+    }
+    item = &w->items[w->count];
+    memset(item->id, 0, sizeof item->id);
+    strcpy(item->id, id);
+    item->map = map;
+    item->format = format;
+    item->width = width;
+    item->height = height;
+    item->offset = offset = w->end;
+    item->size = size;
+    item->seq = w->count++;
+    w->end = cgpack_align(w->end + size);
+    pthread_mutex_unlock(&w->lock);
+
+    /* the space is reserved, so payloads go in side by side */
+    if (!cgpack_pwrite(w->fd, data, size, offset)) {
+        __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+static int cgpack_item_compare(const void *a, const void *b)
+{
+    const struct cgpack_item *x = (const struct cgpack_item *) a, *y = (const struct cgpack_item *) b;
+    int c = strcmp(x->id, y->id);
+    if (c)
+        return c;
+    if (x->map != y->map)
+        return x->map < y->map ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* whether a material was added, items sorted up to count */
+static int cgpack_added(const struct cgpack_item *items, unsigned int count, const char *id)
+{
+    unsigned int lo = 0, hi = count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        int c = strcmp(id, items[mid].id);
+        if (!c)
+            return 1;
+        if (c > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+/* old's maps of materials not added this time, put after the new ones */
+static int cgpack_keep_old(struct cgpack_writer *w)
+{
+    unsigned int added = w->count, i;
+    struct cgpack_entry e;
+
+    for (i = 0; w->old && i < cgpack_count(w->old); i++) {
+        if (!cgpack_entry(w->old, i, &e) || cgpack_added(w->items, added, e.id))
+            continue;
+        if (!cgpack_add(w, e.id, e.map, e.format, e.width, e.height, e.data, e.size))
+            return 0;
+    }
+    if (w->count > added)
+        qsort(w->items, w->count, sizeof(struct cgpack_item), cgpack_item_compare);
+    return 1;
+}
+
+/* writes the index and header and renames the pack in, 0 on failure */
+int cgpack_save(struct cgpack_writer *w)
+{
+    unsigned char head[CGPACK_HEADER], *index = NULL;
+    unsigned int i, n;
+    int ok;
+
+    if (w->fd < 0 || __atomic_load_n(&w->failed, __ATOMIC_RELAXED))
+        return 0;
+    qsort(w->items, w->count, sizeof(struct cgpack_item), cgpack_item_compare);
+    /* a map added twice is kept as it was last */
+    for (i = n = 0; i < w->count; i++) {
+        if (i + 1 < w->count && !strcmp(w->items[i].id, w->items[i + 1].id) && w->items[i].map == w->items[i + 1].map)
+            continue;
+        w->items[n++] = w->items[i];
+    }
+    w->count = n;
+    ok = cgpack_keep_old(w);
+
+    if (ok && (!w->count || (index = calloc(w->count, CGPACK_ENTRY)) != NULL)) {
+        for (i = 0; i < w->count; i++) {
+            unsigned char *p = index + (size_t) i * CGPACK_ENTRY;
+            memcpy(p, w->items[i].id, CGPACK_ID);
+            cgpack_put32(p + 64, w->items[i].map);
+            cgpack_put32(p + 68, w->items[i].format);
+            cgpack_put32(p + 72, w->items[i].width);
+            cgpack_put32(p + 76, w->items[i].height);
+            cgpack_put64(p + 80, w->items[i].offset);
+            cgpack_put64(p + 88, w->items[i].size);
+        }
+        memset(head, 0, sizeof head);
+        memcpy(head, CGPACK_MAGIC, 8);
+        cgpack_put32(head + 8, CGPACK_VERSION);
+        cgpack_put32(head + 12, w->count);
+        cgpack_put64(head + 16, w->end);
+        cgpack_put32(head + 24, CGPACK_ENTRY);
+        cgpack_put32(head + 28, CGPACK_ALIGN);
+        /* the header last, so a pack cut short is never taken for one */
+        ok = cgpack_pwrite(w->fd, index, (size_t) w->count * CGPACK_ENTRY, w->end)
+            && cgpack_pwrite(w->fd, head, sizeof head, 0);
+    } else {
+        ok = 0;
+    }
+    free(index);
+    ok = close(w->fd) == 0 && ok;
+    w->fd = -1;
+    if (ok && rename(w->tmp, w->path) == 0)
+        return 1;
+    unlink(w->tmp);
+    return 0;
+}
+
+/* a writer never saved leaves nothing behind */
+void cgpack_writer_free(struct cgpack_writer *w)
+{
+    if (!w)
+        return;
+    if (w->fd >= 0) {
+        close(w->fd);
+        unlink(w->tmp);
+    }
+    pthread_mutex_destroy(&w->lock);
+    free(w->items);
+    free(w->path);
+    free(w->tmp);
+    free(w);
+}
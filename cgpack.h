@@ -0,0 +1,42 @@
+#ifndef CGPACK_H_
+#define CGPACK_H_
+
+#include <stddef.h>
+
+/* how an entry's bytes are encoded */
+enum cgpack_format {
+    cgpack_format_png = 1,
+    cgpack_format_qoi = 2,
+    cgpack_format_dds = 3,
+    cgpack_format_ktx2 = 4
+};
+
+/* one map of a pack, pointing into its mapping */
+struct cgpack_entry {
+    const char *id; /* material */
+    unsigned int map; /* enum cgapi_matmap */
+    unsigned int format; /* enum cgpack_format */
+    unsigned int width, height;
+    const unsigned char *data;
+    size_t size;
+};
+
+struct cgpack;
+struct cgpack_writer;
+
+/* reading */
+struct cgpack *cgpack_open(const char *path);
+unsigned int cgpack_count(const struct cgpack *pack);
+int cgpack_entry(const struct cgpack *pack, unsigned int i, struct cgpack_entry *entry);
+int cgpack_find(const struct cgpack *pack, const char *id, unsigned int map, struct cgpack_entry *entry);
+int cgpack_has(const struct cgpack *pack, const char *id);
+void cgpack_free(struct cgpack *pack);
+
+/* writing */
+struct cgpack_writer *cgpack_create(const char *path, const struct cgpack *old);
+int cgpack_add(struct cgpack_writer *w, const char *id, unsigned int map, unsigned int format,
+        unsigned int width, unsigned int height, const void *data, size_t size);
+int cgpack_save(struct cgpack_writer *w);
+void cgpack_writer_free(struct cgpack_writer *w);
+
+#endif /* CGPACK_H_ */
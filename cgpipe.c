@@ -0,0 +1,317 @@
+
+#include <stdlib.h>
+
+#include "cgpipe.h"
+
+int cgpipe_queue_init(struct cgpipe_queue *q, unsigned int cap)
+{
+    q->items = malloc(cap * sizeof(void *));
+    if (!q->items)
+        return 0;
+    q->cap = cap;
+    q->head = q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 1;
+}
+
+void cgpipe_queue_push(struct cgpipe_queue *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count++) % q->cap] = item;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* NULL once the queue is closed and drained */
+void *cgpipe_queue_pop(struct cgpipe_queue *q)
+{
+    void *item = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+void cgpipe_queue_close(struct cgpipe_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void cgpipe_queue_destroy(struct cgpipe_queue *q)
+{
+    free(q->items);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+struct cgpipe_handback {
+    void *item;
+    int ok;
+};
+
+/*
+ * an async stage takes two threads however many items it has going: one
+ * starts items as slots free up, the other passes on what cgpipe_finish
+ * handed back. finishing never waits, so it is fine from an event loop.
+ */
+struct cgpipe_async {
+    struct cgpipe_handback *finished; /* ring of limit, never more are out */
+    unsigned int limit, outstanding, head, count;
+    int started_all;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+struct cgpipe_worker {
+    struct cgpipe_stage *stage;
+    struct cgpipe_queue *in, *out;
+    unsigned int *running; /* workers of this stage still going */
+    struct cgpipe_async *async; /* for both threads of an async stage */
+    void (*done)(void *item);
+    pthread_t thread;
+};
+
+static void *cgpipe_worker_run(void *ud)
+{
+    struct cgpipe_worker *w = (struct cgpipe_worker *) ud;
+    void *item;
+    while ((item = cgpipe_queue_pop(w->in)) != NULL) {
+        if (!w->stage->fn(item, w->stage->ud))
+            w->done(item);
+        else if (w->out)
+            cgpipe_queue_push(w->out, item);
+        else
+            w->done(item);
+    }
+    /* the last worker out closes the way for the next stage */
+    if (__atomic_sub_fetch(w->running, 1, __ATOMIC_ACQ_REL) == 0 && w->out)
+        cgpipe_queue_close(w->out);
+    return NULL;
+}
+
+static int cgpipe_async_init(struct cgpipe_async *a, unsigned int limit)
+{
+    a->finished = malloc(limit * sizeof(struct cgpipe_handback));
+    if (!a->finished)
+        return 0;
+    a->limit = limit;
+    a->outstanding = a->head = a->count = 0;
+    a->started_all = 0;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->changed, NULL);
+    return 1;
+}
+
+static void cgpipe_async_destroy(struct cgpipe_async *a)
+{
+    free(a->finished);
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->changed);
+}
+
+/* one item fewer out, wakes both sides */
+static void cgpipe_async_settle(struct cgpipe_async *a)
+{
+    pthread_mutex_lock(&a->lock);
+    a->outstanding--;
+    pthread_cond_broadcast(&a->changed);
+    pthread_mutex_unlock(&a->lock);
+}
+
+static void cgpipe_async_close(struct cgpipe_async *a)
+{
+    pthread_mutex_lock(&a->lock);
+    a->started_all = 1;
+    pthread_cond_broadcast(&a->changed);
+    pthread_mutex_unlock(&a->lock);
+}
+
+static void *cgpipe_async_start(void *ud)
+{
+    struct cgpipe_worker *w = (struct cgpipe_worker *) ud;
+    struct cgpipe_async *a = w->async;
+    void *item;
+    while ((item = cgpipe_queue_pop(w->in)) != NULL) {
+        pthread_mutex_lock(&a->lock);
+        while (a->outstanding >= a->limit)
+            pthread_cond_wait(&a->changed, &a->lock);
+        a->outstanding++;
+        pthread_mutex_unlock(&a->lock);
+        if (!w->stage->start(item, w->stage->ud, a)) {
+            cgpipe_async_settle(a);
+            w->done(item);
+        }
+    }
+    cgpipe_async_close(a);
+    return NULL;
+}
+
+static void *cgpipe_async_pass(void *ud)
+{
+    struct cgpipe_worker *w = (struct cgpipe_worker *) ud;
+    struct cgpipe_async *a = w->async;
+    struct cgpipe_handback h;
+
+    pthread_mutex_lock(&a->lock);
+    for (;;) {
+        while (a->count == 0 && !(a->started_all && a->outstanding == 0))
+            pthread_cond_wait(&a->changed, &a->lock);
+        if (a->count == 0)
+            break;
+        h = a->finished[a->head];
+        a->head = (a->head + 1) % a->limit;
+        a->count--;
+        pthread_mutex_unlock(&a->lock);
+        if (h.ok && w->out)
+            cgpipe_queue_push(w->out, h.item);
+        else
+            w->done(h.item);
+        pthread_mutex_lock(&a->lock);
+        a->outstanding--;
+        pthread_cond_broadcast(&a->changed);
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (w->out)
+        cgpipe_queue_close(w->out);
+    return NULL;
+}
+
+/* ends an item an async stage started, ok passes it on */
+void cgpipe_finish(struct cgpipe_async *async, void *item, int ok)
+{
+    struct cgpipe_handback *h;
+    pthread_mutex_lock(&async->lock);
+    h = &async->finished[(async->head + async->count++) % async->limit];
+    h->item = item;
+    h->ok = ok;
+    pthread_cond_broadcast(&async->changed);
+    pthread_mutex_unlock(&async->lock);
+}
+
+/*
+ * runs every item through the stages in order, with stage->workers threads
+ * per stage, and at most depth items waiting between two stages. done is
+ * called on each item once it leaves the pipeline, whether it got to the
+ * end or not. a stage with start instead of fn has up to stage->inflight
+ * items going on its own, each passed on once cgpipe_finish is called.
+ */
+int cgpipe_run(struct cgpipe_stage *stages, int stage_count, void **items, int item_count, unsigned int depth, void (*done)(void *item))
+{
+    struct cgpipe_queue *queues;
+    struct cgpipe_async *asyncs;
+    struct cgpipe_worker *workers;
+    unsigned int *running;
+    int i, worker_count = 0, started = 0, ok = 1;
+
+    if (stage_count <= 0)
+        return 1;
+    for (i = 0; i < stage_count; i++)
+        worker_count += stages[i].start ? 2 : stages[i].workers > 0 ? stages[i].workers : 1;
+    queues = calloc(stage_count, sizeof(struct cgpipe_queue));
+    asyncs = calloc(stage_count, sizeof(struct cgpipe_async));
+    running = calloc(stage_count, sizeof(unsigned int));
+    workers = calloc(worker_count, sizeof(struct cgpipe_worker));
+    if (!queues || !asyncs || !running || !workers) {
+        free(queues);
+        free(asyncs);
+        free(running);
+        free(workers);
+        return 0;
+    }
+    for (i = 0; i < stage_count; i++) {
+        if (!cgpipe_queue_init(&queues[i], depth > 0 ? depth : 1))
+            break;
+        if (stages[i].start && !cgpipe_async_init(&asyncs[i], stages[i].inflight > 0 ? stages[i].inflight : 1)) {
+            cgpipe_queue_destroy(&queues[i]);
+            break;
+        }
+    }
+    if (i < stage_count) {
+        while (i-- > 0) {
+            cgpipe_queue_destroy(&queues[i]);
+            if (stages[i].start)
+                cgpipe_async_destroy(&asyncs[i]);
+        }
+        free(queues);
+        free(asyncs);
+        free(running);
+        free(workers);
+        return 0;
+    }
+
+    for (i = 0; i < stage_count; i++)
+        running[i] = stages[i].workers > 0 ? stages[i].workers : 1;
+    for (i = 0; ok && i < stage_count; i++) {
+        unsigned int j;
+        if (stages[i].start) {
+            struct cgpipe_worker *pass = &workers[started], *start = &workers[started + 1];
+            pass->stage = start->stage = &stages[i];
+            pass->in = start->in = &queues[i];
+            pass->out = start->out = i + 1 < stage_count ? &queues[i + 1] : NULL;
+            pass->async = start->async = &asyncs[i];
+            pass->done = start->done = done;
+            if (pthread_create(&pass->thread, NULL, cgpipe_async_pass, pass)) {
+                ok = 0;
+                break;
+            }
+            started++;
+            if (pthread_create(&start->thread, NULL, cgpipe_async_start, start)) {
+                /* nothing was started, so the passing side just leaves */
+                cgpipe_async_close(&asyncs[i]);
+                ok = 0;
+                break;
+            }
+            started++;
+            continue;
+        }
+        for (j = 0; j < running[i]; j++) {
+            struct cgpipe_worker *w = &workers[started];
+            w->stage = &stages[i];
+            w->in = &queues[i];
+            w->out = i + 1 < stage_count ? &queues[i + 1] : NULL;
+            w->running = &running[i];
+            w->done = done;
+            if (pthread_create(&w->thread, NULL, cgpipe_worker_run, w)) {
+                /* nothing is pushed, so the started ones only wait for the close */
+                running[i] = j;
+                ok = 0;
+                break;
+            }
+            started++;
+        }
+    }
+
+    if (ok)
+        for (i = 0; i < item_count; i++)
+            cgpipe_queue_push(&queues[0], items[i]);
+    cgpipe_queue_close(&queues[0]);
+
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    for (i = 0; i < stage_count; i++) {
+        cgpipe_queue_destroy(&queues[i]);
+        if (stages[i].start)
+            cgpipe_async_destroy(&asyncs[i]);
+    }
+    free(queues);
+    free(asyncs);
+    free(running);
+    free(workers);
+    return ok;
+}
@@ -0,0 +1,42 @@
+#ifndef CGPIPE_H_
+#define CGPIPE_H_
+
+#include <pthread.h>
+
+/* blocking fifo of fixed capacity, closed once the producer is done */
+struct cgpipe_queue {
+    void **items;
+    unsigned int cap, head, count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+};
+
+/* returns 0 to drop the item instead of passing it on */
+typedef int (*cgpipe_fn)(void *item, void *ud);
+
+/* hands the items of an async stage back, from whichever thread */
+struct cgpipe_async;
+
+/* starts on item and returns, or returns 0 to drop it without cgpipe_finish */
+typedef int (*cgpipe_start_fn)(void *item, void *ud, struct cgpipe_async *async);
+
+struct cgpipe_stage {
+    const char *name;
+    cgpipe_fn fn;
+    void *ud;
+    unsigned int workers; /* threads on this stage, 0 means 1 */
+    cgpipe_start_fn start; /* instead of fn, for work that goes on elsewhere */
+    unsigned int inflight; /* items start has going at once, 0 means 1 */
+};
+
+int cgpipe_queue_init(struct cgpipe_queue *q, unsigned int cap);
+void cgpipe_queue_push(struct cgpipe_queue *q, void *item);
+void *cgpipe_queue_pop(struct cgpipe_queue *q);
+void cgpipe_queue_close(struct cgpipe_queue *q);
+void cgpipe_queue_destroy(struct cgpipe_queue *q);
+
+void cgpipe_finish(struct cgpipe_async *async, void *item, int ok);
+int cgpipe_run(struct cgpipe_stage *stages, int stage_count, void **items, int item_count, unsigned int depth, void (*done)(void *item));
+
+#endif /* CGPIPE_H_ */
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE /* snprintf, pread */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef CGRIP_LZ4
+#include <lz4.h>
+#endif
+
+#include "cgmem.h"
+#include "cgpix.h"
+#include "cgstore.h"
+
+/*
+ * the header is exactly as long as cgmem's, so an uncompressed file maps
+ * in whole with its pixels right where a buffer's data goes.
+ */
+#define CGPIX_HEADER CGMEM_HEADER
+#define CGPIX_MAGIC "cgrippix"
+#define CGPIX_VERSION 1
+
+enum cgpix_format {
+    cgpix_format_rgba8 = 1
+};
+
+enum cgpix_codec {
+    cgpix_codec_none,
+    cgpix_codec_lz4
+};
+
+/*
+ * decoded maps by a key of their encoded bytes, one file each:
+ *
+ *   0  "cgrippix"
+ *   8  version, format, width, height, codec (32 bit little endian each)
+ *  28  unused
+ *  32  bytes stored after the header (64 bit little endian)
+ *  40  zeroes up to the pixels at CGPIX_HEADER
+ */
+struct cgpix {
+    char *dir;
+    int lz4;
+};
+
+static unsigned long cgpix_tmp_count = 0;
+
+static void cgpix_put32(unsigned char *p, unsigned long v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static unsigned long cgpix_get32(const unsigned char *p)
+{
+    return p[0] | (unsigned long) p[1] << 8 | (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+/* lz4 is only used when built with CGRIP_LZ4 */
+struct cgpix *cgpix_open(const char *dir, int lz4)
+{
+    struct cgpix *pix = malloc(sizeof(struct cgpix));
+    if (!pix)
+        return NULL;
+    pix->dir = malloc(strlen(dir) + 1);
+    if (!pix->dir) {
+        free(pix);
+        return NULL;
+    }
+    strcpy(pix->dir, dir);
+    if (!cgstore_mkdirs(pix->dir)) {
+        free(pix->dir);
+        free(pix);
+        return NULL;
+    }
+#ifdef CGRIP_LZ4
+    pix->lz4 = lz4;
+#else
+    pix->lz4 = 0;
+#endif
+    return pix;
+}
+
+static void cgpix_path(struct cgpix *pix, unsigned long key, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/%016lx.pix", pix->dir, key);
+}
+
+#ifdef CGRIP_LZ4
+static unsigned char *cgpix_inflate(int fd, size_t file_size, size_t raw)
+{
+    unsigned char *data, *p;
+    int n;
+
+    if (raw > (size_t) LZ4_MAX_INPUT_SIZE)
+        return NULL;
+    p = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    data = cgmem_alloc(raw);
+    if (data) {
+        n = LZ4_decompress_safe((const char *) p + CGPIX_HEADER, (char *) data, file_size - CGPIX_HEADER, raw);
+        if (n < 0 || (size_t) n != raw) {
+            cgmem_free(data);
+            data = NULL;
+        }
+    }
+    munmap(p, file_size);
+    return data;
+}
+#endif
+
+/*
+ * the map decoded under key into data, a cgmem buffer. uncompressed ones
+ * are mapped from the file rather than read. returns 0 on a miss.
+ */
+int cgpix_load(struct cgpix *pix, unsigned long key, unsigned char **data, unsigned int *width, unsigned int *height)
+{
+    char path[4096];
+    unsigned char head[CGPIX_HEADER];
+    unsigned long w, h, codec;
+    size_t raw, stored;
+    struct stat st;
+    int fd;
+
+    cgpix_path(pix, key, path, sizeof path);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    *data = NULL;
+    if (pread(fd, head, sizeof head, 0) != sizeof head || fstat(fd, &st) != 0
+            || memcmp(head, CGPIX_MAGIC, 8) || cgpix_get32(head + 8) != CGPIX_VERSION
+            || cgpix_get32(head + 12) != cgpix_format_rgba8)
+        goto out;
+    w = cgpix_get32(head + 16);
+    h = cgpix_get32(head + 20);
+    codec = cgpix_get32(head + 24);
+    stored = cgpix_get32(head + 32) | (size_t) cgpix_get32(head + 36) << 16 << 16;
+    raw = (size_t) w * h * 4;
+    /* anything cut short is just a miss */
+    if (!w || !h || (size_t) st.st_size != CGPIX_HEADER + stored)
+        goto out;
+    if (codec == cgpix_codec_none && stored == raw)
+        *data = cgmem_map_file(fd, st.st_size);
+#ifdef CGRIP_LZ4
+    else if (codec == cgpix_codec_lz4)
+        *data = cgpix_inflate(fd, st.st_size, raw);
+#endif
+    if (*data) {
+        *width = w;
+        *height = h;
+    }
+out:
+    close(fd);
+    return *data != NULL;
+}
+
+/* written aside and renamed in, so a reader never sees half of it */
+void cgpix_save(struct cgpix *pix, unsigned long key, const unsigned char *data, unsigned int width, unsigned int height)
+{
+    char path[4096], tmp[4096];
+    unsigned char head[CGPIX_HEADER];
+    const unsigned char *out = data;
+    size_t raw = (size_t) width * height * 4, stored = raw;
+    enum cgpix_codec codec = cgpix_codec_none;
+    char *packed = NULL;
+    FILE *fp;
+    int ok;
+
+    cgpix_path(pix, key, path, sizeof path);
+    if (access(path, F_OK) == 0)
+        return;
+    snprintf(tmp, sizeof tmp, "%s.%lu.%lu.tmp", path, (unsigned long) getpid(),
+            __atomic_add_fetch(&cgpix_tmp_count, 1, __ATOMIC_RELAXED));
+
+#ifdef CGRIP_LZ4
+    if (pix->lz4 && raw <= (size_t) LZ4_MAX_INPUT_SIZE
+            && (packed = malloc(LZ4_compressBound(raw))) != NULL) {
+        int n = LZ4_compress_default((const char *) data, packed, raw, LZ4_compressBound(raw));
+        /* maps that hardly shrink are worth more mapped straight in */
+        if (n > 0 && (size_t) n < raw - raw / 8) {
+            out = (const unsigned char *) packed;
+            stored = n;
+            codec = cgpix_codec_lz4;
+        }
+    }
+#endif
+
+    memset(head, 0, sizeof head);
+    memcpy(head, CGPIX_MAGIC, 8);
+    cgpix_put32(head + 8, CGPIX_VERSION);
+    cgpix_put32(head + 12, cgpix_format_rgba8);
+    cgpix_put32(head + 16, width);
+    cgpix_put32(head + 20, height);
+    cgpix_put32(head + 24, codec);
+    cgpix_put32(head + 32, stored & 0xFFFFFFFFUL);
+    cgpix_put32(head + 36, stored >> 16 >> 16);
+
+    if ((fp = fopen(tmp, "wb")) != NULL) {
+        ok = fwrite(head, 1, sizeof head, fp) == sizeof head && fwrite(out, 1, stored, fp) == stored;
+        ok = fclose(fp) == 0 && ok;
+        if (!ok || rename(tmp, path) != 0)
+            remove(tmp);
+    }
+    free(packed);
+}
+
+void cgpix_free(struct cgpix *pix)
+{
+    if (!pix)
+        return;
+    free(pix->dir);
+    free(pix);
+}
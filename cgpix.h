@@ -0,0 +1,11 @@
+#ifndef CGPIX_H_
+#define CGPIX_H_
+
+struct cgpix;
+
+struct cgpix *cgpix_open(const char *dir, int lz4);
+int cgpix_load(struct cgpix *pix, unsigned long key, unsigned char **data, unsigned int *width, unsigned int *height);
+void cgpix_save(struct cgpix *pix, unsigned long key, const unsigned char *data, unsigned int width, unsigned int height);
+void cgpix_free(struct cgpix *pix);
+
+#endif /* CGPIX_H_ */
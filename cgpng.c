@@ -0,0 +1,719 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "cgpng.h"
+
+/* compressed bytes an IDAT chunk holds before it is handed on */
+#define CGPNG_IDAT 65536
+/* colors a palette takes, and the slots they are looked up in */
+#define CGPNG_COLORS 256
+#define CGPNG_SLOTS 1024
+
+enum cgpng_type {
+    cgpng_type_gray = 0,
+    cgpng_type_rgb = 2,
+    cgpng_type_palette = 3,
+    cgpng_type_gray_alpha = 4,
+    cgpng_type_rgba = 6
+};
+
+/* the distinct colors of an image, as long as there are few enough */
+struct cgpng_colors {
+    unsigned long keys[CGPNG_SLOTS];
+    short index[CGPNG_SLOTS]; /* into palette, -1 for an empty slot */
+    unsigned char palette[CGPNG_COLORS * 4];
+    unsigned int count;
+};
+
+/*
+ * one png on its way out. deflate writes straight into chunk after room
+ * for the length and type, so a full IDAT goes to the sink in one piece.
+ */
+struct cgpng_encoder {
+    cgformat_sink sink;
+    void *ud;
+    z_stream z;
+    unsigned char *chunk;
+    struct cgpng_colors *colors; /* the palette, when type is one */
+    unsigned char *rows, *prev, *cur, *best, *attempt;
+    unsigned int width;
+    size_t stride, bpp;
+    int type, depth, filter;
+};
+
+static void cgpng_put32(unsigned char *p, unsigned long v)
+{
+    p[0] = (v >> 24) & 0xFF;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+static unsigned int cgpng_slot(unsigned long key)
+{
+    return ((key * 2654435761UL) >> 13) & (CGPNG_SLOTS - 1);
+}
+
+/* index of color key, -1 when it is not in */
+static int cgpng_color_find(const struct cgpng_colors *c, unsigned long key)
+{
+    unsigned int i = cgpng_slot(key);
+    while (c->index[i] >= 0) {
+        if (c->keys[i] == key)
+            return c->index[i];
+        i = (i + 1) & (CGPNG_SLOTS - 1);
+    }
+    return -1;
+}
+
+/* adds color key, 0 once there are too many for a palette */
+static int cgpng_color_add(struct cgpng_colors *c, unsigned long key)
+{
+    unsigned int i = cgpng_slot(key);
+    if (c->count == CGPNG_COLORS)
+        return 0;
+    while (c->index[i] >= 0)
+        i = (i + 1) & (CGPNG_SLOTS - 1);
+    c->keys[i] = key;
+    c->index[i] = c->count;
+    cgpng_put32(c->palette + c->count * 4, key);
+    c->count++;
+    return 1;
+}
+
+/*
+ * the smallest color type that holds every pixel, the same way lodepng
+ * chooses one: a palette for few colors unless gray does as well, gray
+ * when nothing is colored, and alpha only when something is not opaque.
+ */
+static void cgpng_choose(const unsigned char *rgba, size_t pixels, struct cgpng_colors *c, int *type, int *depth)
+{
+    int colored = 0, alpha = 0, palette = 1, bits;
+    unsigned long key, last = 0;
+    size_t i;
+
+    for (i = 0; i < CGPNG_SLOTS; i++)
+        c->index[i] = -1;
+    c->count = 0;
+    for (i = 0; i < pixels; i++) {
+        const unsigned char *p = rgba + i * 4;
+        colored |= p[0] != p[1] || p[1] != p[2];
+        alpha |= p[3] != 255;
+        if (palette) {
+            key = (unsigned long) p[0] << 24 | (unsigned long) p[1] << 16 | (unsigned long) p[2] << 8 | p[3];
+            if ((!i || key != last) && cgpng_color_find(c, key) < 0 && !cgpng_color_add(c, key))
+                palette = 0;
+            last = key;
+        }
+        if (colored && alpha && !palette)
+            break;
+    }
+    bits = c->count <= 2 ? 1 : c->count <= 4 ? 2 : c->count <= 16 ? 4 : 8;
+    /* not worth a palette for a handful of pixels */
+    if (pixels < (size_t) c->count * 2)
+        palette = 0;
+    if (!colored && !alpha && bits == 8)
+        palette = 0;
+    if (palette) {
+        *type = cgpng_type_palette;
+        *depth = bits;
+    } else {
+        *type = colored ? (alpha ? cgpng_type_rgba : cgpng_type_rgb) : (alpha ? cgpng_type_gray_alpha : cgpng_type_gray);
+        *depth = 8;
+    }
+}
+
+/* the chunk of type whose len bytes are already in place */
+static int cgpng_emit(struct cgpng_encoder *enc, const char *type, size_t len)
+{
+    unsigned long crc;
+    cgpng_put32(enc->chunk, len);
+    memcpy(enc->chunk + 4, type, 4);
+    crc = crc32(0L, enc->chunk + 4, len + 4);
+    cgpng_put32(enc->chunk + 8 + len, crc);
+    return enc->sink(enc->ud, enc->chunk, len + 12);
+}
+
+static int cgpng_chunk(struct cgpng_encoder *enc, const char *type, const unsigned char *data, size_t len)
+{
+    memcpy(enc->chunk + 8, data, len);
+    return cgpng_emit(enc, type, len);
+}
+
+/* whatever deflate made so far as an IDAT */
+static int cgpng_idat(struct cgpng_encoder *enc)
+{
+    size_t len = CGPNG_IDAT - enc->z.avail_out;
+    if (len && !cgpng_emit(enc, "IDAT", len))
+        return 0;
+    enc->z.next_out = enc->chunk + 8;
+    enc->z.avail_out = CGPNG_IDAT;
+    return 1;
+}
+
+static int cgpng_deflate(struct cgpng_encoder *enc, const unsigned char *data, size_t size, int flush)
+{
+    int r, full;
+    enc->z.next_in = (Bytef *) data;
+    enc->z.avail_in = size;
+    do {
+        r = deflate(&enc->z, flush);
+        if (r == Z_STREAM_ERROR)
+            return 0;
+        full = !enc->z.avail_out;
+        if ((full || r == Z_STREAM_END) && !cgpng_idat(enc))
+            return 0;
+    } while (full || (flush == Z_FINISH ? r != Z_STREAM_END : enc->z.avail_in > 0));
+    return 1;
+}
+
+/* row y of rgba as the chosen type stores it */
+static void cgpng_row(const unsigned char *rgba, unsigned int width, int type, int depth,
+        const struct cgpng_colors *c, unsigned char *out, size_t stride)
+{
+    unsigned int x;
+    const unsigned char *p = rgba;
+
+    switch (type) {
+    case cgpng_type_gray:
+        for (x = 0; x < width; x++, p += 4)
+            out[x] = p[0];
+        break;
+    case cgpng_type_gray_alpha:
+        for (x = 0; x < width; x++, p += 4) {
+            out[x * 2] = p[0];
+            out[x * 2 + 1] = p[3];
+        }
+        break;
+    case cgpng_type_rgb:
+        for (x = 0; x < width; x++, p += 4)
+            memcpy(out + x * 3, p, 3);
+        break;
+    case cgpng_type_rgba:
+        memcpy(out, p, stride);
+        break;
+    case cgpng_type_palette:
+        memset(out, 0, stride);
+        for (x = 0; x < width; x++, p += 4) {
+            unsigned long key = (unsigned long) p[0] << 24 | (unsigned long) p[1] << 16 | (unsigned long) p[2] << 8 | p[3];
+            unsigned int bit = x * depth;
+            int idx = cgpng_color_find(c, key);
+            out[bit / 8] |= (idx < 0 ? 0 : idx) << (8 - depth - bit % 8);
+        }
+        break;
+    }
+}
+
+static unsigned char cgpng_paeth(int a, int b, int c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+/* cur filtered with type into out after its filter byte, the sum to judge it by */
+static unsigned long cgpng_filter(int type, const unsigned char *cur, const unsigned char *prev,
+        size_t stride, size_t bpp, unsigned char *out)
+{
+    unsigned long sum = 0;
+    size_t i;
+
+    out[0] = type;
+    for (i = 0; i < stride; i++) {
+        int left = i >= bpp ? cur[i - bpp] : 0, up = prev[i], corner = i >= bpp ? prev[i - bpp] : 0;
+        unsigned char v;
+        switch (type) {
+        case 1:
+            v = cur[i] - left;
+            break;
+        case 2:
+            v = cur[i] - up;
+            break;
+        case 3:
+            v = cur[i] - ((left + up) >> 1);
+            break;
+        case 4:
+            v = cur[i] - cgpng_paeth(left, up, corner);
+            break;
+        default:
+            v = cur[i];
+            break;
+        }
+        out[i + 1] = v;
+        sum += v < 128 ? v : 256 - v;
+    }
+    return sum;
+}
+
+/* signature and header of the png enc is set up for, 0 on failure */
+static int cgpng_start(struct cgpng_encoder *enc, unsigned int width, unsigned int height)
+{
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    struct cgpng_colors *colors = enc->colors;
+    unsigned char head[13];
+    int channels;
+    unsigned int i;
+
+    channels = enc->type == cgpng_type_rgba ? 4 : enc->type == cgpng_type_rgb ? 3 : enc->type == cgpng_type_gray_alpha ? 2 : 1;
+    enc->width = width;
+    enc->stride = ((size_t) width * channels * enc->depth + 7) / 8;
+    enc->bpp = channels * enc->depth / 8 ? channels * enc->depth / 8 : 1;
+    enc->chunk = malloc(CGPNG_IDAT + 12);
+    if (!enc->chunk || !(enc->rows = calloc(4, enc->stride + 1)))
+        return 0;
+    enc->prev = enc->rows;
+    enc->cur = enc->prev + enc->stride + 1;
+    enc->best = enc->cur + enc->stride + 1;
+    enc->attempt = enc->best + enc->stride + 1;
+    /* filtering is no use on palettes, and deflate is told when it is used */
+    enc->filter = enc->type != cgpng_type_palette && enc->depth == 8;
+    if (deflateInit2(&enc->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15, 8, enc->filter ? Z_FILTERED : Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    enc->z.next_out = enc->chunk + 8;
+    enc->z.avail_out = CGPNG_IDAT;
+
+    cgpng_put32(head, width);
+    cgpng_put32(head + 4, height);
+    head[8] = enc->depth;
+    head[9] = enc->type;
+    head[10] = head[11] = head[12] = 0;
+    if (!enc->sink(enc->ud, signature, sizeof signature) || !cgpng_chunk(enc, "IHDR", head, sizeof head))
+        return 0;
+    if (enc->type == cgpng_type_palette) {
+        unsigned int trns = 0;
+        for (i = 0; i < colors->count; i++) {
+            memcpy(enc->chunk + 8 + i * 3, colors->palette + i * 4, 3);
+            if (colors->palette[i * 4 + 3] != 255)
+                trns = i + 1;
+        }
+        if (!cgpng_emit(enc, "PLTE", colors->count * 3))
+            return 0;
+        for (i = 0; i < trns; i++)
+            enc->chunk[8 + i] = colors->palette[i * 4 + 3];
+        if (trns && !cgpng_emit(enc, "tRNS", trns))
+            return 0;
+    }
+    return 1;
+}
+
+/* filters and deflates the next row, a width of rgba pixels */
+static int cgpng_put_row(struct cgpng_encoder *enc, const unsigned char *rgba)
+{
+    unsigned long sum, least;
+    unsigned char *t;
+    int f;
+
+    cgpng_row(rgba, enc->width, enc->type, enc->depth, enc->colors, enc->cur, enc->stride);
+    least = cgpng_filter(0, enc->cur, enc->prev, enc->stride, enc->bpp, enc->best);
+    /* the filter whose bytes stray least from zero, like lodepng's minsum */
+    for (f = 1; enc->filter && f <= 4; f++) {
+        sum = cgpng_filter(f, enc->cur, enc->prev, enc->stride, enc->bpp, enc->attempt);
+        if (sum < least) {
+            least = sum;
+            t = enc->best;
+            enc->best = enc->attempt;
+            enc->attempt = t;
+        }
+    }
+    if (!cgpng_deflate(enc, enc->best, enc->stride + 1, Z_NO_FLUSH))
+        return 0;
+    memcpy(enc->prev, enc->cur, enc->stride);
+    return 1;
+}
+
+static int cgpng_finish(struct cgpng_encoder *enc)
+{
+    return cgpng_deflate(enc, NULL, 0, Z_FINISH) && cgpng_emit(enc, "IEND", 0);
+}
+
+static void cgpng_end(struct cgpng_encoder *enc)
+{
+    deflateEnd(&enc->z);
+    free(enc->rows);
+    free(enc->chunk);
+    free(enc->colors);
+}
+
+/*
+ * encodes rgba row by row, each filtered, deflated and handed to sink in
+ * IDAT chunks as they fill. besides the image it only ever holds a few
+ * rows, one chunk and deflate's window. returns 0 on failure, with errno
+ * as the sink left it.
+ */
+int cgpng_encode(const unsigned char *rgba, unsigned int width, unsigned int height, cgformat_sink sink, void *ud)
+{
+    struct cgpng_encoder enc;
+    unsigned int y;
+    int ok = 0;
+
+    if (!width || !height)
+        return 0;
+    memset(&enc, 0, sizeof enc);
+    enc.sink = sink;
+    enc.ud = ud;
+    if ((enc.colors = malloc(sizeof(struct cgpng_colors)))) {
+        cgpng_choose(rgba, (size_t) width * height, enc.colors, &enc.type, &enc.depth);
+        ok = cgpng_start(&enc, width, height);
+    }
+    for (y = 0; ok && y < height; y++)
+        ok = cgpng_put_row(&enc, rgba + (size_t) y * width * 4);
+    ok = ok && cgpng_finish(&enc);
+    cgpng_end(&enc);
+    return ok;
+}
+
+/*
+ * an encoder taking rows one at a time, for images that are never whole.
+ * with nothing to choose a color type from, channels fixes it: 1 gray,
+ * 2 gray and alpha, 3 rgb or 4 rgba. given palette, colors rgb triples
+ * that every pixel is one of, opaque, it is stored with that instead.
+ */
+struct cgpng_encoder *cgpng_encoder_new(unsigned int width, unsigned int height, int channels,
+        const unsigned char *palette, unsigned int colors, cgformat_sink sink, void *ud)
+{
+    static const int types[] = { cgpng_type_gray, cgpng_type_gray_alpha, cgpng_type_rgb, cgpng_type_rgba };
+    struct cgpng_encoder *enc;
+    unsigned int i;
+
+    if (!width || !height || channels < 1 || channels > 4 || (palette && (!colors || colors > CGPNG_COLORS)))
+        return NULL;
+    if (!(enc = calloc(1, sizeof(struct cgpng_encoder))))
+        return NULL;
+    enc->sink = sink;
+    enc->ud = ud;
+    enc->type = types[channels - 1];
+    enc->depth = 8;
+    if (palette && (enc->colors = malloc(sizeof(struct cgpng_colors)))) {
+        for (i = 0; i < CGPNG_SLOTS; i++)
+            enc->colors->index[i] = -1;
+        enc->colors->count = 0;
+        for (i = 0; i < colors; i++, palette += 3) {
+            unsigned long key = (unsigned long) palette[0] << 24 | (unsigned long) palette[1] << 16 | (unsigned long) palette[2] << 8 | 255;
+            if (cgpng_color_find(enc->colors, key) < 0)
+                cgpng_color_add(enc->colors, key);
+        }
+        i = enc->colors->count;
+        enc->type = cgpng_type_palette;
+        enc->depth = i <= 2 ? 1 : i <= 4 ? 2 : i <= 16 ? 4 : 8;
+    }
+    if ((palette && !enc->colors) || !cgpng_start(enc, width, height)) {
+        cgpng_encoder_free(enc);
+        return NULL;
+    }
+    return enc;
+}
+
+int cgpng_encoder_row(struct cgpng_encoder *enc, const unsigned char *rgba)
+{
+    return cgpng_put_row(enc, rgba);
+}
+
+/* ends the png once every row is in */
+int cgpng_encoder_finish(struct cgpng_encoder *enc)
+{
+    return cgpng_finish(enc);
+}
+
+void cgpng_encoder_free(struct cgpng_encoder *enc)
+{
+    if (!enc)
+        return;
+    cgpng_end(enc);
+    free(enc);
+}
+
+/* what is known of a png before its first IDAT */
+struct cgpng_decoder {
+    unsigned int width, height;
+    int type, depth, interlaced;
+    unsigned char palette[CGPNG_COLORS * 4];
+    unsigned int colors;
+    int keyed; /* tRNS gave the one transparent gray or rgb */
+    unsigned int key[3];
+    int translucent; /* some palette entry is not opaque */
+    size_t idat; /* offset of the first IDAT chunk */
+};
+
+static unsigned long cgpng_get32(const unsigned char *p)
+{
+    return (unsigned long) p[0] << 24 | (unsigned long) p[1] << 16 | (unsigned long) p[2] << 8 | p[3];
+}
+
+/* the chunk at pos, 0 when it runs off the end or fails its crc */
+static int cgpng_chunk_at(const unsigned char *png, size_t size, size_t pos, const unsigned char **data, size_t *len)
+{
+    if (pos > size || size - pos < 12)
+        return 0;
+    *len = cgpng_get32(png + pos);
+    if (*len > size - pos - 12)
+        return 0;
+    *data = png + pos + 8;
+    return crc32(crc32(0L, Z_NULL, 0), png + pos + 4, *len + 4) == cgpng_get32(png + pos + 8 + *len);
+}
+
+/* reads the header and everything up to the pixels, 0 when png is not one it can stream */
+static int cgpng_parse(const unsigned char *png, size_t size, struct cgpng_decoder *dec)
+{
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    const unsigned char *data;
+    size_t pos = 8, len;
+    unsigned int i;
+    int d;
+
+    memset(dec, 0, sizeof *dec);
+    if (size < 8 || memcmp(png, signature, 8) || !cgpng_chunk_at(png, size, pos, &data, &len)
+            || len != 13 || memcmp(data - 4, "IHDR", 4))
+        return 0;
+    dec->width = cgpng_get32(data);
+    dec->height = cgpng_get32(data + 4);
+    dec->depth = d = data[8];
+    dec->type = data[9];
+    dec->interlaced = data[12];
+    if (!dec->width || !dec->height || dec->width > 0x7FFFFFFFUL || dec->height > 0x7FFFFFFFUL
+            || data[10] || data[11] || dec->interlaced > 1)
+        return 0;
+    switch (dec->type) {
+    case cgpng_type_gray:
+        if (d != 1 && d != 2 && d != 4 && d != 8 && d != 16)
+            return 0;
+        break;
+    case cgpng_type_palette:
+        if (d != 1 && d != 2 && d != 4 && d != 8)
+            return 0;
+        break;
+    case cgpng_type_rgb:
+    case cgpng_type_gray_alpha:
+    case cgpng_type_rgba:
+        if (d != 8 && d != 16)
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+
+    for (pos += 12 + len; cgpng_chunk_at(png, size, pos, &data, &len); pos += 12 + len) {
+        const unsigned char *type = data - 4;
+        if (!memcmp(type, "IDAT", 4)) {
+            dec->idat = pos;
+            return dec->type != cgpng_type_palette || dec->colors;
+        } else if (!memcmp(type, "PLTE", 4)) {
+            if (!len || len % 3 || len / 3 > CGPNG_COLORS)
+                return 0;
+            dec->colors = len / 3;
+            for (i = 0; i < dec->colors; i++) {
+                memcpy(dec->palette + i * 4, data + i * 3, 3);
+                dec->palette[i * 4 + 3] = 255;
+            }
+        } else if (!memcmp(type, "tRNS", 4)) {
+            if (dec->type == cgpng_type_palette) {
+                if (len > dec->colors)
+                    return 0;
+                for (i = 0; i < len; i++) {
+                    dec->palette[i * 4 + 3] = data[i];
+                    dec->translucent |= data[i] != 255;
+                }
+            } else if (dec->type == cgpng_type_gray && len == 2) {
+                dec->keyed = 1;
+                dec->key[0] = data[0] << 8 | data[1];
+            } else if (dec->type == cgpng_type_rgb && len == 6) {
+                dec->keyed = 1;
+                for (i = 0; i < 3; i++)
+                    dec->key[i] = data[i * 2] << 8 | data[i * 2 + 1];
+            } else {
+                return 0;
+            }
+        } else if (!memcmp(type, "IEND", 4)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+int cgpng_read_info(const unsigned char *png, size_t size, struct cgpng_info *info)
+{
+    struct cgpng_decoder dec;
+    if (!cgpng_parse(png, size, &dec))
+        return 0;
+    info->width = dec.width;
+    info->height = dec.height;
+    info->interlaced = dec.interlaced;
+    switch (dec.type) {
+    case cgpng_type_gray:
+        info->channels = dec.keyed ? 2 : 1;
+        break;
+    case cgpng_type_gray_alpha:
+        info->channels = 2;
+        break;
+    case cgpng_type_rgb:
+        info->channels = dec.keyed ? 4 : 3;
+        break;
+    case cgpng_type_palette:
+        info->channels = dec.translucent ? 4 : 3;
+        break;
+    default:
+        info->channels = 4;
+        break;
+    }
+    return 1;
+}
+
+/* sample x of a row of depth bit samples */
+static unsigned int cgpng_sample(const unsigned char *row, size_t x, int depth)
+{
+    size_t bit;
+    if (depth == 8)
+        return row[x];
+    if (depth == 16)
+        return row[x * 2] << 8 | row[x * 2 + 1];
+    bit = x * depth;
+    return (row[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+}
+
+/* a raw row as 8 bit rgba, the way lodepng_decode32 has it */
+static void cgpng_unpack(const struct cgpng_decoder *dec, const unsigned char *in, unsigned char *out)
+{
+    int d = dec->depth, shift = d == 16 ? 8 : 0;
+    unsigned int x, v, r, g, b, highest = (1 << d) - 1;
+
+    for (x = 0; x < dec->width; x++, out += 4) {
+        switch (dec->type) {
+        case cgpng_type_gray:
+            v = cgpng_sample(in, x, d);
+            out[0] = out[1] = out[2] = d >= 8 ? v >> shift : v * 255 / highest;
+            out[3] = dec->keyed && v == dec->key[0] ? 0 : 255;
+            break;
+        case cgpng_type_gray_alpha:
+            out[0] = out[1] = out[2] = cgpng_sample(in, x * 2, d) >> shift;
+            out[3] = cgpng_sample(in, x * 2 + 1, d) >> shift;
+            break;
+        case cgpng_type_rgb:
+            r = cgpng_sample(in, x * 3, d);
+            g = cgpng_sample(in, x * 3 + 1, d);
+            b = cgpng_sample(in, x * 3 + 2, d);
+            out[0] = r >> shift;
+            out[1] = g >> shift;
+            out[2] = b >> shift;
+            out[3] = dec->keyed && r == dec->key[0] && g == dec->key[1] && b == dec->key[2] ? 0 : 255;
+            break;
+        case cgpng_type_palette:
+            v = cgpng_sample(in, x, d);
+            if (v < dec->colors) {
+                memcpy(out, dec->palette + v * 4, 4);
+            } else {
+                /* out of the palette is black, as lodepng has it */
+                out[0] = out[1] = out[2] = 0;
+                out[3] = 255;
+            }
+            break;
+        default:
+            out[0] = cgpng_sample(in, x * 4, d) >> shift;
+            out[1] = cgpng_sample(in, x * 4 + 1, d) >> shift;
+            out[2] = cgpng_sample(in, x * 4 + 2, d) >> shift;
+            out[3] = cgpng_sample(in, x * 4 + 3, d) >> shift;
+            break;
+        }
+    }
+}
+
+/* undoes the filter of cur, its filter byte first, against prev */
+static int cgpng_unfilter(unsigned char *cur, const unsigned char *prev, size_t stride, size_t bpp)
+{
+    int type = cur[0];
+    size_t i;
+
+    cur++;
+    prev++;
+    for (i = 0; i < stride; i++) {
+        int left = i >= bpp ? cur[i - bpp] : 0, up = prev[i], corner = i >= bpp ? prev[i - bpp] : 0;
+        switch (type) {
+        case 0:
+            return 1;
+        case 1:
+            cur[i] += left;
+            break;
+        case 2:
+            cur[i] += up;
+            break;
+        case 3:
+            cur[i] += (left + up) >> 1;
+            break;
+        case 4:
+            cur[i] += cgpng_paeth(left, up, corner);
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * decodes png a row at a time, inflating only as far as the next row
+ * needs, and hands each to rows as rgba. it holds two raw rows, one rgba
+ * row and inflate's window, never the image. interlaced pngs are not
+ * streamed, cgpng_read_info tells them apart. returns 0 on a bad png or
+ * when rows stops it.
+ */
+int cgpng_decode_rows(const unsigned char *png, size_t size, cgpng_rows rows, void *ud)
+{
+    struct cgpng_decoder dec;
+    z_stream z;
+    unsigned char *raw = NULL, *prev, *cur, *t, *rgba = NULL;
+    const unsigned char *data;
+    size_t stride, bpp, pos, len;
+    unsigned int y = 0;
+    int channels, r, ok = 0;
+
+    if (!cgpng_parse(png, size, &dec) || dec.interlaced)
+        return 0;
+    channels = dec.type == cgpng_type_rgba ? 4 : dec.type == cgpng_type_rgb ? 3 : dec.type == cgpng_type_gray_alpha ? 2 : 1;
+    stride = ((size_t) dec.width * channels * dec.depth + 7) / 8;
+    bpp = channels * dec.depth / 8 ? channels * dec.depth / 8 : 1;
+    memset(&z, 0, sizeof z);
+    raw = calloc(2, stride + 1);
+    rgba = malloc((size_t) dec.width * 4);
+    if (!raw || !rgba || inflateInit(&z) != Z_OK)
+        goto out;
+    prev = raw;
+    cur = raw + stride + 1;
+    z.next_out = cur;
+    z.avail_out = stride + 1;
+
+    /*
+     * a row can still be coming out of inflate after its input ran dry,
+     * so the next IDAT is only taken when inflate has nothing more to give.
+     */
+    for (pos = dec.idat; y < dec.height;) {
+        r = inflate(&z, Z_NO_FLUSH);
+        if (!z.avail_out) {
+            if (!cgpng_unfilter(cur, prev, stride, bpp))
+                goto done;
+            cgpng_unpack(&dec, cur + 1, rgba);
+            if (!rows(ud, rgba, y++))
+                goto done;
+            t = prev;
+            prev = cur;
+            cur = t;
+            z.next_out = cur;
+            z.avail_out = stride + 1;
+        } else if (r == Z_STREAM_END || (r != Z_OK && r != Z_BUF_ERROR)) {
+            goto done;
+        } else if (!z.avail_in) {
+            if (!cgpng_chunk_at(png, size, pos, &data, &len) || memcmp(data - 4, "IDAT", 4))
+                goto done;
+            pos += 12 + len;
+            z.next_in = (Bytef *) data;
+            z.avail_in = len;
+        }
+    }
+    ok = y == dec.height;
+
+done:
+    inflateEnd(&z);
+out:
+    free(raw);
+    free(rgba);
+    return ok;
+}
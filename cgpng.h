@@ -0,0 +1,30 @@
+#ifndef CGPNG_H_
+#define CGPNG_H_
+
+#include <stddef.h>
+
+#include "cgformat.h"
+
+/* takes row y of a png as it is decoded, rgba, returns 0 to stop */
+typedef int (*cgpng_rows)(void *ud, const unsigned char *rgba, unsigned int y);
+
+struct cgpng_encoder;
+
+struct cgpng_info {
+    unsigned int width, height;
+    int channels; /* 1 gray, 2 gray and alpha, 3 rgb, 4 rgba, whatever it is stored as */
+    int interlaced;
+};
+
+int cgpng_encode(const unsigned char *rgba, unsigned int width, unsigned int height, cgformat_sink sink, void *ud);
+
+struct cgpng_encoder *cgpng_encoder_new(unsigned int width, unsigned int height, int channels,
+        const unsigned char *palette, unsigned int colors, cgformat_sink sink, void *ud);
+int cgpng_encoder_row(struct cgpng_encoder *enc, const unsigned char *rgba);
+int cgpng_encoder_finish(struct cgpng_encoder *enc);
+void cgpng_encoder_free(struct cgpng_encoder *enc);
+
+int cgpng_read_info(const unsigned char *png, size_t size, struct cgpng_info *info);
+int cgpng_decode_rows(const unsigned char *png, size_t size, cgpng_rows rows, void *ud);
+
+#endif /* CGPNG_H_ */
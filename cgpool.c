@@ -0,0 +1,290 @@
+#define _GNU_SOURCE /* sched_getaffinity */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgpool.h"
+
+struct cgpool_task {
+    cgpool_fn fn;
+    void *ud;
+    struct cgpool_group *group;
+};
+
+/* owner pushes and pops the bottom, thieves take from the top */
+struct cgpool_deque {
+    pthread_mutex_t lock;
+    struct cgpool_task *tasks;
+    unsigned int cap, top, count;
+};
+
+struct cgpool_worker {
+    struct cgpool *pool;
+    struct cgpool_deque deque;
+    unsigned int index;
+    pthread_t thread;
+};
+
+struct cgpool {
+    struct cgpool_worker *workers;
+    unsigned int threads, started;
+    unsigned int next; /* round robin for submits from outside the pool */
+    unsigned long queued;
+    int stop;
+    /* sleeping, for idle workers and waiters alike */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_key_t self;
+};
+
+/* cpu quota of our cgroup, v2 then v1, in whole cpus rounded up */
+static unsigned int cgpool_cgroup_cpus(void)
+{
+    FILE *fp;
+    long quota = -1, period = 0;
+    char buf[64];
+
+    if ((fp = fopen("/sys/fs/cgroup/cpu.max", "r"))) {
+        if (fscanf(fp, "%63s %ld", buf, &period) == 2 && strcmp(buf, "max") != 0)
+            quota = atol(buf);
+        fclose(fp);
+    } else if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))) {
+        if (fscanf(fp, "%ld", &quota) != 1)
+            quota = -1;
+        fclose(fp);
+        if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))) {
+            if (fscanf(fp, "%ld", &period) != 1)
+                period = 0;
+            fclose(fp);
+        }
+    }
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return (quota + period - 1) / period;
+}
+
+unsigned int cgpool_default_threads(void)
+{
+    cpu_set_t set;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int quota;
+
+    if (sched_getaffinity(0, sizeof set, &set) == 0)
+        cpus = CPU_COUNT(&set);
+    quota = cgpool_cgroup_cpus();
+    if (quota > 0 && quota < cpus)
+        cpus = quota;
+    return cpus > 0 ? cpus : 1;
+}
+
+static int cgpool_deque_push(struct cgpool_deque *d, struct cgpool_task task)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->cap) {
+        unsigned int cap = d->cap ? d->cap * 2 : 64, i;
+        struct cgpool_task *tasks = malloc(cap * sizeof(struct cgpool_task));
+        if (!tasks) {
+            pthread_mutex_unlock(&d->lock);
+            return 0;
+        }
+        for (i = 0; i < d->count; i++)
+            tasks[i] = d->tasks[(d->top + i) % d->cap];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->cap = cap;
+        d->top = 0;
+    }
+    d->tasks[(d->top + d->count++) % d->cap] = task;
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+
+static int cgpool_deque_pop(struct cgpool_deque *d, struct cgpool_task *task)
+{
+    int ok = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        *task = d->tasks[(d->top + --d->count) % d->cap];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static int cgpool_deque_steal(struct cgpool_deque *d, struct cgpool_task *task)
+{
+    int ok = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        *task = d->tasks[d->top];
+        d->top = (d->top + 1) % d->cap;
+        d->count--;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+/* own deque first, newest first, then the oldest task of everyone else */
+static int cgpool_take(struct cgpool *pool, struct cgpool_worker *self, struct cgpool_task *task)
+{
+    unsigned int i, start = self ? self->index + 1 : 0;
+    int found = 0;
+
+    if (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+    if (self)
+        found = cgpool_deque_pop(&self->deque, task);
+    for (i = 0; !found && i < pool->threads; i++)
+        found = cgpool_deque_steal(&pool->workers[(start + i) % pool->threads].deque, task);
+    if (found)
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    return found;
+}
+
+static void cgpool_run(struct cgpool *pool, struct cgpool_task *task)
+{
+    task->fn(task->ud);
+    if (task->group && __atomic_sub_fetch(&task->group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void *cgpool_worker_main(void *ud)
+{
+    struct cgpool_worker *self = (struct cgpool_worker *) ud;
+    struct cgpool *pool = self->pool;
+    struct cgpool_task task;
+
+    pthread_setspecific(pool->self, self);
+    while (1) {
+        if (cgpool_take(pool, self, &task)) {
+            cgpool_run(pool, &task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stop && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+struct cgpool *cgpool_new(unsigned int threads)
+{
+    struct cgpool *pool = calloc(1, sizeof(struct cgpool));
+    unsigned int i;
+
+    if (!pool)
+        return NULL;
+    if (threads == 0)
+        threads = 1;
+    pool->workers = calloc(threads, sizeof(struct cgpool_worker));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pool->threads = threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_key_create(&pool->self, NULL);
+    for (i = 0; i < threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+    }
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, cgpool_worker_main, &pool->workers[i]))
+            break;
+        pool->started++;
+    }
+    if (pool->started == 0) {
+        cgpool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+unsigned int cgpool_threads(struct cgpool *pool)
+{
+    return pool ? pool->started : 1;
+}
+
+/*
+ * a task submitted from a worker goes on that worker's own deque, so
+ * nested work stays local until someone idle steals it.
+ */
+int cgpool_submit(struct cgpool *pool, struct cgpool_group *group, cgpool_fn fn, void *ud)
+{
+    struct cgpool_worker *self = pthread_getspecific(pool->self);
+    struct cgpool_task task;
+
+    task.fn = fn;
+    task.ud = ud;
+    task.group = group;
+    if (!self)
+        self = &pool->workers[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->started];
+    if (group)
+        __atomic_add_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+    if (!cgpool_deque_push(&self->deque, task)) {
+        if (group)
+            __atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+        return 0;
+    }
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+/* runs queued tasks, anyone's, until everything in group is done */
+void cgpool_wait(struct cgpool *pool, struct cgpool_group *group)
+{
+    struct cgpool_worker *self = pthread_getspecific(pool->self);
+    struct cgpool_task task;
+
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+        if (cgpool_take(pool, self, &task)) {
+            cgpool_run(pool, &task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        if (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0
+                && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void cgpool_free(struct cgpool *pool)
+{
+    unsigned int i;
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->started; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    for (i = 0; i < pool->threads; i++) {
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.tasks);
+    }
+    pthread_key_delete(pool->self);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->workers);
+    free(pool);
+}
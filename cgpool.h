@@ -0,0 +1,20 @@
+#ifndef CGPOOL_H_
+#define CGPOOL_H_
+
+/* tasks submitted against a group can be waited on together */
+struct cgpool_group {
+    unsigned int pending;
+};
+
+typedef void (*cgpool_fn)(void *ud);
+
+struct cgpool;
+
+unsigned int cgpool_default_threads(void);
+struct cgpool *cgpool_new(unsigned int threads);
+unsigned int cgpool_threads(struct cgpool *pool);
+int cgpool_submit(struct cgpool *pool, struct cgpool_group *group, cgpool_fn fn, void *ud);
+void cgpool_wait(struct cgpool *pool, struct cgpool_group *group);
+void cgpool_free(struct cgpool *pool);
+
+#endif /* CGPOOL_H_ */
@@ -1,8 +1,16 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
+#include <sched.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "cgmem.h"
+#include "cgpool.h"
 #include "cgpro.h"
 #include "lodepng.h"
 
@@ -54,6 +62,55 @@ static const int matrix8[64] = {
     63, 31, 55, 23, 61, 29, 53, 21
 };
 
+/* error diffusion kernels, as (dx, dy, weight). weights are out of 1 << shift */
+struct cgpro_diffusion_tap {
+    int dx, dy, weight;
+};
+
+struct cgpro_diffusion_kernel {
+    const struct cgpro_diffusion_tap *taps;
+    int tap_count;
+    int shift;
+};
+
+static const struct cgpro_diffusion_tap floyd_steinberg_taps[] = {
+                  { 1, 0, 7 },
+    { -1, 1, 3 }, { 0, 1, 5 }, { 1, 1, 1 },
+};
+
+/* only diffuses 6/8 of the error, which is what gives atkinson its contrast */
+static const struct cgpro_diffusion_tap atkinson_taps[] = {
+                  { 1, 0, 1 }, { 2, 0, 1 },
+    { -1, 1, 1 }, { 0, 1, 1 }, { 1, 1, 1 },
+                  { 0, 2, 1 },
+};
+
+static const struct cgpro_diffusion_tap sierra_lite_taps[] = {
+                  { 1, 0, 2 },
+    { -1, 1, 1 }, { 0, 1, 1 },
+};
+
+#define CGPRO_KERNEL(taps, shift) { taps, sizeof(taps) / sizeof(taps[0]), shift }
+
+static const struct cgpro_diffusion_kernel diffusion_kernels[] = {
+    { NULL, 0, 0 }, /* cgpro_dither_bayer8x8 */
+    CGPRO_KERNEL(floyd_steinberg_taps, 4),
+    CGPRO_KERNEL(atkinson_taps, 3),
+    CGPRO_KERNEL(sierra_lite_taps, 2),
+};
+
+#define CGPRO_HISTOGRAM_BINS (1 << 15)
+#define CGPRO_KMEANS_PASSES 4
+
+/* widest reach of any kernel, for padding error rows */
+#define CGPRO_DIFFUSION_PAD 2
+/* how many pixels a row gets through before publishing its progress */
+#define CGPRO_PROGRESS_STEP 16
+
+static struct cgpool *cgpro_pool = NULL;
+static unsigned long cgpro_cache_hits = 0;
+static unsigned long cgpro_cache_misses = 0;
+
 static unsigned int col_diff[4 * 128] = { 0 };
 
 static unsigned int *col_diff_g;
@@ -61,6 +118,10 @@ static unsigned int *col_diff_r;
 static unsigned int *col_diff_b;
 static unsigned int *col_diff_a;
 
+/* srgb to linear light, and back from 12 bits of it, for mipmaps */
+static float cgpro_linear[256];
+static unsigned char cgpro_srgb[4096];
+
 void cgpro_init(void)
 {
     int i = 0;
@@ -76,6 +137,26 @@ void cgpro_init(void)
         col_diff_b[i] = col_diff_b[128 - i] = k * 11 * 11;
         col_diff_a[i] = col_diff_a[128 - i] = k * 8 * 8;
     }
+    for (i = 0; i < 256; i++) {
+        double c = i / 255.0;
+        cgpro_linear[i] = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+    }
+    for (i = 0; i < 4096; i++) {
+        double l = i / 4095.0;
+        cgpro_srgb[i] = (l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1 / 2.4) - 0.055) * 255 + 0.5;
+    }
+}
+
+/* without a pool everything runs on the calling thread */
+void cgpro_set_pool(struct cgpool *pool)
+{
+    cgpro_pool = pool;
+}
+
+/* threads that may work on one map: the pool plus whoever called in */
+static unsigned int cgpro_workers(void)
+{
+    return cgpro_pool ? cgpool_threads(cgpro_pool) + 1 : 1;
 }
 
 struct cgpro_palette cgpro_palette_load_default(void)
@@ -141,6 +222,45 @@ unsigned int cgpro_palette_nearest(struct cgpro_palette P, struct cgpro_color c)
     return best_fit;
 }
 
+void cgpro_cache_reset(struct cgpro_cache *cache)
+{
+    int i;
+    for (i = 0; i < 1 << CGPRO_CACHE_BITS; i++)
+        cache->entries[i].idx = -1;
+    cache->hits = cache->misses = 0;
+}
+
+/*
+ * cgpro_palette_nearest only looks at the top 5 bits of each channel and at
+ * whether alpha is zero, so those are all the key keeps. a cache must only
+ * ever be used with one palette between resets.
+ */
+unsigned int cgpro_cache_nearest(struct cgpro_cache *cache, struct cgpro_palette P, struct cgpro_color c)
+{
+    struct cgpro_cache_entry *e;
+    unsigned int key;
+
+    if (!cache)
+        return cgpro_palette_nearest(P, c);
+    key = ((unsigned int) c.r << 24 | (unsigned int) c.g << 16 | (unsigned int) c.b << 8 | c.a) & 0xF8F8F8F8;
+    key |= c.a != 0;
+    e = &cache->entries[((key * 2654435761u) & 0xFFFFFFFF) >> (32 - CGPRO_CACHE_BITS)];
+    if (e->idx >= 0 && e->key == key) {
+        cache->hits++;
+        return e->idx;
+    }
+    cache->misses++;
+    e->key = key;
+    e->idx = cgpro_palette_nearest(P, c);
+    return e->idx;
+}
+
+void cgpro_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = __atomic_load_n(&cgpro_cache_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cgpro_cache_misses, __ATOMIC_RELAXED);
+}
+
 static int cgpro_color_distance(struct cgpro_color a, struct cgpro_color b)
 {
     int result = 0;
@@ -162,10 +282,10 @@ static unsigned char cgpro_fit(int x)
 
 static int cgpro_bayer_value(unsigned int x, unsigned int y)
 {
-    return matrix8[(y & 0xF) * 8 + (x & 0xF)];
+    return matrix8[(y & 0x7) * 8 + (x & 0x7)];
 }
 
-unsigned int cgpro_palette_bayer8x8(struct cgpro_palette P, struct cgpro_color c, unsigned int x, unsigned int y)
+unsigned int cgpro_palette_bayer8x8(struct cgpro_palette P, struct cgpro_cache *cache, struct cgpro_color c, unsigned int x, unsigned int y)
 {
     int d, D, th;
     unsigned int idx1, idx2;
@@ -173,14 +293,14 @@ unsigned int cgpro_palette_bayer8x8(struct cgpro_palette P, struct cgpro_color c
 
     if (c.a == 0)
         return 0;
-    idx1 = cgpro_palette_nearest(P, c);
+    idx1 = cgpro_cache_nearest(cache, P, c);
     c1 = cgpro_palette_get_idx(P, idx1);
 
     c2.r = cgpro_fit(c.r - (c1.r - c.r));
     c2.g = cgpro_fit(c.g - (c1.g - c.g));
     c2.b = cgpro_fit(c.b - (c1.b - c.b));
     c2.a = cgpro_fit(c.a - (c1.a - c.a));
-    idx2 = cgpro_palette_nearest(P, c2);
+    idx2 = cgpro_cache_nearest(cache, P, c2);
 
     if (idx1 == idx2)
         return idx1;
@@ -197,65 +317,840 @@ unsigned int cgpro_palette_bayer8x8(struct cgpro_palette P, struct cgpro_color c
 void cgpro_palette_free(struct cgpro_palette palette)
 {
     if (palette.data == default_palette) return;
-    free(palette.data);
-}
-
-/* TODO: more quantization methods */
-int cgpro_quantize_to(struct cgapi_map *target, struct cgpro_palette palette)
-{
-    unsigned int i, j = 0;
-    for (i = 0; i < target->width; i++) {
-        for (j = 0; j < target->height; j++) {
-            unsigned char *p = &target->data[(j * target->width + i) * 4];
-            unsigned int idx;
-            struct cgpro_color oldcol;
-            struct cgpro_color newcol;
-            oldcol.r = p[0];
-            oldcol.g = p[1];
-            oldcol.b = p[2];
-            oldcol.a = p[3];
-            idx = cgpro_palette_bayer8x8(palette, oldcol, i, j);
-            newcol = cgpro_palette_get_idx(palette, idx);
-            p[0] = newcol.r;
-            p[1] = newcol.g;
-            p[2] = newcol.b;
+    cgmem_free(palette.data);
+}
+
+int cgpro_palette_save(struct cgpro_palette P, const char *filename)
+{
+    return lodepng_encode24_file(filename, P.data, P.num, 1) == 0;
+}
+
+struct cgpro_histogram cgpro_histogram_new(void)
+{
+    struct cgpro_histogram out;
+    out.count = calloc(CGPRO_HISTOGRAM_BINS, sizeof(unsigned long));
+    out.sum = calloc(CGPRO_HISTOGRAM_BINS * 3, sizeof(unsigned long));
+    if (!out.count || !out.sum) {
+        free(out.count);
+        free(out.sum);
+        out.count = out.sum = NULL;
+    }
+    return out;
+}
+
+void cgpro_histogram_add(struct cgpro_histogram *hist, struct cgapi_map *map)
+{
+    unsigned int i, n = map->width * map->height;
+    const unsigned char *p = map->data;
+    if (!hist->count || !p)
+        return;
+    for (i = 0; i < n; i++, p += 4) {
+        unsigned int bin;
+        if (p[3] == 0)
+            continue; /* transparent pixels all go to index 0 anyway */
+        bin = ((p[0] >> 3) << 10) | ((p[1] >> 3) << 5) | (p[2] >> 3);
+        hist->count[bin]++;
+        hist->sum[bin * 3 + 0] += p[0];
+        hist->sum[bin * 3 + 1] += p[1];
+        hist->sum[bin * 3 + 2] += p[2];
+    }
+}
+
+void cgpro_histogram_free(struct cgpro_histogram hist)
+{
+    free(hist.count);
+    free(hist.sum);
+}
+
+/* a non-empty histogram bin, with the mean of the colors that fell into it */
+struct cgpro_cell {
+    int c[3];
+    unsigned long count;
+};
+
+struct cgpro_box {
+    unsigned int start, end; /* cells [start, end) */
+    unsigned long count;
+    int axis, range;
+};
+
+static int cgpro_cell_cmp_r(const void *a, const void *b)
+{
+    return ((const struct cgpro_cell *) a)->c[0] - ((const struct cgpro_cell *) b)->c[0];
+}
+
+static int cgpro_cell_cmp_g(const void *a, const void *b)
+{
+    return ((const struct cgpro_cell *) a)->c[1] - ((const struct cgpro_cell *) b)->c[1];
+}
+
+static int cgpro_cell_cmp_b(const void *a, const void *b)
+{
+    return ((const struct cgpro_cell *) a)->c[2] - ((const struct cgpro_cell *) b)->c[2];
+}
+
+static int (*const cgpro_cell_cmp[3])(const void *, const void *) = {
+    cgpro_cell_cmp_r,
+    cgpro_cell_cmp_g,
+    cgpro_cell_cmp_b,
+};
+
+static void cgpro_box_shrink(struct cgpro_box *box, struct cgpro_cell *cells)
+{
+    int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+    unsigned int i;
+    int k;
+    box->count = 0;
+    for (i = box->start; i < box->end; i++) {
+        for (k = 0; k < 3; k++) {
+            if (cells[i].c[k] < lo[k]) lo[k] = cells[i].c[k];
+            if (cells[i].c[k] > hi[k]) hi[k] = cells[i].c[k];
         }
+        box->count += cells[i].count;
     }
-    return 1;
+    box->axis = 0;
+    for (k = 1; k < 3; k++)
+        if (hi[k] - lo[k] > hi[box->axis] - lo[box->axis])
+            box->axis = k;
+    box->range = hi[box->axis] - lo[box->axis];
 }
 
-int cgpro_scale_nearest(struct cgapi_map *target, unsigned int new_width, unsigned int new_height)
+/* non-empty bins only, so the passes below never touch the raw pixels */
+static struct cgpro_cell *cgpro_histogram_cells(struct cgpro_histogram *hist, unsigned int *ncells)
+{
+    struct cgpro_cell *cells = malloc(CGPRO_HISTOGRAM_BINS * sizeof(struct cgpro_cell));
+    unsigned int i;
+    *ncells = 0;
+    if (!cells)
+        return NULL;
+    for (i = 0; i < CGPRO_HISTOGRAM_BINS; i++) {
+        unsigned long n = hist->count[i];
+        struct cgpro_cell *cell = &cells[*ncells];
+        if (!n)
+            continue;
+        cell->c[0] = (hist->sum[i * 3 + 0] + n / 2) / n;
+        cell->c[1] = (hist->sum[i * 3 + 1] + n / 2) / n;
+        cell->c[2] = (hist->sum[i * 3 + 2] + n / 2) / n;
+        cell->count = n;
+        (*ncells)++;
+    }
+    return cells;
+}
+
+static unsigned int cgpro_median_cut(struct cgpro_cell *cells, unsigned int ncells, struct cgpro_box *boxes, unsigned int colors)
+{
+    unsigned int nboxes = 1, i;
+
+    boxes[0].start = 0;
+    boxes[0].end = ncells;
+    cgpro_box_shrink(&boxes[0], cells);
+    while (nboxes < colors) {
+        struct cgpro_box *box = NULL, *split;
+        unsigned long half, seen = 0;
+        unsigned int mid;
+        /* split the box covering the most pixels over the widest range */
+        for (i = 0; i < nboxes; i++)
+            if (boxes[i].end - boxes[i].start > 1
+                && (!box || (double) boxes[i].count * boxes[i].range > (double) box->count * box->range))
+                box = &boxes[i];
+        if (!box)
+            break;
+
+        qsort(&cells[box->start], box->end - box->start, sizeof(struct cgpro_cell), cgpro_cell_cmp[box->axis]);
+        half = box->count / 2;
+        for (mid = box->start; mid < box->end - 2; mid++) {
+            seen += cells[mid].count;
+            if (seen >= half)
+                break;
+        }
+        split = &boxes[nboxes++];
+        split->start = mid + 1;
+        split->end = box->end;
+        box->end = mid + 1;
+        cgpro_box_shrink(box, cells);
+        cgpro_box_shrink(split, cells);
+    }
+    return nboxes;
+}
+
+/* refines the boxes' means, writing them to palette entries 1..nboxes */
+static int cgpro_kmeans(struct cgpro_cell *cells, unsigned int ncells, struct cgpro_box *boxes, unsigned int nboxes, unsigned char *palette)
 {
-    unsigned int old_width = target->width;
-    unsigned int old_height = target->height;
-    float width_ratio = old_width / (float) new_width;
-    float height_ratio = old_height / (float) new_height;
-    unsigned int i, j;
-    unsigned char *new_data;
-    unsigned char *old_data = target->data;
+    unsigned int *owner = malloc(ncells * sizeof(unsigned int));
+    double *acc = malloc(nboxes * 4 * sizeof(double));
+    unsigned int i, j, pass;
 
-    if (!old_data)
+    if (!owner || !acc) {
+        free(owner);
+        free(acc);
         return 0;
-    new_data = malloc(4 * new_width * new_height * sizeof(unsigned char));
-    if (!new_data)
+    }
+    for (i = 0; i < nboxes; i++)
+        for (j = boxes[i].start; j < boxes[i].end; j++)
+            owner[j] = i;
+
+    for (pass = 0; pass <= CGPRO_KMEANS_PASSES; pass++) {
+        memset(acc, 0, nboxes * 4 * sizeof(double));
+        for (j = 0; j < ncells; j++) {
+            double *a = &acc[owner[j] * 4];
+            a[0] += (double) cells[j].c[0] * cells[j].count;
+            a[1] += (double) cells[j].c[1] * cells[j].count;
+            a[2] += (double) cells[j].c[2] * cells[j].count;
+            a[3] += cells[j].count;
+        }
+        for (i = 0; i < nboxes; i++) {
+            unsigned char *p = &palette[(i + 1) * 3];
+            double *a = &acc[i * 4];
+            if (a[3] == 0)
+                continue; /* emptied clusters keep their last centroid */
+            p[0] = a[0] / a[3] + 0.5;
+            p[1] = a[1] / a[3] + 0.5;
+            p[2] = a[2] / a[3] + 0.5;
+        }
+        if (pass == CGPRO_KMEANS_PASSES)
+            break;
+
+        for (j = 0; j < ncells; j++) {
+            long best = LONG_MAX;
+            for (i = 0; i < nboxes; i++) {
+                const unsigned char *p = &palette[(i + 1) * 3];
+                long dr = cells[j].c[0] - p[0], dg = cells[j].c[1] - p[1], db = cells[j].c[2] - p[2];
+                long d = dr * dr * 30 + dg * dg * 59 + db * db * 11;
+                if (d < best) {
+                    best = d;
+                    owner[j] = i;
+                }
+            }
+        }
+    }
+
+    free(owner);
+    free(acc);
+    return 1;
+}
+
+/*
+ * median cut over the histogram, then a few k-means passes to pull the
+ * boxes' means onto the clusters median cut only roughly found. palette
+ * index 0 stays the transparent slot, so the palette holds colors + 1.
+ */
+struct cgpro_palette cgpro_palette_generate(struct cgpro_histogram *hist, unsigned int colors)
+{
+    struct cgpro_palette out = { 0 };
+    struct cgpro_cell *cells;
+    struct cgpro_box *boxes;
+    unsigned int ncells, nboxes;
+
+    if (!hist->count || colors == 0)
+        return out;
+    cells = cgpro_histogram_cells(hist, &ncells);
+    boxes = malloc(colors * sizeof(struct cgpro_box));
+    if (cells && boxes && ncells > 0) {
+        nboxes = cgpro_median_cut(cells, ncells, boxes, colors);
+        out.data = cgmem_alloc((nboxes + 1) * 3);
+        if (out.data)
+            memset(out.data, 0, (nboxes + 1) * 3);
+        if (out.data && cgpro_kmeans(cells, ncells, boxes, nboxes, out.data)) {
+            out.num = nboxes + 1;
+        } else {
+            cgmem_free(out.data);
+            out.data = NULL;
+        }
+    }
+    free(cells);
+    free(boxes);
+    return out;
+}
+
+/*
+ * rows are handed out in order off a shared counter, so any row a worker
+ * waits on has already been claimed by a worker that is running it.
+ */
+struct cgpro_rows {
+    struct cgapi_map *target;
+    struct cgpro_palette palette;
+    unsigned int next_row;
+
+    /* scaling only */
+    struct cgapi_map *scale_source;
+    unsigned int *scale_x; /* nearest source column per target column */
+    float height_ratio;
+
+    /* channel combining only */
+    struct cgapi_map *source;
+    unsigned int channel, source_channel;
+    unsigned int *source_x; /* nearest source column per target column */
+
+    /* error diffusion only */
+    const struct cgpro_diffusion_kernel *kernel;
+    unsigned int *progress; /* pixels finished per row */
+    int *error; /* ring of (width + 2 * pad) * 3 weighted errors per row */
+    unsigned int ring, depth, lag, stride;
+
+    /* mipmaps only */
+    struct cgapi_map *mip_source;
+    enum cgformat_kind mip_kind;
+};
+
+typedef void (*cgpro_row_fn)(struct cgpro_rows *rows, struct cgpro_cache *cache, unsigned int y);
+
+struct cgpro_worker {
+    struct cgpro_rows *rows;
+    cgpro_row_fn fn;
+};
+
+static void cgpro_rows_worker(void *ud)
+{
+    struct cgpro_worker *w = (struct cgpro_worker *) ud;
+    struct cgpro_cache *cache = NULL;
+    unsigned int y;
+    if (w->rows->palette.data)
+        cache = malloc(sizeof(struct cgpro_cache));
+    /* no cache just means every lookup goes to the palette */
+    if (cache)
+        cgpro_cache_reset(cache);
+    while ((y = __atomic_fetch_add(&w->rows->next_row, 1, __ATOMIC_RELAXED)) < w->rows->target->height)
+        w->fn(w->rows, cache, y);
+    if (cache) {
+        __atomic_fetch_add(&cgpro_cache_hits, cache->hits, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cgpro_cache_misses, cache->misses, __ATOMIC_RELAXED);
+        free(cache);
+    }
+}
+
+static void cgpro_run_rows(struct cgpro_rows *rows, cgpro_row_fn fn)
+{
+    struct cgpro_worker worker;
+    struct cgpool_group group = { 0 };
+    unsigned int i, n = cgpro_workers();
+
+    if (n > rows->target->height)
+        n = rows->target->height;
+
+    worker.rows = rows;
+    worker.fn = fn;
+    rows->next_row = 0;
+    /*
+     * the calling thread always takes part, so helpers that start late
+     * or not at all only cost speed.
+     */
+    for (i = 1; i < n; i++)
+        if (!cgpool_submit(cgpro_pool, &group, cgpro_rows_worker, &worker))
+            break;
+    cgpro_rows_worker(&worker);
+    if (cgpro_pool)
+        cgpool_wait(cgpro_pool, &group);
+}
+
+static struct cgpro_color cgpro_pixel_get(const unsigned char *p)
+{
+    struct cgpro_color c;
+    c.r = p[0];
+    c.g = p[1];
+    c.b = p[2];
+    c.a = p[3];
+    return c;
+}
+
+/* row y of width pixels at p */
+static void cgpro_bayer_pixels(struct cgpro_palette palette, struct cgpro_cache *cache, unsigned char *p, unsigned int width, unsigned int y)
+{
+    unsigned int x;
+    for (x = 0; x < width; x++, p += 4) {
+        unsigned int idx = cgpro_palette_bayer8x8(palette, cache, cgpro_pixel_get(p), x, y);
+        struct cgpro_color newcol = cgpro_palette_get_idx(palette, idx);
+        p[0] = newcol.r;
+        p[1] = newcol.g;
+        p[2] = newcol.b;
+    }
+}
+
+static void cgpro_bayer_row(struct cgpro_rows *rows, struct cgpro_cache *cache, unsigned int y)
+{
+    struct cgapi_map *target = rows->target;
+    cgpro_bayer_pixels(rows->palette, cache, &target->data[y * target->width * 4], target->width, y);
+}
+
+static void cgpro_wait_progress(struct cgpro_rows *rows, unsigned int y, unsigned int x)
+{
+    while (__atomic_load_n(&rows->progress[y], __ATOMIC_ACQUIRE) < x)
+        sched_yield();
+}
+
+static int *cgpro_error_row(struct cgpro_rows *rows, unsigned int y)
+{
+    return &rows->error[(y % rows->ring) * rows->stride + CGPRO_DIFFUSION_PAD * 3];
+}
+
+static int cgpro_clamp(int x)
+{
+    return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+static void cgpro_diffuse_row(struct cgpro_rows *rows, struct cgpro_cache *cache, unsigned int y)
+{
+    const struct cgpro_diffusion_kernel *k = rows->kernel;
+    struct cgapi_map *target = rows->target;
+    unsigned int width = target->width, height = target->height;
+    unsigned char *p = &target->data[y * width * 4];
+    int *err = cgpro_error_row(rows, y);
+    int *below[CGPRO_DIFFUSION_PAD + 1];
+    int ahead[CGPRO_DIFFUSION_PAD + 1][3];
+    int round = 1 << (k->shift - 1);
+    unsigned int x, ready = y > 0 ? 0 : width, i;
+
+    /* recycle the ring slot the deepest tap writes into once its old row is done */
+    if (y + rows->depth >= rows->ring) {
+        unsigned int old = y + rows->depth - rows->ring;
+        cgpro_wait_progress(rows, old, width);
+        memset(cgpro_error_row(rows, y + rows->depth) - CGPRO_DIFFUSION_PAD * 3, 0, rows->stride * sizeof(int));
+    }
+    for (i = 1; i <= rows->depth; i++)
+        below[i] = y + i < height ? cgpro_error_row(rows, y + i) : NULL;
+    memset(ahead, 0, sizeof ahead);
+
+    for (x = 0; x < width; x++, p += 4) {
+        struct cgpro_color c, pc;
+        int e[3];
+        int t;
+
+        /* the row above has to be done with everything that diffuses into x */
+        if (ready < width && ready < x + rows->lag) {
+            cgpro_wait_progress(rows, y - 1, x + rows->lag < width ? x + rows->lag : width);
+            ready = __atomic_load_n(&rows->progress[y - 1], __ATOMIC_ACQUIRE);
+        }
+
+        c = cgpro_pixel_get(p);
+        if (c.a != 0) {
+            c.r = cgpro_clamp(c.r + ((err[x * 3 + 0] + ahead[0][0] + round) >> k->shift));
+            c.g = cgpro_clamp(c.g + ((err[x * 3 + 1] + ahead[0][1] + round) >> k->shift));
+            c.b = cgpro_clamp(c.b + ((err[x * 3 + 2] + ahead[0][2] + round) >> k->shift));
+            pc = cgpro_palette_get_idx(rows->palette, cgpro_cache_nearest(cache, rows->palette, c));
+            e[0] = c.r - pc.r;
+            e[1] = c.g - pc.g;
+            e[2] = c.b - pc.b;
+        } else {
+            /* fully transparent pixels neither take nor pass on error */
+            pc = cgpro_palette_get_idx(rows->palette, 0);
+            e[0] = e[1] = e[2] = 0;
+        }
+        p[0] = pc.r;
+        p[1] = pc.g;
+        p[2] = pc.b;
+
+        memmove(ahead[0], ahead[1], sizeof ahead - sizeof ahead[0]);
+        memset(ahead[CGPRO_DIFFUSION_PAD], 0, sizeof ahead[0]);
+        for (t = 0; t < k->tap_count; t++) {
+            const struct cgpro_diffusion_tap *tap = &k->taps[t];
+            int *dst;
+            if (tap->dy == 0)
+                dst = ahead[tap->dx - 1];
+            else if (below[tap->dy])
+                dst = &below[tap->dy][((int) x + tap->dx) * 3];
+            else
+                continue;
+            dst[0] += e[0] * tap->weight;
+            dst[1] += e[1] * tap->weight;
+            dst[2] += e[2] * tap->weight;
+        }
+
+        if ((x + 1) % CGPRO_PROGRESS_STEP == 0)
+            __atomic_store_n(&rows->progress[y], x + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&rows->progress[y], width, __ATOMIC_RELEASE);
+}
+
+static void cgpro_combine_row(struct cgpro_rows *rows, struct cgpro_cache *cache, unsigned int y)
+{
+    struct cgapi_map *target = rows->target, *source = rows->source;
+    unsigned int sy = (unsigned long) y * source->height / target->height;
+    unsigned char *dst = &target->data[y * target->width * 4] + rows->channel;
+    const unsigned char *src = &source->data[sy * source->width * 4] + rows->source_channel;
+    unsigned int x = 0;
+
+    if (!rows->source_x) {
+#ifdef __SSE2__
+        /* same width: move the channel 4 pixels at a time */
+        const unsigned char *s = src - rows->source_channel;
+        unsigned char *d = dst - rows->channel;
+        __m128i keep = _mm_set1_epi32(~(0xFFu << (rows->channel * 8)));
+        __m128i take = _mm_set1_epi32(0xFF);
+        __m128i from = _mm_cvtsi32_si128(rows->source_channel * 8);
+        __m128i to = _mm_cvtsi32_si128(rows->channel * 8);
+        for (; x + 4 <= target->width; x += 4, s += 16, d += 16) {
+            __m128i v = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128((const __m128i *) s), from), take);
+            __m128i o = _mm_and_si128(_mm_loadu_si128((const __m128i *) d), keep);
+            _mm_storeu_si128((__m128i *) d, _mm_or_si128(o, _mm_sll_epi32(v, to)));
+        }
+#endif
+        for (; x < target->width; x++)
+            dst[x * 4] = src[x * 4];
+        return;
+    }
+    for (; x < target->width; x++)
+        dst[x * 4] = src[rows->source_x[x] * 4];
+}
+
+/* nearest source column per target column */
+static unsigned int *cgpro_scale_columns(unsigned int width, unsigned int new_width)
+{
+    float width_ratio = width / (float) new_width;
+    unsigned int *scale_x = malloc(new_width * sizeof(unsigned int));
+    unsigned int x;
+    if (scale_x)
+        for (x = 0; x < new_width; x++)
+            scale_x[x] = x * width_ratio;
+    return scale_x;
+}
+
+/* nearest source row of target row y */
+static unsigned int cgpro_scale_y(unsigned int y, float height_ratio)
+{
+    return y * height_ratio;
+}
+
+static void cgpro_scale_pixels(unsigned char *dst, const unsigned char *src, const unsigned int *scale_x, unsigned int width)
+{
+    unsigned int x;
+    for (x = 0; x < width; x++, dst += 4) {
+        const unsigned char *old = &src[scale_x[x] * 4];
+        dst[0] = old[0]; /* r */
+        dst[1] = old[1]; /* g */
+        dst[2] = old[2]; /* b */
+        dst[3] = old[3]; /* a */
+    }
+}
+
+static void cgpro_scale_row(struct cgpro_rows *rows, unsigned int y)
+{
+    struct cgapi_map *target = rows->target, *source = rows->scale_source;
+    unsigned int sy = cgpro_scale_y(y, rows->height_ratio);
+    cgpro_scale_pixels(&target->data[y * target->width * 4], &source->data[sy * source->width * 4], rows->scale_x, target->width);
+}
+
+/* every operator runs on a row before the next row is touched */
+static void cgpro_pipeline_row(struct cgpro_rows *rows, struct cgpro_cache *cache, unsigned int y)
+{
+    if (rows->scale_source)
+        cgpro_scale_row(rows, y);
+    if (rows->source)
+        cgpro_combine_row(rows, cache, y);
+    if (rows->kernel)
+        cgpro_diffuse_row(rows, cache, y);
+    else if (rows->palette.data)
+        cgpro_bayer_row(rows, cache, y);
+}
+
+static void cgpro_rows_free(struct cgpro_rows *rows)
+{
+    free(rows->scale_x);
+    free(rows->source_x);
+    free(rows->progress);
+    free(rows->error);
+}
+
+/*
+ * error diffusion runs as a skewed wavefront: a row may only start on
+ * pixel x once the row above has finished the pixels diffusing into it.
+ */
+static int cgpro_rows_diffusion(struct cgpro_rows *rows, enum cgpro_dither dither)
+{
+    unsigned int width = rows->target->width, height = rows->target->height;
+    int t;
+
+    rows->kernel = &diffusion_kernels[dither];
+    for (t = 0; t < rows->kernel->tap_count; t++) {
+        const struct cgpro_diffusion_tap *tap = &rows->kernel->taps[t];
+        if ((unsigned int) tap->dy > rows->depth)
+            rows->depth = tap->dy;
+        /* pixel x of a row hears from pixel x - dx of the row above */
+        if (tap->dy == 1 && 1 - tap->dx > (int) rows->lag)
+            rows->lag = 1 - tap->dx;
+    }
+    rows->ring = cgpro_workers() + rows->depth + 1;
+    rows->stride = (width + 2 * CGPRO_DIFFUSION_PAD) * 3;
+    rows->progress = calloc(height, sizeof(unsigned int));
+    rows->error = calloc(rows->ring * rows->stride, sizeof(int));
+    return rows->progress && rows->error;
+}
+
+int cgpro_pipeline_run(struct cgpro_pipeline *pipeline, struct cgapi_map *target)
+{
+    struct cgpro_rows rows = { 0 };
+    struct cgapi_map out = *target;
+    unsigned int x;
+    int ok = 1;
+
+    if (!target->data)
         return 0;
+    rows.target = &out;
+
+    if (pipeline->width && pipeline->height) {
+        out.width = pipeline->width;
+        out.height = pipeline->height;
+        out.data = cgmem_alloc(4 * out.width * out.height * sizeof(unsigned char));
+        rows.scale_x = cgpro_scale_columns(target->width, out.width);
+        if (!out.data || !rows.scale_x) {
+            cgmem_free(out.data);
+            free(rows.scale_x);
+            return 0;
+        }
+        rows.height_ratio = target->height / (float) pipeline->height;
+        rows.scale_source = target;
+    }
+
+    if (pipeline->combine && pipeline->combine->data) {
+        struct cgapi_map *source = pipeline->combine;
+        rows.source = source;
+        rows.channel = pipeline->combine_channel;
+        rows.source_channel = pipeline->combine_source_channel;
+        if (rows.channel > 3 || rows.source_channel > 3) {
+            ok = 0;
+        } else if (source->width != out.width) {
+            rows.source_x = malloc(out.width * sizeof(unsigned int));
+            if (rows.source_x)
+                for (x = 0; x < out.width; x++)
+                    rows.source_x[x] = (unsigned long) x * source->width / out.width;
+            else
+                ok = 0;
+        }
+    }
 
-    for (i = 0; i < new_width; i++) {
-        for (j = 0; j < new_height; j++) {
-            unsigned int nearest_i = i * width_ratio;
-            unsigned int nearest_j = j * height_ratio;
-            unsigned char *new = &new_data[(j * new_width + i) * 4];
-            unsigned char *old = &old_data[(nearest_j * old_width + nearest_i) * 4];
-            new[0] = old[0]; /* r */
-            new[1] = old[1]; /* g */
-            new[2] = old[2]; /* b */
-            new[3] = old[3]; /* a */
+    if (ok && pipeline->palette.data) {
+        rows.palette = pipeline->palette;
+        if (pipeline->dither != cgpro_dither_bayer8x8)
+            ok = cgpro_rows_diffusion(&rows, pipeline->dither);
+    }
+
+    if (ok)
+        cgpro_run_rows(&rows, cgpro_pipeline_row);
+    cgpro_rows_free(&rows);
+
+    if (out.data != target->data) {
+        if (!ok) {
+            cgmem_free(out.data);
+            return 0;
         }
+        cgmem_free(target->data);
+        *target = out;
+    }
+    return ok;
+}
+
+/*
+ * takes the source a row at a time, top to bottom, and hands on each
+ * output row as soon as the source row it is sampled from is in. the
+ * nearest scale needs no more of the source than that one row, and bayer
+ * only its position, so nothing the size of the map is ever held.
+ * pipelines that combine or diffuse error need the whole map.
+ */
+int cgpro_stream_init(struct cgpro_stream *stream, struct cgpro_pipeline *pipeline,
+        unsigned int width, unsigned int height, cgpro_stream_fn fn, void *ud)
+{
+    memset(stream, 0, sizeof *stream);
+    if (pipeline->combine || (pipeline->palette.data && pipeline->dither != cgpro_dither_bayer8x8))
+        return 0;
+    stream->palette = pipeline->palette;
+    stream->fn = fn;
+    stream->ud = ud;
+    stream->width = width;
+    stream->height = height;
+    stream->height_ratio = 1;
+    if (pipeline->width && pipeline->height) {
+        stream->width = pipeline->width;
+        stream->height = pipeline->height;
+        stream->height_ratio = height / (float) pipeline->height;
+        if (!(stream->scale_x = cgpro_scale_columns(width, stream->width)))
+            return 0;
+    }
+    stream->row = malloc(stream->width * 4);
+    if (stream->palette.data && (stream->cache = malloc(sizeof(struct cgpro_cache))))
+        cgpro_cache_reset(stream->cache);
+    if (!stream->row) {
+        cgpro_stream_free(stream);
+        return 0;
+    }
+    return 1;
+}
+
+/* source row sy, after every row above it */
+int cgpro_stream_row(struct cgpro_stream *stream, const unsigned char *rgba, unsigned int sy)
+{
+    unsigned int y;
+    for (y = stream->next; y < stream->height; y++) {
+        if ((stream->scale_x ? cgpro_scale_y(y, stream->height_ratio) : y) != sy)
+            break;
+        if (stream->scale_x)
+            cgpro_scale_pixels(stream->row, rgba, stream->scale_x, stream->width);
+        else
+            memcpy(stream->row, rgba, stream->width * 4);
+        if (stream->palette.data)
+            cgpro_bayer_pixels(stream->palette, stream->cache, stream->row, stream->width, y);
+        if (!stream->fn(stream->ud, stream->row, y))
+            return 0;
+    }
+    stream->next = y;
+    return 1;
+}
+
+void cgpro_stream_free(struct cgpro_stream *stream)
+{
+    if (stream->cache) {
+        __atomic_fetch_add(&cgpro_cache_hits, stream->cache->hits, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cgpro_cache_misses, stream->cache->misses, __ATOMIC_RELAXED);
     }
+    free(stream->cache);
+    free(stream->scale_x);
+    free(stream->row);
+    stream->cache = NULL;
+    stream->scale_x = NULL;
+    stream->row = NULL;
+}
+
+/* DirectX and OpenGL normal maps only differ by the sign of green */
+int cgpro_flip_green(struct cgapi_map *target, struct cgapi_map *source)
+{
+    unsigned int i = 0, n = source->width * source->height * 4;
+    const unsigned char *src = source->data;
+    unsigned char *dst;
 
-    free(old_data);
-    target->data = new_data;
-    target->width = new_width;
-    target->height = new_height;
+    if (!src)
+        return 0;
+    dst = cgmem_alloc(n);
+    if (!dst)
+        return 0;
+#ifdef __SSE2__
+    {
+        __m128i green = _mm_set1_epi32(0x0000FF00);
+        for (; i + 16 <= n; i += 16)
+            _mm_storeu_si128((__m128i *) &dst[i], _mm_xor_si128(_mm_loadu_si128((const __m128i *) &src[i]), green));
+    }
+#endif
+    for (; i < n; i += 4) {
+        dst[i + 0] = src[i + 0];
+        dst[i + 1] = 255 - src[i + 1];
+        dst[i + 2] = src[i + 2];
+        dst[i + 3] = src[i + 3];
+    }
+    cgmem_free(target->data);
+    target->data = dst;
+    target->width = source->width;
+    target->height = source->height;
+    return 1;
+}
+
+int cgpro_quantize_to(struct cgapi_map *target, struct cgpro_palette palette, enum cgpro_dither dither)
+{
+    struct cgpro_pipeline pipeline = { 0 };
+    if (!palette.data)
+        return 0;
+    pipeline.palette = palette;
+    pipeline.dither = dither;
+    return cgpro_pipeline_run(&pipeline, target);
+}
+
+/*
+ * copies one channel of source into one channel of target, e.g. opacity
+ * into alpha. source is sampled nearest-neighbour when the sizes differ.
+ */
+int cgpro_combine_channel(struct cgapi_map *target, unsigned int channel, struct cgapi_map *source, unsigned int source_channel)
+{
+    struct cgpro_pipeline pipeline = { 0 };
+    if (!source->data)
+        return 0;
+    pipeline.combine = source;
+    pipeline.combine_channel = channel;
+    pipeline.combine_source_channel = source_channel;
+    return cgpro_pipeline_run(&pipeline, target);
+}
+
+int cgpro_scale_nearest(struct cgapi_map *target, unsigned int new_width, unsigned int new_height)
+{
+    struct cgpro_pipeline pipeline = { 0 };
+    pipeline.width = new_width;
+    pipeline.height = new_height;
+    if (!cgpro_pipeline_run(&pipeline, target))
+        return 0;
     return 4 * new_width * new_height * sizeof(unsigned char);
 }
+
+static unsigned char cgpro_unit(float v)
+{
+    return (v + 1) * 127.5f + 0.5f;
+}
+
+static void cgpro_mip_row(struct cgpro_rows *rows, struct cgpro_cache *cache, unsigned int y)
+{
+    const struct cgapi_map *source = rows->mip_source;
+    unsigned int width = rows->target->width, sy = y * 2 + 1 < source->height ? y * 2 + 1 : y * 2, x, x1, c;
+    const unsigned char *r0 = &source->data[(size_t) y * 2 * source->width * 4], *r1 = &source->data[(size_t) sy * source->width * 4];
+    const unsigned char *p[4];
+    unsigned char *dst = &rows->target->data[(size_t) y * width * 4];
+    float v[3], len;
+
+    (void) cache;
+    for (x = 0; x < width; x++, dst += 4) {
+        x1 = x * 2 + 1 < source->width ? x * 2 + 1 : x * 2;
+        p[0] = r0 + x * 8;
+        p[1] = r0 + x1 * 4;
+        p[2] = r1 + x * 8;
+        p[3] = r1 + x1 * 4;
+        dst[3] = (p[0][3] + p[1][3] + p[2][3] + p[3][3] + 2) / 4;
+        switch (rows->mip_kind) {
+        case cgformat_kind_color:
+            for (c = 0; c < 3; c++)
+                dst[c] = cgpro_srgb[(int) ((cgpro_linear[p[0][c]] + cgpro_linear[p[1][c]] + cgpro_linear[p[2][c]]
+                            + cgpro_linear[p[3][c]]) * (4095 / 4.0f) + 0.5f)];
+            break;
+        case cgformat_kind_normal:
+            for (c = 0, len = 0; c < 3; c++) {
+                v[c] = (p[0][c] + p[1][c] + p[2][c] + p[3][c]) / 510.0f - 1;
+                len += v[c] * v[c];
+            }
+            len = sqrt(len);
+            for (c = 0; c < 3; c++)
+                dst[c] = len > 0 ? cgpro_unit(v[c] / len) : c == 2 ? 255 : 128;
+            break;
+        default:
+            for (c = 0; c < 3; c++)
+                dst[c] = (p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) / 4;
+        }
+    }
+}
+
+/* levels in a full mip chain of a width by height map, down to 1x1 */
+unsigned int cgpro_mip_levels(unsigned int width, unsigned int height)
+{
+    unsigned int levels = 1;
+    while (width > 1 || height > 1) {
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        levels++;
+    }
+    return levels;
+}
+
+/*
+ * the mip level after width by height rgba, each side halved down to 1,
+ * in a cgmem buffer. every pixel averages the 2x2 it covers: color in
+ * linear light, normals as vectors made unit length again, the rest as
+ * they are. rows are spread over the pool like the pipeline's.
+ */
+unsigned char *cgpro_mipmap(const unsigned char *rgba, unsigned int width, unsigned int height, enum cgformat_kind kind)
+{
+    struct cgpro_rows rows = { 0 };
+    struct cgapi_map source = { 0 }, out = { 0 };
+
+    source.data = (unsigned char *) rgba;
+    source.width = width;
+    source.height = height;
+    out.width = width > 1 ? width / 2 : 1;
+    out.height = height > 1 ? height / 2 : 1;
+    if (!(out.data = cgmem_alloc((size_t) out.width * out.height * 4)))
+        return NULL;
+    rows.target = &out;
+    rows.mip_source = &source;
+    rows.mip_kind = kind;
+    cgpro_run_rows(&rows, cgpro_mip_row);
+    return out.data;
+}
@@ -4,6 +4,8 @@
 
 #include "cgapi.h"
 
+struct cgpool;
+
 struct cgpro_color {
     unsigned char r, g, b, a;
 };
@@ -13,16 +15,87 @@ struct cgpro_palette {
     unsigned int num;
 };
 
+/* colors of one or more maps, reduced to 5 bits per channel */
+struct cgpro_histogram {
+    unsigned long *count;
+    unsigned long *sum; /* per-bin r, g, b totals for exact bin means */
+};
+
+#define CGPRO_CACHE_BITS 12
+
+/* direct-mapped memo of cgpro_palette_nearest, one per thread and palette */
+struct cgpro_cache {
+    struct cgpro_cache_entry {
+        unsigned int key;
+        int idx; /* -1 when empty */
+    } entries[1 << CGPRO_CACHE_BITS];
+    unsigned long hits, misses;
+};
+
+enum cgpro_dither {
+    cgpro_dither_bayer8x8,
+    cgpro_dither_floyd_steinberg,
+    cgpro_dither_atkinson,
+    cgpro_dither_sierra_lite
+};
+
+/*
+ * per-map operators, run in this order in a single pass over the output:
+ * nearest scale, channel combine, then quantize. unset stages are skipped.
+ */
+struct cgpro_pipeline {
+    unsigned int width, height; /* scale to, 0 keeps the map's size */
+    struct cgapi_map *combine; /* e.g. opacity, sampled to the output size */
+    unsigned int combine_channel, combine_source_channel;
+    struct cgpro_palette palette; /* quantize when data is set */
+    enum cgpro_dither dither;
+};
+
+/* takes output row y of a cgpro_stream, returns 0 to stop */
+typedef int (*cgpro_stream_fn)(void *ud, const unsigned char *rgba, unsigned int y);
+
+/* a pipeline run over a source fed to it a row at a time */
+struct cgpro_stream {
+    unsigned int width, height; /* of the output */
+    unsigned int *scale_x; /* NULL when not scaling */
+    float height_ratio;
+    unsigned int next; /* output row */
+    struct cgpro_palette palette;
+    struct cgpro_cache *cache;
+    unsigned char *row;
+    cgpro_stream_fn fn;
+    void *ud;
+};
+
 void cgpro_init(void);
+void cgpro_set_pool(struct cgpool *pool);
 
 struct cgpro_palette cgpro_palette_load_default(void);
 struct cgpro_palette cgpro_palette_load_from_file(const char *filename);
 struct cgpro_color cgpro_palette_get_idx(struct cgpro_palette P, unsigned int idx);
 unsigned int cgpro_palette_nearest(struct cgpro_palette P, struct cgpro_color c);
-unsigned int cgpro_palette_bayer8x8(struct cgpro_palette P, struct cgpro_color c, unsigned int x, unsigned int y);
+unsigned int cgpro_palette_bayer8x8(struct cgpro_palette P, struct cgpro_cache *cache, struct cgpro_color c, unsigned int x, unsigned int y);
+void cgpro_cache_reset(struct cgpro_cache *cache);
+unsigned int cgpro_cache_nearest(struct cgpro_cache *cache, struct cgpro_palette P, struct cgpro_color c);
+void cgpro_cache_stats(unsigned long *hits, unsigned long *misses);
+int cgpro_palette_save(struct cgpro_palette P, const char *filename);
 void cgpro_palette_free(struct cgpro_palette palette);
 
-int cgpro_quantize_to(struct cgapi_map *target, struct cgpro_palette palette);
+struct cgpro_histogram cgpro_histogram_new(void);
+void cgpro_histogram_add(struct cgpro_histogram *hist, struct cgapi_map *map);
+struct cgpro_palette cgpro_palette_generate(struct cgpro_histogram *hist, unsigned int colors);
+void cgpro_histogram_free(struct cgpro_histogram hist);
+
+int cgpro_flip_green(struct cgapi_map *target, struct cgapi_map *source);
+int cgpro_pipeline_run(struct cgpro_pipeline *pipeline, struct cgapi_map *target);
+int cgpro_stream_init(struct cgpro_stream *stream, struct cgpro_pipeline *pipeline,
+        unsigned int width, unsigned int height, cgpro_stream_fn fn, void *ud);
+int cgpro_stream_row(struct cgpro_stream *stream, const unsigned char *rgba, unsigned int sy);
+void cgpro_stream_free(struct cgpro_stream *stream);
+int cgpro_quantize_to(struct cgapi_map *target, struct cgpro_palette palette, enum cgpro_dither dither);
+int cgpro_combine_channel(struct cgapi_map *target, unsigned int channel, struct cgapi_map *source, unsigned int source_channel);
 int cgpro_scale_nearest(struct cgapi_map *target, unsigned int new_width, unsigned int new_height);
+unsigned int cgpro_mip_levels(unsigned int width, unsigned int height);
+unsigned char *cgpro_mipmap(const unsigned char *rgba, unsigned int width, unsigned int height, enum cgformat_kind kind);
 
 #endif /* CGPRO_H_ */
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgqoi.h"
+
+/* bytes an encoder gathers before handing them on */
+#define CGQOI_BUFFER 65536
+/* header, and the end marker after the last pixel */
+#define CGQOI_HEADER 14
+#define CGQOI_PADDING 8
+
+#define CGQOI_OP_INDEX 0x00
+#define CGQOI_OP_DIFF 0x40
+#define CGQOI_OP_LUMA 0x80
+#define CGQOI_OP_RUN 0xC0
+#define CGQOI_OP_RGB 0xFE
+#define CGQOI_OP_RGBA 0xFF
+#define CGQOI_MASK 0xC0
+
+static const unsigned char cgqoi_padding[CGQOI_PADDING] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+/*
+ * one qoi on its way out: every pixel is a run of the last, one of the 64
+ * seen most recently by hash, a small step from the last, or itself.
+ * all it ever holds is that state and a buffer of output.
+ */
+struct cgqoi_encoder {
+    cgformat_sink sink;
+    void *ud;
+    unsigned int width;
+    int channels;
+    unsigned char index[64 * 4];
+    unsigned char prev[4];
+    unsigned int run;
+    size_t used;
+    unsigned char buf[CGQOI_BUFFER];
+};
+
+static void cgqoi_put32(unsigned char *p, unsigned long v)
+{
+    p[0] = (v >> 24) & 0xFF;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+static unsigned int cgqoi_hash(const unsigned char *p)
+{
+    return (p[0] * 3 + p[1] * 5 + p[2] * 7 + p[3] * 11) % 64;
+}
+
+static int cgqoi_flush(struct cgqoi_encoder *enc)
+{
+    int ok = !enc->used || enc->sink(enc->ud, enc->buf, enc->used);
+    enc->used = 0;
+    return ok;
+}
+
+static void cgqoi_end_run(struct cgqoi_encoder *enc)
+{
+    if (enc->run) {
+        enc->buf[enc->used++] = CGQOI_OP_RUN | (enc->run - 1);
+        enc->run = 0;
+    }
+}
+
+static void cgqoi_start(struct cgqoi_encoder *enc, unsigned int width, unsigned int height, int channels)
+{
+    memset(enc->index, 0, sizeof enc->index);
+    enc->prev[0] = enc->prev[1] = enc->prev[2] = 0;
+    enc->prev[3] = 255;
+    enc->run = 0;
+    enc->width = width;
+    enc->channels = channels;
+    memcpy(enc->buf, "qoif", 4);
+    cgqoi_put32(enc->buf + 4, width);
+    cgqoi_put32(enc->buf + 8, height);
+    enc->buf[12] = channels;
+    enc->buf[13] = 0; /* srgb, only ever informative */
+    enc->used = CGQOI_HEADER;
+}
+
+/* encodes the next row, a width of rgba pixels */
+static int cgqoi_put_row(struct cgqoi_encoder *enc, const unsigned char *rgba)
+{
+    unsigned char px[4], *out;
+    unsigned int x, h;
+
+    for (x = 0; x < enc->width; x++, rgba += 4) {
+        /* the most a pixel can take, with a run before it */
+        if (enc->used + 6 > CGQOI_BUFFER && !cgqoi_flush(enc))
+            return 0;
+        memcpy(px, rgba, 4);
+        if (enc->channels == 3)
+            px[3] = 255;
+        if (!memcmp(px, enc->prev, 4)) {
+            if (++enc->run == 62)
+                cgqoi_end_run(enc);
+            continue;
+        }
+        cgqoi_end_run(enc);
+        out = enc->buf + enc->used;
+        h = cgqoi_hash(px);
+        if (!memcmp(enc->index + h * 4, px, 4)) {
+            *out++ = CGQOI_OP_INDEX | h;
+        } else {
+            memcpy(enc->index + h * 4, px, 4);
+            if (px[3] == enc->prev[3]) {
+                signed char vr = px[0] - enc->prev[0], vg = px[1] - enc->prev[1], vb = px[2] - enc->prev[2];
+                signed char vg_r = vr - vg, vg_b = vb - vg;
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    *out++ = CGQOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                    *out++ = CGQOI_OP_LUMA | (vg + 32);
+                    *out++ = (vg_r + 8) << 4 | (vg_b + 8);
+                } else {
+                    *out++ = CGQOI_OP_RGB;
+                    memcpy(out, px, 3);
+                    out += 3;
+                }
+            } else {
+                *out++ = CGQOI_OP_RGBA;
+                memcpy(out, px, 4);
+                out += 4;
+            }
+        }
+        enc->used = out - enc->buf;
+        memcpy(enc->prev, px, 4);
+    }
+    return 1;
+}
+
+static int cgqoi_finish(struct cgqoi_encoder *enc)
+{
+    if (enc->used + 1 + CGQOI_PADDING > CGQOI_BUFFER && !cgqoi_flush(enc))
+        return 0;
+    cgqoi_end_run(enc);
+    memcpy(enc->buf + enc->used, cgqoi_padding, CGQOI_PADDING);
+    enc->used += CGQOI_PADDING;
+    return cgqoi_flush(enc);
+}
+
+/* 4 channels when anything is not opaque, 3 otherwise */
+int cgqoi_encode(const unsigned char *rgba, unsigned int width, unsigned int height, cgformat_sink sink, void *ud)
+{
+    struct cgqoi_encoder *enc;
+    size_t i, n = (size_t) width * height;
+    unsigned int y;
+    int channels = 3, ok;
+
+    for (i = 0; i < n; i++)
+        if (rgba[i * 4 + 3] != 255) {
+            channels = 4;
+            break;
+        }
+    if (!(enc = cgqoi_encoder_new(width, height, channels, sink, ud)))
+        return 0;
+    for (y = 0, ok = 1; ok && y < height; y++)
+        ok = cgqoi_put_row(enc, rgba + (size_t) y * width * 4);
+    ok = ok && cgqoi_finish(enc);
+    cgqoi_encoder_free(enc);
+    return ok;
+}
+
+/*
+ * an encoder taking rows one at a time. qoi only stores rgb or rgba, so
+ * channels of 1 and 2 are taken as 3 and 4.
+ */
+struct cgqoi_encoder *cgqoi_encoder_new(unsigned int width, unsigned int height, int channels, cgformat_sink sink, void *ud)
+{
+    struct cgqoi_encoder *enc;
+    if (!width || !height || channels < 1 || channels > 4)
+        return NULL;
+    if (!(enc = malloc(sizeof(struct cgqoi_encoder))))
+        return NULL;
+    enc->sink = sink;
+    enc->ud = ud;
+    cgqoi_start(enc, width, height, channels == 2 || channels == 4 ? 4 : 3);
+    return enc;
+}
+
+int cgqoi_encoder_row(struct cgqoi_encoder *enc, const unsigned char *rgba)
+{
+    return cgqoi_put_row(enc, rgba);
+}
+
+/* ends the qoi once every row is in */
+int cgqoi_encoder_finish(struct cgqoi_encoder *enc)
+{
+    return cgqoi_finish(enc);
+}
+
+void cgqoi_encoder_free(struct cgqoi_encoder *enc)
+{
+    free(enc);
+}
@@ -0,0 +1,14 @@
+#ifndef CGQOI_H_
+#define CGQOI_H_
+
+#include "cgformat.h"
+
+struct cgqoi_encoder;
+
+int cgqoi_encode(const unsigned char *rgba, unsigned int width, unsigned int height, cgformat_sink sink, void *ud);
+struct cgqoi_encoder *cgqoi_encoder_new(unsigned int width, unsigned int height, int channels, cgformat_sink sink, void *ud);
+int cgqoi_encoder_row(struct cgqoi_encoder *enc, const unsigned char *rgba);
+int cgqoi_encoder_finish(struct cgqoi_encoder *enc);
+void cgqoi_encoder_free(struct cgqoi_encoder *enc);
+
+#endif /* CGQOI_H_ */
@@ -1,8 +1,10 @@
+#define _GNU_SOURCE /* strncasecmp */
 
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <string.h>
 
@@ -12,9 +14,38 @@
 
 #include "cgrip.h"
 #include "cgapi.h"
+#include "cgbcn.h"
+#include "cgdaemon.h"
+#include "cgformat.h"
+#include "cghash.h"
+#include "cglib.h"
+#include "cgmanifest.h"
+#include "cgmem.h"
+#include "cgpack.h"
+#include "cgpipe.h"
+#include "cgpool.h"
 #include "cgpro.h"
+#include "cgserve.h"
+#include "cgpix.h"
+#include "cgstore.h"
 #include "gen_godot4.h"
 
+/* materials allowed to wait between two pipeline stages */
+#define CGRIP_PIPE_DEPTH 1
+/* materials whose maps are in the pool at once */
+#define CGRIP_MAP_STAGE_WORKERS 2
+/* zips downloading at once unless --downloads says otherwise */
+#define CGRIP_DOWNLOADS 4
+/* threads encoding and writing maps unless --writers says otherwise */
+#define CGRIP_WRITERS 2
+/* most threads or downloads an option can ask for */
+#define CGRIP_COUNT_MAX 1024
+/* materials being written at once, past that the maps stage waits */
+#define CGRIP_SAVING 4
+/* palette files and godot roots a daemon keeps around between jobs */
+#define CGRIP_PALETTE_CACHE 16
+#define CGRIP_GODOT_CACHE 8
+
 struct arguments arguments = { 0 };
 
 struct usage {
@@ -28,9 +59,16 @@ struct usage {
     { "-a, --all", "Save all material maps found in the zips." },
     { "-z, --zip [DIR]", "Save material zip file, optionally to dir DIR. default: OUTPUT" },
     { "-s, --downscale SIZE", "Downscale exported matmaps. format: WxH" },
-    { "--quantize [PALETTE]", "Quantize with given palette or the default Aseprite palette." },
+    { "--format FORMAT", "Save matmaps as FORMAT. options: PNG, QOI, DDS, DDS-BC7, KTX2, KTX2-BC7. default: PNG" },
+    { "--mipmaps", "Save full mip chains in DDS and KTX2 maps." },
+    { "--zstd[=LEVEL]", "Zstandard supercompress KTX2 maps at LEVEL, when built with libzstd. default: 3" },
+    { "--quantize [PALETTE]", "Quantize with given palette or the default Aseprite palette. AUTO[:N] builds an N color palette. default N: 32" },
+    { "--dither METHOD", "Dithering used by --quantize. options: BAYER, FLOYD-STEINBERG, ATKINSON, SIERRA-LITE. default: BAYER" },
+    { "--shared-palette", "With --quantize AUTO, build one palette across all materials instead of one each." },
+    { "--save-palette", "Save palettes built by --quantize AUTO alongside the textures." },
     { "--macro SCALE", "When downscaling, multiply the size of non-albedo maps by this." },
     { "--gen-godot4", "Generate Godot 4 materials alongside the textures." },
+    { "-f, --force", "Make every material again, even those OUTPUT/.cgrip-manifest says are up to date." },
     { "--nearest", "Generate any in-game materials to use nearest filtering instead of linear." },
     { "--ao", "Save ambientocclusion matmap." },
     { "-c, --color", "Save color/albedo matmap. True by default if nothing specified." },
@@ -41,6 +79,19 @@ struct usage {
     { "--apply-opacity", "Instead of saving opacity matmap, applies it to the colormap." },
     { "-r, --roughness", "Save roughness matmap" },
     { "-n, --normal [TYPE]", "options: NONE, GL, DX, BOTH. unsupplied: NONE, otherwise default: GL" },
+    { "-j, --threads N", "Process maps on N threads. default: CPUs available to cgrip" },
+    { "--downloads N", "Keep N zips downloading at once, all on one thread. default: 4" },
+    { "--writers N", "Encode and write maps on N threads of their own, behind processing. default: 2" },
+    { "--max-memory SIZE", "Hold off downloads and decodes to stay within SIZE bytes, K, M or G suffixed. default: no limit" },
+    { "--huge-pages", "Back large image buffers with transparent huge pages." },
+    { "--serve[=PORT]", "Answer GET /ID/QUALITY/MAP?size=WxH&palette=P&dither=D&format=F on localhost with processed maps. default PORT: 8080" },
+    { "--cache-size SIZE", "Bytes of responses and zips --serve keeps in memory, K, M or G suffixed. default: 256M" },
+    { "--cache-dir DIR", "Also keep what --serve made in DIR, across restarts." },
+    { "--pack[=FILE]", "Write every map into one indexed pack FILE instead of a file each. default: OUTPUT/cgrip.pack" },
+    { "--store[=DIR]", "Keep finished maps in DIR and link them into any output that needs them again. default: ~/.cache/cgrip" },
+    { "--pixel-cache[=DIR]", "Keep every map decoded in DIR, so changing how it is processed skips decoding it again. default: ~/.cache/cgrip/pixels" },
+    { "--lz4", "LZ4 compress what --pixel-cache keeps. Smaller, but read back instead of mapped in." },
+    { "--daemon[=SOCKET]", "Stay up and run jobs sent to unix socket SOCKET, other options are their defaults. default: $XDG_RUNTIME_DIR/cgrip.sock" },
     { "--disable-color", "Force cgrip to not output terminal color. Fixes odd terminal output." },
     { 0 },
 };
@@ -54,36 +105,113 @@ const char *usage_text =
     "\n"
     "optional arguments";
 
-int strncat_s(char *dest, const char *src, int sz)
+/* which half of the work a maps stage does */
+enum run_stage {
+    run_stage_all,
+    run_stage_gather, /* decode and process, keep for the shared palette */
+    run_stage_finish /* quantize against the shared palette and save */
+};
+
+/* one batch of ids and everything they are processed with */
+struct run {
+    enum run_stage stage;
+    struct cgpool *pool;
+    struct cgpool *writers; /* encode and write what the pool made */
+    struct cglib_job job;
+    struct cglib_context ctx;
+    enum cgapi_quality quality;
+    unsigned long order; /* of the first material, against the memory budget */
+    struct cgdaemon_client *client; /* a daemon's job, NULL on the cli */
+    unsigned int done, total;
+    unsigned int downloads; /* in flight at once */
+    struct cgmanifest *manifest; /* of the output dir, while running */
+    struct cgstore *store; /* finished maps shared with other runs, NULL for none */
+    unsigned long params; /* hash of what the outputs depend on besides the zip */
+    const char *pack_path; /* --pack, "" for the default, NULL for a file per map */
+    struct cgpack *pack_old; /* the pack as the last run left it, while running */
+    struct cgpack_writer *pack; /* the maps of this run, while running */
+    unsigned verbose : 1;
+    unsigned force : 1; /* made again whatever the manifest says */
+    unsigned quantize : 1;
+    unsigned shared_palette : 1;
+    unsigned save_palette : 1;
+    unsigned gen_godot4 : 1;
+    unsigned free_palette : 1; /* the job's palette is its own */
+};
+
+/* options of the whole process, not of a run */
+struct process {
+    unsigned int threads;
+    unsigned int writers;
+    size_t budget;
+    const char *daemon; /* socket to serve jobs on, NULL to run once */
+    struct cgserve_options serve; /* answers http when port is set */
+    const char *store; /* dir of the store, "" for the default, NULL for none */
+    const char *pixels; /* dir of the pixel cache, "" for the default, NULL for none */
+    unsigned lz4 : 1;
+};
+
+/* prints library messages the same way as the cli's own */
+static void cgrip_log(void *ud, enum cglib_log_level level, const char *fmt, va_list args)
 {
-    if (sz - 1 <= 0) return 0;
-    strncat(dest, src, sz - 1);
-    return strlen(src);
+    switch (level) {
+    case cglib_log_verbose:
+        if (ud ? !((struct run *) ud)->verbose : !arguments.verbose)
+            return;
+        putcolor(CGRIP_CYAN);
+        fputs("[VERBOSE] ", stdout);
+        break;
+    case cglib_log_info:
+        vfprintf(stdout, fmt, args);
+        return;
+    case cglib_log_warn:
+    case cglib_log_error:
+        putcolor(CGRIP_YELLOW);
+        fputs("[WARN] ", stdout);
+        break;
+    }
+    vfprintf(stdout, fmt, args);
+    putcolor(CGRIP_RESET);
+}
+
+/* while parsing the command line, where any error is the end of it */
+static void cgrip_log_fatal(void *ud, enum cglib_log_level level, const char *fmt, va_list args)
+{
+    if (level != cglib_log_error) {
+        cgrip_log(ud, level, fmt, args);
+        return;
+    }
+    fputcolor(CGRIP_RED, stderr);
+    fputs("[FATAL] ", stderr);
+    vfprintf(stderr, fmt, args);
+    fputcolor(CGRIP_RESET, stderr);
+    exit(EXIT_FAILURE);
+}
+
+/* sends a daemon job's messages back to whoever sent it */
+static void cgrip_log_client(void *ud, enum cglib_log_level level, const char *fmt, va_list args)
+{
+    static const char *kinds[] = { "verbose", "info", "warn", "error" };
+    struct run *run = (struct run *) ud;
+    if (level == cglib_log_verbose && !run->verbose)
+        return;
+    cgdaemon_vsend(run->client, kinds[level], fmt, args);
 }
 
 void verbose(const char *fmt, ...)
 {
     va_list args;
-    if (!arguments.verbose)
-        return;
-    
-    putcolor(CGRIP_CYAN);
-    fputs("[VERBOSE] ", stdout);
     va_start(args, fmt);
-    vfprintf(stdout, fmt, args);
+    cgrip_log(NULL, cglib_log_verbose, fmt, args);
     va_end(args);
-    putcolor(CGRIP_RESET);
 }
 
 void warn(const char *fmt, ...)
 {
     va_list args;
-    putcolor(CGRIP_YELLOW);
-    fputs("[WARN] ", stdout);
     va_start(args, fmt);
-    vfprintf(stdout, fmt, args);
+    cgrip_log(NULL, cglib_log_warn, fmt, args);
     va_end(args);
-    putcolor(CGRIP_RESET);
 }
 
 CGRIP_NORETURN void fatal(const char *fmt, ...)
@@ -140,14 +268,14 @@ static const char *quality_types[] = {
     "8k",
 };
 
-static enum cgapi_quality get_quality_type(char *arg)
+static enum cgapi_quality get_quality_type(struct cglib_context *ctx, char *arg)
 {
     char *p;
     enum cgapi_quality i;
     for (p = arg; *p; p++) *p = tolower(*p);
     for (i = 0; i < 4; i++)
         if (!strcmp(quality_types[i], arg)) return i;
-    warn("got unexpected --quality argument %s, defaulting to 1k\n", arg);
+    cglib_log(ctx, cglib_log_warn, "got unexpected --quality argument %s, defaulting to 1k\n", arg);
     return cgapi_quality_1k_png;
 }
 
@@ -158,7 +286,7 @@ static const char *save_normal_types[] = {
     "both",
 };
 
-static enum cgrip_normal_type get_normal_type(char *arg)
+static enum cgrip_normal_type get_normal_type(struct cglib_context *ctx, char *arg)
 {
     char *p;
     enum cgrip_normal_type i;
@@ -166,14 +294,761 @@ static enum cgrip_normal_type get_normal_type(char *arg)
     for (p = arg; *p; p++) *p = tolower(*p);
     for (i = 0; i < 4; i++)
         if (!strcmp(save_normal_types[i], arg)) return i;
-    warn("got unexpected --save-normal argument %s, defaulting to gl\n", arg);
+    cglib_log(ctx, cglib_log_warn, "got unexpected --save-normal argument %s, defaulting to gl\n", arg);
     return cgrip_normal_type_gl;
 }
 
-int main(int argc, char *argv[])
+static const char *dither_types[] = {
+    "bayer",
+    "floyd-steinberg",
+    "atkinson",
+    "sierra-lite",
+};
+
+static enum cgpro_dither get_dither_type(struct cglib_context *ctx, char *arg)
+{
+    char *p;
+    enum cgpro_dither i;
+    for (p = arg; *p; p++) *p = tolower(*p);
+    for (i = 0; i < 4; i++)
+        if (!strcmp(dither_types[i], arg)) return i;
+    cglib_log(ctx, cglib_log_warn, "got unexpected --dither argument %s, defaulting to bayer\n", arg);
+    return cgpro_dither_bayer8x8;
+}
+
+static enum cgformat get_format(struct cglib_context *ctx, char *arg)
+{
+    int format = cgformat_parse(arg);
+    if (format >= 0)
+        return format;
+    cglib_log(ctx, cglib_log_warn, "got unexpected --format argument %s, defaulting to png\n", arg);
+    return cgformat_png;
+}
+
+/*
+ * palettes loaded from files, by name and age. a daemon keeps them for
+ * every later job, a replaced one may still be in use so it is never freed.
+ */
+static struct palette_entry {
+    char *filename;
+    time_t mtime;
+    struct cgpro_palette palette;
+} palette_cache[CGRIP_PALETTE_CACHE];
+static pthread_mutex_t palette_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void load_palette(struct run *run, const char *filename)
+{
+    struct stat s;
+    struct palette_entry *e = NULL;
+    int i;
+
+    if (stat(filename, &s) != 0)
+        s.st_mtime = 0;
+    pthread_mutex_lock(&palette_lock);
+    for (i = 0; i < CGRIP_PALETTE_CACHE && palette_cache[i].filename; i++)
+        if (!strcmp(palette_cache[i].filename, filename))
+            break;
+    if (i < CGRIP_PALETTE_CACHE) {
+        e = &palette_cache[i];
+        if (e->filename && e->mtime == s.st_mtime) {
+            run->job.palette = e->palette;
+            pthread_mutex_unlock(&palette_lock);
+            return;
+        }
+    }
+    run->job.palette = cgpro_palette_load_from_file(filename);
+    run->free_palette = !e;
+    if (!run->job.palette.data) {
+        run->free_palette = 0;
+        cglib_log(&run->ctx, cglib_log_warn, "failed to load palette %s\n", filename);
+    } else if (e && !e->filename && !(e->filename = malloc(strlen(filename) + 1))) {
+        run->free_palette = 1;
+    } else if (e) {
+        strcpy(e->filename, filename);
+        e->mtime = s.st_mtime;
+        e->palette = run->job.palette;
+    }
+    pthread_mutex_unlock(&palette_lock);
+}
+
+/* project roots found above output dirs, so they are only looked for once */
+static struct godot_entry {
+    char output[4096];
+    char root[4096];
+} godot_cache[CGRIP_GODOT_CACHE];
+static unsigned int godot_next = 0;
+static pthread_mutex_t godot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void find_godot_root(struct run *run)
+{
+    const char *output = run->job.output;
+    int i;
+
+    pthread_mutex_lock(&godot_lock);
+    for (i = 0; i < CGRIP_GODOT_CACHE; i++) {
+        if (*godot_cache[i].root && !strcmp(godot_cache[i].output, output)) {
+            strcpy(run->job.godot4_root, godot_cache[i].root);
+            pthread_mutex_unlock(&godot_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&godot_lock);
+    if (strlen(output) >= sizeof godot_cache[0].output
+            || !gen_godot4_find_root(&run->ctx, &run->job, output))
+        return;
+    pthread_mutex_lock(&godot_lock);
+    i = godot_next++ % CGRIP_GODOT_CACHE;
+    strcpy(godot_cache[i].output, output);
+    strcpy(godot_cache[i].root, run->job.godot4_root);
+    pthread_mutex_unlock(&godot_lock);
+}
+
+/* id is NULL for the palette shared by the whole batch */
+static void save_palette(struct run *run, struct cgpro_palette P, const char *id)
+{
+    char buf[256];
+    int sz = 0;
+
+    *buf = 0;
+    if (run->job.output) {
+        sz += strncat_s(buf + sz, run->job.output, sizeof buf - sz);
+        sz += strncat_s(buf + sz, "/", sizeof buf - sz);
+    }
+    if (id) {
+        sz += strncat_s(buf + sz, id, sizeof buf - sz);
+        sz += strncat_s(buf + sz, "_", sizeof buf - sz);
+    }
+    sz += strncat_s(buf + sz, "palette.png", sizeof buf - sz);
+    cglib_log(&run->ctx, cglib_log_info, "saving %s\n", buf);
+    if (!cgpro_palette_save(P, buf))
+        cglib_log(&run->ctx, cglib_log_warn, "failed to save palette to %s\n", buf);
+    else if (id)
+        cglib_output(&run->ctx, id, buf);
+}
+
+/* against the job's palette when set, otherwise mat gets its own */
+static void quantize_material(struct run *run, struct cgapi_material *mat)
+{
+    const struct cglib_job *job = &run->job;
+    struct cgapi_map *color = &mat->maps[cgapi_matmap_color];
+    struct cgpro_palette mat_palette = job->palette;
+    if (!color->data)
+        return;
+    if (!mat_palette.data) {
+        struct cgpro_histogram hist = cgpro_histogram_new();
+        if (!hist.count) {
+            cglib_fail(&run->ctx, cglib_error_memory, "out of memory quantizing %s\n", mat->id);
+            return;
+        }
+        cgpro_histogram_add(&hist, color);
+        mat_palette = cgpro_palette_generate(&hist, job->palette_colors);
+        cgpro_histogram_free(hist);
+        if (mat_palette.data && run->save_palette)
+            save_palette(run, mat_palette, mat->id);
+    }
+    if (mat_palette.data) {
+        cglib_log(&run->ctx, cglib_log_verbose, "quantizing %s\n", mat->id);
+        cgpro_quantize_to(color, mat_palette, job->dither);
+    }
+    if (mat_palette.data != job->palette.data)
+        cgpro_palette_free(mat_palette);
+}
+
+/*
+ * how maps are saved, for the store and the manifest alike. png and unset
+ * options are left out, so what was made before them still matches.
+ */
+static unsigned long hash_format_options(unsigned long h, const struct cglib_job *job)
+{
+    if (job->format == cgformat_png)
+        return h;
+    h = cghash_uint(h, job->format);
+    if (job->mipmaps)
+        h = cghash_uint(h, job->mipmaps);
+    if (job->zstd)
+        h = cghash_uint(h, job->zstd);
+    return h;
+}
+
+/* what a map's output is made from, as far as the store is concerned */
+static unsigned long map_key(const struct run *run, const struct cgapi_material *mat, enum cgapi_matmap j)
+{
+    const struct cglib_job *job = &run->job;
+    unsigned long h = cghash_str(CGHASH_INIT, CGRIP_VERSION);
+
+    h = cghash_uint(h, mat->zip_hash);
+    h = cghash_uint(h, j);
+    h = cghash_uint(h, mat->derived_normal == (int) j);
+    h = cghash_uint(h, job->downscale_width);
+    h = cghash_uint(h, job->downscale_height);
+    h = hash_format_options(h, job);
+    if (j != cgapi_matmap_color)
+        return cghash_uint(h, job->macro_scale);
+    h = cghash_uint(h, job->apply_opacity);
+    if (run->quantize) {
+        h = cghash_uint(h, job->palette_colors);
+        h = cghash_uint(h, job->dither);
+        h = cghash_bytes(h, job->palette.data, job->palette.data ? job->palette.num * 3 : 0);
+    }
+    return h;
+}
+
+static void map_path(const struct run *run, struct cgapi_material *mat, enum cgapi_matmap j, char *buf, int size)
+{
+    int sz = 0;
+    *buf = 0;
+    if (run->job.output) {
+        sz += strncat_s(buf + sz, run->job.output, size - sz);
+        sz += strncat_s(buf + sz, "/", size - sz);
+    }
+    cgapi_material_get_filename(mat, j, run->job.format, buf + sz, size - sz);
+}
+
+/* the store's copy of a map put in place, instead of making it */
+static int link_stored_map(struct run *run, struct cgapi_material *mat, enum cgapi_matmap j)
+{
+    struct cgapi_map *map = &mat->maps[j];
+    char path[256];
+
+    map_path(run, mat, j, path, sizeof path);
+    if (!cgstore_link(run->store, map_key(run, mat, j), path))
+        return 0;
+    cglib_log(&run->ctx, cglib_log_info, "linking %s\n", strrchr(path, '/') ? strrchr(path, '/') + 1 : path);
+    cglib_output(&run->ctx, mat->id, path);
+    cgmem_free(map->encoded);
+    map->encoded = NULL;
+    map->encoded_size = 0;
+    map->stored = 1;
+    return 1;
+}
+
+/*
+ * links whichever saved maps of mat the store has. a normal that is
+ * derived from the other goes first, since its source has to be decoded
+ * when it is missing. a built palette is saved as a side effect of
+ * making the color map, so that is always made.
+ */
+static void link_stored_maps(struct run *run, struct cgapi_material *mat)
+{
+    int j;
+    if (mat->derived_normal >= 0 && link_stored_map(run, mat, mat->derived_normal))
+        mat->derived_normal = -1;
+    for (j = 0; j < CGAPI_MAPNUM; j++) {
+        if (!mat->maps[j].encoded || !cgapi_map_is_saved(&run->job, j))
+            continue;
+        if (mat->derived_normal >= 0 && (j == cgapi_matmap_normaldx || j == cgapi_matmap_normalgl))
+            continue;
+        if (j == cgapi_matmap_color && run->save_palette && run->quantize && !run->job.palette.data)
+            continue;
+        link_stored_map(run, mat, j);
+    }
+}
+
+/* one node of a material's task graph: decode and process a map */
+struct map_task {
+    struct material_tasks *tasks;
+    enum cgapi_matmap matmap;
+};
+
+struct material_tasks {
+    struct cgapi_material *mat;
+    struct run *run;
+    struct cgpool_group group;
+    struct map_task maps[CGAPI_MAPNUM];
+};
+
+static void store_map(struct run *run, struct cgapi_material *mat, enum cgapi_matmap j)
+{
+    if (run->store && run->stage == run_stage_all && !run->pack) {
+        char path[256];
+        map_path(run, mat, j, path, sizeof path);
+        cgstore_put(run->store, map_key(run, mat, j), path);
+    }
+}
+
+static void run_map_task(void *ud)
+{
+    struct map_task *task = (struct map_task *) ud;
+    struct material_tasks *tasks = task->tasks;
+    struct cgapi_material *mat = tasks->mat;
+    struct run *run = tasks->run;
+    enum cgapi_matmap j = task->matmap;
+
+    if (run->stage != run_stage_finish) {
+        struct cgapi_map *opacity = &mat->maps[cgapi_matmap_opacity];
+        /* big maps nothing needs whole go from png to file a row at a time */
+        if (run->stage == run_stage_all && !run->pack && cglib_stream_map(&run->ctx, mat, j, run->job.output)) {
+            store_map(run, mat, j);
+            return;
+        }
+        if (!cgapi_map_decode(&run->ctx, mat, j))
+            return;
+        /* the derived normal only exists now, and goes on by itself */
+        if (mat->derived_normal >= 0 && mat->derived_normal != (int) j
+                && (j == cgapi_matmap_normaldx || j == cgapi_matmap_normalgl)
+                && mat->maps[mat->derived_normal].data)
+            if (!cgpool_submit(run->pool, &tasks->group, run_map_task, &tasks->maps[mat->derived_normal]))
+                run_map_task(&tasks->maps[mat->derived_normal]);
+        if (j == cgapi_matmap_color && run->job.apply_opacity)
+            cgapi_map_decode(&run->ctx, mat, cgapi_matmap_opacity);
+        cglib_process_map(&run->ctx, mat, j);
+        if (j == cgapi_matmap_color && run->job.apply_opacity && opacity->data) {
+            /* folded into the color map, so it is neither saved nor referenced */
+            cgmem_free(opacity->data);
+            opacity->data = NULL;
+        }
+        if (j == cgapi_matmap_color && run->quantize && run->job.palette_colors && run->stage == run_stage_all)
+            quantize_material(run, mat);
+    } else if (j == cgapi_matmap_color) {
+        quantize_material(run, mat);
+    }
+}
+
+/*
+ * a material's maps on their way out through the writers, each encoded
+ * by a task of its own and then all written in one go.
+ */
+struct material_save {
+    struct cgapi_material *mat;
+    struct run *run;
+    struct cgpipe_async *async;
+    unsigned int count, left;
+    int heap; /* freed by the last task */
+    struct save_task {
+        struct material_save *save;
+        enum cgapi_matmap matmap;
+    } tasks[CGAPI_MAPNUM];
+    struct cgapi_output outputs[CGAPI_MAPNUM]; /* by task */
+};
+
+/* what the tasks of save encoded, out as files or into the pack */
+static void save_outputs(struct run *run, struct material_save *save)
+{
+    struct cgapi_material *mat = save->mat;
+    unsigned int k;
+
+    if (!run->pack) {
+        cgapi_material_write_maps(&run->ctx, mat, save->outputs, save->count);
+        for (k = 0; k < save->count; k++)
+            store_map(run, mat, save->tasks[k].matmap);
+        return;
+    }
+    for (k = 0; k < save->count; k++) {
+        struct cgapi_output *output = &save->outputs[k];
+        struct cgapi_map *map = &mat->maps[save->tasks[k].matmap];
+        if (!output->data)
+            continue;
+        if (!cgpack_add(run->pack, mat->id, save->tasks[k].matmap, cgformat_get(run->job.format)->pack,
+                    map->width, map->height, output->data, output->size))
+            cglib_fail(&run->ctx, cglib_error_io, "failed to pack %s\n", output->path);
+        cgmem_free(output->data);
+        output->data = NULL;
+    }
+}
+
+static void run_save_task(void *ud)
+{
+    struct save_task *task = (struct save_task *) ud;
+    struct material_save *save = task->save;
+    struct run *run = save->run;
+    struct cgapi_output *output = &save->outputs[task - save->tasks];
+    struct cgapi_map *map = &save->mat->maps[task->matmap];
+
+    /* a pack takes whole files, files can take big ones as they are made */
+    if (!run->pack && (size_t) map->width * map->height >= CGAPI_STREAM_PIXELS) {
+        output->data = NULL;
+        cgapi_material_stream_map(&run->ctx, save->mat, task->matmap, run->job.output);
+    } else {
+        cgapi_material_encode_map(&run->ctx, save->mat, task->matmap, run->job.output, output);
+    }
+    /* the last one out writes them all and passes the material on */
+    if (__atomic_sub_fetch(&save->left, 1, __ATOMIC_ACQ_REL) == 0) {
+        save_outputs(run, save);
+        cgpipe_finish(save->async, save->mat, 1);
+        if (save->heap)
+            free(save);
+    }
+}
+
+/*
+ * each material flows download -> extract -> maps -> save -> godot on its
+ * own, and is released as soon as it is through. the maps stage hands every map to
+ * the pool as its own task, so they run side by side across materials.
+ */
+static void download_done(struct cgapi_material *mat, int ok, void *ud)
+{
+    cgpipe_finish((struct cgpipe_async *) ud, mat, ok);
+}
+
+/* downloads all go through the one event loop, this only starts them */
+static int stage_download(void *item, void *ud, struct cgpipe_async *async)
+{
+    return cgapi_material_download_start(&((struct run *) ud)->ctx, (struct cgapi_material *) item, download_done, async);
+}
+
+static int stage_extract(void *item, void *ud)
+{
+    struct cgapi_material *mat = (struct cgapi_material *) item;
+    struct run *run = (struct run *) ud;
+    cgmanifest_begin(run->manifest, mat->id, run->params, mat->download_size);
+    cgapi_material_save_zip(&run->ctx, mat);
+    if (run->store && mat->zip)
+        mat->zip_hash = cghash_bytes(CGHASH_INIT, mat->zip, mat->zip_size);
+    return cgapi_material_extract(&run->ctx, mat);
+}
+
+static int stage_maps(void *item, void *ud)
+{
+    struct material_tasks tasks;
+    struct run *run = (struct run *) ud;
+    int j;
+
+    tasks.mat = (struct cgapi_material *) item;
+    tasks.run = run;
+    tasks.group.pending = 0;
+    for (j = 0; j < CGAPI_MAPNUM; j++) {
+        tasks.maps[j].tasks = &tasks;
+        tasks.maps[j].matmap = j;
+    }
+    /* a shared palette is only known later, so that run keeps to itself */
+    if (run->store && run->stage == run_stage_all && !run->pack)
+        link_stored_maps(run, tasks.mat);
+    for (j = 0; j < CGAPI_MAPNUM; j++) {
+        struct cgapi_map *map = &tasks.mat->maps[j];
+        if (run->stage == run_stage_finish ? !map->data || j != cgapi_matmap_color : !map->encoded)
+            continue;
+        /* decoded by the color task, which needs it */
+        if (j == cgapi_matmap_opacity && run->job.apply_opacity)
+            continue;
+        if (!cgpool_submit(run->pool, &tasks.group, run_map_task, &tasks.maps[j]))
+            run_map_task(&tasks.maps[j]);
+    }
+    cgpool_wait(run->pool, &tasks.group);
+    return 1;
+}
+
+/*
+ * hands every map to the writers and returns, so the maps stage can get on
+ * with the next material while this one is encoded and written.
+ */
+static int stage_save(void *item, void *ud, struct cgpipe_async *async)
 {
-    int opt, pargc, i;
-    const char *short_opts = ":ho:vq:as:z::demrcn::";
+    struct cgapi_material *mat = (struct cgapi_material *) item;
+    struct run *run = (struct run *) ud;
+    struct material_save *save, here;
+    unsigned int count = 0;
+    int j;
+
+    for (j = 0; j < CGAPI_MAPNUM; j++)
+        if (mat->maps[j].data && cgapi_map_is_saved(&run->job, j))
+            count++;
+    if (!count) {
+        cgpipe_finish(async, mat, 1);
+        return 1;
+    }
+    save = malloc(sizeof(struct material_save));
+    /* without memory to hand them over with, written right here */
+    if (!save)
+        save = &here;
+    save->heap = save != &here;
+    save->mat = mat;
+    save->run = run;
+    save->async = async;
+    save->count = save->left = count;
+    count = 0;
+    for (j = 0; j < CGAPI_MAPNUM; j++) {
+        if (mat->maps[j].data && cgapi_map_is_saved(&run->job, j)) {
+            save->tasks[count].save = save;
+            save->tasks[count++].matmap = j;
+        }
+    }
+    /* the tasks may finish and free save before this loop is through */
+    for (j = 0; j < (int) count; j++)
+        if (save == &here || !cgpool_submit(run->writers, NULL, run_save_task, &save->tasks[j]))
+            run_save_task(&save->tasks[j]);
+    return 1;
+}
+
+static int stage_godot(void *item, void *ud)
+{
+    struct cgapi_material *mat = (struct cgapi_material *) item;
+    struct run *run = (struct run *) ud;
+    if (run->gen_godot4)
+        gen_godot4_generate(&run->ctx, mat, run->job.output);
+    cgmanifest_finish(run->manifest, mat->id, mat->source);
+    if (run->client)
+        cgdaemon_send(run->client, "progress", "%u/%u %s", ++run->done, run->total, mat->id);
+    return 1;
+}
+
+/* the manifest's record of what each material made */
+static void run_output(void *ud, const char *id, const char *path)
+{
+    struct run *run = (struct run *) ud;
+    if (run->manifest)
+        cgmanifest_output(run->manifest, id, path);
+}
+
+static void stage_keep(void *item)
+{
+    /* the shared palette needs every material kept, so none can be waited on */
+    cgmem_release(&((struct cgapi_material *) item)->mem);
+}
+
+static void stage_release(void *item)
+{
+    cgapi_material_release((struct cgapi_material *) item);
+}
+
+/* materials of concurrent runs are ordered against each other, oldest first */
+static unsigned long next_order = 0;
+
+/* everything a material's outputs depend on besides its zip */
+static unsigned long run_params(const struct run *run)
+{
+    const struct cglib_job *job = &run->job;
+    unsigned long flags, h = cghash_str(CGHASH_INIT, CGRIP_VERSION);
+
+    flags = job->save_zip | job->save_ambientocclusion << 1 | job->save_color << 2
+        | job->save_displacement << 3 | job->save_emission << 4 | job->save_metalness << 5
+        | job->save_opacity << 6 | job->save_roughness << 7 | job->apply_opacity << 8
+        | job->filter_nearest << 9 | run->quantize << 10 | run->shared_palette << 11
+        | run->save_palette << 12 | run->gen_godot4 << 13;
+    h = cghash_uint(h, flags);
+    h = cghash_uint(h, run->quality);
+    h = cghash_uint(h, job->save_normal);
+    h = cghash_uint(h, job->downscale_width);
+    h = cghash_uint(h, job->downscale_height);
+    h = cghash_uint(h, job->macro_scale);
+    h = cghash_uint(h, job->palette_colors);
+    h = cghash_uint(h, job->dither);
+    h = cghash_bytes(h, job->palette.data, job->palette.data ? job->palette.num * 3 : 0);
+    h = cghash_str(h, job->output_zip);
+    h = cghash_str(h, run->gen_godot4 ? job->godot4_root : NULL);
+    h = cghash_str(h, run->pack_path);
+    return hash_format_options(h, job);
+}
+
+/*
+ * materials the manifest says were made the same way from a zip that can
+ * be revalidated get their download made conditional, the ones upstream
+ * did not change then stop there. a shared palette depends on every
+ * material, so with one nothing is skipped.
+ */
+static void run_check_manifest(struct run *run, struct cgapi_materials *mats)
+{
+    int i, candidates = 0;
+    if (run->force || (run->quantize && run->job.palette_colors && run->shared_palette))
+        return;
+    for (i = 0; i < mats->material_count; i++) {
+        struct cgapi_material *mat = &mats->materials[i];
+        mat->source = cgmanifest_check(run->manifest, mat->id, run->params, mat->download_size);
+        /* the manifest only knows files, a packed material has to be in the pack */
+        if (mat->source && run->pack && !(run->pack_old && cgpack_has(run->pack_old, mat->id))) {
+            free(mat->source);
+            mat->source = NULL;
+        }
+        if (mat->source)
+            candidates++;
+    }
+    cglib_log(&run->ctx, cglib_log_verbose, "%d of %d materials may be up to date\n", candidates, mats->material_count);
+}
+
+/* returns NULL once every material was tried, otherwise why none were */
+static const char *run_ids(struct run *run, const char **ids, int id_count)
+{
+    struct cgapi_materials mats;
+    const char *why = NULL;
+    char pack[4096];
+    void **items;
+    int i, sz = 0;
+
+    mats = cgapi_list_ids(&run->ctx, run->quality, ids, id_count);
+    if (run->ctx.error == cglib_error_network || run->ctx.error == cglib_error_listing)
+        return "failed to list materials";
+    items = malloc((mats.material_count + 1) * sizeof(void *));
+    if (!items) {
+        cgapi_materials_free(&mats);
+        run->ctx.error = cglib_error_memory;
+        return "out of memory";
+    }
+    run->order = __atomic_fetch_add(&next_order, mats.material_count, __ATOMIC_RELAXED);
+    for (i = 0; i < mats.material_count; i++) {
+        mats.materials[i].mem.order += run->order;
+        items[i] = &mats.materials[i];
+    }
+    run->done = 0;
+    run->total = mats.material_count;
+    if (run->pack_path && run->gen_godot4) {
+        cglib_log(&run->ctx, cglib_log_warn, "godot cannot read a pack, ignoring --gen-godot4\n");
+        run->gen_godot4 = 0;
+    }
+    if (run->job.format == cgformat_qoi && run->gen_godot4) {
+        cglib_log(&run->ctx, cglib_log_warn, "godot cannot import %s, ignoring --gen-godot4\n", cgformat_get(run->job.format)->name);
+        run->gen_godot4 = 0;
+    }
+    if (run->job.mipmaps && !cgformat_get(run->job.format)->mipmaps) {
+        cglib_log(&run->ctx, cglib_log_warn, "%s holds no mip chain, ignoring --mipmaps\n", cgformat_get(run->job.format)->name);
+        run->job.mipmaps = 0;
+    }
+    if (run->job.zstd && cgformat_get(run->job.format)->pack != cgpack_format_ktx2) {
+        cglib_log(&run->ctx, cglib_log_warn, "only KTX2 is supercompressed, ignoring --zstd\n");
+        run->job.zstd = 0;
+    }
+    if (run->gen_godot4 && !*run->job.godot4_root)
+        find_godot_root(run);
+    run->params = run_params(run);
+    run->manifest = cgmanifest_open(run->job.output ? run->job.output : ".");
+    if (!run->manifest) {
+        free(items);
+        cgapi_materials_free(&mats);
+        run->ctx.error = cglib_error_memory;
+        return "out of memory";
+    }
+    if (run->pack_path) {
+        *pack = 0;
+        if (!*run->pack_path && run->job.output) {
+            sz += strncat_s(pack + sz, run->job.output, sizeof pack - sz);
+            sz += strncat_s(pack + sz, "/", sizeof pack - sz);
+        }
+        strncat_s(pack + sz, *run->pack_path ? run->pack_path : "cgrip.pack", sizeof pack - sz);
+        run->pack_old = cgpack_open(pack);
+        if (!(run->pack = cgpack_create(pack, run->pack_old))) {
+            cgpack_free(run->pack_old);
+            run->pack_old = NULL;
+            cgmanifest_free(run->manifest);
+            run->manifest = NULL;
+            free(items);
+            cgapi_materials_free(&mats);
+            cglib_fail(&run->ctx, cglib_error_io, "cannot write %s\n", pack);
+            return "failed to create the pack";
+        }
+    }
+    run_check_manifest(run, &mats);
+
+    if (run->quantize && run->job.palette_colors && run->shared_palette) {
+        /* a shared palette has to see every material before any is quantized */
+        struct cgpipe_stage gather[] = {
+            { "download", NULL, NULL, 0, stage_download },
+            { "extract", stage_extract, NULL },
+            { "maps", stage_maps, NULL, CGRIP_MAP_STAGE_WORKERS },
+        };
+        struct cgpipe_stage finish[] = {
+            { "maps", stage_maps, NULL, CGRIP_MAP_STAGE_WORKERS },
+            { "save", NULL, NULL, 0, stage_save, CGRIP_SAVING },
+            { "godot", stage_godot, NULL },
+        };
+        struct cgpro_histogram hist = cgpro_histogram_new();
+        for (i = 0; i < 3; i++)
+            gather[i].ud = run;
+        gather[0].inflight = run->downloads;
+        for (i = 0; i < 3; i++)
+            finish[i].ud = run;
+        run->stage = run_stage_gather;
+        if (!hist.count) {
+            why = "out of memory";
+        } else if (!cgpipe_run(gather, 3, items, mats.material_count, CGRIP_PIPE_DEPTH, stage_keep)) {
+            why = "failed to start processing threads";
+        } else {
+            for (i = 0; i < mats.material_count; i++)
+                cgpro_histogram_add(&hist, &mats.materials[i].maps[cgapi_matmap_color]);
+            run->job.palette = cgpro_palette_generate(&hist, run->job.palette_colors);
+            if (run->job.palette.data && run->save_palette)
+                save_palette(run, run->job.palette, NULL);
+            run->stage = run_stage_finish;
+            if (!cgpipe_run(finish, 3, items, mats.material_count, CGRIP_PIPE_DEPTH, stage_release))
+                why = "failed to start processing threads";
+            cgpro_palette_free(run->job.palette);
+            run->job.palette.data = NULL;
+        }
+        if (hist.count)
+            cgpro_histogram_free(hist);
+    } else {
+        struct cgpipe_stage stages[] = {
+            { "download", NULL, NULL, 0, stage_download },
+            { "extract", stage_extract, NULL },
+            { "maps", stage_maps, NULL, CGRIP_MAP_STAGE_WORKERS },
+            { "save", NULL, NULL, 0, stage_save, CGRIP_SAVING },
+            { "godot", stage_godot, NULL },
+        };
+        for (i = 0; i < 5; i++)
+            stages[i].ud = run;
+        stages[0].inflight = run->downloads;
+        run->stage = run_stage_all;
+        if (!cgpipe_run(stages, 5, items, mats.material_count, CGRIP_PIPE_DEPTH, stage_release))
+            why = "failed to start processing threads";
+    }
+    if (why)
+        run->ctx.error = cglib_error_memory;
+    if (run->pack) {
+        if (!why && !cgpack_save(run->pack))
+            cglib_fail(&run->ctx, cglib_error_io, "failed to write %s\n", pack);
+        cgpack_writer_free(run->pack);
+        cgpack_free(run->pack_old);
+        run->pack = NULL;
+        run->pack_old = NULL;
+    }
+    if (!cgmanifest_save(run->manifest))
+        cglib_log(&run->ctx, cglib_log_warn, "failed to save the manifest in %s\n", run->job.output);
+    cgmanifest_free(run->manifest);
+    run->manifest = NULL;
+
+    free(items);
+    cgapi_materials_free(&mats);
+    return why;
+}
+
+static void run_init(struct run *run)
+{
+    memset(run, 0, sizeof(struct run));
+    cglib_job_init(&run->job);
+    cglib_context_init(&run->ctx, &run->job);
+    run->ctx.log = cgrip_log;
+    run->ctx.output = run_output;
+    run->ctx.log_ud = run;
+    run->quality = cgapi_quality_1k_png;
+    run->downloads = CGRIP_DOWNLOADS;
+}
+
+/* a byte count, K, M or G suffixed */
+static int parse_size(const char *arg, size_t *size)
+{
+    char *endptr;
+    *size = strtoul(arg, &endptr, 10);
+    switch (tolower(*endptr)) {
+    case 'g':
+        *size *= 1024;
+    case 'm':
+        *size *= 1024;
+    case 'k':
+        *size *= 1024;
+        endptr++;
+    default:
+        break;
+    }
+    return !*endptr && *size > 0;
+}
+
+/* a count of threads or downloads from 1 to CGRIP_COUNT_MAX, 0 when arg is not one */
+static unsigned int parse_count(const char *arg)
+{
+    char *endptr;
+    long n = strtol(arg, &endptr, 10);
+    return *endptr || n < 1 || n > CGRIP_COUNT_MAX ? 0 : n;
+}
+
+/* getopt keeps its state in globals, so daemon jobs parse one at a time */
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * reads argv into run, and into proc for the cli. a daemon's job has no
+ * proc, and whatever belongs to the whole process is ignored for it.
+ * returns the index of the first id, or -1 when argv is no good.
+ */
+static int parse_args(struct run *run, int argc, char *argv[], struct process *proc)
+{
+    int opt, first;
+    const char *short_opts = ":ho:vq:as:z::demrcn::j:f";
     struct option long_opts[] = {
         { "help", no_argument, NULL, 'h' },
         { "output", required_argument, NULL, 'o' },
@@ -184,10 +1059,30 @@ int main(int argc, char *argv[])
         { "downscale", required_argument, NULL, 's' },
         { "macro", required_argument, NULL, 'M' },
         { "quantize", optional_argument, NULL, 'Q' },
+        { "dither", required_argument, NULL, 'X' },
+        { "format", required_argument, NULL, 'F' },
+        { "mipmaps", no_argument, NULL, 'V' },
+        { "zstd", optional_argument, NULL, 'E' },
+        { "shared-palette", no_argument, NULL, 'S' },
+        { "save-palette", no_argument, NULL, 'W' },
+        { "threads", required_argument, NULL, 'j' },
+        { "force", no_argument, NULL, 'f' },
+        { "downloads", required_argument, NULL, 'J' },
+        { "writers", required_argument, NULL, 'B' },
+        { "max-memory", required_argument, NULL, 'R' },
+        { "huge-pages", no_argument, NULL, 'H' },
+        { "pack", optional_argument, NULL, 'I' },
+        { "store", optional_argument, NULL, 'U' },
+        { "pixel-cache", optional_argument, NULL, 'C' },
+        { "lz4", no_argument, NULL, 'Z' },
+        { "daemon", optional_argument, NULL, 'Y' },
+        { "serve", optional_argument, NULL, 'T' },
+        { "cache-size", required_argument, NULL, 'K' },
+        { "cache-dir", required_argument, NULL, 'L' },
 
         { "gen-godot4", optional_argument, NULL, 'G' },
         { "nearest", optional_argument, NULL, 'N' },
-        
+
         { "all", no_argument, NULL, 'a' },
         { "ao", no_argument, NULL, 'A' },
         { "disp", no_argument, NULL, 'd' },
@@ -200,115 +1095,232 @@ int main(int argc, char *argv[])
         { "normal", required_argument, NULL, 'n' },
         { 0 },
     };
-    struct cgapi_materials mats = { 0 };
-    struct cgpro_palette palette;
-    enum cgapi_quality quality = cgapi_quality_1k_png;
+    struct cglib_context *ctx = &run->ctx;
+    struct cglib_job *job = &run->job;
+    long level;
     char *endptr;
 
-    cgpro_init();
-
-    arguments.macro_scale = 0;
-#ifdef CGRIP_TERMCOLOR
-    arguments.use_term_colors = getenv("TERM") != NULL;
-#endif
-
+    pthread_mutex_lock(&parse_lock);
+    optind = 0;
     while (1) {
         opt = getopt_long(argc, argv, short_opts, long_opts, NULL);
         if (opt == -1)
             break;
 
+        if (!proc && strchr("hDjBRHYTKLUCZ", opt)) {
+            struct option *o;
+            for (o = long_opts; o->name && o->val != opt; o++)
+                ;
+            cglib_log(ctx, cglib_log_warn, "ignoring --%s, it is up to the daemon\n", o->name);
+            continue;
+        }
         switch (opt) {
         case 'h': /* --help */
             usage(EXIT_SUCCESS);
             break;
         case 'o': /* --output */
-            if (!is_directory(optarg))
-                fatal("%s is not valid output directory\n", optarg);
-            arguments.output = optarg;
+            if (!is_directory(optarg)) {
+                cglib_fail(ctx, cglib_error_argument, "%s is not valid output directory\n", optarg);
+                goto fail;
+            }
+            job->output = optarg;
             break;
         case 'v': /* --verbose */
-            arguments.verbose = 1;
+            run->verbose = 1;
+            if (proc)
+                arguments.verbose = 1;
             break;
         case 'q': /* --quality */
-            quality = get_quality_type(optarg);
+            run->quality = get_quality_type(ctx, optarg);
             break;
         case 'z': /* --zip */
-            arguments.save_zip = 1;
-            arguments.output_zip = optarg;
+            job->save_zip = 1;
+            job->output_zip = optarg;
             break;
         case 's': /* --downscale */
-            arguments.downscale_width = strtol(optarg, &endptr, 10);
-            if (*endptr != 'x')
-                fatal("incorrect --downscale SIZE format, expected WxH\n");
-            arguments.downscale_height = strtol(++endptr, &endptr, 10);
-            verbose("target downscale: %dx%d\n", arguments.downscale_width, arguments.downscale_height);
-            if (arguments.downscale_width * arguments.downscale_height == 0)
-                warn("invalid downscale SIZE, ignoring\n");
-            else
-                arguments.downscale = 1;
+            job->downscale_width = strtol(optarg, &endptr, 10);
+            if (*endptr != 'x') {
+                cglib_fail(ctx, cglib_error_argument, "incorrect --downscale SIZE format, expected WxH\n");
+                goto fail;
+            }
+            job->downscale_height = strtol(++endptr, &endptr, 10);
+            cglib_log(ctx, cglib_log_verbose, "target downscale: %dx%d\n", job->downscale_width, job->downscale_height);
+            if (job->downscale_width * job->downscale_height == 0) {
+                cglib_log(ctx, cglib_log_warn, "invalid downscale SIZE, ignoring\n");
+                job->downscale_width = job->downscale_height = 0;
+            }
             break;
         case 'M': /* --macro */
-            arguments.macro_scale = strtol(optarg, &endptr, 10);
-            verbose("using macro_scale %u\n", arguments.macro_scale);
+            job->macro_scale = strtol(optarg, &endptr, 10);
+            cglib_log(ctx, cglib_log_verbose, "using macro_scale %u\n", job->macro_scale);
             if (*endptr && *endptr != 'x')
-                warn("ignored garbage characters for --macro: %s\n", endptr);
+                cglib_log(ctx, cglib_log_warn, "ignored garbage characters for --macro: %s\n", endptr);
             break;
         case 'Q': /* --quantize */
-            arguments.quantize = 1;
+            run->quantize = 1;
             if (!optarg) {
-                verbose("quantize: using default palette\n", optarg);
-                palette = cgpro_palette_load_default();
+                cglib_log(ctx, cglib_log_verbose, "quantize: using default palette\n");
+                job->palette = cgpro_palette_load_default();
+            } else if (!strncasecmp(optarg, "auto", 4) && (!optarg[4] || optarg[4] == ':')) {
+                job->palette_colors = 32;
+                if (optarg[4] == ':') {
+                    job->palette_colors = strtol(&optarg[5], &endptr, 10);
+                    if (*endptr)
+                        job->palette_colors = 0;
+                }
+                if (job->palette_colors < 1 || job->palette_colors > 255) {
+                    cglib_fail(ctx, cglib_error_argument, "--quantize AUTO:N expects 1 to 255 colors\n");
+                    goto fail;
+                }
+                cglib_log(ctx, cglib_log_verbose, "quantize: generating %u color palettes\n", job->palette_colors);
+                job->palette.data = NULL;
             } else {
-                verbose("quantize: using palette loaded from file %s\n", optarg);
-                palette = cgpro_palette_load_from_file(optarg);
+                cglib_log(ctx, cglib_log_verbose, "quantize: using palette loaded from file %s\n", optarg);
+                load_palette(run, optarg);
+            }
+            break;
+        case 'X': /* --dither */
+            job->dither = get_dither_type(ctx, optarg);
+            break;
+        case 'F': /* --format */
+            job->format = get_format(ctx, optarg);
+            break;
+        case 'V': /* --mipmaps */
+            job->mipmaps = 1;
+            break;
+        case 'E': /* --zstd */
+            level = optarg ? strtol(optarg, &endptr, 10) : 3;
+            if ((optarg && *endptr) || level < 1 || level > 22) {
+                cglib_fail(ctx, cglib_error_argument, "--zstd expects a level from 1 to 22\n");
+                goto fail;
             }
+#ifdef CGRIP_ZSTD
+            job->zstd = level;
+#else
+            cglib_log(ctx, cglib_log_warn, "built without zstd, KTX2 maps stay uncompressed\n");
+#endif
+            break;
+        case 'S': /* --shared-palette */
+            run->shared_palette = 1;
+            break;
+        case 'W': /* --save-palette */
+            run->save_palette = 1;
+            break;
+        case 'R': /* --max-memory */
+            if (!parse_size(optarg, &proc->budget)) {
+                cglib_fail(ctx, cglib_error_argument, "incorrect --max-memory SIZE, expected a number of bytes, K, M or G\n");
+                goto fail;
+            }
+            break;
+        case 'K': /* --cache-size */
+            if (!parse_size(optarg, &proc->serve.cache_size)) {
+                cglib_fail(ctx, cglib_error_argument, "incorrect --cache-size SIZE, expected a number of bytes, K, M or G\n");
+                goto fail;
+            }
+            break;
+        case 'L': /* --cache-dir */
+            if (!is_directory(optarg)) {
+                cglib_fail(ctx, cglib_error_argument, "%s is not valid cache directory\n", optarg);
+                goto fail;
+            }
+            proc->serve.cache_dir = optarg;
+            break;
+        case 'T': /* --serve */
+            proc->serve.port = optarg ? strtoul(optarg, &endptr, 10) : 8080;
+            if ((optarg && *endptr) || proc->serve.port < 1 || proc->serve.port > 65535) {
+                cglib_fail(ctx, cglib_error_argument, "--serve expects a port number\n");
+                goto fail;
+            }
+            break;
+        case 'I': /* --pack */
+            run->pack_path = optarg ? optarg : "";
+            break;
+        case 'U': /* --store */
+            proc->store = optarg ? optarg : "";
+            break;
+        case 'C': /* --pixel-cache */
+            proc->pixels = optarg ? optarg : "";
+            break;
+        case 'Z': /* --lz4 */
+#ifdef CGRIP_LZ4
+            proc->lz4 = 1;
+#else
+            cglib_log(ctx, cglib_log_warn, "built without lz4, --pixel-cache stays uncompressed\n");
+#endif
+            break;
+        case 'H': /* --huge-pages */
+            cgmem_set_huge_pages(1);
+            break;
+        case 'f': /* --force */
+            run->force = 1;
+            break;
+        case 'j': /* --threads */
+            if (!(proc->threads = parse_count(optarg))) {
+                cglib_fail(ctx, cglib_error_argument, "--threads expects a number from 1 to %d\n", CGRIP_COUNT_MAX);
+                goto fail;
+            }
+            break;
+        case 'J': /* --downloads */
+            if (!(run->downloads = parse_count(optarg))) {
+                cglib_fail(ctx, cglib_error_argument, "--downloads expects a number from 1 to %d\n", CGRIP_COUNT_MAX);
+                goto fail;
+            }
+            break;
+        case 'B': /* --writers */
+            if (!(proc->writers = parse_count(optarg))) {
+                cglib_fail(ctx, cglib_error_argument, "--writers expects a number from 1 to %d\n", CGRIP_COUNT_MAX);
+                goto fail;
+            }
+            break;
+        case 'Y': /* --daemon */
+            proc->daemon = optarg ? optarg : "";
             break;
 
         case 'G':
-            arguments.gen_godot4 = 1;
+            run->gen_godot4 = 1;
             if (optarg)
-                gen_godot4_set_root(optarg);
+                gen_godot4_set_root(ctx, job, optarg);
             break;
         case 'N':
-            arguments.filter_nearest = 1;
+            job->filter_nearest = 1;
             break;
 
         case 'a': /* --all */
-            arguments.save_ambientocclusion = 1;
-            arguments.save_color = 1;
-            arguments.save_displacement = 1;
-            arguments.save_emission = 1;
-            arguments.save_metalness = 1;
-            arguments.save_opacity = 1;
-            arguments.save_roughness = 1;
-            if (arguments.save_normal == cgrip_normal_type_none)
-                arguments.save_normal = cgrip_normal_type_both;
+            job->save_ambientocclusion = 1;
+            job->save_color = 1;
+            job->save_displacement = 1;
+            job->save_emission = 1;
+            job->save_metalness = 1;
+            job->save_opacity = 1;
+            job->save_roughness = 1;
+            if (job->save_normal == cgrip_normal_type_none)
+                job->save_normal = cgrip_normal_type_both;
             break;
         case 'A': /* --ao */
-            arguments.save_ambientocclusion = 1;
+            job->save_ambientocclusion = 1;
             break;
         case 'c': /* --color */
-            arguments.save_color = 1;
+            job->save_color = 1;
             break;
         case 'd': /* --disp */
-            arguments.save_displacement = 1;
+            job->save_displacement = 1;
             break;
         case 'e': /* --emission */
-            arguments.save_emission = 1;
+            job->save_emission = 1;
             break;
         case 'm': /* --metalness */
-            arguments.save_metalness = 1;
+            job->save_metalness = 1;
             break;
         case 'P': /* --apply-opacity */
-            arguments.apply_opacity = 1;
+            job->apply_opacity = 1;
         case 'O': /* --opacity */
-            arguments.save_opacity = 1;
+            job->save_opacity = 1;
             break;
         case 'r': /* --roughness */
-            arguments.save_roughness = 1;
+            job->save_roughness = 1;
             break;
         case 'n': /* --normal */
-            arguments.save_normal = get_normal_type(optarg);
+            job->save_normal = get_normal_type(ctx, optarg);
             break;
 #ifdef CGRIP_TERMCOLOR
         case 'D':
@@ -316,77 +1328,208 @@ int main(int argc, char *argv[])
             break;
 #endif
         case ':':
-            fatal("missing argument for option '%c'\n", optopt);
-            break;
+            cglib_fail(ctx, cglib_error_argument, "missing argument for option '%c'\n", optopt);
+            goto fail;
         case '?':
         default:
-            fatal("unknown option '%c'\n", optopt);
-            break;
+            cglib_fail(ctx, cglib_error_argument, "unknown option '%s'\n", argv[optind - 1]);
+            goto fail;
         }
     }
+    first = optind;
+    pthread_mutex_unlock(&parse_lock);
+    return first;
+
+fail:
+    pthread_mutex_unlock(&parse_lock);
+    return -1;
+}
+
+/* what is left unset after parsing */
+static void run_defaults(struct run *run)
+{
+    struct cglib_job *job = &run->job;
 
     if (
-        !arguments.save_ambientocclusion
-        && !arguments.save_color
-        && !arguments.save_displacement
-        && !arguments.save_emission
-        && !arguments.save_metalness
-        && !arguments.save_normal 
-        && !arguments.save_opacity 
-        && !arguments.save_roughness
+        !job->save_ambientocclusion
+        && !job->save_color
+        && !job->save_displacement
+        && !job->save_emission
+        && !job->save_metalness
+        && !job->save_normal
+        && !job->save_opacity
+        && !job->save_roughness
     ) {
-        arguments.save_color = 1;
-        verbose("no matmaps specified, saving albedo\n");
+        job->save_color = 1;
+        cglib_log(&run->ctx, cglib_log_verbose, "no matmaps specified, saving albedo\n");
     }
+}
+
+/*
+ * a job line from a daemon client: the same options and ids as the cli,
+ * on top of the options the daemon was started with.
+ */
+static const char *daemon_job(struct cgdaemon_client *client, int argc, char **argv, void *ud)
+{
+    struct run *defaults = (struct run *) ud;
+    struct run *run = malloc(sizeof(struct run));
+    char **args = malloc((argc + 2) * sizeof(char *));
+    const char *why = NULL;
+    int first, i;
+
+    if (!run || !args) {
+        free(run);
+        free(args);
+        return "out of memory";
+    }
+    *run = *defaults;
+    run->ctx.job = &run->job;
+    run->ctx.log = cgrip_log_client;
+    run->ctx.log_ud = run;
+    run->ctx.error = cglib_error_none;
+    run->client = client;
+    run->free_palette = 0;
+    /* getopt skips the program name */
+    args[0] = "cgrip";
+    for (i = 0; i < argc; i++)
+        args[i + 1] = argv[i];
+    args[argc + 1] = NULL;
+
+    first = parse_args(run, argc + 1, args, NULL);
+    if (first < 0)
+        why = cglib_error_string(run->ctx.error);
+    else if (first >= argc + 1)
+        why = "no ids given";
+    if (!why) {
+        run_defaults(run);
+        verbose("job: %d ids\n", argc + 1 - first);
+        why = run_ids(run, (const char **) &args[first], argc + 1 - first);
+        if (!why && run->ctx.error != cglib_error_none)
+            why = cglib_error_string(run->ctx.error);
+    }
+    if (run->free_palette)
+        cgpro_palette_free(run->job.palette);
+    free(args);
+    free(run);
+    return why;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct run run;
+    struct process proc = { 0 };
+    struct cgpix *pixels = NULL;
+    const char *why;
+    int first;
 
-    pargc = argc - optind;
-    if (pargc < 1)
+    cglib_init();
+    run_init(&run);
+
+#ifdef CGRIP_TERMCOLOR
+    arguments.use_term_colors = getenv("TERM") != NULL;
+#endif
+
+    run.ctx.log = cgrip_log_fatal;
+    first = parse_args(&run, argc, argv, &proc);
+    run.ctx.log = cgrip_log;
+    /* a daemon's jobs get theirs once their own options are in */
+    if (!proc.daemon)
+        run_defaults(&run);
+
+    if (!proc.daemon && !proc.serve.port && argc - first < 1)
         usage(EXIT_FAILURE);
 
-    mats = cgapi_download_ids(quality, (const char **) &argv[optind], pargc);
-    if (!arguments.output) {
+    if (!run.job.output) {
         char buf[256];
         if (getcwd(buf, sizeof(buf)) != NULL) {
-            arguments.output = malloc(strlen(buf) + 1);
-            strcpy(arguments.output, buf);
+            char *cwd = malloc(strlen(buf) + 1);
+            doom(cwd);
+            strcpy(cwd, buf);
+            run.job.output = cwd;
         }
     }
 
-    if (arguments.downscale)
-        for (i = 0; i < mats.material_count; i++) {
-            struct cgapi_material *mat = &mats.materials[i];
-            int j;
-            for (j = 0; j < CGAPI_MAPNUM; j++) {
-                struct cgapi_map *map = &mat->maps[j];
-                unsigned int width = arguments.downscale_width, height = arguments.downscale_height;
-                if (j != cgapi_matmap_color && arguments.macro_scale > 0)
-                    if ((arguments.apply_opacity && j != cgapi_matmap_opacity) || !arguments.apply_opacity) {
-                        width *= arguments.macro_scale;
-                        height *= arguments.macro_scale;
-                    }
-                if (map->data && !cgpro_scale_nearest(map, width, height))
-                    warn("failed to scale %d for matmap %s\n", j, mat->id);
-            }
-        }
+    if (!proc.threads)
+        proc.threads = cgpool_default_threads();
+    verbose("using %u threads\n", proc.threads);
+    /* the waiting maps stage helps out too, so it counts as a thread */
+    run.pool = cgpool_new(proc.threads > 1 ? proc.threads - 1 : 1);
+    if (!run.pool)
+        fatal("failed to start processing threads\n");
+    cgpro_set_pool(run.pool);
+    cgbcn_set_pool(run.pool);
+    run.writers = cgpool_new(proc.writers ? proc.writers : CGRIP_WRITERS);
+    if (!run.writers)
+        fatal("failed to start writer threads\n");
 
-    if (arguments.quantize && palette.data)
-        for (i = 0; i < mats.material_count; i++) {
-            struct cgapi_material *mat = &mats.materials[i];
-            struct cgapi_map *color = &mat->maps[cgapi_matmap_color];
-            if (color->data) {
-                verbose("quantizing %s\n", mat->id);
-                cgpro_quantize_to(color, palette);
-            }
-        }
+    if (proc.budget)
+        verbose("memory budget: %lu B\n", (unsigned long) proc.budget);
+    cgmem_set_budget(proc.budget);
+    if (proc.store) {
+        char buf[4096];
+        const char *dir = *proc.store ? proc.store : cgstore_default_dir(buf, sizeof buf);
+        if (!dir || !(run.store = cgstore_open(dir)))
+            warn("cannot use %s as a store, making everything\n", dir ? dir : "~/.cache/cgrip");
+        else
+            verbose("store: %s\n", dir);
+    }
+    if (proc.pixels) {
+        char buf[4096];
+        const char *dir = proc.pixels;
+        if (!*dir && cgstore_default_dir(buf, sizeof buf) && strlen(buf) + 8 <= sizeof buf)
+            dir = strcat(buf, "/pixels");
+        if (!*dir || !(pixels = cgpix_open(dir, proc.lz4)))
+            warn("cannot use %s as a pixel cache, decoding everything\n", *dir ? dir : "~/.cache/cgrip/pixels");
+        else
+            verbose("pixel cache: %s%s\n", dir, proc.lz4 ? ", lz4" : "");
+        cgapi_set_pixels(pixels);
+    }
 
-    cgapi_materials_save(&mats, arguments.output);
+    if (proc.serve.port) {
+        if (!proc.serve.cache_size)
+            proc.serve.cache_size = (size_t) 256 * 1024 * 1024;
+        proc.serve.log = cgrip_log;
+        proc.serve.log_ud = &run;
+        printf("serving on http://127.0.0.1:%u\n", proc.serve.port);
+        fflush(stdout);
+        if (!cgserve_run(&proc.serve))
+            fatal("failed to serve on port %u\n", proc.serve.port);
+        verbose("server stopped\n");
+    } else if (proc.daemon) {
+        char path[256];
+        if (!*proc.daemon)
+            proc.daemon = cgdaemon_default_path(path, sizeof path);
+        printf("listening on %s\n", proc.daemon);
+        fflush(stdout);
+        if (!cgdaemon_run(proc.daemon, daemon_job, &run))
+            fatal("failed to start daemon on %s\n", proc.daemon);
+        verbose("daemon stopped\n");
+    } else if ((why = run_ids(&run, (const char **) &argv[first], argc - first))) {
+        fatal("%s: %s\n", why, cglib_error_string(run.ctx.error));
+    }
 
-    if (arguments.gen_godot4)
-        for (i = 0; i < mats.material_count; i++) {
-            gen_godot4_generate(&mats.materials[i], arguments.output);
-        }
+    if (run.quantize) {
+        unsigned long hits, misses;
+        cgpro_cache_stats(&hits, &misses);
+        if (hits + misses > 0)
+            verbose("palette cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+                    hits, misses, 100.0 * hits / (hits + misses));
+    }
 
-    cgapi_materials_free(&mats);
+    if (arguments.verbose) {
+        unsigned long reused, mapped;
+        verbose("peak memory held: %lu B\n", (unsigned long) cgmem_peak());
+        cgmem_buffer_stats(&reused, &mapped);
+        verbose("image buffers: %lu reused, %lu mapped\n", reused, mapped);
+    }
+    cgpro_set_pool(NULL);
+    cgbcn_set_pool(NULL);
+    cgpool_free(run.writers);
+    cgpool_free(run.pool);
+    cgstore_free(run.store);
+    cgapi_set_pixels(NULL);
+    cgpix_free(pixels);
+    cglib_cleanup();
 
     return 0;
 }
@@ -34,39 +34,14 @@ void fputcolor(const char *col, FILE *fp);
 
 #define doom(ptr) if (!ptr) fatal("out of memory\n")
 
-enum cgrip_normal_type {
-    cgrip_normal_type_none,
-    cgrip_normal_type_gl,
-    cgrip_normal_type_dx,
-    cgrip_normal_type_both
-};
-
+/* the process' own options, each run keeps the rest */
 extern struct arguments {
-    char *output;
-    char *output_zip;
-    enum cgrip_normal_type save_normal;
-    unsigned int downscale_width, downscale_height;
-    unsigned int macro_scale;
     unsigned verbose : 1;
-    unsigned downscale : 1;
-    unsigned quantize : 1;
-    unsigned gen_godot4 : 1;
-    unsigned filter_nearest : 1;
-    unsigned apply_opacity : 1;
-    unsigned save_zip : 1;
-    unsigned save_ambientocclusion: 1;
-    unsigned save_color : 1;
-    unsigned save_displacement : 1;
-    unsigned save_emission : 1;
-    unsigned save_metalness : 1;
-    unsigned save_opacity : 1;
-    unsigned save_roughness : 1;
 #ifdef CGRIP_TERMCOLOR
     unsigned use_term_colors : 1;
 #endif
 } arguments;
 
-int strncat_s(char *dest, const char *src, int sz);
 void verbose(const char *fmt, ...);
 void warn(const char *fmt, ...);
 CGRIP_NORETURN void fatal(const char *fmt, ...);
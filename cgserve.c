@@ -0,0 +1,610 @@
+#define _GNU_SOURCE /* sigaction, strncasecmp, MSG_NOSIGNAL */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cgserve.h"
+#include "cgapi.h"
+#include "cgcache.h"
+#include "cgformat.h"
+#include "cglib.h"
+#include "cgmem.h"
+#include "cgpro.h"
+
+/* request line and headers, nothing we answer has a body to read */
+#define CGSERVE_HEAD_MAX 8192
+#define CGSERVE_SIZE_MAX 16384
+/* connections answered at once, each may hold a decoded map; past that accept waits */
+#define CGSERVE_CONNS_MAX 16
+/* seconds a kept alive connection may sit idle before its slot goes to another */
+#define CGSERVE_IDLE 10
+/* seconds between looks at cgserve_stop while waiting, the signal may land on any thread */
+#define CGSERVE_TICK 1
+
+static const char *cgserve_qualities[] = { "1k", "2k", "4k", "8k" };
+
+/* by enum cgapi_matmap */
+static const char *cgserve_maps[] = {
+    "ambientocclusion",
+    "color",
+    "displacement",
+    "emission",
+    "metalness",
+    "normaldx",
+    "normalgl",
+    "opacity",
+    "roughness",
+};
+
+static const char *cgserve_dithers[] = {
+    "bayer",
+    "floyd-steinberg",
+    "atkinson",
+    "sierra-lite",
+};
+
+struct cgserve {
+    const struct cgserve_options *opts;
+    struct cgcache *cache;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    unsigned int conns; /* being answered, under lock */
+    int fds[CGSERVE_CONNS_MAX]; /* theirs by slot, -1 for free ones, under lock */
+};
+
+struct cgserve_conn {
+    struct cgserve *serve;
+    int fd;
+    unsigned int slot;
+};
+
+/* GET /ID/QUALITY/MAP?size=WxH&palette=P&dither=D, parsed */
+struct cgserve_request {
+    struct cgserve *serve;
+    char id[64];
+    enum cgapi_quality quality;
+    enum cgapi_matmap matmap;
+    struct cglib_job job;
+    struct cglib_context ctx;
+};
+
+static volatile sig_atomic_t cgserve_stop = 0;
+
+static void cgserve_on_signal(int sig)
+{
+    cgserve_stop = 1;
+}
+
+static void cgserve_log(struct cgserve *serve, enum cglib_log_level level, const char *fmt, ...)
+{
+    va_list args;
+    if (!serve->opts->log)
+        return;
+    va_start(args, fmt);
+    serve->opts->log(serve->opts->log_ud, level, fmt, args);
+    va_end(args);
+}
+
+/* what went wrong upstream, as a status */
+static int cgserve_status(enum cglib_error error)
+{
+    switch (error) {
+    case cglib_error_network:
+    case cglib_error_listing:
+    case cglib_error_archive:
+    case cglib_error_image:
+        return 502;
+    default:
+        return 500;
+    }
+}
+
+static const char *cgserve_reason(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 502: return "Bad Gateway";
+    default: return "Internal Server Error";
+    }
+}
+
+/* source zips are shared by every map and variant of a material */
+static int cgserve_fill_zip(void *ud, void **data, size_t *size)
+{
+    struct cgserve_request *req = (struct cgserve_request *) ud;
+    struct cgapi_materials mats;
+    const char *ids[1];
+    int i, status = 404;
+
+    ids[0] = req->id;
+    mats = cgapi_list_ids(&req->ctx, req->quality, ids, 1);
+    if (req->ctx.error != cglib_error_none)
+        status = cgserve_status(req->ctx.error);
+    for (i = 0; i < mats.material_count; i++) {
+        struct cgapi_material *mat = &mats.materials[i];
+        if (strcmp(mat->id, req->id))
+            continue;
+        if (!cgapi_material_download(&req->ctx, mat)) {
+            status = cgserve_status(req->ctx.error);
+            break;
+        }
+        *data = mat->zip;
+        *size = mat->zip_size;
+        mat->zip = NULL;
+        mat->zip_size = 0;
+        status = 0;
+        break;
+    }
+    cgapi_materials_free(&mats);
+    return status;
+}
+
+static int cgserve_fill_map(void *ud, void **data, size_t *size)
+{
+    struct cgserve_request *req = (struct cgserve_request *) ud;
+    struct cgcache_item *zip;
+    struct cgapi_material mat;
+    struct cgapi_map *map;
+    struct cgformat_options options;
+    unsigned char *encoded = NULL;
+    size_t encoded_size = 0;
+    char key[128];
+    int err = 0, hit, ok;
+
+    snprintf(key, sizeof key, "zip/%s/%s", req->id, cgserve_qualities[req->quality]);
+    zip = cgcache_get(req->serve->cache, key, cgserve_fill_zip, req, &err, &hit);
+    if (!zip)
+        return err > 0 ? err : 500;
+    ok = cglib_process_zip(&req->ctx, &mat, req->id, zip->data, zip->size);
+    cgcache_put(req->serve->cache, zip);
+    if (!ok)
+        return cgserve_status(req->ctx.error);
+    map = &mat.maps[req->matmap];
+    if (!map->data) {
+        cglib_material_free(&mat);
+        return 404;
+    }
+    cgapi_format_options(&req->job, req->matmap, &options);
+    encoded = cgformat_encode_memory(req->job.format, map->data, map->width, map->height, &options, &encoded_size);
+    cglib_material_free(&mat);
+    if (!encoded) {
+        cgserve_log(req->serve, cglib_log_warn, "out of memory encoding %s\n", req->id);
+        return 500;
+    }
+    *data = encoded;
+    *size = encoded_size;
+    return 0;
+}
+
+static int cgserve_lookup(const char **names, int count, const char *name)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        if (!strcasecmp(names[i], name))
+            return i;
+    return -1;
+}
+
+/*
+ * fills req from the request target, and key with everything the response
+ * depends on, spelled the same way however the request was.
+ */
+static int cgserve_parse(struct cgserve_request *req, char *target, char *key, size_t keysize)
+{
+    struct cglib_job *job = &req->job;
+    char *parts[3], *query, *p;
+    char palette[16] = "none";
+    int i, n;
+
+    query = strchr(target, '?');
+    if (query)
+        *query++ = 0;
+    if (*target != '/')
+        return 0;
+    for (i = 0, p = target + 1; i < 3; i++) {
+        parts[i] = p;
+        p = strchr(p, '/');
+        if (!p != (i == 2))
+            return 0;
+        if (p)
+            *p++ = 0;
+    }
+    if (!*parts[0] || strlen(parts[0]) >= sizeof req->id)
+        return 0;
+    for (p = parts[0]; *p; p++)
+        if (!isalnum((unsigned char) *p) && *p != '_' && *p != '-')
+            return 0;
+    strcpy(req->id, parts[0]);
+    if ((n = cgserve_lookup(cgserve_qualities, 4, parts[1])) < 0)
+        return 0;
+    req->quality = n;
+    if ((n = cgserve_lookup(cgserve_maps, CGAPI_MAPNUM, parts[2])) < 0)
+        return 0;
+    req->matmap = n;
+
+    cglib_job_init(job);
+    while (query && *query) {
+        char *value, *next = strchr(query, '&');
+        if (next)
+            *next++ = 0;
+        value = strchr(query, '=');
+        if (!value)
+            return 0;
+        *value++ = 0;
+        if (!strcmp(query, "size")) {
+            char *end;
+            job->downscale_width = strtoul(value, &end, 10);
+            if (*end != 'x')
+                return 0;
+            job->downscale_height = strtoul(end + 1, &end, 10);
+            if (*end || !job->downscale_width || !job->downscale_height
+                    || job->downscale_width > CGSERVE_SIZE_MAX || job->downscale_height > CGSERVE_SIZE_MAX)
+                return 0;
+        } else if (!strcmp(query, "palette")) {
+            if (!strcasecmp(value, "default")) {
+                job->palette = cgpro_palette_load_default();
+                strcpy(palette, "default");
+            } else if (!strncasecmp(value, "auto", 4)) {
+                job->palette_colors = 32;
+                if (value[4] == ':')
+                    job->palette_colors = strtoul(&value[5], NULL, 10);
+                else if (value[4])
+                    return 0;
+                if (job->palette_colors < 1 || job->palette_colors > 255)
+                    return 0;
+                sprintf(palette, "auto:%u", job->palette_colors);
+            } else if (strcasecmp(value, "none")) {
+                return 0;
+            }
+        } else if (!strcmp(query, "format")) {
+            if ((n = cgformat_parse(value)) < 0)
+                return 0;
+            job->format = n;
+        } else if (!strcmp(query, "dither")) {
+            if ((n = cgserve_lookup(cgserve_dithers, 4, value)) < 0)
+                return 0;
+            job->dither = n;
+        } else {
+            return 0;
+        }
+        query = next;
+    }
+
+    switch (req->matmap) {
+    case cgapi_matmap_normaldx:
+        job->save_normal = cgrip_normal_type_dx;
+        break;
+    case cgapi_matmap_normalgl:
+        job->save_normal = cgrip_normal_type_gl;
+        break;
+    default:
+        /* save_ambientocclusion up to save_roughness, in matmap order */
+        job->save_ambientocclusion = req->matmap == cgapi_matmap_ambientocclusion;
+        job->save_color = req->matmap == cgapi_matmap_color;
+        job->save_displacement = req->matmap == cgapi_matmap_displacement;
+        job->save_emission = req->matmap == cgapi_matmap_emission;
+        job->save_metalness = req->matmap == cgapi_matmap_metalness;
+        job->save_opacity = req->matmap == cgapi_matmap_opacity;
+        job->save_roughness = req->matmap == cgapi_matmap_roughness;
+        break;
+    }
+    /* only the albedo is ever quantized */
+    if (req->matmap != cgapi_matmap_color) {
+        job->palette.data = NULL;
+        job->palette_colors = 0;
+        strcpy(palette, "none");
+    }
+    if (!strcmp(palette, "none"))
+        job->dither = cgpro_dither_bayer8x8;
+    snprintf(key, keysize, "%s/%s/%s?size=%ux%u&palette=%s&dither=%s&format=%s",
+            req->id, cgserve_qualities[req->quality], cgserve_maps[req->matmap],
+            job->downscale_width, job->downscale_height, palette, cgserve_dithers[job->dither],
+            cgformat_get(job->format)->name);
+    return 1;
+}
+
+static int cgserve_write(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+/* head and body in one write, so a hit is one round trip */
+static int cgserve_respond(int fd, int status, const char *type, const void *body, size_t size, const char *cache, int keep_alive, int head_only)
+{
+    char head[512];
+    struct iovec iov[2];
+    int n;
+
+    n = snprintf(head, sizeof head,
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %lu\r\n"
+            "%s%s%s"
+            "%s"
+            "Connection: %s\r\n"
+            "\r\n",
+            status, cgserve_reason(status), type, (unsigned long) size,
+            cache ? "X-Cache: " : "", cache ? cache : "", cache ? "\r\n" : "",
+            status == 200 ? "Cache-Control: public, max-age=31536000, immutable\r\n" : "",
+            keep_alive ? "keep-alive" : "close");
+    iov[0].iov_base = head;
+    iov[0].iov_len = n;
+    iov[1].iov_base = (void *) body;
+    iov[1].iov_len = head_only ? 0 : size;
+    return cgserve_write(fd, iov, head_only || !size ? 1 : 2);
+}
+
+static int cgserve_error(int fd, int status, int keep_alive, int head_only)
+{
+    char body[64];
+    int n = sprintf(body, "%s\n", cgserve_reason(status));
+    return cgserve_respond(fd, status, "text/plain", body, n, NULL, keep_alive, head_only);
+}
+
+/* one request from its head, returns whether the connection can go on */
+static int cgserve_handle(struct cgserve *serve, int fd, char *head)
+{
+    struct cgserve_request req;
+    struct cgcache_item *item;
+    struct timeval start, end;
+    char key[256];
+    char *method, *target, *version, *line, *p;
+    int keep_alive, head_only, status = 200, err = 0, hit = 0, ok;
+
+    gettimeofday(&start, NULL);
+    method = head;
+    target = strchr(method, ' ');
+    version = target ? strchr(target + 1, ' ') : NULL;
+    line = strstr(head, "\r\n");
+    if (!target || !version || !line || version > line) {
+        cgserve_error(fd, 400, 0, 0);
+        return 0;
+    }
+    *target++ = 0;
+    *version++ = 0;
+    *line = 0;
+    keep_alive = !strcmp(version, "HTTP/1.1");
+    for (p = line + 2; *p; p = line + 2) {
+        line = strstr(p, "\r\n");
+        if (!line)
+            break;
+        *line = 0;
+        if (!strncasecmp(p, "connection:", 11)) {
+            for (p += 11; *p == ' '; p++)
+                ;
+            keep_alive = strcasecmp(p, "close") && (keep_alive || !strcasecmp(p, "keep-alive"));
+        }
+    }
+    head_only = !strcmp(method, "HEAD");
+    if (!head_only && strcmp(method, "GET"))
+        return cgserve_error(fd, 405, keep_alive, 0) && keep_alive;
+
+    memset(&req, 0, sizeof req);
+    req.serve = serve;
+    cglib_context_init(&req.ctx, &req.job);
+    req.ctx.log = serve->opts->log;
+    req.ctx.log_ud = serve->opts->log_ud;
+    cgserve_log(serve, cglib_log_verbose, "%s %s\n", method, target);
+    if (!cgserve_parse(&req, target, key, sizeof key))
+        return cgserve_error(fd, 400, keep_alive, head_only) && keep_alive;
+
+    item = cgcache_get(serve->cache, key, cgserve_fill_map, &req, &err, &hit);
+    if (item) {
+        ok = cgserve_respond(fd, 200, cgformat_get(req.job.format)->mime, item->data, item->size, hit ? "hit" : "miss", keep_alive, head_only);
+        cgcache_put(serve->cache, item);
+    } else {
+        status = err > 0 ? err : 500;
+        ok = cgserve_error(fd, status, keep_alive, head_only);
+    }
+    gettimeofday(&end, NULL);
+    cgserve_log(serve, cglib_log_verbose, "%s %d %s %.2fms\n", key, status, hit ? "hit" : "miss",
+            (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0);
+    return ok && keep_alive;
+}
+
+static void *cgserve_conn_main(void *ud)
+{
+    struct cgserve_conn *conn = (struct cgserve_conn *) ud;
+    struct cgserve *serve = conn->serve;
+    char buf[CGSERVE_HEAD_MAX + 1];
+    size_t used = 0;
+    int go_on = 1;
+
+    while (go_on) {
+        char *end;
+        ssize_t n = recv(conn->fd, buf + used, CGSERVE_HEAD_MAX - used, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        used += n;
+        buf[used] = 0;
+        /* pipelined requests are answered in order */
+        while (go_on && (end = strstr(buf, "\r\n\r\n"))) {
+            size_t len = end + 4 - buf;
+            end[2] = 0;
+            go_on = cgserve_handle(serve, conn->fd, buf);
+            used -= len;
+            memmove(buf, buf + len, used);
+            buf[used] = 0;
+        }
+        if (used == CGSERVE_HEAD_MAX) {
+            cgserve_error(conn->fd, 400, 0, 0);
+            break;
+        }
+    }
+    /* closed under the lock, so a stop never shuts down an fd reused since */
+    pthread_mutex_lock(&serve->lock);
+    close(conn->fd);
+    serve->fds[conn->slot] = -1;
+    serve->conns--;
+    pthread_cond_signal(&serve->done);
+    free(conn);
+    pthread_mutex_unlock(&serve->lock);
+    return NULL;
+}
+
+static void cgserve_free(struct cgserve *serve)
+{
+    cgcache_free(serve->cache);
+    pthread_cond_destroy(&serve->done);
+    pthread_mutex_destroy(&serve->lock);
+}
+
+/* waits on done for at most CGSERVE_TICK, with lock held */
+static void cgserve_wait(struct cgserve *serve)
+{
+    struct timeval now;
+    struct timespec until;
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + CGSERVE_TICK;
+    until.tv_nsec = now.tv_usec * 1000L;
+    pthread_cond_timedwait(&serve->done, &serve->lock, &until);
+}
+
+/*
+ * answers on localhost until SIGINT or SIGTERM, a thread per connection
+ * and up to CGSERVE_CONNS_MAX of them. on the way out connections are
+ * shut down and waited for, so nothing they use goes before they do.
+ * returns 0 when it could not listen.
+ */
+int cgserve_run(const struct cgserve_options *opts)
+{
+    struct cgserve serve;
+    struct sockaddr_in addr;
+    struct sigaction sa;
+    struct timeval idle;
+    struct pollfd listener;
+    pthread_attr_t attr;
+    unsigned long hits, misses, coalesced;
+    unsigned int i;
+    size_t bytes;
+    int fd, on = 1;
+
+    serve.opts = opts;
+    serve.cache = cgcache_new(opts->cache_size, opts->cache_dir);
+    if (!serve.cache)
+        return 0;
+    pthread_mutex_init(&serve.lock, NULL);
+    pthread_cond_init(&serve.done, NULL);
+    serve.conns = 0;
+    for (i = 0; i < CGSERVE_CONNS_MAX; i++)
+        serve.fds[i] = -1;
+    idle.tv_sec = CGSERVE_IDLE;
+    idle.tv_usec = 0;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        cgserve_free(&serve);
+        return 0;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof addr) != 0 || listen(fd, 64) != 0) {
+        cgserve_log(&serve, cglib_log_error, "cannot listen on port %u: %s\n", opts->port, strerror(errno));
+        close(fd);
+        cgserve_free(&serve);
+        return 0;
+    }
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = cgserve_on_signal;
+    sigemptyset(&sa.sa_mask);
+    /* no SA_RESTART, poll has to give up to notice */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (!cgserve_stop) {
+        struct cgserve_conn *conn;
+        pthread_t thread;
+        int cfd;
+
+        /* the rest wait in the listen backlog */
+        pthread_mutex_lock(&serve.lock);
+        while (serve.conns >= CGSERVE_CONNS_MAX && !cgserve_stop)
+            cgserve_wait(&serve);
+        pthread_mutex_unlock(&serve.lock);
+        listener.fd = fd;
+        listener.events = POLLIN;
+        if (cgserve_stop || poll(&listener, 1, CGSERVE_TICK * 1000) <= 0)
+            continue;
+        if ((cfd = accept(fd, NULL, NULL)) < 0)
+            continue;
+        /* responses go out whole, waiting for more of them only adds latency */
+        setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof idle);
+        conn = malloc(sizeof(struct cgserve_conn));
+        if (!conn) {
+            close(cfd);
+            continue;
+        }
+        conn->serve = &serve;
+        conn->fd = cfd;
+        pthread_mutex_lock(&serve.lock);
+        for (conn->slot = 0; serve.fds[conn->slot] >= 0; conn->slot++)
+            ;
+        serve.fds[conn->slot] = cfd;
+        serve.conns++;
+        if (pthread_create(&thread, &attr, cgserve_conn_main, conn)) {
+            serve.fds[conn->slot] = -1;
+            serve.conns--;
+            free(conn);
+            close(cfd);
+        }
+        pthread_mutex_unlock(&serve.lock);
+    }
+    pthread_attr_destroy(&attr);
+    close(fd);
+
+    /* a request being made finishes, then finds its connection gone */
+    pthread_mutex_lock(&serve.lock);
+    for (i = 0; i < CGSERVE_CONNS_MAX; i++)
+        if (serve.fds[i] >= 0)
+            shutdown(serve.fds[i], SHUT_RDWR);
+    while (serve.conns)
+        pthread_cond_wait(&serve.done, &serve.lock);
+    pthread_mutex_unlock(&serve.lock);
+
+    cgcache_stats(serve.cache, &hits, &misses, &coalesced, &bytes);
+    cgserve_log(&serve, cglib_log_verbose, "cache: %lu hits, %lu misses, %lu coalesced, %lu B held\n",
+            hits, misses, coalesced, (unsigned long) bytes);
+    cgserve_free(&serve);
+    return 1;
+}
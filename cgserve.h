@@ -0,0 +1,18 @@
+#ifndef CGSERVE_H_
+#define CGSERVE_H_
+
+#include <stddef.h>
+
+#include "cglib.h"
+
+struct cgserve_options {
+    unsigned int port; /* on localhost */
+    size_t cache_size; /* bytes of responses and zips kept in memory */
+    const char *cache_dir; /* also kept here across restarts, NULL for none */
+    cglib_log_fn log;
+    void *log_ud;
+};
+
+int cgserve_run(const struct cgserve_options *opts);
+
+#endif /* CGSERVE_H_ */
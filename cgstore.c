@@ -0,0 +1,196 @@
+#define _GNU_SOURCE /* snprintf */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cgstore.h"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/*
+ * finished outputs by a key of everything they were made from, shared by
+ * any number of output dirs. objects are read-only and only ever replaced
+ * whole, since outputs may be hard links to them.
+ */
+struct cgstore {
+    char *dir;
+};
+
+static unsigned long cgstore_tmp_count = 0;
+
+/* $XDG_CACHE_HOME/cgrip, or ~/.cache/cgrip */
+const char *cgstore_default_dir(char *buf, unsigned long size)
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache && *cache)
+        snprintf(buf, size, "%s/cgrip", cache);
+    else if (home && *home)
+        snprintf(buf, size, "%s/.cache/cgrip", home);
+    else
+        return NULL;
+    return buf;
+}
+
+/* mkdir -p, path is put back the way it was */
+int cgstore_mkdirs(char *path)
+{
+    char *p;
+    for (p = path + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = 0;
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            *p = '/';
+            return 0;
+        }
+        *p = '/';
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+struct cgstore *cgstore_open(const char *dir)
+{
+    struct cgstore *store = malloc(sizeof(struct cgstore));
+    if (!store)
+        return NULL;
+    store->dir = malloc(strlen(dir) + 1);
+    if (!store->dir) {
+        free(store);
+        return NULL;
+    }
+    strcpy(store->dir, dir);
+    if (!cgstore_mkdirs(store->dir)) {
+        free(store->dir);
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+/* spread over 256 dirs so none gets huge */
+static void cgstore_object(struct cgstore *store, unsigned long key, char *buf, size_t size, int make_dir)
+{
+    char hex[32];
+    sprintf(hex, "%016lx", key);
+    snprintf(buf, size, "%s/%.2s", store->dir, hex);
+    if (make_dir)
+        mkdir(buf, 0755);
+    snprintf(buf, size, "%s/%.2s/%s", store->dir, hex, hex + 2);
+}
+
+/* a name next to path nobody else is writing, in this process or another */
+static void cgstore_tmp(const char *path, char *buf, size_t size)
+{
+    unsigned long n = __atomic_add_fetch(&cgstore_tmp_count, 1, __ATOMIC_RELAXED);
+    snprintf(buf, size, "%s.%lu.%lu.tmp", path, (unsigned long) getpid(), n);
+}
+
+static int cgstore_copy(int in, int out)
+{
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof buf)) > 0) {
+        char *p = buf;
+        while (n > 0) {
+            ssize_t w = write(out, p, n);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                return 0;
+            }
+            p += w;
+            n -= w;
+        }
+    }
+    return n == 0;
+}
+
+/* from to a new file at to, sharing extents when the filesystem can, or copied */
+static int cgstore_clone(const char *from, const char *to, int allow_link)
+{
+    int in, out, ok;
+    if ((in = open(from, O_RDONLY)) < 0)
+        return 0;
+    if ((out = open(to, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+        close(in);
+        return 0;
+    }
+    ok = ioctl(out, FICLONE, in) == 0;
+    if (!ok && allow_link) {
+        close(out);
+        unlink(to);
+        if (link(from, to) == 0) {
+            close(in);
+            return 1;
+        }
+        if ((out = open(to, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+            close(in);
+            return 0;
+        }
+    }
+    if (!ok)
+        ok = cgstore_copy(in, out);
+    close(in);
+    ok = close(out) == 0 && ok;
+    if (!ok)
+        unlink(to);
+    return ok;
+}
+
+/*
+ * puts the object for key at path, by reflink, hard link or copy in that
+ * order of preference. whatever was at path is replaced, not written to.
+ * returns 0 when the store has no such object.
+ */
+int cgstore_link(struct cgstore *store, unsigned long key, const char *path)
+{
+    char obj[4096], tmp[4096];
+
+    cgstore_object(store, key, obj, sizeof obj, 0);
+    if (access(obj, R_OK) != 0)
+        return 0;
+    cgstore_tmp(path, tmp, sizeof tmp);
+    if (!cgstore_clone(obj, tmp, 1))
+        return 0;
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 0;
+    }
+    /* renaming onto another link to the same file leaves both */
+    unlink(tmp);
+    return 1;
+}
+
+/* keeps a copy of path under key, unless there is one already */
+void cgstore_put(struct cgstore *store, unsigned long key, const char *path)
+{
+    char obj[4096], tmp[4096];
+
+    cgstore_object(store, key, obj, sizeof obj, 1);
+    if (access(obj, F_OK) == 0)
+        return;
+    cgstore_tmp(obj, tmp, sizeof tmp);
+    /* a link would let the output and the store change together */
+    if (!cgstore_clone(path, tmp, 0))
+        return;
+    if (chmod(tmp, 0444) != 0 || rename(tmp, obj) != 0)
+        unlink(tmp);
+}
+
+void cgstore_free(struct cgstore *store)
+{
+    if (!store)
+        return;
+    free(store->dir);
+    free(store);
+}
@@ -0,0 +1,13 @@
+#ifndef CGSTORE_H_
+#define CGSTORE_H_
+
+struct cgstore;
+
+struct cgstore *cgstore_open(const char *dir);
+const char *cgstore_default_dir(char *buf, unsigned long size);
+int cgstore_mkdirs(char *path);
+int cgstore_link(struct cgstore *store, unsigned long key, const char *path);
+void cgstore_put(struct cgstore *store, unsigned long key, const char *path);
+void cgstore_free(struct cgstore *store);
+
+#endif /* CGSTORE_H_ */
@@ -28,6 +28,9 @@
           buildInputs = [
             libarchive
             curlFull
+            lz4
+            zlib
+            zstd
           ];
         };
 
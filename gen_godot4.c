@@ -6,17 +6,18 @@
 
 #include "gen_godot4.h"
 #include "cgapi.h"
-#include "cgrip.h"
+#include "cglib.h"
+#include "cgout.h"
 
 #define GEN_GODOT4_HEADER "[gd_resource type=\"StandardMaterial3D\" load_steps=%d format=3]\n\n"
 #define GEN_GODOT4_EXTTXT "[ext_resource type=\"Texture2D\" path=\"%s\" id=\"%d\"]\n"
 #define GEN_GODOT4_RESHEADER "[resource]\n"
 
-char gen_godot4_root[4096] = { 0 };
 const char *gen_godot4_res = "res://";
 const char *gen_godot4_rootpattern = "/project.godot";
 
 extern char *realpath(const char *path, char *resolved_path);
+extern FILE *open_memstream(char **ptr, size_t *sizeloc);
 
 static const char *get_extension(const char *path)
 {
@@ -28,57 +29,78 @@ static const char *get_extension(const char *path)
     return NULL;
 }
 
-void gen_godot4_set_root(const char *path)
+/* sets job's project root from the path of its project.godot */
+int gen_godot4_set_root(struct cglib_context *ctx, struct cglib_job *job, const char *path)
 {
     const char *p;
-    if (!realpath(path, gen_godot4_root)) {
-        warn("--gen-godot4 couldn't find %s: %s\n", path, strerror(errno));
-        return;
+    if (!realpath(path, job->godot4_root)) {
+        *job->godot4_root = 0;
+        return cglib_fail(ctx, cglib_error_argument, "--gen-godot4 couldn't find %s: %s\n", path, strerror(errno));
     }
-    p = get_extension(gen_godot4_root);
+    p = get_extension(job->godot4_root);
     if (!p || strcmp(p, "godot")) {
-        *gen_godot4_root = 0;
-        warn("invalid --gen-godot4 root, defaulting to none\n");
-    } else
-        verbose("gen_godot4_root = %s\n", gen_godot4_root);
+        *job->godot4_root = 0;
+        return cglib_fail(ctx, cglib_error_argument, "invalid --gen-godot4 root, defaulting to none\n");
+    }
+    cglib_log(ctx, cglib_log_verbose, "gen_godot4_root = %s\n", job->godot4_root);
+    return 1;
 }
 
-static char *gen_godot4_get_root(const char *path)
+/* looks for a project.godot in dir or above it, dir is clobbered */
+static char *gen_godot4_search(struct cglib_context *ctx, char *dir, size_t dirsz, char *root)
 {
-    char buf[4096] = { 0 };
-    int sz;
-    if (*gen_godot4_root)
-        return gen_godot4_root;
-    if (!realpath(path, buf))
-        return NULL;
-    verbose("get_root: %s\n", buf);
-    sz = strlen(buf);
-    while (1) {
+    int sz = strlen(dir);
+    while (sz > 0) {
         char *p;
         FILE *t;
-        for (p = buf + sz; p > buf; p--) {
-            if (*p == '/') {
-                *p = 0;
-                break;
-            }
-        }
-        sz = p - buf;
-        if (sz <= 0) return NULL;
-        strncat_s(buf + sz, gen_godot4_rootpattern, sizeof buf - sz);
-        verbose("%s\n", buf);
-        t = fopen(buf, "r");
+        strncat_s(dir + sz, gen_godot4_rootpattern, dirsz - sz);
+        cglib_log(ctx, cglib_log_verbose, "%s\n", dir);
+        t = fopen(dir, "r");
+        dir[sz] = 0;
         if (t) {
-            size_t size = strlen(buf) - strlen(gen_godot4_rootpattern) + 1;
-            memcpy(gen_godot4_root, buf, size - 1);
-            gen_godot4_root[size - 1] = 0;
+            memcpy(root, dir, sz + 1);
             fclose(t);
-            return gen_godot4_root;
+            return root;
         }
+        for (p = dir + sz; p > dir && *p != '/'; p--)
+            ;
         *p = 0;
+        sz = p - dir;
     }
     return NULL;
 }
 
+/* sets job's project root from the one found above dir, if any */
+int gen_godot4_find_root(struct cglib_context *ctx, struct cglib_job *job, const char *dir)
+{
+    char buf[4096] = { 0 };
+    if (!realpath(dir, buf))
+        return cglib_fail(ctx, cglib_error_argument, "--gen-godot4 couldn't find %s: %s\n", dir, strerror(errno));
+    if (!gen_godot4_search(ctx, buf, sizeof buf, job->godot4_root))
+        return 0;
+    cglib_log(ctx, cglib_log_verbose, "gen_godot4_root = %s\n", job->godot4_root);
+    return 1;
+}
+
+/* root is either the job's, or found above path and kept in root */
+static char *gen_godot4_get_root(struct cglib_context *ctx, const char *path, char *root)
+{
+    char buf[4096] = { 0 };
+    char *p;
+    if (*ctx->job->godot4_root)
+        return (char *) ctx->job->godot4_root;
+    if (*root)
+        return root;
+    if (!realpath(path, buf))
+        return NULL;
+    cglib_log(ctx, cglib_log_verbose, "get_root: %s\n", buf);
+    p = strrchr(buf, '/');
+    if (!p)
+        return NULL;
+    *p = 0;
+    return gen_godot4_search(ctx, buf, sizeof buf, root);
+}
+
 static int gen_godot4_is_subpath(const char *root, const char *subpath)
 {
     if (strlen(subpath) < strlen(root))
@@ -86,25 +108,28 @@ static int gen_godot4_is_subpath(const char *root, const char *subpath)
     return !strncmp(subpath, root, strlen(root));
 }
 
-static char *gen_godot4_resource_path(const char *path)
+static char *gen_godot4_resource_path(struct cglib_context *ctx, const char *path, char *found_root)
 {
     char buf[4096] = { 0 };
     char *root, *p, *out;
     int f, s;
     if (!realpath(path, buf))
         return NULL;
-    root = gen_godot4_get_root(path);
-    verbose("root: %s\n", root);
+    root = gen_godot4_get_root(ctx, path, found_root);
+    cglib_log(ctx, cglib_log_verbose, "root: %s\n", root);
     if (!root)
         return NULL;
     if (!gen_godot4_is_subpath(root, buf)) {
-        verbose("buf is not subpath... %s WITH %s\n", root, buf);
+        cglib_log(ctx, cglib_log_verbose, "buf is not subpath... %s WITH %s\n", root, buf);
         return NULL;
     }
     p = &buf[strlen(root) + 1]; /* extra slash */
     f = strlen(gen_godot4_res) + strlen(p) + 1;
     out = malloc(f);
-    doom(out);
+    if (!out) {
+        cglib_fail(ctx, cglib_error_memory, "out of memory\n");
+        return NULL;
+    }
 
     *out = 0;
     s = 0;
@@ -113,42 +138,43 @@ static char *gen_godot4_resource_path(const char *path)
     return out;
 }
 
-static void gen_godot4_add_map(struct cgapi_material *mat, enum cgapi_matmap matmap, const char *folder, FILE *out)
+static void gen_godot4_add_map(struct cglib_context *ctx, struct cgapi_material *mat, enum cgapi_matmap matmap, const char *folder, char *root, FILE *out)
 {
-    struct cgapi_map *map = &mat->maps[matmap];
     char buf[256] = { 0 };
     char *path;
     int sz = 0;
-    if (map->data == NULL)
+    if (!cgapi_material_has_map(mat, matmap))
         return;
     sz += strncat_s(buf + sz, folder, sizeof buf - sz);
     sz += strncat_s(buf + sz, "/", sizeof buf - sz);
-    cgapi_material_get_filename(mat, matmap, buf + sz, sizeof buf - sz);
-    path = gen_godot4_resource_path(buf);
+    cgapi_material_get_filename(mat, matmap, ctx->job->format, buf + sz, sizeof buf - sz);
+    path = gen_godot4_resource_path(ctx, buf, root);
     if (!path)
         return;
     fprintf(out, GEN_GODOT4_EXTTXT, path, matmap);
     free(path);
 }
 
-int gen_godot4_generate(struct cgapi_material *mat, const char *out)
+int gen_godot4_generate(struct cglib_context *ctx, struct cgapi_material *mat, const char *out)
 {
     char buf[256] = { 0 };
-    int sz = 0, i;
+    char root[4096] = { 0 };
+    char *data = NULL;
+    size_t size = 0;
+    int sz = 0, i, ok;
     FILE *fp;
     if (out == NULL)
-        fatal("output path is <null>?");
+        return cglib_fail(ctx, cglib_error_argument, "output path is <null>?");
     sz += strncat_s(buf + sz, out, sizeof buf - sz);
     sz += strncat_s(buf + sz, "/", sizeof buf - sz);
     sz += strncat_s(buf + sz, mat->id, sizeof buf - sz);
     sz += strncat_s(buf + sz, ".tres", sizeof buf - sz);
-    fp = fopen(buf, "w");
-    if (!fp) {
-        warn("cannot access %s\n", buf);
-        return 0;
-    }
+    /* put together in memory and written out like the maps are */
+    fp = open_memstream(&data, &size);
+    if (!fp)
+        return cglib_fail(ctx, cglib_error_memory, "cannot generate %s\n", buf);
 
-    printf("generating %s.tres\n", mat->id);
+    cglib_log(ctx, cglib_log_info, "generating %s.tres\n", mat->id);
     sz = 1;
     for (i = 0; i < CGAPI_MAPNUM; i++) {
         if (cgapi_material_has_map(mat, i))
@@ -156,7 +182,7 @@ int gen_godot4_generate(struct cgapi_material *mat, const char *out)
     }
     fprintf(fp, GEN_GODOT4_HEADER, sz);
     for (i = 0; i < CGAPI_MAPNUM; i++) {
-        gen_godot4_add_map(mat, i, out, fp);
+        gen_godot4_add_map(ctx, mat, i, out, root, fp);
     }
     fputc('\n', fp);
     fprintf(fp, GEN_GODOT4_RESHEADER);
@@ -185,8 +211,16 @@ int gen_godot4_generate(struct cgapi_material *mat, const char *out)
     }
     if (cgapi_material_has_map(mat, cgapi_matmap_roughness))
         fprintf(fp, "roughness_texture = ExtResource(\"%d\")\n", cgapi_matmap_roughness);
-    fprintf(fp, "texture_filter = %d\n", arguments.filter_nearest ? 2 : 3);
+    fprintf(fp, "texture_filter = %d\n", ctx->job->filter_nearest ? 2 : 3);
 
-    fclose(fp);
+    if (fclose(fp) != 0) {
+        free(data);
+        return cglib_fail(ctx, cglib_error_memory, "cannot generate %s\n", buf);
+    }
+    ok = cgout_save(buf, data, size);
+    free(data);
+    if (!ok)
+        return cglib_fail(ctx, cglib_error_io, "failed to write %s\n", buf);
+    cglib_output(ctx, mat->id, buf);
     return 1;
 }
@@ -4,7 +4,8 @@
 
 #include "cgapi.h"
 
-void gen_godot4_set_root(const char *path);
-int gen_godot4_generate(struct cgapi_material *mat, const char *out);
+int gen_godot4_set_root(struct cglib_context *ctx, struct cglib_job *job, const char *path);
+int gen_godot4_find_root(struct cglib_context *ctx, struct cglib_job *job, const char *dir);
+int gen_godot4_generate(struct cglib_context *ctx, struct cgapi_material *mat, const char *out);
 
 #endif /* GEN_GODOT4_H_ */